@@ -0,0 +1,21 @@
+# - Find LZ4
+# Find the native LZ4 header and library.
+#
+# LZ4_INCLUDE_DIRS     - where to find lz4.h
+# LZ4_LIBRARIES        - libraries to link against.
+# LZ4_FOUND            - true if LZ4 found.
+#
+
+# This is based on the FindCURL.cmake file distributed with Cmake.
+
+find_path(LZ4_INCLUDE_DIR NAMES lz4.h)
+find_library(LZ4_LIBRARY NAMES lz4)
+
+include(FindPackageHandleStandardArgs)
+FIND_PACKAGE_HANDLE_STANDARD_ARGS(LZ4
+                                  REQUIRED_VARS LZ4_INCLUDE_DIR LZ4_LIBRARY)
+
+if(LZ4_FOUND)
+    set(LZ4_INCLUDE_DIRS ${LZ4_INCLUDE_DIR})
+    set(LZ4_LIBRARIES ${LZ4_LIBRARY})
+endif()
@@ -21,6 +21,16 @@ RetCode FileSystem::closeFile ( const FileHandle& )
     return NotImplemented;
 }
 
+RetCode FileSystem::flushFile ( const FileHandle& )
+{
+    return NotImplemented;
+}
+
+RetCode FileSystem::syncFile ( const FileHandle&, bool )
+{
+    return NotImplemented;
+}
+
 RetCode FileSystem::readFile ( const FileHandle&, std::vector<char>&, off_t,
                                size_t& ) const
 {
@@ -38,6 +48,22 @@ RetCode FileSystem::resizeFile ( const std::string&, size_t )
     return NotImplemented;
 }
 
+RetCode FileSystem::getFileDescriptor ( const FileHandle&, int& )
+{
+    return NotSupported;
+}
+
+RetCode FileSystem::copyFile ( const std::string&, const std::string& )
+{
+    return NotImplemented;
+}
+
+RetCode FileSystem::copyRange ( const FileHandle&, off_t, const FileHandle&, off_t, size_t,
+                                size_t& )
+{
+    return NotImplemented;
+}
+
 RetCode FileSystem::createDirectory ( const std::string&, const Metadata& )
 {
     return NotImplemented;
@@ -73,6 +99,11 @@ RetCode FileSystem::readMetadata ( const std::string&, Metadata& ) const
     return NotImplemented;
 }
 
+RetCode FileSystem::readFileMetadata ( const FileHandle&, Metadata& ) const
+{
+    return NotSupported;
+}
+
 RetCode FileSystem::setOwner ( const std::string&, const std::string&,
                                const std::string& )
 {
@@ -84,3 +115,54 @@ RetCode FileSystem::setMode ( const std::string&, const Metadata::Modes& )
     return NotImplemented;
 }
 
+RetCode FileSystem::getUsage ( const std::string&, Usage& ) const
+{
+    return NotSupported;
+}
+
+RetCode FileSystem::getXAttr ( const std::string&, const std::string&, std::string& ) const
+{
+    return NotSupported;
+}
+
+RetCode FileSystem::listXAttr ( const std::string&, std::vector<std::string>& ) const
+{
+    return NotSupported;
+}
+
+RetCode FileSystem::setXAttr ( const std::string&, const std::string&, const std::string&,
+                               XAttrMode )
+{
+    return NotSupported;
+}
+
+RetCode FileSystem::removeXAttr ( const std::string&, const std::string& )
+{
+    return NotSupported;
+}
+
+FileSystem::CachePolicy FileSystem::getCachePolicy ( const FileHandle& ) const
+{
+    return CacheUntilOpen;
+}
+
+RetCode FileSystem::getVersion ( const FileHandle&, uint64_t& ) const
+{
+    return NotSupported;
+}
+
+RetCode FileSystem::addWaiter ( const FileHandle&, uint64_t, std::function<void()> )
+{
+    return NotSupported;
+}
+
+RetCode FileSystem::removeWaiter ( const FileHandle& )
+{
+    return NotSupported;
+}
+
+void FileSystem::notifyChange ( const std::string& path, ChangeType type ) const
+{
+    if ( onChangeHandler_ )
+        onChangeHandler_ ( path, type );
+}
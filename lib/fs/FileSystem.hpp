@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
 
 #include "Common.pb.h"
 #include "RetCode.hpp"
@@ -14,17 +17,75 @@ namespace rfs
 class FileSystem
 {
 public:
+    /// @brief How long the contents of a file may be cached by the reader.
+    enum CachePolicy
+    {
+        CacheNever, ///< The contents change without notice; always read them afresh.
+        CacheUntilOpen, ///< Cached contents may be reused until the file is next opened.
+        CacheUntilChanged ///< Cached contents stay valid until a ContentChanged notification.
+    };
+
+    /// @brief The kinds of change reported through the change handler.
+    enum ChangeType
+    {
+        ContentChanged, ///< The contents or metadata of a file changed.
+        EntryAdded, ///< An entry was added at the path.
+        EntryRemoved ///< The entry at the path was removed.
+    };
+
+    /// @brief How setXAttr() treats an attribute which may already exist.
+    enum XAttrMode
+    {
+        XAttrSet, ///< Add the attribute, or replace its value.
+        XAttrCreate, ///< Add the attribute; AlreadyExists if it exists.
+        XAttrReplace ///< Replace the value; NoSuchAttribute if it doesn't exist.
+    };
+
+    /// @brief The totals for a subtree.
+    struct Usage
+    {
+        uint64_t files; ///< The number of files.
+        uint64_t directories; ///< The number of directories, including the subtree root.
+        uint64_t bytes; ///< The total size of the files.
+    };
+
     virtual ~FileSystem();
 
     virtual RetCode createFile ( const Metadata& md, bool reqWrite, FileHandle& fh );
     virtual RetCode openFile ( const std::string& path, bool reqWrite, FileHandle& fh );
     virtual RetCode closeFile ( const FileHandle& fh );
+    /// @brief Pass anything buffered for a handle on to the file.
+    /// Unlike syncFile(), this doesn't wait for the data to reach stable storage.
+    virtual RetCode flushFile ( const FileHandle& fh );
+    /// @brief Ensure data written through a handle has reached stable storage.
+    /// @param [in] dataOnly If true, metadata not needed to read the data back may
+    /// be left unsynchronized (fdatasync semantics).
+    virtual RetCode syncFile ( const FileHandle& fh, bool dataOnly );
 
     virtual RetCode readFile ( const FileHandle& fh, std::vector<char>& data,
                                off_t offset, size_t& processed ) const;
     virtual RetCode writeFile ( const FileHandle& fh, const std::vector<char>& data,
                                 off_t offset, size_t& processed );
     virtual RetCode resizeFile ( const std::string& path, size_t size );
+    /// @brief Expose the descriptor backing an open file, for zero-copy transfers.
+    /// Anything buffered for the handle is written out first, and the caller may then
+    /// read and write the descriptor directly. The descriptor remains owned by the
+    /// file system and must not be closed.
+    /// @param [out] fd The descriptor.
+    /// @return Standard error code; NotSupported if the file has no descriptor.
+    virtual RetCode getFileDescriptor ( const FileHandle& fh, int& fd );
+
+    /// @brief Copy the contents of one file into a new (or truncated) file.
+    /// Implementations should perform the copy without passing the data through
+    /// the caller where possible.
+    /// @return Standard error code; NotPossible if both paths name the same file.
+    virtual RetCode copyFile ( const std::string& from, const std::string& to );
+    /// @brief Copy a range of bytes between two open files.
+    /// @param [out] processed The number of bytes copied; may be less than size if
+    /// the end of the source file was reached.
+    virtual RetCode copyRange ( const FileHandle& from, off_t fromOffset,
+                                const FileHandle& to, off_t toOffset, size_t size,
+                                size_t& processed );
 
     virtual RetCode createDirectory ( const std::string& path, const Metadata& md );
     virtual RetCode readDirectory ( const std::string& path,
@@ -39,15 +100,87 @@ public:
 
     virtual RetCode readMetadata ( const std::string& path, Metadata& md ) const;
 
+    /// @brief Read the metadata of an open file, whatever has become of its path since.
+    /// @return Standard error code; NotSupported if only paths can be looked up.
+    virtual RetCode readFileMetadata ( const FileHandle& fh, Metadata& md ) const;
+
     virtual RetCode setOwner ( const std::string& path, const std::string& user,
                                const std::string& group );
 
     virtual RetCode setMode ( const std::string& path, const Metadata::Modes& mode );
 
+    /// @brief Retrieve the value of an extended attribute.
+    /// @param [out] value The value of the attribute.
+    /// @return Standard error code; NoSuchAttribute if the entry doesn't have it.
+    virtual RetCode getXAttr ( const std::string& path, const std::string& key,
+                               std::string& value ) const;
+    /// @brief Retrieve the names of the extended attributes of an entry.
+    /// @param [out] keys The names are appended to this.
+    virtual RetCode listXAttr ( const std::string& path,
+                                std::vector<std::string>& keys ) const;
+    /// @brief Set the value of an extended attribute.
+    virtual RetCode setXAttr ( const std::string& path, const std::string& key,
+                               const std::string& value, XAttrMode mode );
+    /// @brief Remove an extended attribute.
+    /// @return Standard error code; NoSuchAttribute if the entry doesn't have it.
+    virtual RetCode removeXAttr ( const std::string& path, const std::string& key );
+
+    /// @brief How the contents read through a handle may be cached.
+    /// Defaults to CacheUntilOpen; changes made other than through the handle
+    /// aren't reported.
+    virtual CachePolicy getCachePolicy ( const FileHandle& fh ) const;
+
+    /// @brief Count the files, directories and bytes at or below a path.
+    /// Intended to be cheap enough to answer statfs with; file systems which would
+    /// have to walk the tree don't implement it.
+    /// @param [out] usage The totals.
+    /// @return Standard error code; NotSupported if usage isn't tracked.
+    virtual RetCode getUsage ( const std::string& path, Usage& usage ) const;
+
+    /// @brief The version of the contents of an open file.
+    /// Versions only ever increase, and change whenever the contents change by
+    /// themselves (as reported to the change handler).
+    /// @param [out] version The current version.
+    /// @return Standard error code; NotSupported if changes aren't tracked.
+    virtual RetCode getVersion ( const FileHandle& fh, uint64_t& version ) const;
+
+    /// @brief Call a function once the contents of an open file change.
+    /// @param [in] version The version the caller has seen. If the file has already
+    /// moved past it, cb is called straight away.
+    /// @param [in] cb The function to call. It is called at most once, when the file
+    /// changes or is removed, from whichever thread made the change, and must not
+    /// call back into the file system.
+    /// @return Standard error code; NotSupported if changes aren't tracked, in which
+    /// case cb is never called.
+    virtual RetCode addWaiter ( const FileHandle& fh, uint64_t version,
+                                std::function<void()> cb );
+
+    /// @brief Drop the functions added with addWaiter() for a handle, without calling
+    /// them. Called once the caller has stopped waiting, so waiters don't pile up on
+    /// a file which doesn't change; closing the handle drops them as well.
+    /// @return Standard error code; NotSupported if changes aren't tracked.
+    virtual RetCode removeWaiter ( const FileHandle& fh );
+
     bool exists ( const std::string& path ) const;
 
+    /// @brief Set the handler to call when the file system changes by itself.
+    /// Only changes which don't come through this interface are reported, and only
+    /// by file systems which are able to detect them.
+    /// @param [in] cb The callback to invoke with the changed path.
+    inline void setOnChangeHandler (
+        std::function<void ( const std::string& path, ChangeType type )> cb )
+    {
+        onChangeHandler_ = cb;
+    }
+
 protected:
+    /// @brief Report a change to the change handler, if there is one.
+    void notifyChange ( const std::string& path, ChangeType type ) const;
+
     const std::string HostId;
+
+    /// @brief Callback to invoke when the file system changes.
+    std::function<void ( const std::string& path, ChangeType type )> onChangeHandler_;
 };
 
 }
@@ -0,0 +1,223 @@
+#include "InstrumentedFileSystem.hpp"
+#include "LatencyStats.hpp"
+
+using namespace rfs;
+
+/// @brief The LatencyStats layer calls are recorded in.
+static const char* const Layer = "fs";
+
+InstrumentedFileSystem::InstrumentedFileSystem ( FileSystem& fs ) : fs_ ( fs )
+{
+    fs_.setOnChangeHandler ( [this] ( const std::string& path, ChangeType type )
+    {
+        notifyChange ( path, type );
+    } );
+}
+
+InstrumentedFileSystem::~InstrumentedFileSystem()
+{
+    fs_.setOnChangeHandler (
+        std::function<void ( const std::string&, ChangeType )>() );
+}
+
+RetCode InstrumentedFileSystem::createFile ( const Metadata& md, bool reqWrite,
+                                             FileHandle& fh )
+{
+    LatencyTimer timer ( Layer, "createFile", md.path().c_str() );
+    return fs_.createFile ( md, reqWrite, fh );
+}
+
+RetCode InstrumentedFileSystem::openFile ( const std::string& path, bool reqWrite,
+                                           FileHandle& fh )
+{
+    LatencyTimer timer ( Layer, "openFile", path.c_str() );
+    return fs_.openFile ( path, reqWrite, fh );
+}
+
+RetCode InstrumentedFileSystem::closeFile ( const FileHandle& fh )
+{
+    LatencyTimer timer ( Layer, "closeFile" );
+    return fs_.closeFile ( fh );
+}
+
+RetCode InstrumentedFileSystem::flushFile ( const FileHandle& fh )
+{
+    LatencyTimer timer ( Layer, "flushFile" );
+    return fs_.flushFile ( fh );
+}
+
+RetCode InstrumentedFileSystem::syncFile ( const FileHandle& fh, bool dataOnly )
+{
+    LatencyTimer timer ( Layer, "syncFile" );
+    return fs_.syncFile ( fh, dataOnly );
+}
+
+RetCode InstrumentedFileSystem::readFile ( const FileHandle& fh, std::vector<char>& data,
+                                           off_t offset, size_t& processed ) const
+{
+    LatencyTimer timer ( Layer, "readFile" );
+    return fs_.readFile ( fh, data, offset, processed );
+}
+
+RetCode InstrumentedFileSystem::writeFile ( const FileHandle& fh,
+                                            const std::vector<char>& data, off_t offset,
+                                            size_t& processed )
+{
+    LatencyTimer timer ( Layer, "writeFile" );
+    return fs_.writeFile ( fh, data, offset, processed );
+}
+
+RetCode InstrumentedFileSystem::resizeFile ( const std::string& path, size_t size )
+{
+    LatencyTimer timer ( Layer, "resizeFile", path.c_str() );
+    return fs_.resizeFile ( path, size );
+}
+
+RetCode InstrumentedFileSystem::getFileDescriptor ( const FileHandle& fh, int& fd )
+{
+    LatencyTimer timer ( Layer, "getFileDescriptor" );
+    return fs_.getFileDescriptor ( fh, fd );
+}
+
+RetCode InstrumentedFileSystem::copyFile ( const std::string& from, const std::string& to )
+{
+    LatencyTimer timer ( Layer, "copyFile", from.c_str() );
+    return fs_.copyFile ( from, to );
+}
+
+RetCode InstrumentedFileSystem::copyRange ( const FileHandle& from, off_t fromOffset,
+                                            const FileHandle& to, off_t toOffset,
+                                            size_t size, size_t& processed )
+{
+    LatencyTimer timer ( Layer, "copyRange" );
+    return fs_.copyRange ( from, fromOffset, to, toOffset, size, processed );
+}
+
+RetCode InstrumentedFileSystem::createDirectory ( const std::string& path,
+                                                  const Metadata& md )
+{
+    LatencyTimer timer ( Layer, "createDirectory", path.c_str() );
+    return fs_.createDirectory ( path, md );
+}
+
+RetCode InstrumentedFileSystem::readDirectory ( const std::string& path,
+                                                std::vector<Metadata>& children ) const
+{
+    LatencyTimer timer ( Layer, "readDirectory", path.c_str() );
+    return fs_.readDirectory ( path, children );
+}
+
+RetCode InstrumentedFileSystem::createLink ( const std::string& target,
+                                             const std::string& link )
+{
+    LatencyTimer timer ( Layer, "createLink", link.c_str() );
+    return fs_.createLink ( target, link );
+}
+
+RetCode InstrumentedFileSystem::readLink ( const std::string& target,
+                                           std::string& link ) const
+{
+    LatencyTimer timer ( Layer, "readLink", target.c_str() );
+    return fs_.readLink ( target, link );
+}
+
+RetCode InstrumentedFileSystem::remove ( const std::string& path )
+{
+    LatencyTimer timer ( Layer, "remove", path.c_str() );
+    return fs_.remove ( path );
+}
+
+RetCode InstrumentedFileSystem::rename ( const std::string& from, const std::string& to )
+{
+    LatencyTimer timer ( Layer, "rename", from.c_str() );
+    return fs_.rename ( from, to );
+}
+
+RetCode InstrumentedFileSystem::readMetadata ( const std::string& path,
+                                               Metadata& md ) const
+{
+    LatencyTimer timer ( Layer, "readMetadata", path.c_str() );
+    return fs_.readMetadata ( path, md );
+}
+
+RetCode InstrumentedFileSystem::readFileMetadata ( const FileHandle& fh, Metadata& md ) const
+{
+    LatencyTimer timer ( Layer, "readFileMetadata" );
+    return fs_.readFileMetadata ( fh, md );
+}
+
+RetCode InstrumentedFileSystem::setOwner ( const std::string& path,
+                                           const std::string& user,
+                                           const std::string& group )
+{
+    LatencyTimer timer ( Layer, "setOwner", path.c_str() );
+    return fs_.setOwner ( path, user, group );
+}
+
+RetCode InstrumentedFileSystem::setMode ( const std::string& path,
+                                          const Metadata::Modes& mode )
+{
+    LatencyTimer timer ( Layer, "setMode", path.c_str() );
+    return fs_.setMode ( path, mode );
+}
+
+RetCode InstrumentedFileSystem::getXAttr ( const std::string& path,
+                                           const std::string& key,
+                                           std::string& value ) const
+{
+    LatencyTimer timer ( Layer, "getXAttr", path.c_str() );
+    return fs_.getXAttr ( path, key, value );
+}
+
+RetCode InstrumentedFileSystem::listXAttr ( const std::string& path,
+                                            std::vector<std::string>& keys ) const
+{
+    LatencyTimer timer ( Layer, "listXAttr", path.c_str() );
+    return fs_.listXAttr ( path, keys );
+}
+
+RetCode InstrumentedFileSystem::setXAttr ( const std::string& path,
+                                           const std::string& key,
+                                           const std::string& value, XAttrMode mode )
+{
+    LatencyTimer timer ( Layer, "setXAttr", path.c_str() );
+    return fs_.setXAttr ( path, key, value, mode );
+}
+
+RetCode InstrumentedFileSystem::removeXAttr ( const std::string& path,
+                                              const std::string& key )
+{
+    LatencyTimer timer ( Layer, "removeXAttr", path.c_str() );
+    return fs_.removeXAttr ( path, key );
+}
+
+FileSystem::CachePolicy InstrumentedFileSystem::getCachePolicy ( const FileHandle& fh ) const
+{
+    // Called alongside every open; too cheap to be worth recording.
+    return fs_.getCachePolicy ( fh );
+}
+
+RetCode InstrumentedFileSystem::getUsage ( const std::string& path, Usage& usage ) const
+{
+    LatencyTimer timer ( Layer, "getUsage", path.c_str() );
+    return fs_.getUsage ( path, usage );
+}
+
+RetCode InstrumentedFileSystem::getVersion ( const FileHandle& fh, uint64_t& version ) const
+{
+    LatencyTimer timer ( Layer, "getVersion" );
+    return fs_.getVersion ( fh, version );
+}
+
+RetCode InstrumentedFileSystem::addWaiter ( const FileHandle& fh, uint64_t version,
+                                            std::function<void()> cb )
+{
+    LatencyTimer timer ( Layer, "addWaiter" );
+    return fs_.addWaiter ( fh, version, cb );
+}
+
+RetCode InstrumentedFileSystem::removeWaiter ( const FileHandle& fh )
+{
+    LatencyTimer timer ( Layer, "removeWaiter" );
+    return fs_.removeWaiter ( fh );
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "FileSystem.hpp"
+
+namespace rfs
+{
+
+/// @brief Wraps another FileSystem, recording the latency of every call to it.
+/// Calls are recorded in the "fs" layer of LatencyStats, under the name of the
+/// function called and (where the call takes one) the path operated on. Everything
+/// else, including changes reported by the wrapped file system, is passed through.
+class InstrumentedFileSystem : public FileSystem
+{
+public:
+    /// @brief Constructor.
+    /// @param [in] fs The file system to wrap. Its change handler is replaced with one
+    /// forwarding to this file system's handler.
+    InstrumentedFileSystem ( FileSystem& fs );
+
+    /// @brief Destructor.
+    /// Clears the change handler of the wrapped file system.
+    virtual ~InstrumentedFileSystem();
+
+    virtual RetCode createFile ( const Metadata& md, bool reqWrite, FileHandle& fh );
+    virtual RetCode openFile ( const std::string& path, bool reqWrite, FileHandle& fh );
+    virtual RetCode closeFile ( const FileHandle& fh );
+    virtual RetCode flushFile ( const FileHandle& fh );
+    virtual RetCode syncFile ( const FileHandle& fh, bool dataOnly );
+
+    virtual RetCode readFile ( const FileHandle& fh, std::vector<char>& data,
+                               off_t offset, size_t& processed ) const;
+    virtual RetCode writeFile ( const FileHandle& fh, const std::vector<char>& data,
+                                off_t offset, size_t& processed );
+    virtual RetCode resizeFile ( const std::string& path, size_t size );
+    virtual RetCode getFileDescriptor ( const FileHandle& fh, int& fd );
+
+    virtual RetCode copyFile ( const std::string& from, const std::string& to );
+    virtual RetCode copyRange ( const FileHandle& from, off_t fromOffset,
+                                const FileHandle& to, off_t toOffset, size_t size,
+                                size_t& processed );
+
+    virtual RetCode createDirectory ( const std::string& path, const Metadata& md );
+    virtual RetCode readDirectory ( const std::string& path,
+                                    std::vector<Metadata>& children ) const;
+
+    virtual RetCode createLink ( const std::string& target, const std::string& link );
+    virtual RetCode readLink ( const std::string& target, std::string& link ) const;
+
+    virtual RetCode remove ( const std::string& path );
+    virtual RetCode rename ( const std::string& from, const std::string& to );
+
+    virtual RetCode readMetadata ( const std::string& path, Metadata& md ) const;
+    virtual RetCode readFileMetadata ( const FileHandle& fh, Metadata& md ) const;
+
+    virtual RetCode setOwner ( const std::string& path, const std::string& user,
+                               const std::string& group );
+
+    virtual RetCode setMode ( const std::string& path, const Metadata::Modes& mode );
+
+    virtual RetCode getXAttr ( const std::string& path, const std::string& key,
+                               std::string& value ) const;
+    virtual RetCode listXAttr ( const std::string& path,
+                                std::vector<std::string>& keys ) const;
+    virtual RetCode setXAttr ( const std::string& path, const std::string& key,
+                               const std::string& value, XAttrMode mode );
+    virtual RetCode removeXAttr ( const std::string& path, const std::string& key );
+
+    virtual CachePolicy getCachePolicy ( const FileHandle& fh ) const;
+
+    virtual RetCode getUsage ( const std::string& path, Usage& usage ) const;
+
+    virtual RetCode getVersion ( const FileHandle& fh, uint64_t& version ) const;
+    virtual RetCode addWaiter ( const FileHandle& fh, uint64_t version,
+                                std::function<void()> cb );
+    virtual RetCode removeWaiter ( const FileHandle& fh );
+
+private:
+    FileSystem& fs_; ///< The wrapped file system.
+};
+
+}
@@ -0,0 +1,331 @@
+#include "LatencyStats.hpp"
+
+#include <cassert>
+#include <iomanip>
+#include <sstream>
+
+using namespace rfs;
+
+size_t LatencyStats::PrefixDepth ( 1 );
+
+/// @brief The shard the calling thread records into.
+/// Threads are spread over the shards in the order they first record something.
+static size_t getShard()
+{
+    static std::atomic<size_t> next ( 0 );
+    static thread_local size_t shard = next++ % LatencyHistogram::ShardCount;
+
+    return shard;
+}
+
+/// @brief Escape a Prometheus label value.
+static void appendLabel ( std::string& out, const char* name, const std::string& value )
+{
+    out.append ( name ).append ( "=\"" );
+
+    for ( size_t i = 0; i < value.length(); ++i )
+    {
+        const char c = value.at ( i );
+
+        if ( c == '\\' )
+            out.append ( "\\\\" );
+        else if ( c == '"' )
+            out.append ( "\\\"" );
+        else if ( c == '\n' )
+            out.append ( "\\n" );
+        else
+            out.push_back ( c );
+    }
+
+    out.push_back ( '"' );
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    for ( size_t s = 0; s < ShardCount; ++s )
+    {
+        for ( size_t i = 0; i < BucketCount; ++i )
+            shards_[s].buckets[i].store ( 0, std::memory_order_relaxed );
+
+        shards_[s].count.store ( 0, std::memory_order_relaxed );
+        shards_[s].sum.store ( 0, std::memory_order_relaxed );
+    }
+}
+
+void LatencyHistogram::record ( uint64_t nanos )
+{
+    Shard& shard = shards_[getShard()];
+
+    shard.buckets[getBucket ( nanos )].fetch_add ( 1, std::memory_order_relaxed );
+    shard.count.fetch_add ( 1, std::memory_order_relaxed );
+    shard.sum.fetch_add ( nanos, std::memory_order_relaxed );
+}
+
+void LatencyHistogram::snapshot ( Snapshot& snapshot ) const
+{
+    snapshot.buckets.assign ( BucketCount, 0 );
+    snapshot.count = 0;
+    snapshot.sum = 0;
+
+    for ( size_t s = 0; s < ShardCount; ++s )
+    {
+        for ( size_t i = 0; i < BucketCount; ++i )
+            snapshot.buckets[i] += shards_[s].buckets[i].load ( std::memory_order_relaxed );
+
+        snapshot.sum += shards_[s].sum.load ( std::memory_order_relaxed );
+    }
+
+    // Count the buckets rather than reading the counts, so the two always agree.
+    for ( size_t i = 0; i < BucketCount; ++i )
+        snapshot.count += snapshot.buckets[i];
+}
+
+size_t LatencyHistogram::getBucket ( uint64_t nanos )
+{
+    if ( nanos < SubBuckets )
+        return nanos;
+
+    const unsigned exponent = 63 - __builtin_clzll ( nanos );
+
+    if ( exponent >= MaxExponent )
+        return BucketCount - 1;
+
+    // Groups of SubBuckets for each power of two, indexed by the bits below the top one.
+    return ( exponent - SubBucketBits + 1 ) * SubBuckets
+           + ( ( nanos >> ( exponent - SubBucketBits ) ) & ( SubBuckets - 1 ) );
+}
+
+uint64_t LatencyHistogram::getLowerBound ( size_t bucket )
+{
+    if ( bucket < SubBuckets )
+        return bucket;
+
+    const size_t group = bucket / SubBuckets;
+    const uint64_t sub = bucket % SubBuckets;
+
+    return ( SubBuckets + sub ) << ( group - 1 );
+}
+
+bool LatencyStats::Key::operator< ( const Key& other ) const
+{
+    if ( layer != other.layer )
+        return layer < other.layer;
+
+    if ( op != other.op )
+        return op < other.op;
+
+    return prefix < other.prefix;
+}
+
+LatencyStats& LatencyStats::get()
+{
+    static LatencyStats stats;
+    return stats;
+}
+
+LatencyStats::LatencyStats()
+{
+}
+
+LatencyStats::~LatencyStats()
+{
+    for ( std::map<Key, LatencyHistogram*>::iterator it = histograms_.begin();
+          it != histograms_.end(); ++it )
+    {
+        delete it->second;
+    }
+
+    histograms_.clear();
+}
+
+void LatencyStats::record ( const char* layer, const char* op, const char* path,
+                            uint64_t nanos )
+{
+    assert ( layer != nullptr );
+    assert ( op != nullptr );
+
+    // Histograms are never removed, so the pointers cached stay valid.
+    static thread_local std::map<std::pair<const char*, const char*>, CachedOp> cache;
+
+    CachedOp& cached = cache[std::make_pair ( layer, op )];
+
+    Key key;
+
+    if ( cached.all == nullptr )
+    {
+        key.layer = layer;
+        key.op = op;
+        cached.all = &getHistogram ( key );
+    }
+
+    cached.all->record ( nanos );
+
+    if ( path == nullptr )
+        return;
+
+    const std::string prefix ( getPrefix ( path ) );
+    LatencyHistogram*& h = cached.prefixes[prefix];
+
+    if ( h == nullptr )
+    {
+        key.layer = layer;
+        key.op = op;
+        key.prefix = prefix;
+        h = &getHistogram ( key );
+    }
+
+    h->record ( nanos );
+}
+
+void LatencyStats::getLayers ( std::vector<std::string>& layers ) const
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    for ( std::map<Key, LatencyHistogram*>::const_iterator it = histograms_.begin();
+          it != histograms_.end(); ++it )
+    {
+        if ( layers.empty() || layers.back() != it->first.layer )
+            layers.push_back ( it->first.layer );
+    }
+}
+
+void LatencyStats::render ( const std::string& layer, std::string& out ) const
+{
+    std::vector<std::pair<Key, LatencyHistogram*> > series;
+
+    {
+        std::lock_guard<std::mutex> guard ( mtx_ );
+
+        for ( std::map<Key, LatencyHistogram*>::const_iterator it = histograms_.begin();
+              it != histograms_.end(); ++it )
+        {
+            if ( it->first.layer == layer )
+                series.push_back ( *it );
+        }
+    }
+
+    // Exposed buckets are powers of four nanoseconds, from about 1us to about 69s,
+    // all of which are exact bucket boundaries.
+    static const unsigned MinBoundExponent = 10;
+    static const unsigned MaxBoundExponent = 36;
+    static const unsigned Step = 2;
+
+    std::ostringstream s;
+    s << std::setprecision ( 9 );
+
+    // Per operation series first, then per prefix ones.
+    for ( int prefixed = 0; prefixed < 2; ++prefixed )
+    {
+        const std::string name ( "rfs_" + layer
+                                 + ( prefixed ? "_path_latency_seconds"
+                                              : "_op_latency_seconds" ) );
+        bool first = true;
+
+        for ( size_t i = 0; i < series.size(); ++i )
+        {
+            const Key& key = series.at ( i ).first;
+
+            if ( key.prefix.empty() == ( prefixed != 0 ) )
+                continue;
+
+            if ( first )
+            {
+                s << "# HELP " << name << " Latency of rfs " << layer << " operations"
+                  << ( prefixed ? ", by path prefix.\n" : ".\n" );
+                s << "# TYPE " << name << " histogram\n";
+                first = false;
+            }
+
+            std::string labels;
+            appendLabel ( labels, "op", key.op );
+
+            if ( prefixed )
+            {
+                labels.push_back ( ',' );
+                appendLabel ( labels, "prefix", key.prefix );
+            }
+
+            LatencyHistogram::Snapshot snap;
+            series.at ( i ).second->snapshot ( snap );
+
+            uint64_t cumulative = 0;
+            size_t bucket = 0;
+
+            for ( unsigned e = MinBoundExponent; e <= MaxBoundExponent; e += Step )
+            {
+                const uint64_t bound = UINT64_C ( 1 ) << e;
+
+                // Every bucket below the one holding the bound lies entirely under it.
+                for ( ; bucket < LatencyHistogram::getBucket ( bound ); ++bucket )
+                    cumulative += snap.buckets.at ( bucket );
+
+                s << name << "_bucket{" << labels << ",le=\"" << bound / 1e9 << "\"} "
+                  << cumulative << "\n";
+            }
+
+            s << name << "_bucket{" << labels << ",le=\"+Inf\"} " << snap.count << "\n";
+            s << name << "_sum{" << labels << "} " << snap.sum / 1e9 << "\n";
+            s << name << "_count{" << labels << "} " << snap.count << "\n";
+        }
+    }
+
+    out.append ( s.str() );
+}
+
+std::string LatencyStats::getPrefix ( const char* path )
+{
+    assert ( path != nullptr );
+
+    const std::string p ( path );
+
+    size_t end = 0;
+
+    for ( size_t depth = 0; depth < PrefixDepth; ++depth )
+    {
+        const size_t start = p.find_first_not_of ( '/', end );
+
+        if ( start == std::string::npos )
+            break;
+
+        end = p.find ( '/', start );
+
+        if ( end == std::string::npos )
+        {
+            end = p.length();
+            break;
+        }
+    }
+
+    if ( end == 0 )
+        return "/";
+
+    return p.substr ( 0, end );
+}
+
+LatencyHistogram& LatencyStats::getHistogram ( const Key& key )
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    LatencyHistogram*& h = histograms_[key];
+
+    if ( h == nullptr )
+        h = new LatencyHistogram();
+
+    return *h;
+}
+
+LatencyTimer::LatencyTimer ( const char* layer, const char* op, const char* path )
+    : layer_ ( layer ), op_ ( op ), path_ ( path ),
+      start_ ( std::chrono::steady_clock::now() )
+{
+}
+
+LatencyTimer::~LatencyTimer()
+{
+    const std::chrono::steady_clock::duration elapsed
+        = std::chrono::steady_clock::now() - start_;
+
+    LatencyStats::get().record (
+        layer_, op_, path_,
+        std::chrono::duration_cast<std::chrono::nanoseconds> ( elapsed ).count() );
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace rfs
+{
+
+/// @brief A histogram of latencies, cheap enough to record on every operation.
+/// Buckets are log-linear: each power of two is split into SubBuckets equal parts,
+/// which bounds the relative error of any value to 1 / SubBuckets while keeping the
+/// bucket count small.
+///
+/// Recording increments counters in one of several shards, picked by the calling
+/// thread, so threads recording at the same time rarely touch the same cache lines.
+/// The shards are only merged when the histogram is read.
+class LatencyHistogram
+{
+public:
+    /// @brief The number of buckets each power of two is split into (log2).
+    static const unsigned SubBucketBits = 2;
+    /// @brief The number of buckets each power of two is split into.
+    static const unsigned SubBuckets = 1 << SubBucketBits;
+    /// @brief Values of 2^MaxExponent nanoseconds (about 18 minutes) and above all
+    /// go into the last bucket.
+    static const unsigned MaxExponent = 40;
+    /// @brief The total number of buckets.
+    static const size_t BucketCount = ( MaxExponent - SubBucketBits + 1 ) * SubBuckets;
+    /// @brief The number of shards counters are spread over.
+    static const size_t ShardCount = 8;
+
+    /// @brief The merged contents of a histogram.
+    struct Snapshot
+    {
+        std::vector<uint64_t> buckets; ///< The count in each bucket.
+        uint64_t count; ///< The total number of values.
+        uint64_t sum; ///< The sum of all values (nanoseconds).
+    };
+
+    /// @brief Constructor.
+    LatencyHistogram();
+
+    /// @brief Record a single value.
+    /// @param [in] nanos The latency, in nanoseconds.
+    void record ( uint64_t nanos );
+
+    /// @brief Merge the shards.
+    /// Values recorded concurrently may or may not be included.
+    /// @param [out] snapshot The merged contents.
+    void snapshot ( Snapshot& snapshot ) const;
+
+    /// @brief The bucket a value falls into.
+    static size_t getBucket ( uint64_t nanos );
+
+    /// @brief The smallest value which falls into a bucket.
+    static uint64_t getLowerBound ( size_t bucket );
+
+private:
+    /// @brief The counters updated by a subset of the threads.
+    /// Padded so the counters of neighbouring shards don't share a cache line.
+    struct Shard
+    {
+        std::atomic<uint64_t> buckets[BucketCount];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        char padding[64];
+    };
+
+    LatencyHistogram ( const LatencyHistogram& );
+    LatencyHistogram& operator= ( const LatencyHistogram& );
+
+    Shard shards_[ShardCount];
+};
+
+/// @brief The process-wide collection of latency histograms.
+/// Each operation is recorded twice: once under its name alone, and once under its
+/// name and the first PrefixDepth components of its path, so that slow parts of the
+/// tree (a single slow ProcessFile, say) stand out. Operations are grouped in
+/// layers, such as "fuse" for FUSE callbacks and "fs" for FileSystem calls.
+///
+/// Each thread caches the histograms it records into, keyed by the addresses of the
+/// layer and operation names, so only the first record() of an operation (or of a
+/// prefix) on a thread takes the lock. Names must therefore be string literals, or
+/// otherwise outlive every thread recording them.
+///
+/// All functions are safe to call from multiple threads.
+class LatencyStats
+{
+public:
+    /// @brief Configuration field, the number of path components in a prefix.
+    static size_t PrefixDepth;
+
+    /// @brief Retrieve the shared instance.
+    /// @return Latency statistics.
+    static LatencyStats& get();
+
+    /// @brief Destructor.
+    ~LatencyStats();
+
+    /// @brief Record the latency of an operation.
+    /// @param [in] layer The layer the operation belongs to; a string literal.
+    /// @param [in] op The name of the operation; a string literal.
+    /// @param [in] path The path operated on; may be nullptr.
+    /// @param [in] nanos The latency, in nanoseconds.
+    void record ( const char* layer, const char* op, const char* path, uint64_t nanos );
+
+    /// @brief The names of the layers with at least one histogram.
+    /// @param [out] layers The names are appended to this.
+    void getLayers ( std::vector<std::string>& layers ) const;
+
+    /// @brief Render the histograms of a layer in the Prometheus text format.
+    /// @param [in] layer The layer to render.
+    /// @param [out] out The text is appended to this.
+    void render ( const std::string& layer, std::string& out ) const;
+
+    /// @brief The prefix of a path which operations on it are grouped under.
+    static std::string getPrefix ( const char* path );
+
+private:
+    /// @brief What a histogram is recording.
+    struct Key
+    {
+        std::string layer; ///< The layer.
+        std::string op; ///< The operation.
+        std::string prefix; ///< The path prefix; empty for all paths.
+
+        bool operator< ( const Key& other ) const;
+    };
+
+    /// @brief The histograms of an operation, as cached by a recording thread.
+    struct CachedOp
+    {
+        CachedOp() : all ( nullptr )
+        {
+        }
+
+        LatencyHistogram* all; ///< For all paths; nullptr until first needed.
+        std::map<std::string, LatencyHistogram*> prefixes; ///< By path prefix.
+    };
+
+    LatencyStats();
+
+    /// @brief Find (or create) the histogram for a key.
+    LatencyHistogram& getHistogram ( const Key& key );
+
+    /// @brief Protects histograms_. Histograms are never removed, so references to
+    /// them remain valid without holding this.
+    mutable std::mutex mtx_;
+
+    /// @brief The histograms, ordered so related series are rendered together.
+    std::map<Key, LatencyHistogram*> histograms_;
+};
+
+/// @brief Records the time between its construction and destruction.
+/// Intended to be placed at the top of the function being timed.
+class LatencyTimer
+{
+public:
+    /// @brief Constructor; starts timing.
+    /// @param [in] layer The layer the operation belongs to.
+    /// @param [in] op The name of the operation.
+    /// @param [in] path The path operated on; may be nullptr. Must remain valid
+    /// until the timer is destroyed.
+    LatencyTimer ( const char* layer, const char* op, const char* path = nullptr );
+
+    /// @brief Destructor; records the elapsed time.
+    ~LatencyTimer();
+
+private:
+    const char* layer_; ///< The layer the operation belongs to.
+    const char* op_; ///< The name of the operation.
+    const char* path_; ///< The path operated on.
+
+    const std::chrono::steady_clock::time_point start_; ///< When timing started.
+};
+
+}
@@ -0,0 +1,367 @@
+#include "NameCache.hpp"
+
+extern "C"
+{
+#include <unistd.h>
+
+#include <grp.h>
+#include <pwd.h>
+}
+
+#include <cerrno>
+#include <climits>
+#include <vector>
+
+using namespace rfs;
+
+size_t NameCache::MaxEntries ( 4096 );
+
+NameCache& NameCache::get()
+{
+    static NameCache instance;
+    return instance;
+}
+
+NameCache::NameCache() : foundTimeout_ ( 300 ), notFoundTimeout_ ( 30 )
+{
+    hostname_.found = false;
+    hostname_.expiry = 0;
+}
+
+bool NameCache::getUserId ( const std::string& name, uid_t& uid )
+{
+    const time_t now = time ( nullptr );
+
+    {
+        std::lock_guard<std::mutex> guard ( mtx_ );
+
+        Entry<uid_t> e;
+        if ( find ( userIds_, name, now, e ) )
+        {
+            uid = e.value;
+            return e.found;
+        }
+    }
+
+    // The name service is queried without holding the lock; two threads missing on
+    // the same name at once will both look it up, which is harmless.
+    uid_t tmp = 0;
+    const Lookup res = lookupUserId ( name, tmp );
+
+    // The name service failing says nothing about whether the name exists, so it's
+    // asked again next time rather than remembered as not found.
+    if ( res == LookupFailed )
+        return false;
+
+    const bool found = ( res == Found );
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    store ( userIds_, name, tmp, found, now );
+
+    if ( found )
+        store ( userNames_, tmp, name, true, now );
+
+    uid = tmp;
+    return found;
+}
+
+bool NameCache::getGroupId ( const std::string& name, gid_t& gid )
+{
+    const time_t now = time ( nullptr );
+
+    {
+        std::lock_guard<std::mutex> guard ( mtx_ );
+
+        Entry<gid_t> e;
+        if ( find ( groupIds_, name, now, e ) )
+        {
+            gid = e.value;
+            return e.found;
+        }
+    }
+
+    gid_t tmp = 0;
+    const Lookup res = lookupGroupId ( name, tmp );
+
+    if ( res == LookupFailed )
+        return false;
+
+    const bool found = ( res == Found );
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    store ( groupIds_, name, tmp, found, now );
+
+    if ( found )
+        store ( groupNames_, tmp, name, true, now );
+
+    gid = tmp;
+    return found;
+}
+
+bool NameCache::getUserName ( uid_t uid, std::string& name )
+{
+    const time_t now = time ( nullptr );
+
+    {
+        std::lock_guard<std::mutex> guard ( mtx_ );
+
+        Entry<std::string> e;
+        if ( find ( userNames_, uid, now, e ) )
+        {
+            name = e.value;
+            return e.found;
+        }
+    }
+
+    std::string tmp;
+    const Lookup res = lookupUserName ( uid, tmp );
+
+    if ( res == LookupFailed )
+        return false;
+
+    const bool found = ( res == Found );
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    store ( userNames_, uid, tmp, found, now );
+
+    if ( found )
+        store ( userIds_, tmp, uid, true, now );
+
+    name = tmp;
+    return found;
+}
+
+bool NameCache::getGroupName ( gid_t gid, std::string& name )
+{
+    const time_t now = time ( nullptr );
+
+    {
+        std::lock_guard<std::mutex> guard ( mtx_ );
+
+        Entry<std::string> e;
+        if ( find ( groupNames_, gid, now, e ) )
+        {
+            name = e.value;
+            return e.found;
+        }
+    }
+
+    std::string tmp;
+    const Lookup res = lookupGroupName ( gid, tmp );
+
+    if ( res == LookupFailed )
+        return false;
+
+    const bool found = ( res == Found );
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    store ( groupNames_, gid, tmp, found, now );
+
+    if ( found )
+        store ( groupIds_, tmp, gid, true, now );
+
+    name = tmp;
+    return found;
+}
+
+std::string NameCache::getHostname()
+{
+    const time_t now = time ( nullptr );
+
+    {
+        std::lock_guard<std::mutex> guard ( mtx_ );
+
+        if ( now < hostname_.expiry )
+            return hostname_.value;
+    }
+
+    std::vector<char> buf ( _POSIX_HOST_NAME_MAX + 1, '\0' );
+
+    const bool found = ( gethostname ( &buf[0], buf.size() - 1 ) == 0 );
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    hostname_.found = found;
+    hostname_.value = ( found ? std::string ( &buf[0] ) : std::string() );
+    hostname_.expiry = now + ( found ? foundTimeout_ : notFoundTimeout_ );
+
+    return hostname_.value;
+}
+
+void NameCache::setTimeouts ( time_t found, time_t notFound )
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    foundTimeout_ = found;
+    notFoundTimeout_ = notFound;
+}
+
+void NameCache::clear()
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    userIds_.clear();
+    groupIds_.clear();
+    userNames_.clear();
+    groupNames_.clear();
+
+    hostname_.expiry = 0;
+}
+
+template<typename K, typename T>
+bool NameCache::find ( const std::unordered_map<K, Entry<T> >& map, const K& key,
+                       time_t now, Entry<T>& entry )
+{
+    typename std::unordered_map<K, Entry<T> >::const_iterator it = map.find ( key );
+
+    if ( it == map.end() || it->second.expiry <= now )
+        return false;
+
+    entry = it->second;
+    return true;
+}
+
+template<typename K, typename T>
+void NameCache::store ( std::unordered_map<K, Entry<T> >& map, const K& key,
+                        const T& value, bool found, time_t now )
+{
+    if ( map.size() >= MaxEntries && map.find ( key ) == map.end() )
+    {
+        for ( typename std::unordered_map<K, Entry<T> >::iterator it = map.begin();
+              it != map.end(); )
+        {
+            if ( it->second.expiry <= now )
+                it = map.erase ( it );
+            else
+                ++it;
+        }
+
+        // Everything is still live; start over rather than grow without bound.
+        if ( map.size() >= MaxEntries )
+            map.clear();
+    }
+
+    Entry<T>& e = map[key];
+    e.value = value;
+    e.found = found;
+    e.expiry = now + ( found ? foundTimeout_ : notFoundTimeout_ );
+}
+
+size_t NameCache::initialBufferSize ( int name )
+{
+    const long size = sysconf ( name );
+
+    if ( size <= 0 )
+        return 1024;
+
+    return size;
+}
+
+NameCache::Lookup NameCache::toLookup ( int ret, bool found )
+{
+    switch ( ret )
+    {
+    case 0:
+        return ( found ? Found : NotFound );
+
+    // POSIX leaves these to the name service modules for names they don't know.
+    case ENOENT:
+    case ESRCH:
+    case EBADF:
+    case EPERM:
+        return NotFound;
+
+    default:
+        return LookupFailed;
+    }
+}
+
+NameCache::Lookup NameCache::lookupUserId ( const std::string& name, uid_t& uid )
+{
+    std::vector<char> buf ( initialBufferSize ( _SC_GETPW_R_SIZE_MAX ) );
+
+    struct passwd pw;
+    struct passwd* result = nullptr;
+
+    int ret = 0;
+    while ( ( ret = getpwnam_r ( name.c_str(), &pw, &buf[0], buf.size(), &result ) )
+            == ERANGE )
+    {
+        buf.resize ( buf.size() * 2 );
+    }
+
+    const Lookup lookup = toLookup ( ret, result != nullptr );
+
+    if ( lookup == Found )
+        uid = pw.pw_uid;
+
+    return lookup;
+}
+
+NameCache::Lookup NameCache::lookupGroupId ( const std::string& name, gid_t& gid )
+{
+    std::vector<char> buf ( initialBufferSize ( _SC_GETGR_R_SIZE_MAX ) );
+
+    struct group gr;
+    struct group* result = nullptr;
+
+    int ret = 0;
+    while ( ( ret = getgrnam_r ( name.c_str(), &gr, &buf[0], buf.size(), &result ) )
+            == ERANGE )
+    {
+        buf.resize ( buf.size() * 2 );
+    }
+
+    const Lookup lookup = toLookup ( ret, result != nullptr );
+
+    if ( lookup == Found )
+        gid = gr.gr_gid;
+
+    return lookup;
+}
+
+NameCache::Lookup NameCache::lookupUserName ( uid_t uid, std::string& name )
+{
+    std::vector<char> buf ( initialBufferSize ( _SC_GETPW_R_SIZE_MAX ) );
+
+    struct passwd pw;
+    struct passwd* result = nullptr;
+
+    int ret = 0;
+    while ( ( ret = getpwuid_r ( uid, &pw, &buf[0], buf.size(), &result ) ) == ERANGE )
+    {
+        buf.resize ( buf.size() * 2 );
+    }
+
+    const Lookup lookup = toLookup ( ret, result != nullptr );
+
+    if ( lookup == Found )
+        name = pw.pw_name;
+
+    return lookup;
+}
+
+NameCache::Lookup NameCache::lookupGroupName ( gid_t gid, std::string& name )
+{
+    std::vector<char> buf ( initialBufferSize ( _SC_GETGR_R_SIZE_MAX ) );
+
+    struct group gr;
+    struct group* result = nullptr;
+
+    int ret = 0;
+    while ( ( ret = getgrgid_r ( gid, &gr, &buf[0], buf.size(), &result ) ) == ERANGE )
+    {
+        buf.resize ( buf.size() * 2 );
+    }
+
+    const Lookup lookup = toLookup ( ret, result != nullptr );
+
+    if ( lookup == Found )
+        name = gr.gr_name;
+
+    return lookup;
+}
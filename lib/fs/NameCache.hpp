@@ -0,0 +1,135 @@
+#pragma once
+
+extern "C"
+{
+#include <sys/types.h>
+}
+
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace rfs
+{
+
+/// @brief A process-wide cache of user, group and host name lookups.
+/// Translating between uids/gids and names goes through NSS, which on hosts backed
+/// by LDAP or SSSD can mean a network round trip for every call. The classic
+/// getpwnam() family also returns static storage, so it can't be used from more than
+/// one thread at a time.
+///
+/// This class resolves names using the reentrant (_r) variants and remembers the
+/// result in both directions for a limited amount of time. Failed lookups are
+/// remembered as well (for a shorter period) so that unknown names don't repeatedly
+/// hit the name service; errors of the name service itself aren't. All functions are safe to call from multiple threads.
+class NameCache
+{
+public:
+    /// @brief Retrieve the shared instance of the cache.
+    /// @return Name cache.
+    static NameCache& get();
+
+    /// @brief Constructor.
+    NameCache();
+
+    /// @brief Resolve a user name to a uid.
+    /// @param [in] name The user name to resolve.
+    /// @param [out] uid The uid of the user; only valid if true is returned.
+    /// @return true if the user exists; false otherwise.
+    bool getUserId ( const std::string& name, uid_t& uid );
+
+    /// @brief Resolve a group name to a gid.
+    /// @param [in] name The group name to resolve.
+    /// @param [out] gid The gid of the group; only valid if true is returned.
+    /// @return true if the group exists; false otherwise.
+    bool getGroupId ( const std::string& name, gid_t& gid );
+
+    /// @brief Resolve a uid to a user name.
+    /// @param [in] uid The uid to resolve.
+    /// @param [out] name The name of the user; only valid if true is returned.
+    /// @return true if the user exists; false otherwise.
+    bool getUserName ( uid_t uid, std::string& name );
+
+    /// @brief Resolve a gid to a group name.
+    /// @param [in] gid The gid to resolve.
+    /// @param [out] name The name of the group; only valid if true is returned.
+    /// @return true if the group exists; false otherwise.
+    bool getGroupName ( gid_t gid, std::string& name );
+
+    /// @brief Retrieve the name of this host.
+    /// @return The host name; empty if it could not be determined.
+    std::string getHostname();
+
+    /// @brief Change how long lookup results are kept for.
+    /// Existing entries keep the expiry time they were created with.
+    /// @param [in] found Lifetime (in seconds) of successful lookups.
+    /// @param [in] notFound Lifetime (in seconds) of failed lookups.
+    void setTimeouts ( time_t found, time_t notFound );
+
+    /// @brief Discard all cached results.
+    void clear();
+
+private:
+    /// @brief A single cached lookup result.
+    template<typename T>
+    struct Entry
+    {
+        T value; ///< The resolved value; meaningless if found is false.
+        bool found; ///< Whether the lookup succeeded.
+        time_t expiry; ///< The time after which this entry must be looked up again.
+    };
+
+    /// @brief Look up an entry in one of the maps, honouring its expiry time.
+    /// Must be called with mtx_ held.
+    /// @return true if a non-expired entry was present; false otherwise.
+    template<typename K, typename T>
+    static bool find ( const std::unordered_map<K, Entry<T> >& map, const K& key,
+                       time_t now, Entry<T>& entry );
+
+    /// @brief Store a lookup result in one of the maps.
+    /// Must be called with mtx_ held.
+    template<typename K, typename T>
+    void store ( std::unordered_map<K, Entry<T> >& map, const K& key, const T& value,
+                 bool found, time_t now );
+
+    /// @brief The result of asking the name service.
+    enum Lookup
+    {
+        Found, ///< The entry exists.
+        NotFound, ///< There is no such entry.
+        LookupFailed ///< The name service failed, and couldn't tell.
+    };
+
+    /// @brief Interpret what a getpw*_r/getgr*_r call returned.
+    /// @param [in] ret The error number it returned.
+    /// @param [in] found Whether it handed back an entry.
+    static Lookup toLookup ( int ret, bool found );
+
+    /// @brief Determine the initial buffer size to hand to a getpw*_r/getgr*_r call.
+    /// @param [in] name The sysconf() name holding the suggested size.
+    static size_t initialBufferSize ( int name );
+
+    static Lookup lookupUserId ( const std::string& name, uid_t& uid );
+    static Lookup lookupGroupId ( const std::string& name, gid_t& gid );
+    static Lookup lookupUserName ( uid_t uid, std::string& name );
+    static Lookup lookupGroupName ( gid_t gid, std::string& name );
+
+    /// @brief Configuration field, the maximum number of entries kept per map.
+    /// Once reached, expired entries are pruned; if that isn't enough the map is reset.
+    static size_t MaxEntries;
+
+    std::mutex mtx_; ///< Protects all members below.
+
+    time_t foundTimeout_; ///< Lifetime of successful lookups.
+    time_t notFoundTimeout_; ///< Lifetime of failed lookups.
+
+    std::unordered_map<std::string, Entry<uid_t> > userIds_;
+    std::unordered_map<std::string, Entry<gid_t> > groupIds_;
+    std::unordered_map<uid_t, Entry<std::string> > userNames_;
+    std::unordered_map<gid_t, Entry<std::string> > groupNames_;
+
+    Entry<std::string> hostname_; ///< The cached name of this host.
+};
+
+}
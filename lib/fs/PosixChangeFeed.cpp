@@ -0,0 +1,563 @@
+#include "PosixChangeFeed.hpp"
+
+extern "C"
+{
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#endif
+}
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "PosixTreeWalker.hpp"
+#include "PosixUtils.hpp"
+
+using namespace rfs;
+
+size_t PosixChangeFeed::ReadBufferSize ( 64 * 1024 );
+
+PosixChangeFeed::PosixChangeFeed ( const std::string& rootPath )
+    : rootPath_ ( rootPath ), notifyFd_ ( -1 ), mountFd_ ( -1 ), wakeFd_ ( -1 ),
+      usingFanotify_ ( false )
+{
+}
+
+PosixChangeFeed::~PosixChangeFeed()
+{
+    stop();
+}
+
+#ifdef __linux__
+
+RetCode PosixChangeFeed::start()
+{
+    if ( notifyFd_ >= 0 )
+        return AlreadyStarted;
+
+    // fanotify reports canonical paths, so compare against the canonical root.
+    char* real = realpath ( rootPath_.c_str(), nullptr );
+
+    if ( real == nullptr )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    rootPath_ = real;
+    free ( real );
+
+    wakeFd_ = eventfd ( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+
+    if ( wakeFd_ < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    buf_.resize ( ReadBufferSize );
+
+    RetCode rc = startFanotify();
+
+    if ( NotOk ( rc ) )
+        rc = startInotify();
+
+    if ( NotOk ( rc ) )
+    {
+        stop();
+        return rc;
+    }
+
+    thread_ = std::thread ( &PosixChangeFeed::run, this );
+
+    return Success;
+}
+
+void PosixChangeFeed::stop()
+{
+    if ( thread_.joinable() )
+    {
+        const uint64_t one = 1;
+
+        if ( write ( wakeFd_, &one, sizeof ( one ) ) < 0 )
+        {
+            // The counter can only be full if we've already been woken.
+        }
+
+        thread_.join();
+    }
+
+    if ( notifyFd_ >= 0 )
+        close ( notifyFd_ );
+
+    if ( mountFd_ >= 0 )
+        close ( mountFd_ );
+
+    if ( wakeFd_ >= 0 )
+        close ( wakeFd_ );
+
+    notifyFd_ = mountFd_ = wakeFd_ = -1;
+    usingFanotify_ = false;
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+    wdPaths_.clear();
+}
+
+RetCode PosixChangeFeed::startFanotify()
+{
+#ifdef FAN_REPORT_DFID_NAME
+    // Filesystem marks need CAP_SYS_ADMIN and resolving the reported handles needs
+    // CAP_DAC_READ_SEARCH; either failing means falling back to inotify.
+    int fd = fanotify_init ( FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC
+                             | FAN_NONBLOCK, O_RDONLY | O_CLOEXEC );
+
+    if ( fd < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    const uint64_t mask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO
+                          | FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR;
+
+    if ( fanotify_mark ( fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD,
+                         rootPath_.c_str() ) < 0 )
+    {
+        const int err = errno;
+        close ( fd );
+        return PosixUtils::errnoToRetCode ( err );
+    }
+
+    int mountFd = open ( rootPath_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+
+    if ( mountFd < 0 )
+    {
+        const int err = errno;
+        close ( fd );
+        return PosixUtils::errnoToRetCode ( err );
+    }
+
+    // Make sure we'll actually be able to turn handles back into paths.
+    std::vector<char> handle ( sizeof ( struct file_handle ) + MAX_HANDLE_SZ );
+    struct file_handle* fh = reinterpret_cast<struct file_handle*> ( &handle[0] );
+    fh->handle_bytes = MAX_HANDLE_SZ;
+
+    int mountId = 0;
+    int testFd = -1;
+
+    if ( name_to_handle_at ( AT_FDCWD, rootPath_.c_str(), fh, &mountId, 0 ) < 0
+         || ( testFd = open_by_handle_at ( mountFd, fh, O_PATH | O_CLOEXEC ) ) < 0 )
+    {
+        const int err = errno;
+        close ( mountFd );
+        close ( fd );
+        return PosixUtils::errnoToRetCode ( err );
+    }
+
+    close ( testFd );
+
+    notifyFd_ = fd;
+    mountFd_ = mountFd;
+    usingFanotify_ = true;
+
+    return Success;
+#else
+    return NotSupported;
+#endif
+}
+
+RetCode PosixChangeFeed::startInotify()
+{
+    notifyFd_ = inotify_init1 ( IN_CLOEXEC | IN_NONBLOCK );
+
+    if ( notifyFd_ < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    usingFanotify_ = false;
+
+    return addWatches ( "/", false );
+}
+
+void PosixChangeFeed::run()
+{
+    struct pollfd fds[2];
+    memset ( fds, 0, sizeof ( fds ) );
+
+    fds[0].fd = notifyFd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeFd_;
+    fds[1].events = POLLIN;
+
+    while ( true )
+    {
+        int ret = poll ( fds, 2, -1 );
+
+        if ( ret < 0 && errno == EINTR )
+            continue;
+        else if ( ret < 0 || ( fds[1].revents & POLLIN ) )
+            return;
+
+        if ( fds[0].revents & POLLIN )
+        {
+            if ( usingFanotify_ )
+                readFanotify();
+            else
+                readInotify();
+        }
+    }
+}
+
+void PosixChangeFeed::readFanotify()
+{
+#ifdef FAN_REPORT_DFID_NAME
+    ssize_t len = read ( notifyFd_, &buf_[0], buf_.size() );
+
+    if ( len <= 0 )
+        return;
+
+    char linkPath[64];
+    char dirPath[PATH_MAX];
+
+    const struct fanotify_event_metadata* md
+        = reinterpret_cast<const struct fanotify_event_metadata*> ( &buf_[0] );
+
+    for ( ; FAN_EVENT_OK ( md, len ); md = FAN_EVENT_NEXT ( md, len ) )
+    {
+        if ( md->vers != FANOTIFY_METADATA_VERSION )
+            return;
+
+        if ( md->fd >= 0 )
+            close ( md->fd );
+
+        if ( md->mask & FAN_Q_OVERFLOW )
+        {
+            report ( Rescan, "/", true );
+            continue;
+        }
+
+        const char* info = reinterpret_cast<const char*> ( md ) + md->metadata_len;
+        const char* end = reinterpret_cast<const char*> ( md ) + md->event_len;
+
+        while ( info + sizeof ( struct fanotify_event_info_header ) <= end )
+        {
+            const struct fanotify_event_info_fid* fid
+                = reinterpret_cast<const struct fanotify_event_info_fid*> ( info );
+
+            if ( fid->hdr.len == 0 )
+                break;
+
+            info += fid->hdr.len;
+
+            if ( fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME )
+                continue;
+
+            // The handle of the directory is followed by the name of the entry.
+            struct file_handle* fh = reinterpret_cast<struct file_handle*> (
+                const_cast<unsigned char*> ( fid->handle ) );
+            const char* name = reinterpret_cast<const char*> ( fh->f_handle )
+                               + fh->handle_bytes;
+
+            int dirFd = open_by_handle_at ( mountFd_, fh, O_PATH | O_CLOEXEC );
+
+            // The directory has gone since the event was queued; its removal will
+            // be (or has been) reported by its parent.
+            if ( dirFd < 0 )
+                continue;
+
+            snprintf ( linkPath, sizeof ( linkPath ), "/proc/self/fd/%d", dirFd );
+
+            ssize_t ret = readlink ( linkPath, dirPath, sizeof ( dirPath ) - 1 );
+            close ( dirFd );
+
+            if ( ret < 0 )
+                continue;
+
+            dirPath[ret] = '\0';
+
+            // The mark covers the whole filesystem; skip anything outside the root.
+            std::string path ( dirPath );
+
+            if ( path.compare ( 0, rootPath_.length(), rootPath_ ) != 0
+                 || ( path.length() > rootPath_.length()
+                      && path.at ( rootPath_.length() ) != '/' ) )
+            {
+                continue;
+            }
+
+            path = path.substr ( rootPath_.length() );
+
+            if ( path.empty() )
+                path = "/";
+
+            if ( strcmp ( name, "." ) != 0 )
+                path = join ( path, name );
+
+            const bool isDir = ( ( md->mask & FAN_ONDIR ) != 0 );
+
+            // Events for the same entry may have been merged into one.
+            if ( md->mask & ( FAN_CREATE | FAN_MOVED_TO ) )
+                report ( Created, path, isDir );
+
+            if ( md->mask & FAN_MODIFY )
+                report ( Modified, path, isDir );
+
+            if ( md->mask & FAN_ATTRIB )
+                report ( AttributesChanged, path, isDir );
+
+            if ( md->mask & ( FAN_DELETE | FAN_MOVED_FROM ) )
+                report ( Removed, path, isDir );
+        }
+    }
+#endif
+}
+
+void PosixChangeFeed::readInotify()
+{
+    ssize_t len = read ( notifyFd_, &buf_[0], buf_.size() );
+
+    if ( len <= 0 )
+        return;
+
+    // Directories moved away, keyed by cookie, waiting for a matching IN_MOVED_TO.
+    std::unordered_map<uint32_t, std::string> moved;
+
+    for ( ssize_t i = 0; i < len; )
+    {
+        const struct inotify_event* ev
+            = reinterpret_cast<const struct inotify_event*> ( &buf_[i] );
+
+        i += sizeof ( struct inotify_event ) + ev->len;
+
+        if ( ev->mask & IN_Q_OVERFLOW )
+        {
+            report ( Rescan, "/", true );
+
+            // Directories created while events were being dropped still need watches.
+            addWatches ( "/", false );
+            continue;
+        }
+
+        std::string dir;
+
+        {
+            std::lock_guard<std::mutex> guard ( mtx_ );
+
+            std::unordered_map<int, std::string>::iterator it = wdPaths_.find ( ev->wd );
+
+            if ( it == wdPaths_.end() )
+                continue;
+
+            if ( ev->mask & IN_IGNORED )
+            {
+                wdPaths_.erase ( it );
+                continue;
+            }
+
+            dir = it->second;
+        }
+
+        const bool isDir = ( ( ev->mask & IN_ISDIR ) != 0 );
+
+        // Events on a watched directory itself duplicate those its parent sees,
+        // except for the root, which has no watched parent.
+        if ( ev->len == 0 )
+        {
+            if ( dir != "/" )
+                continue;
+
+            if ( ev->mask & IN_ATTRIB )
+                report ( AttributesChanged, dir, true );
+
+            if ( ev->mask & ( IN_DELETE_SELF | IN_MOVE_SELF ) )
+                report ( Removed, dir, true );
+
+            continue;
+        }
+
+        const std::string path ( join ( dir, ev->name ) );
+
+        if ( ev->mask & IN_CREATE )
+        {
+            report ( Created, path, isDir );
+
+            if ( isDir )
+                addWatches ( path, true );
+        }
+        else if ( ev->mask & IN_MOVED_TO )
+        {
+            report ( Created, path, isDir );
+
+            if ( isDir )
+            {
+                std::unordered_map<uint32_t, std::string>::iterator it
+                    = moved.find ( ev->cookie );
+
+                if ( it != moved.end() )
+                {
+                    moveWatches ( it->second, path );
+                    moved.erase ( it );
+                }
+                else
+                {
+                    addWatches ( path, true );
+                }
+            }
+        }
+        else if ( ev->mask & IN_MOVED_FROM )
+        {
+            report ( Removed, path, isDir );
+
+            if ( isDir )
+                moved[ev->cookie] = path;
+        }
+        else if ( ev->mask & IN_DELETE )
+        {
+            report ( Removed, path, isDir );
+        }
+        else if ( ev->mask & IN_MODIFY )
+        {
+            report ( Modified, path, isDir );
+        }
+        else if ( ev->mask & IN_ATTRIB )
+        {
+            report ( AttributesChanged, path, isDir );
+        }
+    }
+
+    // Anything not moved back into the tree in the same batch has left it.
+    for ( std::unordered_map<uint32_t, std::string>::const_iterator it = moved.begin();
+          it != moved.end(); ++it )
+    {
+        removeWatches ( it->second );
+    }
+}
+
+RetCode PosixChangeFeed::addWatches ( const std::string& path, bool report )
+{
+    const uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                          | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF
+                          | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+    std::string root ( rootPath_ );
+
+    if ( path != "/" )
+        root.append ( path );
+
+    std::mutex foundMtx;
+    std::vector<Event> found;
+
+    // Directories created one at a time (an untar, mkdir -p) are nearly always empty,
+    // and not worth a thread per CPU; they are walked on this thread.
+    PosixTreeWalker walker ( report ? 1 : 0 );
+    RetCode rc = walker.walk ( root, false,
+                               [&] ( const PosixTreeWalker::Entry& e )
+    {
+        const std::string p ( e.path.empty() ? path : join ( path, e.path.c_str() ) );
+        const bool isDir = S_ISDIR ( e.st.st_mode );
+
+        if ( isDir )
+        {
+            std::string full ( root );
+
+            if ( ! e.path.empty() )
+                full.append ( "/" ).append ( e.path );
+
+            int wd = inotify_add_watch ( notifyFd_, full.c_str(), mask );
+
+            if ( wd >= 0 )
+            {
+                std::lock_guard<std::mutex> guard ( mtx_ );
+                wdPaths_[wd] = p;
+            }
+        }
+
+        if ( report && ! e.path.empty() )
+        {
+            const Event event = { Created, p, isDir };
+
+            std::lock_guard<std::mutex> guard ( foundMtx );
+            found.push_back ( event );
+        }
+
+        return true;
+    },
+    PosixTreeWalker::Visitor() );
+
+    // Report from this thread only; the walk ran on several.
+    for ( size_t i = 0; i < found.size(); ++i )
+        this->report ( found.at ( i ).type, found.at ( i ).path, found.at ( i ).isDirectory );
+
+    // The directory may already have gone again, which isn't an error.
+    if ( rc == NoSuchPath )
+        return Success;
+
+    return rc;
+}
+
+void PosixChangeFeed::removeWatches ( const std::string& path )
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    for ( std::unordered_map<int, std::string>::iterator it = wdPaths_.begin();
+          it != wdPaths_.end(); )
+    {
+        if ( it->second == path || it->second.compare ( 0, path.length() + 1, path + "/" ) == 0 )
+        {
+            inotify_rm_watch ( notifyFd_, it->first );
+            it = wdPaths_.erase ( it );
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void PosixChangeFeed::moveWatches ( const std::string& from, const std::string& to )
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    for ( std::unordered_map<int, std::string>::iterator it = wdPaths_.begin();
+          it != wdPaths_.end(); ++it )
+    {
+        if ( it->second == from )
+            it->second = to;
+        else if ( it->second.compare ( 0, from.length() + 1, from + "/" ) == 0 )
+            it->second = to + it->second.substr ( from.length() );
+    }
+}
+
+#else
+
+RetCode PosixChangeFeed::start()
+{
+    return NotSupported;
+}
+
+void PosixChangeFeed::stop()
+{
+}
+
+#endif
+
+void PosixChangeFeed::report ( EventType type, const std::string& path, bool isDirectory )
+{
+    if ( ! onChangeHandler_ )
+        return;
+
+    const Event event = { type, path, isDirectory };
+    onChangeHandler_ ( event );
+}
+
+std::string PosixChangeFeed::join ( const std::string& dir, const char* name )
+{
+    std::string path ( dir );
+
+    if ( path.empty() || path.back() != '/' )
+        path.append ( "/" );
+
+    path.append ( name );
+    return path;
+}
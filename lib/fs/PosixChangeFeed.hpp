@@ -0,0 +1,147 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "RetCode.hpp"
+
+namespace rfs
+{
+
+/// @brief Reports changes made to a POSIX directory tree, by anybody.
+/// PosixFileSystem only knows about changes made through it; this watches the
+/// tree it serves so that caches layered on top can be invalidated when something
+/// else modifies it.
+///
+/// Where the process is permitted to, a single fanotify filesystem mark reporting
+/// directory handles and names is used, which covers the whole tree without any
+/// per-directory setup. Otherwise an inotify watch is placed on every directory in
+/// the tree, and new directories are watched as they appear.
+///
+/// If the kernel's event queue overflows, events have been lost; a single Rescan
+/// event for the root is reported instead, and consumers should discard anything
+/// they have cached for the tree.
+///
+/// Only supported on Linux; start() returns NotSupported elsewhere.
+class PosixChangeFeed
+{
+public:
+    /// @brief The kinds of change reported.
+    enum EventType
+    {
+        Created, ///< The entry was created, or moved into place.
+        Modified, ///< The contents of the entry were written to.
+        AttributesChanged, ///< The metadata (mode, owner, times) of the entry changed.
+        Removed, ///< The entry was removed, or moved away.
+        Rescan ///< Events were lost; everything at or below the path may have changed.
+    };
+
+    /// @brief A single change.
+    struct Event
+    {
+        EventType type; ///< What happened.
+        std::string path; ///< The path of the entry, relative to the root ("/" is the root).
+        bool isDirectory; ///< Whether the entry is a directory, if known.
+    };
+
+    /// @brief Constructor.
+    /// @param [in] rootPath The root of the tree to watch; the same path given
+    /// to the PosixFileSystem serving it.
+    PosixChangeFeed ( const std::string& rootPath );
+
+    /// @brief Destructor.
+    ~PosixChangeFeed();
+
+    /// @brief Start watching the tree.
+    /// Events are delivered from a thread owned by this object.
+    /// @return Standard error code.
+    RetCode start();
+
+    /// @brief Stop watching the tree.
+    /// No events are delivered once this returns.
+    void stop();
+
+    /// @brief Set the handler to call when a change is seen.
+    /// Must be set before start() is called.
+    /// @param [in] cb The callback to invoke for each change.
+    inline void setOnChangeHandler ( std::function<void ( const Event& event )> cb )
+    {
+        onChangeHandler_ = cb;
+    }
+
+    /// @brief Whether fanotify, rather than inotify, is being used.
+    /// @return true if fanotify is being used.
+    inline bool isUsingFanotify() const
+    {
+        return usingFanotify_;
+    }
+
+private:
+    /// @brief Configuration field, the size of the buffer events are read into.
+    static size_t ReadBufferSize;
+
+    /// @brief Try to set up a fanotify filesystem mark on the root.
+    /// @return Standard error code; fails if fanotify isn't usable here.
+    RetCode startFanotify();
+
+    /// @brief Set up inotify and watch every directory in the tree.
+    /// @return Standard error code.
+    RetCode startInotify();
+
+    /// @brief The body of the thread reading events.
+    void run();
+
+    /// @brief Read and report a batch of fanotify events.
+    void readFanotify();
+
+    /// @brief Read and report a batch of inotify events.
+    void readInotify();
+
+    /// @brief Watch a directory and everything below it with inotify.
+    /// @param [in] path The path of the directory, relative to the root.
+    /// @param [in] report Whether to report everything found as Created; used for
+    /// directories which appear after start(), whose contents may predate the watch.
+    /// @return Standard error code.
+    RetCode addWatches ( const std::string& path, bool report );
+
+    /// @brief Forget the inotify watches on a directory and everything below it.
+    /// @param [in] path The path of the directory, relative to the root.
+    void removeWatches ( const std::string& path );
+
+    /// @brief Update the paths of the inotify watches on a directory which was moved.
+    /// @param [in] from The old path, relative to the root.
+    /// @param [in] to The new path, relative to the root.
+    void moveWatches ( const std::string& from, const std::string& to );
+
+    /// @brief Deliver a single event.
+    void report ( EventType type, const std::string& path, bool isDirectory );
+
+    /// @brief Join a path relative to the root and an entry name.
+    static std::string join ( const std::string& dir, const char* name );
+
+    /// @brief Callback to invoke when a change is seen.
+    std::function<void ( const Event& event )> onChangeHandler_;
+
+    std::string rootPath_; ///< The canonical path of the root.
+
+    int notifyFd_; ///< The fanotify or inotify descriptor.
+    int mountFd_; ///< A descriptor for the root, used to resolve fanotify handles.
+    int wakeFd_; ///< Written to by stop() to wake the thread.
+    bool usingFanotify_; ///< Whether notifyFd_ is a fanotify descriptor.
+
+    std::thread thread_; ///< The thread reading events.
+
+    std::vector<char> buf_; ///< The buffer events are read into.
+
+    /// @brief Protects wdPaths_; inotify watches are added from several threads.
+    std::mutex mtx_;
+
+    /// @brief The path, relative to the root, of the directory each watch is on.
+    std::unordered_map<int, std::string> wdPaths_;
+};
+
+}
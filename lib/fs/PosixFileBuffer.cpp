@@ -0,0 +1,264 @@
+#include "PosixFileBuffer.hpp"
+
+extern "C"
+{
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "PosixUtils.hpp"
+
+using namespace rfs;
+
+size_t PosixFileBuffer::MinReadAhead ( 64 * 1024 );
+size_t PosixFileBuffer::MaxReadAhead ( 1024 * 1024 );
+size_t PosixFileBuffer::MaxWriteBehind ( 1024 * 1024 );
+unsigned PosixFileBuffer::ReadAheadCheckInterval ( 1000 );
+
+/// @brief The modification time of a file.
+static struct timespec getMTime ( const struct stat& s )
+{
+#ifdef __APPLE__
+    return s.st_mtimespec;
+#else
+    return s.st_mtim;
+#endif
+}
+
+PosixFileBuffer::PosixFileBuffer()
+    : readBufOffset_ ( 0 ), readBufSize_ ( 0 ), nextReadOffset_ ( 0 ), readAhead_ ( 0 ),
+      readSize_ ( 0 ), writeBufOffset_ ( 0 ), writeBufSize_ ( 0 ), writeFd_ ( -1 )
+{
+    memset ( &readMTime_, 0, sizeof ( readMTime_ ) );
+}
+
+RetCode PosixFileBuffer::read ( int fd, char* data, size_t size, off_t offset,
+                                size_t& processed )
+{
+    processed = 0;
+
+    if ( size == 0 )
+        return Success;
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    // Buffered writes need to be visible to reads which touch them.
+    if ( writeBufSize_ > 0 && offset < (off_t) ( writeBufOffset_ + writeBufSize_ )
+         && (off_t) ( offset + size ) > writeBufOffset_ )
+    {
+        RetCode rc = doFlush();
+
+        if ( NotOk ( rc ) )
+            return rc;
+    }
+
+    if ( offset != nextReadOffset_ )
+        readAhead_ = 0;
+
+    if ( readBufSize_ > 0 && isReadAheadStale ( fd ) )
+        readBufSize_ = 0;
+
+    // Entirely satisfied by data we've already read ahead.
+    if ( offset >= readBufOffset_
+         && (off_t) ( offset + size ) <= (off_t) ( readBufOffset_ + readBufSize_ ) )
+    {
+        memcpy ( data, &readBuf_[offset - readBufOffset_], size );
+        processed = size;
+        nextReadOffset_ = offset + processed;
+        return Success;
+    }
+
+    if ( offset == nextReadOffset_ )
+        readAhead_ = ( readAhead_ == 0 ? MinReadAhead
+                       : std::min ( readAhead_ * 2, MaxReadAhead ) );
+
+    // Random access, or a request as large as the window; buffering only costs a copy.
+    if ( readAhead_ == 0 || size >= readAhead_ )
+    {
+        ssize_t ret = 0;
+
+        do
+        {
+            ret = pread ( fd, data, size, offset );
+        }
+        while ( ret < 0 && errno == EINTR );
+
+        if ( ret < 0 )
+            return PosixUtils::errnoToRetCode ( errno );
+
+        processed = ret;
+        nextReadOffset_ = offset + processed;
+        return Success;
+    }
+
+    if ( readBuf_.size() < readAhead_ )
+        readBuf_.resize ( readAhead_ );
+
+    readBufOffset_ = offset;
+    readBufSize_ = 0;
+
+    // Taken before reading, so a change made while reading shows up as well.
+    struct stat s;
+
+    if ( fstat ( fd, &s ) < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    readSize_ = s.st_size;
+    readMTime_ = getMTime ( s );
+    readChecked_ = std::chrono::steady_clock::now();
+
+    ssize_t ret = 0;
+
+    do
+    {
+        ret = pread ( fd, &readBuf_[0], readAhead_, offset );
+    }
+    while ( ret < 0 && errno == EINTR );
+
+    if ( ret < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    readBufSize_ = ret;
+
+    processed = std::min ( size, readBufSize_ );
+    memcpy ( data, &readBuf_[0], processed );
+    nextReadOffset_ = offset + processed;
+
+    return Success;
+}
+
+RetCode PosixFileBuffer::write ( int fd, const char* data, size_t size, off_t offset,
+                                 size_t& processed )
+{
+    processed = 0;
+
+    if ( size == 0 )
+        return Success;
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    // Anything read ahead may now be stale.
+    readBufSize_ = 0;
+
+    // Data buffered through another handle goes out through that handle's descriptor.
+    const bool contiguous = ( writeBufSize_ > 0 && fd == writeFd_
+                              && offset == (off_t) ( writeBufOffset_ + writeBufSize_ ) );
+
+    if ( writeBufSize_ > 0
+         && ( ! contiguous || writeBufSize_ + size > MaxWriteBehind ) )
+    {
+        RetCode rc = doFlush();
+
+        if ( NotOk ( rc ) )
+            return rc;
+    }
+
+    // Large writes gain nothing from being copied into the buffer first.
+    if ( size >= MaxWriteBehind )
+    {
+        while ( processed < size )
+        {
+            ssize_t ret = pwrite ( fd, data + processed, size - processed,
+                                   offset + processed );
+
+            if ( ret < 0 && errno == EINTR )
+                continue;
+            else if ( ret < 0 )
+                return PosixUtils::errnoToRetCode ( errno );
+
+            processed += ret;
+        }
+
+        return Success;
+    }
+
+    if ( writeBufSize_ == 0 )
+    {
+        writeBufOffset_ = offset;
+        writeFd_ = fd;
+    }
+
+    if ( writeBuf_.size() < MaxWriteBehind )
+        writeBuf_.resize ( MaxWriteBehind );
+
+    memcpy ( &writeBuf_[writeBufSize_], data, size );
+    writeBufSize_ += size;
+    processed = size;
+
+    if ( writeBufSize_ >= MaxWriteBehind )
+        return doFlush();
+
+    return Success;
+}
+
+RetCode PosixFileBuffer::flush()
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    return doFlush();
+}
+
+RetCode PosixFileBuffer::doFlush()
+{
+    // Data read ahead may have been read from under the data written out, and neither
+    // the size nor (with coarse timestamps) the modification time have to change.
+    if ( writeBufSize_ > 0 )
+        readBufSize_ = 0;
+
+    size_t written = 0;
+
+    while ( written < writeBufSize_ )
+    {
+        ssize_t ret = pwrite ( writeFd_, &writeBuf_[written], writeBufSize_ - written,
+                               writeBufOffset_ + written );
+
+        if ( ret < 0 && errno == EINTR )
+            continue;
+        else if ( ret < 0 )
+        {
+            const int err = errno;
+
+            // The data can't be retried meaningfully; drop it so that later
+            // operations on this file aren't stuck behind it.
+            writeBufSize_ = 0;
+            return PosixUtils::errnoToRetCode ( err );
+        }
+
+        written += ret;
+    }
+
+    writeBufSize_ = 0;
+    return Success;
+}
+
+void PosixFileBuffer::invalidate()
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    readBufSize_ = 0;
+}
+
+bool PosixFileBuffer::isReadAheadStale ( int fd )
+{
+    // Reading the clock doesn't take a system call; fstat() does.
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    if ( now - readChecked_ < std::chrono::milliseconds ( ReadAheadCheckInterval ) )
+        return false;
+
+    struct stat s;
+
+    if ( fstat ( fd, &s ) < 0 )
+        return true;
+
+    readChecked_ = now;
+
+    const struct timespec mtime = getMTime ( s );
+
+    return ( s.st_size != readSize_ || mtime.tv_sec != readMTime_.tv_sec
+             || mtime.tv_nsec != readMTime_.tv_nsec );
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+extern "C"
+{
+#include <sys/types.h>
+}
+
+#include <chrono>
+#include <ctime>
+#include <mutex>
+#include <vector>
+
+#include "RetCode.hpp"
+
+namespace rfs
+{
+
+/// @brief Buffers reads and writes to a single POSIX file, shared by every handle open on it.
+/// Requests arriving through FUSE or a remote peer tend to be small (often 4 KiB),
+/// and issuing a pread()/pwrite() for each of them is expensive.
+///
+/// Reads: once two reads in a row are contiguous the file is considered to be read
+/// sequentially, and data is read ahead into a buffer. The readahead window starts
+/// small and doubles on each sequential refill up to a fixed maximum; a
+/// non-sequential read drops it back to reading straight into the caller's buffer.
+///
+/// Writes: contiguous writes are coalesced into a write-behind buffer which is
+/// written out when it fills up, when a non-contiguous write arrives, when a read
+/// overlaps it, or when flush() is called. Errors writing buffered data are reported
+/// by whichever call triggers the write-out, so callers must flush() (and check the
+/// result) before closing the descriptor the data was written through.
+///
+/// As every handle on the file goes through the same buffers, none of them reads stale
+/// data written through another. Writes from outside the process can't be seen coming:
+/// data read ahead is dropped whenever the file is opened again, and once the file's
+/// size or modification time has changed. The latter takes an fstat(), so it is only
+/// checked once ReadAheadCheckInterval has passed since the last check; reads served
+/// from the buffer in between cost no system call at all.
+///
+/// All functions are safe to call from multiple threads. The descriptors operations are
+/// performed on are passed in by the caller, and aren't owned by this.
+class PosixFileBuffer
+{
+public:
+    PosixFileBuffer();
+
+    /// @brief Read data from the file.
+    /// @param [in] fd The descriptor to read through.
+    /// @param [out] data The buffer to fill.
+    /// @param [in] size The number of bytes to read.
+    /// @param [in] offset The offset to start reading from.
+    /// @param [out] processed The number of bytes read; less than size at end of file.
+    /// @return Standard error code.
+    RetCode read ( int fd, char* data, size_t size, off_t offset, size_t& processed );
+
+    /// @brief Write data to the file.
+    /// The data may only be buffered; it is guaranteed to have reached the file
+    /// once flush() returns successfully.
+    /// @param [in] fd The descriptor to write through, which must stay open until the
+    /// data has been written out.
+    /// @param [in] data The data to write.
+    /// @param [in] size The number of bytes to write.
+    /// @param [in] offset The offset to start writing at.
+    /// @param [out] processed The number of bytes accepted.
+    /// @return Standard error code.
+    RetCode write ( int fd, const char* data, size_t size, off_t offset, size_t& processed );
+
+    /// @brief Write out any buffered data.
+    /// @return Standard error code.
+    RetCode flush();
+
+    /// @brief Discard any data which has been read ahead.
+    /// Must be called if the file may have been modified other than through this object.
+    void invalidate();
+
+    /// @brief Configuration field, how long data read ahead is served for before the
+    /// file is checked for changes made outside the process (milliseconds).
+    static unsigned ReadAheadCheckInterval;
+
+private:
+    PosixFileBuffer ( const PosixFileBuffer& );
+    PosixFileBuffer& operator= ( const PosixFileBuffer& );
+
+    /// @brief flush(), with mtx_ held.
+    RetCode doFlush();
+
+    /// @brief Whether the file has changed since it was read ahead, as far as its size and
+    /// modification time tell; assumed not to have until ReadAheadCheckInterval has passed
+    /// since it was last checked. Called with mtx_ held.
+    bool isReadAheadStale ( int fd );
+
+    /// @brief Configuration field, the initial readahead window.
+    static size_t MinReadAhead;
+    /// @brief Configuration field, the largest readahead window.
+    static size_t MaxReadAhead;
+    /// @brief Configuration field, the amount of data to buffer before writing it out.
+    static size_t MaxWriteBehind;
+
+    std::mutex mtx_; ///< Protects all members below.
+
+    std::vector<char> readBuf_; ///< Data which has been read ahead.
+    off_t readBufOffset_; ///< The file offset of the first byte in readBuf_.
+    size_t readBufSize_; ///< The number of valid bytes in readBuf_.
+    off_t nextReadOffset_; ///< Where the next read starts if access is sequential.
+    size_t readAhead_; ///< The current readahead window; 0 if access is random.
+    off_t readSize_; ///< The size of the file when it was read ahead.
+    struct timespec readMTime_; ///< The modification time of the file when it was read ahead.
+    std::chrono::steady_clock::time_point readChecked_; ///< When readSize_ and readMTime_ were.
+
+    std::vector<char> writeBuf_; ///< Data waiting to be written.
+    off_t writeBufOffset_; ///< The file offset of the first byte in writeBuf_.
+    size_t writeBufSize_; ///< The number of valid bytes in writeBuf_.
+    int writeFd_; ///< The descriptor writeBuf_ is to be written through.
+};
+
+}
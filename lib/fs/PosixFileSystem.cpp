@@ -5,20 +5,31 @@ extern "C"
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <dirent.h>
 
-#include <grp.h>
-#include <pwd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/xattr.h>
+#endif
 }
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <mutex>
 
+#include "NameCache.hpp"
+#include "PosixTreeWalker.hpp"
 #include "PosixUtils.hpp"
 
 using namespace rfs;
 
+size_t PosixFileSystem::TreeWalkThreads ( 0 );
+
 PosixFileSystem::PosixFileSystem ( const std::string& rootPath ) : rootPath_ ( rootPath )
 {
     assert ( rootPath_.back() != '/' );
@@ -26,13 +37,27 @@ PosixFileSystem::PosixFileSystem ( const std::string& rootPath ) : rootPath_ ( r
 
 PosixFileSystem::~PosixFileSystem()
 {
-    for ( size_t i = 0; i < fds_.size(); ++i )
+    for ( size_t i = 0; i < files_.size(); ++i )
     {
-        if ( fds_.at ( i ) >= 0 )
-            close ( fds_.at ( i ) );
+        OpenFile* file = files_.at ( i );
+
+        if ( file != nullptr )
+        {
+            file->buffer->flush();
+            close ( file->fd );
+            delete file;
+        }
     }
 
-    fds_.clear();
+    files_.clear();
+
+    for ( std::map<FileId, SharedBuffer>::iterator it = buffers_.begin();
+          it != buffers_.end(); ++it )
+    {
+        delete it->second.buffer;
+    }
+
+    buffers_.clear();
 }
 
 RetCode PosixFileSystem::createFile ( const Metadata& md, bool reqWrite, FileHandle& fh )
@@ -67,13 +92,7 @@ RetCode PosixFileSystem::createFile ( const Metadata& md, bool reqWrite, FileHan
         return rc;
     }
 
-    fds_.push_back ( fd );
-
-    fh.Clear();
-    fh.set_fid ( fds_.size() );
-    fh.set_hid ( HostId );
-
-    return Success;
+    return addFile ( fd, p, fh );
 }
 
 RetCode PosixFileSystem::openFile ( const std::string& path, bool reqWrite,
@@ -94,10 +113,52 @@ RetCode PosixFileSystem::openFile ( const std::string& path, bool reqWrite,
     if ( fd < 0 )
         return PosixUtils::errnoToRetCode ( errno );
 
-    fds_.push_back ( fd );
+    return addFile ( fd, p, fh );
+}
+
+RetCode PosixFileSystem::addFile ( int fd, const std::string& path, FileHandle& fh )
+{
+    struct stat s;
+    memset ( &s, 0, sizeof ( s ) );
+
+    if ( fstat ( fd, &s ) < 0 )
+    {
+        const int err = errno;
+        close ( fd );
+        return PosixUtils::errnoToRetCode ( err );
+    }
+
+    OpenFile* file = new OpenFile();
+    file->fd = fd;
+    file->path = path;
+    file->id = FileId ( s.st_dev, s.st_ino );
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    std::map<FileId, SharedBuffer>::iterator it = buffers_.find ( file->id );
+
+    if ( it == buffers_.end() )
+    {
+        SharedBuffer& shared = buffers_[file->id];
+        shared.buffer = new PosixFileBuffer();
+        shared.handles = 1;
+
+        file->buffer = shared.buffer;
+    }
+    else
+    {
+        // Whatever opened it again may have changed it meanwhile, without changing its
+        // size or modification time (as far as their granularity tells).
+        it->second.buffer->invalidate();
+        ++it->second.handles;
+
+        file->buffer = it->second.buffer;
+    }
+
+    files_.push_back ( file );
 
     fh.Clear();
-    fh.set_fid ( fds_.size() );
+    fh.set_fid ( files_.size() - 1 );
     fh.set_hid ( HostId );
 
     return Success;
@@ -105,54 +166,108 @@ RetCode PosixFileSystem::openFile ( const std::string& path, bool reqWrite,
 
 RetCode PosixFileSystem::closeFile ( const FileHandle& fh )
 {
-    if ( fh.hid() != HostId || fh.fid() < 0 || (size_t) fh.fid() >= fds_.size()
-         || fds_.at ( fh.fid() < 0 ) )
-    {
+    OpenFile* file = getFile ( fh );
+
+    if ( file == nullptr )
         return InvalidFileHandle;
+
+    // The handle is released even if the buffered data couldn't be written,
+    // but the caller still gets to hear about it. The buffers are shared with the
+    // file's other handles, whose data is written out along with this one's.
+    RetCode rc = file->buffer->flush();
+
+    if ( close ( file->fd ) < 0 && IsOk ( rc ) )
+        rc = PosixUtils::errnoToRetCode ( errno );
+
+    PosixFileBuffer* unused = nullptr;
+
+    {
+        std::lock_guard<std::mutex> guard ( mtx_ );
+
+        files_.at ( fh.fid() ) = nullptr;
+
+        std::map<FileId, SharedBuffer>::iterator it = buffers_.find ( file->id );
+        assert ( it != buffers_.end() );
+
+        if ( --it->second.handles == 0 )
+        {
+            unused = it->second.buffer;
+            buffers_.erase ( it );
+        }
     }
 
-    close ( fds_.at ( fh.fid() ) );
-    fds_.at ( fh.fid() ) = -1;
+    delete unused;
+    delete file;
 
-    return Success;
+    return rc;
 }
 
-RetCode PosixFileSystem::readFile ( const FileHandle& fh, std::vector<char>& data,
-                                    off_t offset, size_t& processed ) const
+RetCode PosixFileSystem::flushFile ( const FileHandle& fh )
 {
-    if ( fh.hid() != HostId || fh.fid() < 0 || (size_t) fh.fid() >= fds_.size()
-         || fds_.at ( fh.fid() < 0 ) )
-    {
+    OpenFile* file = getFile ( fh );
+
+    if ( file == nullptr )
         return InvalidFileHandle;
-    }
 
-    ssize_t ret = pread ( fds_.at ( fh.fid() ), &data[0], data.size(), offset );
+    return file->buffer->flush();
+}
+
+RetCode PosixFileSystem::syncFile ( const FileHandle& fh, bool dataOnly )
+{
+    OpenFile* file = getFile ( fh );
+
+    if ( file == nullptr )
+        return InvalidFileHandle;
+
+    RetCode rc = file->buffer->flush();
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+#ifdef __APPLE__
+    // OS X has no fdatasync()
+    (void) dataOnly;
+    int ret = fsync ( file->fd );
+#else
+    int ret = ( dataOnly ? fdatasync ( file->fd ) : fsync ( file->fd ) );
+#endif
 
     if ( ret < 0 )
         return PosixUtils::errnoToRetCode ( errno );
 
-    processed = ret;
-
     return Success;
 }
 
+RetCode PosixFileSystem::readFile ( const FileHandle& fh, std::vector<char>& data,
+                                    off_t offset, size_t& processed ) const
+{
+    OpenFile* file = getFile ( fh );
+
+    if ( file == nullptr )
+        return InvalidFileHandle;
+
+    processed = 0;
+
+    if ( data.empty() )
+        return Success;
+
+    return file->buffer->read ( file->fd, &data[0], data.size(), offset, processed );
+}
+
 RetCode PosixFileSystem::writeFile ( const FileHandle& fh, const std::vector<char>& data,
                                      off_t offset, size_t& processed )
 {
-    if ( fh.hid() != HostId || fh.fid() < 0 || (size_t) fh.fid() >= fds_.size()
-         || fds_.at ( fh.fid() < 0 ) )
-    {
+    OpenFile* file = getFile ( fh );
+
+    if ( file == nullptr )
         return InvalidFileHandle;
-    }
 
-    ssize_t ret = pwrite ( fds_.at ( fh.fid() ), &data[0], data.size(), offset );
+    processed = 0;
 
-    if ( ret < 0 )
-        return PosixUtils::errnoToRetCode ( errno );
-
-    processed = ret;
+    if ( data.empty() )
+        return Success;
 
-    return Success;
+    return file->buffer->write ( file->fd, &data[0], data.size(), offset, processed );
 }
 
 RetCode PosixFileSystem::resizeFile ( const std::string& path, size_t size )
@@ -160,6 +275,11 @@ RetCode PosixFileSystem::resizeFile ( const std::string& path, size_t size )
     std::string p ( rootPath_ );
     p.append ( path );
 
+    RetCode rc = flushPath ( p );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
     int ret = truncate ( p.c_str(), size );
 
     if ( ret < 0 )
@@ -168,6 +288,148 @@ RetCode PosixFileSystem::resizeFile ( const std::string& path, size_t size )
     return Success;
 }
 
+RetCode PosixFileSystem::getFileDescriptor ( const FileHandle& fh, int& fd )
+{
+    OpenFile* file = getFile ( fh );
+
+    if ( file == nullptr )
+        return InvalidFileHandle;
+
+    // The caller bypasses the buffers, so they need to be consistent with what's on disk.
+    RetCode rc = file->buffer->flush();
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    file->buffer->invalidate();
+
+    fd = file->fd;
+    return Success;
+}
+
+RetCode PosixFileSystem::copyFile ( const std::string& from, const std::string& to )
+{
+    std::string f ( rootPath_ );
+    f.append ( from );
+    std::string t ( rootPath_ );
+    t.append ( to );
+
+    RetCode rc = flushPath ( f );
+
+    if ( IsOk ( rc ) )
+        rc = flushPath ( t );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    int src = open ( f.c_str(), O_RDONLY );
+
+    if ( src < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    struct stat s;
+    memset ( &s, 0, sizeof ( s ) );
+
+    if ( fstat ( src, &s ) < 0 )
+    {
+        const int err = errno;
+        close ( src );
+        return PosixUtils::errnoToRetCode ( err );
+    }
+
+    if ( ! S_ISREG ( s.st_mode ) )
+    {
+        close ( src );
+        return InvalidFileType;
+    }
+
+    // Not truncated until it's known not to be the source, under another name or the
+    // same one; truncating it would destroy what is about to be copied.
+    int dst = open ( t.c_str(), O_WRONLY | O_CREAT, s.st_mode & 07777 );
+
+    if ( dst < 0 )
+    {
+        const int err = errno;
+        close ( src );
+        return PosixUtils::errnoToRetCode ( err );
+    }
+
+    struct stat d;
+    memset ( &d, 0, sizeof ( d ) );
+
+    if ( fstat ( dst, &d ) < 0 )
+    {
+        const int err = errno;
+        close ( src );
+        close ( dst );
+        return PosixUtils::errnoToRetCode ( err );
+    }
+
+    if ( d.st_dev == s.st_dev && d.st_ino == s.st_ino )
+    {
+        close ( src );
+        close ( dst );
+        return NotPossible;
+    }
+
+    if ( ftruncate ( dst, 0 ) < 0 )
+    {
+        const int err = errno;
+        close ( src );
+        close ( dst );
+        unlink ( t.c_str() );
+        return PosixUtils::errnoToRetCode ( err );
+    }
+
+    bool cloned = false;
+
+#ifdef FICLONE
+    // On file systems supporting reflinks (btrfs, xfs, ...) the copy shares the
+    // source's extents and costs nothing up front.
+    cloned = ( ioctl ( dst, FICLONE, src ) == 0 );
+#endif
+
+    if ( ! cloned )
+    {
+        size_t processed = 0;
+        rc = copyData ( src, 0, dst, 0, s.st_size, processed );
+    }
+
+    close ( src );
+    close ( dst );
+
+    // Don't leave a partial copy behind.
+    if ( NotOk ( rc ) )
+        unlink ( t.c_str() );
+
+    return rc;
+}
+
+RetCode PosixFileSystem::copyRange ( const FileHandle& from, off_t fromOffset,
+                                     const FileHandle& to, off_t toOffset, size_t size,
+                                     size_t& processed )
+{
+    OpenFile* src = getFile ( from );
+    OpenFile* dst = getFile ( to );
+
+    if ( src == nullptr || dst == nullptr )
+        return InvalidFileHandle;
+
+    // The copy happens underneath both buffers, so they need to be consistent with
+    // the files before it starts.
+    RetCode rc = src->buffer->flush();
+
+    if ( IsOk ( rc ) )
+        rc = dst->buffer->flush();
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    dst->buffer->invalidate();
+
+    return copyData ( src->fd, fromOffset, dst->fd, toOffset, size, processed );
+}
+
 RetCode PosixFileSystem::createDirectory ( const std::string& path, const Metadata& md )
 {
     std::string p ( rootPath_ );
@@ -202,6 +464,10 @@ RetCode PosixFileSystem::readDirectory ( const std::string& path,
 
     for ( struct dirent* de = readdir ( dir ); de != nullptr; de = readdir ( dir ) )
     {
+        // Like ProcessFileSystem, only report real entries.
+        if ( strcmp ( de->d_name, "." ) == 0 || strcmp ( de->d_name, ".." ) == 0 )
+            continue;
+
         Metadata md;
         if ( de->d_type == DT_DIR )
             md.set_type ( Metadata::Directory );
@@ -271,12 +537,147 @@ RetCode PosixFileSystem::readLink ( const std::string& path, std::string& link )
     return Success;
 }
 
+RetCode PosixFileSystem::getXAttr ( const std::string& path, const std::string& key,
+                                    std::string& value ) const
+{
+#ifdef __linux__
+    std::string p ( rootPath_ );
+    p.append ( path );
+
+    // The value may change between asking for its size and reading it.
+    while ( true )
+    {
+        ssize_t size = lgetxattr ( p.c_str(), key.c_str(), nullptr, 0 );
+
+        if ( size < 0 )
+            return ( errno == ENODATA ? NoSuchAttribute : PosixUtils::errnoToRetCode ( errno ) );
+
+        value.resize ( size );
+
+        if ( size == 0 )
+            return Success;
+
+        size = lgetxattr ( p.c_str(), key.c_str(), &value[0], value.size() );
+
+        if ( size >= 0 )
+        {
+            value.resize ( size );
+            return Success;
+        }
+
+        if ( errno != ERANGE )
+            return ( errno == ENODATA ? NoSuchAttribute : PosixUtils::errnoToRetCode ( errno ) );
+    }
+#else
+    ( void ) path;
+    ( void ) key;
+    ( void ) value;
+    return NotSupported;
+#endif
+}
+
+RetCode PosixFileSystem::listXAttr ( const std::string& path,
+                                     std::vector<std::string>& keys ) const
+{
+#ifdef __linux__
+    std::string p ( rootPath_ );
+    p.append ( path );
+
+    std::vector<char> names;
+
+    while ( true )
+    {
+        ssize_t size = llistxattr ( p.c_str(), nullptr, 0 );
+
+        if ( size < 0 )
+            return PosixUtils::errnoToRetCode ( errno );
+
+        if ( size == 0 )
+            return Success;
+
+        names.resize ( size );
+
+        size = llistxattr ( p.c_str(), &names[0], names.size() );
+
+        if ( size >= 0 )
+        {
+            names.resize ( size );
+            break;
+        }
+
+        if ( errno != ERANGE )
+            return PosixUtils::errnoToRetCode ( errno );
+    }
+
+    // The names are each null terminated, one after another.
+    for ( size_t i = 0; i < names.size(); )
+    {
+        const size_t len = strnlen ( &names[i], names.size() - i );
+
+        if ( len > 0 )
+            keys.push_back ( std::string ( &names[i], len ) );
+
+        i += len + 1;
+    }
+
+    return Success;
+#else
+    ( void ) path;
+    ( void ) keys;
+    return NotSupported;
+#endif
+}
+
+RetCode PosixFileSystem::setXAttr ( const std::string& path, const std::string& key,
+                                    const std::string& value, XAttrMode mode )
+{
+#ifdef __linux__
+    std::string p ( rootPath_ );
+    p.append ( path );
+
+    int flags = 0;
+
+    if ( mode == XAttrCreate )
+        flags = XATTR_CREATE;
+    else if ( mode == XAttrReplace )
+        flags = XATTR_REPLACE;
+
+    if ( lsetxattr ( p.c_str(), key.c_str(), value.data(), value.size(), flags ) < 0 )
+        return ( errno == ENODATA ? NoSuchAttribute : PosixUtils::errnoToRetCode ( errno ) );
+
+    return Success;
+#else
+    ( void ) path;
+    ( void ) key;
+    ( void ) value;
+    ( void ) mode;
+    return NotSupported;
+#endif
+}
+
+RetCode PosixFileSystem::removeXAttr ( const std::string& path, const std::string& key )
+{
+#ifdef __linux__
+    std::string p ( rootPath_ );
+    p.append ( path );
+
+    if ( lremovexattr ( p.c_str(), key.c_str() ) < 0 )
+        return ( errno == ENODATA ? NoSuchAttribute : PosixUtils::errnoToRetCode ( errno ) );
+
+    return Success;
+#else
+    ( void ) path;
+    ( void ) key;
+    return NotSupported;
+#endif
+}
+
 RetCode PosixFileSystem::remove ( const std::string& path )
 {
     std::string p ( rootPath_ );
     p.append ( path );
 
-    int ret = remove ( p.c_str() );
+    int ret = ::remove ( p.c_str() );
 
     if ( ret == 0 )
     {
@@ -285,7 +686,7 @@ RetCode PosixFileSystem::remove ( const std::string& path )
 
     assert ( ret == -1 );
 
-    /// @todo Perform a recursive remove if necessary
+    // Non-empty directories aren't removed here; see removeTree().
     return PosixUtils::errnoToRetCode ( errno );
 }
 
@@ -296,9 +697,36 @@ RetCode PosixFileSystem::rename ( const std::string& from, const std::string& to
     std::string t ( rootPath_ );
     t.append ( to );
 
-    if ( rename ( f.c_str(), t.c_str() ) < 0 )
+    RetCode rc = flushPath ( f );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    if ( ::rename ( f.c_str(), t.c_str() ) < 0 )
         return PosixUtils::errnoToRetCode ( errno );
 
+    // Handles stay open across a rename; keep them findable by their new name, along
+    // with those open below a directory renamed.
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    for ( size_t i = 0; i < files_.size(); ++i )
+    {
+        OpenFile* file = files_.at ( i );
+
+        if ( file == nullptr )
+            continue;
+
+        if ( file->path == f )
+        {
+            file->path = t;
+        }
+        else if ( file->path.size() > f.size() && file->path[f.size()] == '/'
+                  && file->path.compare ( 0, f.size(), f ) == 0 )
+        {
+            file->path = t + file->path.substr ( f.size() );
+        }
+    }
+
     return Success;
 }
 
@@ -307,6 +735,12 @@ RetCode PosixFileSystem::readMetadata ( const std::string& path, Metadata& md )
     std::string p ( rootPath_ );
     p.append ( path );
 
+    // The size and times need to reflect writes which are still buffered.
+    RetCode rc = flushPath ( p );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
     struct stat s;
     memset ( &s, 0, sizeof ( s ) );
 
@@ -314,6 +748,32 @@ RetCode PosixFileSystem::readMetadata ( const std::string& path, Metadata& md )
         return PosixUtils::errnoToRetCode ( errno );
 
     PosixUtils::statToMetadata ( &s, md );
+    setOwnerNames ( s, md );
+
+    return Success;
+}
+
+RetCode PosixFileSystem::readFileMetadata ( const FileHandle& fh, Metadata& md ) const
+{
+    OpenFile* file = getFile ( fh );
+
+    if ( file == nullptr )
+        return InvalidFileHandle;
+
+    RetCode rc = file->buffer->flush();
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    struct stat s;
+    memset ( &s, 0, sizeof ( s ) );
+
+    if ( fstat ( file->fd, &s ) < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    PosixUtils::statToMetadata ( &s, md );
+    setOwnerNames ( s, md );
+
     return Success;
 }
 
@@ -323,54 +783,158 @@ RetCode PosixFileSystem::setOwner ( const std::string& path, const std::string&
     std::string p ( rootPath_ );
     p.append ( path );
 
-    const size_t userAtIdx = user.find ( '@' );
+    uid_t uid = 0;
+    gid_t gid = 0;
 
-    std::string username;
-    std::string userhost;
+    RetCode rc = resolveOwner ( user, group, uid, gid );
 
-    if ( userAtIdx != std::string::npos )
-    {
-        username = user.substr ( 0, userAtIdx );
-        userhost = user.substr ( userAtIdx + 1 );
-    }
-    else
+    if ( NotOk ( rc ) )
+        return rc;
+
+    if ( chown ( p.c_str(), uid, gid ) < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    return Success;
+}
+
+RetCode PosixFileSystem::setMode ( const std::string& path,
+                                   const Metadata::Modes& modes )
+{
+    std::string p ( rootPath_ );
+    p.append ( path );
+
+    mode_t mode = 0;
+    Metadata tmp;
+    Metadata::Modes* tmpModes = tmp.mutable_modes();
+    *tmpModes = modes;
+
+    PosixUtils::metadataToPosixMode ( tmp, mode );
+
+    if ( chmod ( p.c_str(), mode ) < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    return Success;
+}
+
+
+RetCode PosixFileSystem::removeTree ( const std::string& path )
+{
+    // Whatever leads back up to the root would remove the whole file system, root included.
+    bool belowRoot = false;
+
+    for ( size_t pos = 0; pos < path.size(); )
     {
-        username = user;
+        size_t next = path.find ( '/', pos );
+
+        if ( next == std::string::npos )
+            next = path.size();
+
+        const std::string name ( path, pos, next - pos );
+
+        if ( name == ".." )
+            return InvalidPath;
+
+        if ( ! name.empty() && name != "." )
+            belowRoot = true;
+
+        pos = next + 1;
     }
 
-    struct passwd* pw = getpwnam ( username.c_str() );
+    if ( ! belowRoot )
+        return InvalidPath;
 
-    if ( pw == nullptr )
-        return InvalidUser;
+    std::string p ( rootPath_ );
+    p.append ( path );
+
+    struct stat s;
+    memset ( &s, 0, sizeof ( s ) );
+
+    if ( lstat ( p.c_str(), &s ) < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
 
-    const size_t groupAtIdx = group.find ( '@' );
+    if ( ! S_ISDIR ( s.st_mode ) )
+        return remove ( path );
 
-    std::string groupname;
-    std::string grouphost;
+    std::atomic<int> err ( 0 );
 
-    if ( groupAtIdx != std::string::npos )
+    // Everything but directories goes as soon as it's found; directories are
+    // removed once they've been emptied.
+    PosixTreeWalker walker ( TreeWalkThreads );
+    RetCode rc = walker.walk ( p, false,
+                               [&err] ( const PosixTreeWalker::Entry& e )
     {
-        groupname = group.substr ( 0, groupAtIdx );
-        grouphost = group.substr ( groupAtIdx + 1 );
-    }
-    else
+        if ( S_ISDIR ( e.st.st_mode ) )
+            return true;
+
+        if ( unlinkat ( e.dirFd, e.name, 0 ) < 0 && errno != ENOENT )
+        {
+            err = errno;
+            return false;
+        }
+
+        return true;
+    },
+    [&err] ( const PosixTreeWalker::Entry& e )
     {
-        groupname = group;
-    }
+        if ( unlinkat ( e.dirFd, e.name, AT_REMOVEDIR ) < 0 && errno != ENOENT )
+        {
+            err = errno;
+            return false;
+        }
 
-    struct group* gr = getgrnam ( groupname.c_str() );
+        return true;
+    } );
 
-    if ( gr == nullptr )
-        return InvalidGroup;
+    if ( NotOk ( rc ) )
+        return rc;
 
-    if ( chown ( p.c_str(), pw->pw_uid, gr->gr_gid ) < 0 )
-        return PosixUtils::errnoToRetCode ( errno );
+    if ( err != 0 )
+        return PosixUtils::errnoToRetCode ( err );
 
     return Success;
 }
 
-RetCode PosixFileSystem::setMode ( const std::string& path,
-                                   const Metadata::Modes& modes )
+RetCode PosixFileSystem::setOwnerTree ( const std::string& path, const std::string& user,
+                                        const std::string& group )
+{
+    std::string p ( rootPath_ );
+    p.append ( path );
+
+    uid_t uid = 0;
+    gid_t gid = 0;
+
+    RetCode rc = resolveOwner ( user, group, uid, gid );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    std::atomic<int> err ( 0 );
+
+    PosixTreeWalker walker ( TreeWalkThreads );
+    rc = walker.walk ( p, false,
+                       [&err, uid, gid] ( const PosixTreeWalker::Entry& e )
+    {
+        if ( fchownat ( e.dirFd, e.name, uid, gid, AT_SYMLINK_NOFOLLOW ) < 0 )
+        {
+            err = errno;
+            return false;
+        }
+
+        return true;
+    },
+    PosixTreeWalker::Visitor() );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    if ( err != 0 )
+        return PosixUtils::errnoToRetCode ( err );
+
+    return Success;
+}
+
+RetCode PosixFileSystem::setModeTree ( const std::string& path,
+                                       const Metadata::Modes& modes )
 {
     std::string p ( rootPath_ );
     p.append ( path );
@@ -381,10 +945,296 @@ RetCode PosixFileSystem::setMode ( const std::string& path,
     *tmpModes = modes;
 
     PosixUtils::metadataToPosixMode ( tmp, mode );
+    mode &= ~S_IFMT;
+
+    std::atomic<int> err ( 0 );
+
+    // Directories are changed after their contents, so that a mode which denies
+    // access to them doesn't stop the walk.
+    PosixTreeWalker walker ( TreeWalkThreads );
+    RetCode rc = walker.walk ( p, false,
+                               [&err, mode] ( const PosixTreeWalker::Entry& e )
+    {
+        if ( S_ISDIR ( e.st.st_mode ) || S_ISLNK ( e.st.st_mode ) )
+            return true;
+
+        if ( fchmodat ( e.dirFd, e.name, mode, 0 ) < 0 )
+        {
+            err = errno;
+            return false;
+        }
+
+        return true;
+    },
+    [&err, mode] ( const PosixTreeWalker::Entry& e )
+    {
+        if ( fchmodat ( e.dirFd, e.name, mode, 0 ) < 0 )
+        {
+            err = errno;
+            return false;
+        }
+
+        return true;
+    } );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    if ( err != 0 )
+        return PosixUtils::errnoToRetCode ( err );
+
+    return Success;
+}
+
+RetCode PosixFileSystem::getTreeSize ( const std::string& path, TreeSize& size ) const
+{
+    std::string p ( rootPath_ );
+    p.append ( path );
+
+    memset ( &size, 0, sizeof ( size ) );
+
+    RetCode rc = flushTree ( p );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    std::atomic<size_t> files ( 0 );
+    std::atomic<size_t> directories ( 0 );
+    std::atomic<uint64_t> bytes ( 0 );
+    std::atomic<uint64_t> allocated ( 0 );
+
+    PosixTreeWalker walker ( TreeWalkThreads );
+    rc = walker.walk ( p, true,
+                       [&] ( const PosixTreeWalker::Entry& e )
+    {
+        if ( S_ISDIR ( e.st.st_mode ) )
+            ++directories;
+        else
+            ++files;
+
+        bytes += e.st.st_size;
+        allocated += (uint64_t) e.st.st_blocks * 512;
+
+        return true;
+    },
+    PosixTreeWalker::Visitor() );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    size.files = files;
+    size.directories = directories;
+    size.bytes = bytes;
+    size.allocated = allocated;
+
+    return Success;
+}
+
+RetCode PosixFileSystem::dumpMetadata ( const std::string& path,
+                                        std::vector<Metadata>& entries ) const
+{
+    std::string p ( rootPath_ );
+    p.append ( path );
+
+    RetCode rc = flushTree ( p );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    std::mutex mtx;
+
+    PosixTreeWalker walker ( TreeWalkThreads );
+    rc = walker.walk ( p, true,
+                       [&] ( const PosixTreeWalker::Entry& e )
+    {
+        Metadata md;
+        PosixUtils::statToMetadata ( &e.st, md );
+
+        std::string mdPath ( path );
+
+        if ( ! e.path.empty() )
+        {
+            if ( mdPath.empty() || mdPath.back() != '/' )
+                mdPath.append ( "/" );
+
+            mdPath.append ( e.path );
+        }
+
+        md.set_path ( mdPath );
+
+        setOwnerNames ( e.st, md );
+
+        std::lock_guard<std::mutex> guard ( mtx );
+        entries.push_back ( md );
+
+        return true;
+    },
+    PosixTreeWalker::Visitor() );
+
+    return rc;
+}
+
+
+PosixFileSystem::OpenFile* PosixFileSystem::getFile ( const FileHandle& fh ) const
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    if ( fh.hid() != HostId || fh.fid() < 0 || (size_t) fh.fid() >= files_.size() )
+        return nullptr;
+
+    return files_.at ( fh.fid() );
+}
+
+RetCode PosixFileSystem::flushPath ( const std::string& path ) const
+{
+    RetCode rc = Success;
+
+    // Held throughout, so no buffer goes away while it's being flushed.
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    for ( size_t i = 0; i < files_.size(); ++i )
+    {
+        OpenFile* file = files_.at ( i );
+
+        if ( file == nullptr || file->path != path )
+            continue;
+
+        RetCode tmp = file->buffer->flush();
+        file->buffer->invalidate();
+
+        if ( NotOk ( tmp ) )
+            rc = tmp;
+    }
+
+    return rc;
+}
+
+RetCode PosixFileSystem::flushTree ( const std::string& path ) const
+{
+    RetCode rc = Success;
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    for ( size_t i = 0; i < files_.size(); ++i )
+    {
+        OpenFile* file = files_.at ( i );
+
+        if ( file == nullptr || file->path.compare ( 0, path.length(), path ) != 0
+             || ( file->path.length() > path.length()
+                  && file->path.at ( path.length() ) != '/' ) )
+        {
+            continue;
+        }
+
+        RetCode tmp = file->buffer->flush();
+
+        if ( NotOk ( tmp ) )
+            rc = tmp;
+    }
+
+    return rc;
+}
+
+RetCode PosixFileSystem::copyData ( int from, off_t fromOffset, int to, off_t toOffset,
+                                    size_t size, size_t& processed )
+{
+    processed = 0;
+
+#ifdef __linux__
+    loff_t in = fromOffset;
+    loff_t out = toOffset;
+
+    while ( processed < size )
+    {
+        ssize_t ret = copy_file_range ( from, &in, to, &out, size - processed, 0 );
+
+        if ( ret == 0 )
+            return Success;
+        else if ( ret > 0 )
+        {
+            processed += ret;
+            continue;
+        }
+
+        if ( errno == EINTR )
+            continue;
+
+        // Older kernels, or a pair of files which can't be copied between directly;
+        // fall back to copying through a buffer from wherever we got to.
+        if ( errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP )
+            break;
 
-    if ( chmod ( p.c_str(), mode ) < 0 )
         return PosixUtils::errnoToRetCode ( errno );
+    }
+#endif
+
+    std::vector<char> buf ( 128 * 1024 );
+
+    while ( processed < size )
+    {
+        const size_t toRead = std::min ( buf.size(), size - processed );
+        ssize_t ret = pread ( from, &buf[0], toRead, fromOffset + processed );
+
+        if ( ret < 0 && errno == EINTR )
+            continue;
+        else if ( ret < 0 )
+            return PosixUtils::errnoToRetCode ( errno );
+        else if ( ret == 0 )
+            break;
+
+        size_t written = 0;
+
+        while ( written < (size_t) ret )
+        {
+            ssize_t w = pwrite ( to, &buf[written], ret - written,
+                                 toOffset + processed + written );
+
+            if ( w < 0 && errno == EINTR )
+                continue;
+            else if ( w < 0 )
+                return PosixUtils::errnoToRetCode ( errno );
+
+            written += w;
+        }
+
+        processed += ret;
+    }
 
     return Success;
 }
 
+RetCode PosixFileSystem::resolveOwner ( const std::string& user, const std::string& group,
+                                        uid_t& uid, gid_t& gid )
+{
+    // The host part of user@host and group@host isn't checked; names are
+    // resolved locally.
+    const std::string username ( user.substr ( 0, user.find ( '@' ) ) );
+    const std::string groupname ( group.substr ( 0, group.find ( '@' ) ) );
+
+    if ( ! NameCache::get().getUserId ( username, uid ) )
+        return InvalidUser;
+
+    if ( ! NameCache::get().getGroupId ( groupname, gid ) )
+        return InvalidGroup;
+
+    return Success;
+}
+
+void PosixFileSystem::setOwnerNames ( const struct stat& s, Metadata& md )
+{
+    NameCache& names = NameCache::get();
+
+    const std::string hostname ( names.getHostname() );
+
+    std::string user;
+    if ( ! names.getUserName ( s.st_uid, user ) )
+        user = std::to_string ( s.st_uid );
+
+    md.set_uid ( user.append ( "@" ).append ( hostname ) );
+
+    std::string group;
+    if ( ! names.getGroupName ( s.st_gid, group ) )
+        group = std::to_string ( s.st_gid );
+
+    md.set_gid ( group.append ( "@" ).append ( hostname ) );
+}
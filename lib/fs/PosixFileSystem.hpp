@@ -1,6 +1,16 @@
 #pragma once
 
+extern "C"
+{
+#include <sys/stat.h>
+}
+
+#include <map>
+#include <mutex>
+#include <utility>
+
 #include "FileSystem.hpp"
+#include "PosixFileBuffer.hpp"
 
 namespace rfs
 {
@@ -8,18 +18,35 @@ namespace rfs
 class PosixFileSystem : public FileSystem
 {
 public:
+    /// @brief Totals gathered by getTreeSize().
+    struct TreeSize
+    {
+        size_t files; ///< The number of non-directory entries.
+        size_t directories; ///< The number of directories, including the root.
+        uint64_t bytes; ///< The sum of the apparent sizes of all entries.
+        uint64_t allocated; ///< The sum of the space allocated to all entries.
+    };
+
     PosixFileSystem ( const std::string& rootPath = "" );
     virtual ~PosixFileSystem();
 
     virtual RetCode createFile ( const Metadata& md, bool reqWrite, FileHandle& fh );
     virtual RetCode openFile ( const std::string& path, bool reqWrite, FileHandle& fh );
     virtual RetCode closeFile ( const FileHandle& fh );
+    virtual RetCode flushFile ( const FileHandle& fh );
+    virtual RetCode syncFile ( const FileHandle& fh, bool dataOnly );
 
     virtual RetCode readFile ( const FileHandle& fh, std::vector<char>& data,
                                off_t offset, size_t& processed ) const;
     virtual RetCode writeFile ( const FileHandle& fh, const std::vector<char>& data,
                                 off_t offset, size_t& processed );
     virtual RetCode resizeFile ( const std::string& path, size_t size );
+    virtual RetCode getFileDescriptor ( const FileHandle& fh, int& fd );
+
+    virtual RetCode copyFile ( const std::string& from, const std::string& to );
+    virtual RetCode copyRange ( const FileHandle& from, off_t fromOffset,
+                                const FileHandle& to, off_t toOffset, size_t size,
+                                size_t& processed );
 
     virtual RetCode createDirectory ( const std::string& path, const Metadata& md );
     virtual RetCode readDirectory ( const std::string& path,
@@ -33,16 +60,125 @@ public:
     virtual RetCode rename ( const std::string& from, const std::string& to );
 
     virtual RetCode readMetadata ( const std::string& path, Metadata& md ) const;
+    virtual RetCode readFileMetadata ( const FileHandle& fh, Metadata& md ) const;
 
     virtual RetCode setOwner ( const std::string& path, const std::string& user,
                                const std::string& group );
 
     virtual RetCode setMode ( const std::string& path, const Metadata::Modes& mode );
 
+    /// @brief Extended attributes are those of the underlying file; symbolic links
+    /// aren't followed.
+    virtual RetCode getXAttr ( const std::string& path, const std::string& key,
+                               std::string& value ) const;
+    virtual RetCode listXAttr ( const std::string& path,
+                                std::vector<std::string>& keys ) const;
+    virtual RetCode setXAttr ( const std::string& path, const std::string& key,
+                               const std::string& value, XAttrMode mode );
+    virtual RetCode removeXAttr ( const std::string& path, const std::string& key );
+
+    /// @brief Remove a path and, if it is a directory, everything below it.
+    /// @param [in] path The path to remove.
+    /// @return Standard error code; InvalidPath for the root, or a path with "..".
+    RetCode removeTree ( const std::string& path );
+
+    /// @brief Change the owner of a directory and everything below it.
+    /// Symbolic links have their own ownership changed; they aren't followed.
+    /// @param [in] path The root of the tree.
+    /// @param [in] user The new owner, in the same form setOwner() accepts.
+    /// @param [in] group The new group, in the same form setOwner() accepts.
+    /// @return Standard error code.
+    RetCode setOwnerTree ( const std::string& path, const std::string& user,
+                           const std::string& group );
+
+    /// @brief Change the mode of a directory and everything below it.
+    /// Symbolic links are skipped.
+    /// @param [in] path The root of the tree.
+    /// @param [in] mode The mode to apply.
+    /// @return Standard error code.
+    RetCode setModeTree ( const std::string& path, const Metadata::Modes& mode );
+
+    /// @brief Total up the entries and space used below a directory.
+    /// @param [in] path The root of the tree.
+    /// @param [out] size The totals.
+    /// @return Standard error code.
+    RetCode getTreeSize ( const std::string& path, TreeSize& size ) const;
+
+    /// @brief Read the metadata of a directory and everything below it.
+    /// Entries are in no particular order.
+    /// @param [in] path The root of the tree.
+    /// @param [out] entries The metadata of each entry, including the root.
+    /// @return Standard error code.
+    RetCode dumpMetadata ( const std::string& path, std::vector<Metadata>& entries ) const;
+
 private:
+    /// @brief Configuration field, the number of threads used by the *Tree() operations.
+    /// 0 uses one per CPU.
+    static size_t TreeWalkThreads;
+
+    /// @brief Resolve the user and group names accepted by setOwner() to IDs.
+    /// @return Standard error code.
+    static RetCode resolveOwner ( const std::string& user, const std::string& group,
+                                  uid_t& uid, gid_t& gid );
+
+    /// @brief Fill in the user@host and group@host owner names of an entry.
+    static void setOwnerNames ( const struct stat& s, Metadata& md );
+
+    /// @brief Identifies a file, whichever path it's opened at.
+    typedef std::pair<dev_t, ino_t> FileId;
+
+    /// @brief A file handle.
+    struct OpenFile
+    {
+        int fd; ///< The descriptor of the handle.
+        std::string path; ///< The full path it was opened at.
+        FileId id; ///< The file it's open on.
+        PosixFileBuffer* buffer; ///< The buffers of the file, shared by every handle on it.
+    };
+
+    /// @brief The buffers of a file, and the number of handles open on it.
+    struct SharedBuffer
+    {
+        PosixFileBuffer* buffer;
+        size_t handles;
+    };
+
+    /// @brief Give a descriptor just opened a file handle.
+    /// @param [in] fd The descriptor; taken over by this, and closed on failure.
+    /// @param [in] path The full path it was opened at.
+    /// @param [out] fh The handle.
+    /// @return Standard error code.
+    RetCode addFile ( int fd, const std::string& path, FileHandle& fh );
+
+    /// @brief Retrieve the open file behind a file handle.
+    /// @return The file, or nullptr if the handle isn't valid.
+    OpenFile* getFile ( const FileHandle& fh ) const;
+
+    /// @brief Write out buffered data and drop readahead for the file open at a path.
+    /// Used before operations which act on the file by name rather than by handle.
+    /// @param [in] path The full (root-prefixed) path.
+    /// @return Standard error code.
+    RetCode flushPath ( const std::string& path ) const;
+
+    /// @brief Write out buffered data for the files open on or below a path.
+    /// @param [in] path The full (root-prefixed) path.
+    /// @return Standard error code.
+    RetCode flushTree ( const std::string& path ) const;
+
+    /// @brief Copy data between two descriptors, keeping it in the kernel if possible.
+    /// @param [out] processed The number of bytes copied.
+    /// @return Standard error code.
+    static RetCode copyData ( int from, off_t fromOffset, int to, off_t toOffset,
+                              size_t size, size_t& processed );
+
     const std::string rootPath_;
 
-    std::vector<int> fds_;
+    /// @brief Protects files_ and buffers_, though not the buffers themselves.
+    mutable std::mutex mtx_;
+
+    std::vector<OpenFile*> files_; ///< Open files, indexed by file handle ID.
+
+    std::map<FileId, SharedBuffer> buffers_; ///< The buffers of the open files.
 
 };
 
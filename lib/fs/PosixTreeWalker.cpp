@@ -0,0 +1,383 @@
+#include "PosixTreeWalker.hpp"
+
+extern "C"
+{
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PosixUtils.hpp"
+
+using namespace rfs;
+
+/// @brief A directory which has been found but not yet finished with.
+struct PosixTreeWalker::Dir
+{
+    Dir ( Dir* _parent, const std::string& _name, const std::string& _path,
+          const struct stat& _st )
+        : parent ( _parent ), name ( _name ), path ( _path ), st ( _st ), fd ( -1 ),
+          pending ( 1 )
+    {
+    }
+
+    Dir* const parent; ///< The containing directory; nullptr for the walk root.
+    const std::string name; ///< The name of the directory within its parent.
+    const std::string path; ///< The path relative to the walk root.
+    const struct stat st; ///< The attributes recorded when the directory was found.
+
+    /// @brief The descriptor of the directory, once it has been scanned; its
+    /// subdirectories are opened relative to it. -1 if it wasn't.
+    int fd;
+
+    /// @brief The scan of this directory plus each subdirectory not yet finished.
+    std::atomic<size_t> pending;
+};
+
+/// @brief The state shared between the threads performing a single walk.
+struct PosixTreeWalker::State
+{
+    /// @brief The queue of directories waiting to be scanned by one thread.
+    struct Queue
+    {
+        std::mutex mtx;
+        std::deque<Dir*> dirs;
+    };
+
+    State ( const std::string& _root, bool _statEntries, const Visitor& _visit,
+            const Visitor& _postVisit, size_t threads )
+        : root ( _root ), statEntries ( _statEntries ), visit ( _visit ),
+          postVisit ( _postVisit ), rootFd ( -1 ), queues ( threads ), queued ( 0 ),
+          outstanding ( 0 ), err ( 0 ), stop ( false )
+    {
+    }
+
+    /// @brief Queue a directory on the given thread's queue.
+    void push ( size_t id, Dir* dir )
+    {
+        ++outstanding;
+
+        {
+            std::lock_guard<std::mutex> guard ( queues.at ( id ).mtx );
+            queues.at ( id ).dirs.push_back ( dir );
+        }
+
+        // Counted with idleMtx held, so a thread about to wait either sees it or is
+        // already waiting when it's notified.
+        {
+            std::lock_guard<std::mutex> guard ( idleMtx );
+            ++queued;
+        }
+
+        idle.notify_one();
+    }
+
+    /// @brief Mark a directory as scanned.
+    void done()
+    {
+        if ( --outstanding > 0 )
+            return;
+
+        // The last directory has been finished; wake everybody waiting for more.
+        {
+            std::lock_guard<std::mutex> guard ( idleMtx );
+        }
+
+        idle.notify_all();
+    }
+
+    /// @brief Take the most recently queued directory from our own queue, or the
+    /// oldest directory from somebody else's.
+    /// @return The directory to scan, or nullptr if there is nothing queued.
+    Dir* pop ( size_t id )
+    {
+        {
+            std::lock_guard<std::mutex> guard ( queues.at ( id ).mtx );
+
+            if ( ! queues.at ( id ).dirs.empty() )
+            {
+                Dir* dir = queues.at ( id ).dirs.back();
+                queues.at ( id ).dirs.pop_back();
+                --queued;
+                return dir;
+            }
+        }
+
+        for ( size_t i = 1; i < queues.size(); ++i )
+        {
+            Queue& victim = queues.at ( ( id + i ) % queues.size() );
+            std::lock_guard<std::mutex> guard ( victim.mtx );
+
+            if ( ! victim.dirs.empty() )
+            {
+                Dir* dir = victim.dirs.front();
+                victim.dirs.pop_front();
+                --queued;
+                return dir;
+            }
+        }
+
+        return nullptr;
+    }
+
+    const std::string& root;
+    const bool statEntries;
+    const Visitor& visit;
+    const Visitor& postVisit;
+
+    int rootFd; ///< Descriptor of the walk root.
+
+    std::vector<Queue> queues; ///< One queue per thread.
+
+    /// @brief The number of directories in the queues.
+    std::atomic<size_t> queued;
+
+    /// @brief The number of directories queued or being scanned.
+    std::atomic<size_t> outstanding;
+
+    std::atomic<int> err; ///< The first error encountered, or 0.
+    std::atomic<bool> stop; ///< Set when the walk should finish early.
+
+    std::mutex idleMtx; ///< Used with idle.
+    std::condition_variable idle; ///< Signalled when work is queued, or the walk is done.
+};
+
+PosixTreeWalker::PosixTreeWalker ( size_t threads )
+    : threads_ ( threads > 0 ? threads
+                 : std::max<size_t> ( 1, std::thread::hardware_concurrency() ) )
+{
+}
+
+RetCode PosixTreeWalker::walk ( const std::string& root, bool statEntries,
+                                const Visitor& visit, const Visitor& postVisit )
+{
+    State state ( root, statEntries, visit, postVisit, threads_ );
+
+    state.rootFd = open ( root.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+
+    if ( state.rootFd < 0 )
+        return PosixUtils::errnoToRetCode ( errno );
+
+    struct stat st;
+    memset ( &st, 0, sizeof ( st ) );
+
+    if ( fstat ( state.rootFd, &st ) < 0 )
+    {
+        const int err = errno;
+        close ( state.rootFd );
+        return PosixUtils::errnoToRetCode ( err );
+    }
+
+    Dir* dir = new Dir ( nullptr, "", "", st );
+
+    if ( visit )
+    {
+        const Entry entry = { AT_FDCWD, root.c_str(), dir->path, dir->st };
+
+        if ( ! visit ( entry ) )
+            state.stop = true;
+    }
+
+    if ( state.stop )
+    {
+        delete dir;
+        close ( state.rootFd );
+        return Success;
+    }
+
+    state.push ( 0, dir );
+
+    std::vector<std::thread> workers;
+
+    for ( size_t i = 1; i < threads_; ++i )
+        workers.push_back ( std::thread ( &PosixTreeWalker::run, std::ref ( state ), i ) );
+
+    run ( state, 0 );
+
+    for ( size_t i = 0; i < workers.size(); ++i )
+        workers.at ( i ).join();
+
+    close ( state.rootFd );
+
+    if ( state.err != 0 )
+        return PosixUtils::errnoToRetCode ( state.err );
+
+    return Success;
+}
+
+void PosixTreeWalker::run ( State& state, size_t id )
+{
+    while ( true )
+    {
+        Dir* dir = state.pop ( id );
+
+        if ( dir != nullptr )
+        {
+            scan ( state, id, dir );
+            state.done();
+            continue;
+        }
+
+        // Everything left is being scanned by other threads; wait for them to find
+        // more work (or finish).
+        std::unique_lock<std::mutex> lock ( state.idleMtx );
+
+        state.idle.wait ( lock, [&state]()
+        {
+            return ( state.queued > 0 || state.outstanding == 0 );
+        } );
+
+        if ( state.queued == 0 && state.outstanding == 0 )
+            return;
+    }
+}
+
+void PosixTreeWalker::scan ( State& state, size_t id, Dir* dir )
+{
+    if ( state.stop )
+    {
+        complete ( state, dir );
+        return;
+    }
+
+    // Only the last component is looked up, in the directory it was found in, so a
+    // symbolic link put in the place of any directory on the way is never followed.
+    if ( dir->parent == nullptr )
+    {
+        dir->fd = fcntl ( state.rootFd, F_DUPFD_CLOEXEC, 0 );
+    }
+    else
+    {
+        dir->fd = openat ( dir->parent->fd, dir->name.c_str(),
+                           O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+    }
+
+    if ( dir->fd < 0 )
+    {
+        fail ( state, errno );
+        complete ( state, dir );
+        return;
+    }
+
+    const int fd = dir->fd;
+
+    // Reading the directory takes a descriptor of its own, which closedir() closes.
+    const int readFd = fcntl ( fd, F_DUPFD_CLOEXEC, 0 );
+    DIR* d = ( readFd < 0 ) ? nullptr : fdopendir ( readFd );
+
+    if ( d == nullptr )
+    {
+        fail ( state, errno );
+
+        if ( readFd >= 0 )
+            close ( readFd );
+
+        complete ( state, dir );
+        return;
+    }
+
+    std::string path;
+
+    for ( struct dirent* de = readdir ( d ); de != nullptr && ! state.stop; de = readdir ( d ) )
+    {
+        if ( strcmp ( de->d_name, "." ) == 0 || strcmp ( de->d_name, ".." ) == 0 )
+            continue;
+
+        struct stat st;
+        memset ( &st, 0, sizeof ( st ) );
+
+        if ( state.statEntries || de->d_type == DT_UNKNOWN )
+        {
+            if ( fstatat ( fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW ) < 0 )
+            {
+                // Removed since we read the directory; not an error.
+                if ( errno == ENOENT )
+                    continue;
+
+                fail ( state, errno );
+                break;
+            }
+        }
+        else if ( de->d_type == DT_DIR )
+            st.st_mode = S_IFDIR;
+        else if ( de->d_type == DT_REG )
+            st.st_mode = S_IFREG;
+        else if ( de->d_type == DT_LNK )
+            st.st_mode = S_IFLNK;
+
+        path = dir->path;
+
+        if ( ! path.empty() )
+            path.append ( "/" );
+
+        path.append ( de->d_name );
+
+        if ( state.visit )
+        {
+            const Entry entry = { fd, de->d_name, path, st };
+
+            if ( ! state.visit ( entry ) )
+            {
+                state.stop = true;
+                break;
+            }
+        }
+
+        if ( S_ISDIR ( st.st_mode ) )
+        {
+            ++dir->pending;
+            state.push ( id, new Dir ( dir, de->d_name, path, st ) );
+        }
+    }
+
+    closedir ( d );
+
+    complete ( state, dir );
+}
+
+void PosixTreeWalker::complete ( State& state, Dir* dir )
+{
+    while ( dir != nullptr && --dir->pending == 0 )
+    {
+        // Everything below it is done with.
+        if ( dir->fd >= 0 )
+        {
+            close ( dir->fd );
+            dir->fd = -1;
+        }
+
+        if ( state.postVisit && ! state.stop )
+        {
+            // Use the full path for the root; everything else is relative to its parent,
+            // whose descriptor is kept until then.
+            const Entry entry = ( dir->parent == nullptr
+                                  ? Entry { AT_FDCWD, state.root.c_str(), dir->path, dir->st }
+                                  : Entry { dir->parent->fd, dir->name.c_str(), dir->path,
+                                            dir->st } );
+
+            if ( ! state.postVisit ( entry ) )
+                state.stop = true;
+        }
+
+        Dir* parent = dir->parent;
+        delete dir;
+        dir = parent;
+    }
+}
+
+void PosixTreeWalker::fail ( State& state, int err )
+{
+    int expected = 0;
+    state.err.compare_exchange_strong ( expected, err );
+    state.stop = true;
+}
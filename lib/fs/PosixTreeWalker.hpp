@@ -0,0 +1,85 @@
+#pragma once
+
+extern "C"
+{
+#include <sys/types.h>
+#include <sys/stat.h>
+}
+
+#include <functional>
+#include <string>
+
+#include "RetCode.hpp"
+
+namespace rfs
+{
+
+/// @brief Walks a POSIX directory tree using a pool of threads.
+/// Each directory is scanned by a single thread, but different directories are
+/// scanned concurrently: subdirectories found during a scan are pushed onto the
+/// scanning thread's own queue, and idle threads steal work from the other end of
+/// busier threads' queues. Each directory is opened by name relative to a descriptor
+/// of its parent, without following symbolic links, and entries are stat()ed relative
+/// to their directory's descriptor. The kernel never has to resolve a full path per
+/// entry, and a directory swapped for a symbolic link during the walk can't lead it
+/// outside the tree. A directory's descriptor is kept until everything below it has
+/// been post-visited.
+///
+/// The visitor is called for every entry (including directories) as it is found.
+/// The post-visitor is called for every directory once everything below it has been
+/// visited, which is the point at which a directory can be removed. Symbolic links
+/// are reported but never followed. Both callbacks are invoked concurrently from
+/// multiple threads and must synchronize any state they share.
+class PosixTreeWalker
+{
+public:
+    /// @brief An entry encountered during the walk.
+    /// dirFd and name can be passed straight to the *at() family of functions.
+    struct Entry
+    {
+        int dirFd; ///< A descriptor the entry can be accessed relative to.
+        const char* name; ///< The name of the entry, relative to dirFd.
+        const std::string& path; ///< The path of the entry relative to the walk root.
+        const struct stat& st; ///< The entry's attributes; only st_mode is set if stat wasn't requested.
+    };
+
+    /// @brief Callback invoked for entries; returning false stops the walk.
+    typedef std::function<bool ( const Entry& entry )> Visitor;
+
+    /// @brief Constructor.
+    /// @param [in] threads The number of threads to walk with; 0 uses one per CPU.
+    explicit PosixTreeWalker ( size_t threads = 0 );
+
+    /// @brief Walk the tree rooted at a directory.
+    /// The root itself is passed to both callbacks, with an empty relative path.
+    /// @param [in] root The full path of the directory to walk.
+    /// @param [in] statEntries If true, every entry is stat()ed; otherwise only the
+    /// type bits of st_mode are filled in where the directory entry provides them.
+    /// @param [in] visit Invoked for every entry when it is found. May be empty.
+    /// @param [in] postVisit Invoked for every directory after its children. May be empty.
+    /// @return Standard error code; the first error encountered if the walk failed.
+    RetCode walk ( const std::string& root, bool statEntries, const Visitor& visit,
+                   const Visitor& postVisit );
+
+private:
+    struct Dir;
+    struct State;
+
+    /// @brief The body of each walking thread.
+    static void run ( State& state, size_t id );
+
+    /// @brief Read a single directory, visiting its entries and queueing subdirectories.
+    static void scan ( State& state, size_t id, Dir* dir );
+
+    /// @brief Mark one outstanding piece of work in a directory as done.
+    /// Once nothing is outstanding the directory is post-visited, released, and its
+    /// parent is completed in turn.
+    static void complete ( State& state, Dir* dir );
+
+    /// @brief Record the first error of the walk, and stop it.
+    static void fail ( State& state, int err );
+
+    const size_t threads_; ///< The number of threads used for each walk.
+};
+
+}
@@ -113,6 +113,16 @@ int PosixUtils::retCodeToErrno ( const RetCode& rc )
         return ERANGE;
     else if ( rc == MemoryError )
         return EFAULT;
+    else if ( rc == AlreadyExists )
+        return EEXIST;
+    else if ( rc == NotSupported )
+        return ENOTSUP;
+    else if ( rc == NoSuchAttribute )
+#ifdef ENOATTR
+        return ENOATTR;
+#else
+        return ENODATA;
+#endif
 
     return EPERM;
 }
@@ -129,6 +139,10 @@ RetCode PosixUtils::errnoToRetCode ( int err )
         return OutOfRange;
     else if ( err == EFAULT )
         return MemoryError;
+    else if ( err == EEXIST )
+        return AlreadyExists;
+    else if ( err == ENOTSUP )
+        return NotSupported;
 
     return InvalidPermissions;
 }
@@ -52,3 +52,14 @@ RetCode ProcessFile::close ( const FileHandle& )
     return Success;
 }
 
+void ProcessFile::notifyChanged()
+{
+    const time_t now = time ( nullptr );
+
+    md_.set_mtime ( now );
+    md_.set_ctime ( now );
+
+    fs_.updateSize ( path_ );
+    fs_.wakeWaiters ( path_ );
+    fs_.notifyChange ( path_, FileSystem::ContentChanged );
+}
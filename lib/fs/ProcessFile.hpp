@@ -82,6 +82,16 @@ public:
     /// @return Amount of data available to be read (in bytes).
     virtual size_t size() const = 0;
 
+    /// @brief How the contents of this file may be cached by readers.
+    /// By default contents are cached until notifyChanged() is called, so files whose
+    /// contents change on their own, or which give each handle its own view (Mode 2),
+    /// must override this.
+    /// @return Cache policy.
+    virtual FileSystem::CachePolicy getCachePolicy() const
+    {
+        return FileSystem::CacheUntilChanged;
+    }
+
     /// @brief The fully qualified path of the file.
     /// @return ProcessFile path.
     const std::string& getPath() const
@@ -97,6 +107,11 @@ public:
     }
         
 protected:
+    /// @brief Tell the file system the contents of this file have changed.
+    /// Must be called whenever what read() returns changes, other than as the
+    /// direct result of a write() through the same handle.
+    void notifyChanged();
+
     ProcessFileSystem& fs_; ///< The file system which is managing this module.
 
 private:
@@ -9,18 +9,27 @@ using namespace rfs;
 
 ProcessFileSystem::Entry::Entry ( ProcessFileSystem& _pfs, Entry& _parent,
                                   const std::string& _name )
-    : name ( _name ), file ( nullptr ), dir ( nullptr ), parent ( _parent ), pfs ( _pfs )
+    : name ( _name ), file ( nullptr ), dir ( nullptr ), parent ( _parent ), pfs ( _pfs ),
+      size ( 0 ), version ( 0 )
 {
-    if ( &parent == this )
-        return;
+    // Every entry starts out as a directory; addFile() turns it into a file.
+    usage.files = 0;
+    usage.directories = 0;
+    usage.bytes = 0;
+
+    if ( &parent != this )
+        parent.children.push_back ( this );
 
-    parent.children.push_back ( this );
+    addUsage ( *this, 0, 1, 0 );
 }
 
 ProcessFileSystem::Entry::~Entry()
 {
     /// @todo: inform file or dir that they are being removed
 
+    // Nothing will change any more; don't leave anybody waiting for it to.
+    pfs.wakeWaiters ( *this );
+
     for ( size_t i = 0; i < handles.size(); ++i )
     {
         if ( handles.at ( i ) >= 0 )
@@ -56,7 +65,7 @@ ProcessFileSystem::Entry::~Entry()
 }
 
 ProcessFileSystem::ProcessFileSystem()
-    : root_ ( Entry ( *this, root_, "" ) )
+    : root_ ( *this, root_, "" )
 {
 }
 
@@ -104,6 +113,10 @@ RetCode ProcessFileSystem::closeFile ( const FileHandle& fh )
     assert ( e->dir == nullptr );
 
     e->file->close ( fh );
+    updateSize ( *e );
+
+    // Nobody is left to wait on the handle.
+    removeWaiters ( *e, fh.fid() );
 
     // we release the file handle regardless of errors (can't really be any)
     releaseHandle ( fh.fid() );
@@ -135,7 +148,11 @@ RetCode ProcessFileSystem::writeFile ( const FileHandle& fh,
 
     assert ( e->dir == nullptr );
 
-    return e->file->write ( fh, data, offset, processed );
+    RetCode rc = e->file->write ( fh, data, offset, processed );
+
+    updateSize ( *e );
+
+    return rc;
 }
 
 RetCode ProcessFileSystem::readDirectory ( const std::string& path,
@@ -144,7 +161,7 @@ RetCode ProcessFileSystem::readDirectory ( const std::string& path,
     const Entry* e = getEntry ( path );
 
     if ( e == nullptr )
-        return InvalidPath;
+        return NoSuchPath;
 
     if ( e->file != nullptr )
         return InvalidFileType;
@@ -185,15 +202,124 @@ RetCode ProcessFileSystem::readMetadata ( const std::string& path, Metadata& md
     const Entry* e = getEntry ( path );
 
     if ( e == nullptr )
-        return InvalidPath;
+        return NoSuchPath;
 
     if ( e->file != nullptr )
     {
         md = e->file->getMetadata();
+        md.set_size ( e->file->size() );
         return Success;
     }
 
-    return NotImplemented;
+    // Directories don't need an owning ProcessDirectory, so describe them here.
+    md.Clear();
+    md.set_type ( Metadata::Directory );
+    md.set_path ( path );
+    md.set_size ( e->children.size() );
+
+    Metadata::Modes* modes = md.mutable_modes();
+    Metadata::Modes::Values* mUser = modes->mutable_user();
+    mUser->set_read ( true );
+    mUser->set_write ( false );
+    mUser->set_execute ( true );
+
+    *modes->mutable_group() = *mUser;
+    *modes->mutable_other() = *mUser;
+
+    return Success;
+}
+
+RetCode ProcessFileSystem::readFileMetadata ( const FileHandle& fh, Metadata& md ) const
+{
+    const Entry* e = getEntry ( fh );
+
+    if ( e == nullptr )
+        return InvalidFileHandle;
+
+    md = e->file->getMetadata();
+    md.set_size ( e->file->size() );
+
+    return Success;
+}
+
+RetCode ProcessFileSystem::getXAttr ( const std::string& path, const std::string& key,
+                                      std::string& value ) const
+{
+    const Entry* e = getEntry ( path );
+
+    if ( e == nullptr )
+        return NoSuchPath;
+
+    if ( ! e->xattrs.get ( key, value ) )
+        return NoSuchAttribute;
+
+    return Success;
+}
+
+RetCode ProcessFileSystem::listXAttr ( const std::string& path,
+                                       std::vector<std::string>& keys ) const
+{
+    const Entry* e = getEntry ( path );
+
+    if ( e == nullptr )
+        return NoSuchPath;
+
+    e->xattrs.list ( keys );
+
+    return Success;
+}
+
+RetCode ProcessFileSystem::setXAttr ( const std::string& path, const std::string& key,
+                                      const std::string& value, XAttrMode mode )
+{
+    Entry* e = getEntry ( path );
+
+    if ( e == nullptr )
+        return NoSuchPath;
+
+    if ( key.empty() )
+        return InvalidData;
+
+    if ( mode != XAttrSet )
+    {
+        const bool exists = ( e->xattrs.find ( key ) != nullptr );
+
+        if ( mode == XAttrCreate && exists )
+            return AlreadyExists;
+        else if ( mode == XAttrReplace && ! exists )
+            return NoSuchAttribute;
+    }
+
+    e->xattrs.set ( key, value );
+
+    return Success;
+}
+
+RetCode ProcessFileSystem::removeXAttr ( const std::string& path, const std::string& key )
+{
+    Entry* e = getEntry ( path );
+
+    if ( e == nullptr )
+        return NoSuchPath;
+
+    if ( ! e->xattrs.remove ( key ) )
+        return NoSuchAttribute;
+
+    return Success;
+}
+
+ProcessFileSystem::CachePolicy ProcessFileSystem::getCachePolicy (
+    const FileHandle& fh ) const
+{
+    if ( fh.hid() != HostId || fh.fid() < 0 || (size_t) fh.fid() >= handles_.size() )
+        return CacheNever;
+
+    const Entry* e = handles_.at ( fh.fid() );
+
+    if ( e == nullptr || e->file == nullptr )
+        return CacheNever;
+
+    return e->file->getCachePolicy();
 }
 
 bool ProcessFileSystem::addFile ( ProcessFile& file )
@@ -209,6 +335,11 @@ bool ProcessFileSystem::addFile ( ProcessFile& file )
 
     e->file = &file;
 
+    // The file isn't fully constructed yet, so its size is picked up later.
+    addUsage ( *e, 1, -1, 0 );
+
+    notifyChange ( file.getPath(), EntryAdded );
+
     return true;
 }
 
@@ -219,6 +350,8 @@ bool ProcessFileSystem::addDirectory ( ProcessDirectory& dir )
 
     e->dir = &dir;
 
+    notifyChange ( dir.getPath(), EntryAdded );
+
     return true;
 }
 
@@ -228,19 +361,194 @@ bool ProcessFileSystem::removePath ( const std::string& path, bool recurse )
 
     if ( entry == nullptr 
         || entry == &root_
-        || ( ! recurse && entry->children.size() > 0 )
-        || entry->handles.size() > 0 )
+        || ( ! recurse && entry->children.size() > 0 ) )
     {
         return false;
     }
 
+    // released handles are left behind as -1
+    for ( size_t i = 0; i < entry->handles.size(); ++i )
+    {
+        if ( entry->handles.at ( i ) >= 0 )
+            return false;
+    }
+
+    addUsage ( entry->parent, -static_cast<int64_t> ( entry->usage.files ),
+               -static_cast<int64_t> ( entry->usage.directories ),
+               -static_cast<int64_t> ( entry->usage.bytes ) );
+
     // the destructor for entry() will ensure that:
     // a) children are cleaned up
     // b) the entry is removed from it's parent's set of children
     delete entry;
+
+    notifyChange ( path, EntryRemoved );
+
     return true;
 }
 
+RetCode ProcessFileSystem::getUsage ( const std::string& path, Usage& usage ) const
+{
+    const Entry* e = getEntry ( path );
+
+    if ( e == nullptr )
+        return NoSuchPath;
+
+    usage = e->usage;
+
+    return Success;
+}
+
+RetCode ProcessFileSystem::getVersion ( const FileHandle& fh, uint64_t& version ) const
+{
+    const Entry* e = getEntry ( fh );
+
+    if ( e == nullptr )
+        return InvalidFileHandle;
+
+    std::lock_guard<std::mutex> guard ( waitMtx_ );
+    version = e->version;
+
+    return Success;
+}
+
+RetCode ProcessFileSystem::addWaiter ( const FileHandle& fh, uint64_t version,
+                                       std::function<void()> cb )
+{
+    Entry* e = getEntry ( fh );
+
+    if ( e == nullptr )
+        return InvalidFileHandle;
+
+    {
+        std::lock_guard<std::mutex> guard ( waitMtx_ );
+
+        if ( e->version == version )
+        {
+            e->waiters.push_back ( std::make_pair ( fh.fid(), cb ) );
+            return Success;
+        }
+    }
+
+    cb();
+
+    return Success;
+}
+
+RetCode ProcessFileSystem::removeWaiter ( const FileHandle& fh )
+{
+    Entry* e = getEntry ( fh );
+
+    if ( e == nullptr )
+        return InvalidFileHandle;
+
+    removeWaiters ( *e, fh.fid() );
+
+    return Success;
+}
+
+void ProcessFileSystem::addUsage ( Entry& entry, int64_t files, int64_t directories,
+                                   int64_t bytes )
+{
+    for ( Entry* e = &entry; ; e = &e->parent )
+    {
+        e->usage.files += files;
+        e->usage.directories += directories;
+        e->usage.bytes += bytes;
+
+        if ( e == &e->parent )
+            break;
+    }
+}
+
+void ProcessFileSystem::updateSize ( Entry& entry )
+{
+    if ( entry.file == nullptr )
+        return;
+
+    const uint64_t size = entry.file->size();
+
+    if ( size == entry.size )
+        return;
+
+    addUsage ( entry, 0, 0, static_cast<int64_t> ( size - entry.size ) );
+    entry.size = size;
+}
+
+void ProcessFileSystem::updateSize ( const std::string& path )
+{
+    Entry* e = getEntry ( path );
+
+    if ( e != nullptr )
+        updateSize ( *e );
+}
+
+void ProcessFileSystem::wakeWaiters ( Entry& entry )
+{
+    std::vector<std::pair<int32_t, std::function<void()> > > waiters;
+
+    {
+        std::lock_guard<std::mutex> guard ( waitMtx_ );
+
+        ++entry.version;
+        waiters.swap ( entry.waiters );
+    }
+
+    for ( size_t i = 0; i < waiters.size(); ++i )
+        waiters.at ( i ).second();
+}
+
+void ProcessFileSystem::removeWaiters ( Entry& entry, int32_t handle )
+{
+    std::lock_guard<std::mutex> guard ( waitMtx_ );
+
+    for ( size_t i = 0; i < entry.waiters.size(); )
+    {
+        if ( entry.waiters.at ( i ).first == handle )
+        {
+            entry.waiters.erase ( entry.waiters.begin() + i );
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+void ProcessFileSystem::wakeWaiters ( const std::string& path )
+{
+    Entry* e = getEntry ( path );
+
+    if ( e != nullptr )
+        wakeWaiters ( *e );
+}
+
+const ProcessFileSystem::Entry* ProcessFileSystem::getEntry ( const FileHandle& fh ) const
+{
+    if ( fh.hid() != HostId || fh.fid() < 0 || (size_t) fh.fid() >= handles_.size() )
+        return nullptr;
+
+    const Entry* e = handles_.at ( fh.fid() );
+
+    if ( e == nullptr || e->file == nullptr )
+        return nullptr;
+
+    return e;
+}
+
+ProcessFileSystem::Entry* ProcessFileSystem::getEntry ( const FileHandle& fh )
+{
+    if ( fh.hid() != HostId || fh.fid() < 0 || (size_t) fh.fid() >= handles_.size() )
+        return nullptr;
+
+    Entry* e = handles_.at ( fh.fid() );
+
+    if ( e == nullptr || e->file == nullptr )
+        return nullptr;
+
+    return e;
+}
+
 ProcessFileSystem::Entry* ProcessFileSystem::getEntry ( const std::string& path,
                                                         bool force )
 {
@@ -249,13 +557,13 @@ ProcessFileSystem::Entry* ProcessFileSystem::getEntry ( const std::string& path,
 
     Entry* curr = &root_;
 
-    // When we split '/' we have one entry of size 1, the empty root path
-    // so we start indexing at 1
-    for ( size_t i = 1; i < sPath.size(); ++i )
+    // When we split '/' we have one entry of size 0, the empty root path
+    for ( size_t i = 0; i < sPath.size(); ++i )
     {
         assert ( curr != nullptr );
-        // splitPath should remove any empty-length names
-        assert ( sPath.at ( i ).size() > 0 );
+
+        if ( sPath.at ( i ).empty() )
+            continue;
 
         bool found = false;
 
@@ -294,13 +602,13 @@ const ProcessFileSystem::Entry* ProcessFileSystem::getEntry (
 
     const Entry* curr = &root_;
 
-    // When we split '/' we have one entry of size 1, the empty root path
-    // so we start indexing at 1
-    for ( size_t i = 1; i < sPath.size(); ++i )
+    // When we split '/' we have one entry of size 0, the empty root path
+    for ( size_t i = 0; i < sPath.size(); ++i )
     {
         assert ( curr != nullptr );
-        // splitPath should remove any empty-length names
-        assert ( sPath.at ( i ).size() > 0 );
+
+        if ( sPath.at ( i ).empty() )
+            continue;
 
         bool found = false;
 
@@ -378,12 +686,18 @@ void ProcessFileSystem::splitPath ( const std::string& path, std::vector<std::st
 
 void ProcessFileSystem::getPath ( const Entry& entry, std::string& path )
 {
-    // if we aren't at the root, get the path of the entry's parent
-    if ( &entry != &entry.parent )
+    // the root is the only path ending in a slash
+    if ( &entry == &entry.parent )
     {
-        getPath ( entry.parent, path );
+        path.append ( "/" );
+        return;
     }
 
-    path.append ( entry.name ).append ( "/" );
+    getPath ( entry.parent, path );
+
+    if ( &entry.parent != &entry.parent.parent )
+        path.append ( "/" );
+
+    path.append ( entry.name );
 }
 
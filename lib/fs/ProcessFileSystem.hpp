@@ -1,9 +1,12 @@
 #pragma once
 
+#include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "FileSystem.hpp"
+#include "XAttrList.hpp"
 
 namespace rfs
 {
@@ -30,6 +33,30 @@ public:
                                     std::vector<Metadata>& children ) const;
 
     virtual RetCode readMetadata ( const std::string& path, Metadata& md ) const;
+    virtual RetCode readFileMetadata ( const FileHandle& fh, Metadata& md ) const;
+
+    /// @brief Extended attributes are kept in memory, on the entry.
+    virtual RetCode getXAttr ( const std::string& path, const std::string& key,
+                               std::string& value ) const;
+    virtual RetCode listXAttr ( const std::string& path,
+                                std::vector<std::string>& keys ) const;
+    virtual RetCode setXAttr ( const std::string& path, const std::string& key,
+                               const std::string& value, XAttrMode mode );
+    virtual RetCode removeXAttr ( const std::string& path, const std::string& key );
+
+    virtual CachePolicy getCachePolicy ( const FileHandle& fh ) const;
+
+    /// @brief Usage is maintained as entries are added, removed and written to, so
+    /// this doesn't depend on the size of the subtree.
+    virtual RetCode getUsage ( const std::string& path, Usage& usage ) const;
+
+    /// @brief The version of a file is bumped each time it calls notifyChanged().
+    virtual RetCode getVersion ( const FileHandle& fh, uint64_t& version ) const;
+    /// @brief Waiters are kept in a list on the file's entry, and cost nothing until
+    /// the file changes, when the whole list is called and cleared.
+    virtual RetCode addWaiter ( const FileHandle& fh, uint64_t version,
+                                std::function<void()> cb );
+    virtual RetCode removeWaiter ( const FileHandle& fh );
 
 protected:
     bool addFile ( ProcessFile& file );
@@ -53,6 +80,15 @@ private:
 
         ProcessFileSystem& pfs;
         std::vector<int32_t> handles;
+
+        XAttrList xattrs; ///< The extended attributes of the entry.
+
+        Usage usage; ///< The totals for this entry and everything below it.
+        uint64_t size; ///< The size of the file, when usage was last updated.
+
+        uint64_t version; ///< Bumped whenever the file's contents change by themselves.
+        /// @brief Called on the next change, each with the handle it was added for.
+        std::vector<std::pair<int32_t, std::function<void()> > > waiters;
     };
 
     static void splitPath ( const std::string& path, std::vector<std::string>& sPath );
@@ -61,12 +97,40 @@ private:
     const Entry* getEntry ( const std::string& path ) const; 
     Entry* getEntry ( const std::string& path, bool force = false );
 
+    /// @brief Apply a change in usage to an entry and all of its parents.
+    static void addUsage ( Entry& entry, int64_t files, int64_t directories,
+                           int64_t bytes );
+
+    /// @brief Bring the usage of a file entry up to date with its size.
+    static void updateSize ( Entry& entry );
+
+    /// @brief Bring the usage of the file at a path up to date with its size.
+    void updateSize ( const std::string& path );
+
+    /// @brief Bump the version of an entry, and call (and clear) its waiters.
+    void wakeWaiters ( Entry& entry );
+
+    /// @brief Bump the version of the entry at a path, and call its waiters.
+    void wakeWaiters ( const std::string& path );
+
+    /// @brief Drop the waiters an entry has for a handle.
+    void removeWaiters ( Entry& entry, int32_t handle );
+
+    /// @brief Find the entry a handle refers to.
+    /// @return The entry, or nullptr if the handle isn't valid.
+    const Entry* getEntry ( const FileHandle& fh ) const;
+    Entry* getEntry ( const FileHandle& fh );
+
     int32_t genHandle ( Entry* e );
     void releaseHandle ( int32_t handle );
 
     Entry root_;
 
     std::vector<Entry*> handles_;
+
+    /// @brief Protects the versions and waiters of all entries; waiters are added by
+    /// readers while the files themselves report changes from their own threads.
+    mutable std::mutex waitMtx_;
 };
 
 }
@@ -0,0 +1,187 @@
+#include "XAttrList.hpp"
+
+#include <cassert>
+#include <mutex>
+#include <unordered_map>
+
+using namespace rfs;
+
+/// @brief The interned attribute names, shared by every list.
+struct KeyTable
+{
+    static KeyTable& get()
+    {
+        static KeyTable table;
+        return table;
+    }
+
+    std::mutex mtx; ///< Protects the maps; entries of several file systems may be used at once.
+    std::unordered_map<std::string, uint32_t> ids; ///< The id of each name.
+    std::vector<std::string> names; ///< The name of each id.
+};
+
+XAttrList::XAttrList() : overflow_ ( nullptr ), count_ ( 0 )
+{
+}
+
+XAttrList::~XAttrList()
+{
+    delete overflow_;
+    overflow_ = nullptr;
+}
+
+bool XAttrList::get ( const std::string& key, std::string& value ) const
+{
+    const std::string* v = find ( key );
+
+    if ( v == nullptr )
+        return false;
+
+    value = *v;
+    return true;
+}
+
+const std::string* XAttrList::find ( const std::string& key ) const
+{
+    uint32_t id = 0;
+
+    if ( count_ == 0 || ! intern ( key, false, id ) )
+        return nullptr;
+
+    const size_t i = indexOf ( id );
+
+    if ( i == count_ )
+        return nullptr;
+
+    return &at ( i ).value;
+}
+
+bool XAttrList::set ( const std::string& key, const std::string& value )
+{
+    uint32_t id = 0;
+    intern ( key, true, id );
+
+    const size_t i = indexOf ( id );
+
+    if ( i < count_ )
+    {
+        at ( i ).value = value;
+        return false;
+    }
+
+    if ( count_ >= InlineCount )
+    {
+        if ( overflow_ == nullptr )
+            overflow_ = new std::vector<Attr>();
+
+        overflow_->push_back ( Attr() );
+    }
+
+    Attr& attr = at ( count_ );
+    attr.key = id;
+    attr.value = value;
+
+    ++count_;
+
+    return true;
+}
+
+bool XAttrList::remove ( const std::string& key )
+{
+    uint32_t id = 0;
+
+    if ( count_ == 0 || ! intern ( key, false, id ) )
+        return false;
+
+    const size_t i = indexOf ( id );
+
+    if ( i == count_ )
+        return false;
+
+    // Order doesn't matter, so fill the gap with the last attribute.
+    if ( i + 1 < count_ )
+    {
+        at ( i ).key = at ( count_ - 1 ).key;
+        at ( i ).value.swap ( at ( count_ - 1 ).value );
+    }
+
+    --count_;
+
+    if ( count_ >= InlineCount )
+    {
+        overflow_->pop_back();
+    }
+    else
+    {
+        inline_[count_].value.clear();
+
+        delete overflow_;
+        overflow_ = nullptr;
+    }
+
+    return true;
+}
+
+void XAttrList::list ( std::vector<std::string>& keys ) const
+{
+    if ( count_ == 0 )
+        return;
+
+    KeyTable& table = KeyTable::get();
+    std::lock_guard<std::mutex> guard ( table.mtx );
+
+    for ( size_t i = 0; i < count_; ++i )
+        keys.push_back ( table.names.at ( at ( i ).key ) );
+}
+
+bool XAttrList::intern ( const std::string& key, bool add, uint32_t& id )
+{
+    KeyTable& table = KeyTable::get();
+    std::lock_guard<std::mutex> guard ( table.mtx );
+
+    std::unordered_map<std::string, uint32_t>::const_iterator it = table.ids.find ( key );
+
+    if ( it != table.ids.end() )
+    {
+        id = it->second;
+        return true;
+    }
+
+    if ( ! add )
+        return false;
+
+    id = table.names.size();
+    table.names.push_back ( key );
+    table.ids[key] = id;
+
+    return true;
+}
+
+XAttrList::Attr& XAttrList::at ( size_t i )
+{
+    if ( i < InlineCount )
+        return inline_[i];
+
+    assert ( overflow_ != nullptr );
+    return overflow_->at ( i - InlineCount );
+}
+
+const XAttrList::Attr& XAttrList::at ( size_t i ) const
+{
+    if ( i < InlineCount )
+        return inline_[i];
+
+    assert ( overflow_ != nullptr );
+    return overflow_->at ( i - InlineCount );
+}
+
+size_t XAttrList::indexOf ( uint32_t id ) const
+{
+    for ( size_t i = 0; i < count_; ++i )
+    {
+        if ( at ( i ).key == id )
+            return i;
+    }
+
+    return count_;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace rfs
+{
+
+/// @brief The extended attributes of a single file system entry.
+/// Most entries have no attributes, and most of the rest have one or two, so the
+/// first few are stored inline and only larger sets go to the heap. Keys are
+/// interned: the same few names (labels, rooms, owners) are used on many entries,
+/// so each entry only stores a small id, and lookups compare ids rather than strings.
+///
+/// Interned keys are never released; the set of distinct names in use is expected
+/// to stay small. Not thread safe, like the file system entries which contain it.
+class XAttrList
+{
+public:
+    /// @brief Constructor.
+    XAttrList();
+
+    /// @brief Destructor.
+    ~XAttrList();
+
+    /// @brief Retrieve the value of an attribute.
+    /// @param [in] key The name of the attribute.
+    /// @param [out] value The value; only valid if true is returned.
+    /// @return true if the attribute exists.
+    bool get ( const std::string& key, std::string& value ) const;
+
+    /// @brief Retrieve the value of an attribute, without copying it.
+    /// @param [in] key The name of the attribute.
+    /// @return The value, or nullptr if the attribute doesn't exist. Only valid
+    /// until the list is next modified.
+    const std::string* find ( const std::string& key ) const;
+
+    /// @brief Set the value of an attribute, adding it if it doesn't exist.
+    /// @param [in] key The name of the attribute.
+    /// @param [in] value The value to set.
+    /// @return true if the attribute was added; false if it was replaced.
+    bool set ( const std::string& key, const std::string& value );
+
+    /// @brief Remove an attribute.
+    /// @param [in] key The name of the attribute.
+    /// @return true if the attribute existed.
+    bool remove ( const std::string& key );
+
+    /// @brief Retrieve the names of all of the attributes.
+    /// @param [out] keys The names are appended to this.
+    void list ( std::vector<std::string>& keys ) const;
+
+    /// @brief The number of attributes.
+    /// @return Attribute count.
+    inline size_t size() const
+    {
+        return count_;
+    }
+
+private:
+    /// @brief A single attribute.
+    struct Attr
+    {
+        uint32_t key; ///< The interned name.
+        std::string value; ///< The value.
+    };
+
+    /// @brief The number of attributes stored without a heap allocation.
+    static const size_t InlineCount = 2;
+
+    XAttrList ( const XAttrList& );
+    XAttrList& operator= ( const XAttrList& );
+
+    /// @brief Look up the id of an interned key.
+    /// @param [in] key The name to look up.
+    /// @param [in] add Whether to intern the name if it isn't already.
+    /// @param [out] id The id of the name; only valid if true is returned.
+    /// @return false if the name isn't interned (and add is false).
+    static bool intern ( const std::string& key, bool add, uint32_t& id );
+
+    /// @brief Retrieve an attribute by its position.
+    Attr& at ( size_t i );
+    const Attr& at ( size_t i ) const;
+
+    /// @brief Find the position of an attribute.
+    /// @return The position, or size() if it doesn't exist.
+    size_t indexOf ( uint32_t id ) const;
+
+    Attr inline_[InlineCount]; ///< The first attributes.
+    std::vector<Attr>* overflow_; ///< Any further attributes; nullptr if there are none.
+    size_t count_; ///< The number of attributes.
+};
+
+}
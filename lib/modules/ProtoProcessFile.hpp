@@ -64,7 +64,10 @@ protected:
         RetCode rc = controller_.set ( *this, state );
 
         if ( rc == Success )
+        {
             state_ = state;
+            notifyChanged();
+        }
 
         processed = data.size();
 
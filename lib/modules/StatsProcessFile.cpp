@@ -0,0 +1,75 @@
+#include "StatsProcessFile.hpp"
+
+#include <algorithm>
+
+#include "fs/LatencyStats.hpp"
+
+using namespace rfs;
+
+StatsProcessFile::StatsProcessFile ( ProcessFileSystem& fs, const std::string& layer )
+    : ProcessFile ( fs, "/.rfs/stats/" + layer + ".prom" ), layer_ ( layer ), size_ ( 0 )
+{
+    std::string contents;
+    LatencyStats::get().render ( layer_, contents );
+
+    size_ = contents.length();
+}
+
+RetCode StatsProcessFile::open ( const FileHandle& fh )
+{
+    std::string contents;
+    LatencyStats::get().render ( layer_, contents );
+
+    size_ = contents.length();
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+    snapshots_[fh.fid()].swap ( contents );
+
+    return Success;
+}
+
+RetCode StatsProcessFile::close ( const FileHandle& fh )
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+    snapshots_.erase ( fh.fid() );
+
+    return Success;
+}
+
+RetCode StatsProcessFile::read ( const FileHandle& fh, std::vector<char>& data,
+                                 off_t offset, size_t& processed )
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    std::unordered_map<int32_t, std::string>::const_iterator it = snapshots_.find ( fh.fid() );
+
+    if ( it == snapshots_.end() )
+        return InvalidFileHandle;
+
+    const std::string& contents = it->second;
+
+    processed = 0;
+
+    if ( offset < 0 )
+        return OutOfRange;
+
+    if ( static_cast<size_t> ( offset ) < contents.length() )
+    {
+        processed = std::min ( data.size(), contents.length() - offset );
+        std::copy ( contents.begin() + offset, contents.begin() + offset + processed,
+                    data.begin() );
+    }
+
+    return Success;
+}
+
+RetCode StatsProcessFile::write ( const FileHandle&, const std::vector<char>&,
+                                  off_t, size_t& )
+{
+    return NotSupported;
+}
+
+size_t StatsProcessFile::size() const
+{
+    return size_;
+}
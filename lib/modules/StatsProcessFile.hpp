@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "fs/ProcessFile.hpp"
+
+namespace rfs
+{
+
+/// @brief Exposes the latency histograms of a LatencyStats layer, read-only, at
+/// /.rfs/stats/<layer>.prom.
+/// The contents are in the Prometheus text format, so the directory can be given
+/// to the node-exporter textfile collector as is. Each open takes its own snapshot
+/// (Mode 2), so a reader sees consistent contents however many reads it takes.
+/// The size reported is that of the latest snapshot, rather than rendering the
+/// histograms on every stat(); the file is read with direct I/O, so readers aren't
+/// cut short by it.
+class StatsProcessFile : public ProcessFile
+{
+public:
+    /// @brief Constructor.
+    /// @param [in] fs The file system to register with.
+    /// @param [in] layer The layer to expose.
+    StatsProcessFile ( ProcessFileSystem& fs, const std::string& layer );
+
+    virtual RetCode open ( const FileHandle& fh );
+    virtual RetCode close ( const FileHandle& fh );
+
+    virtual RetCode read ( const FileHandle& fh, std::vector<char>& data,
+                           off_t offset, size_t& processed );
+    virtual RetCode write ( const FileHandle& fh, const std::vector<char>& data,
+                            off_t offset, size_t& processed );
+    virtual size_t size() const;
+
+    /// @brief The statistics change continually, so they are never cached.
+    virtual FileSystem::CachePolicy getCachePolicy() const
+    {
+        return FileSystem::CacheNever;
+    }
+
+private:
+    const std::string layer_; ///< The layer exposed.
+
+    std::atomic<size_t> size_; ///< The length of the latest snapshot.
+
+    std::mutex mtx_; ///< Protects snapshots_.
+
+    /// @brief The contents rendered when each handle was opened, keyed by its fid.
+    std::unordered_map<int32_t, std::string> snapshots_;
+};
+
+}
@@ -15,6 +15,12 @@ public:
     virtual RetCode write ( const FileHandle& fh, const std::vector<char>& data,
                             off_t offset, size_t& processed );
     virtual size_t size() const;
+
+    /// @brief The time changes continually, so it is never cached.
+    virtual FileSystem::CachePolicy getCachePolicy() const
+    {
+        return FileSystem::CacheNever;
+    }
 };
 
 }
@@ -0,0 +1,188 @@
+extern "C"
+{
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include <cstring>
+#include <iostream>
+
+#include "fs/PosixFileBuffer.hpp"
+#include "fs/PosixFileSystem.hpp"
+
+using namespace rfs;
+
+/// @brief Read through the buffer, and check the data read is what's expected.
+static bool expectRead ( PosixFileBuffer& buf, int fd, off_t offset, const std::string& expected )
+{
+    std::string data ( expected.size(), '\0' );
+    size_t processed = 0;
+
+    RetCode rc = buf.read ( fd, &data[0], data.size(), offset, processed );
+
+    if ( NotOk ( rc ) || processed != expected.size() || data != expected )
+    {
+        std::cerr << "Read at " << offset << " returned '" << data.substr ( 0, processed )
+            << "' (" << rc << "), expected '" << expected << "'" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+static bool write ( PosixFileBuffer& buf, int fd, off_t offset, const std::string& data )
+{
+    size_t processed = 0;
+
+    RetCode rc = buf.write ( fd, data.c_str(), data.size(), offset, processed );
+
+    if ( NotOk ( rc ) || processed != data.size() )
+    {
+        std::cerr << "Write at " << offset << " failed: " << rc << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief Data read ahead must not outlive a write-out of data landing inside it.
+static bool testWriteThroughReadAhead ( const std::string& root )
+{
+    const std::string path = root + "/readahead";
+    const std::string contents ( "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMN" );
+
+    int fd = open ( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+
+    if ( fd < 0 || pwrite ( fd, contents.c_str(), contents.size(), 0 )
+         != static_cast<ssize_t> ( contents.size() ) )
+    {
+        std::cerr << "Unable to create " << path << std::endl;
+        return false;
+    }
+
+    PosixFileBuffer buf;
+
+    // Two contiguous reads make the second one read ahead, past offset 30.
+    bool ok = expectRead ( buf, fd, 0, contents.substr ( 0, 10 ) )
+              && expectRead ( buf, fd, 10, contents.substr ( 10, 10 ) )
+              && write ( buf, fd, 30, "XXXXXXXXXX" )
+              && expectRead ( buf, fd, 20, contents.substr ( 20, 10 ) )
+              && expectRead ( buf, fd, 30, "XXXXXXXXXX" );
+
+    close ( fd );
+
+    return ok;
+}
+
+/// @brief Writes made outside the buffer are noticed once the check interval is over.
+static bool testOutsideWrite ( const std::string& root )
+{
+    const std::string path = root + "/outside";
+    const std::string contents ( "0123456789abcdefghijklmnopqrstuvwxyz" );
+
+    int fd = open ( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+
+    if ( fd < 0 || pwrite ( fd, contents.c_str(), contents.size(), 0 )
+         != static_cast<ssize_t> ( contents.size() ) )
+    {
+        std::cerr << "Unable to create " << path << std::endl;
+        return false;
+    }
+
+    const unsigned interval = PosixFileBuffer::ReadAheadCheckInterval;
+    PosixFileBuffer::ReadAheadCheckInterval = 0;
+
+    PosixFileBuffer buf;
+
+    bool ok = expectRead ( buf, fd, 0, contents.substr ( 0, 10 ) )
+              && expectRead ( buf, fd, 10, contents.substr ( 10, 5 ) );
+
+    // Grows the file, so the size no longer matches whatever the timestamps do.
+    if ( ok && pwrite ( fd, "!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!", 40, 15 ) != 40 )
+        ok = false;
+
+    ok = ok && expectRead ( buf, fd, 15, "!!!!!" );
+
+    PosixFileBuffer::ReadAheadCheckInterval = interval;
+    close ( fd );
+
+    return ok;
+}
+
+/// @brief Files open below a renamed directory are flushed by their new path.
+static bool testRenameDirectory ( const std::string& root )
+{
+    const std::string dir = root + "/from";
+    int fd = -1;
+
+    if ( mkdir ( dir.c_str(), 0755 ) != 0
+         || ( fd = open ( ( dir + "/file" ).c_str(), O_WRONLY | O_CREAT, 0644 ) ) < 0 )
+    {
+        std::cerr << "Unable to create the file to write" << std::endl;
+        return false;
+    }
+
+    close ( fd );
+
+    PosixFileSystem fs ( root );
+    FileHandle fh;
+
+    if ( NotOk ( fs.openFile ( "/from/file", true, fh ) ) )
+    {
+        std::cerr << "Unable to open the file to write" << std::endl;
+        return false;
+    }
+
+    Metadata md;
+    const std::vector<char> data ( 10, 'x' );
+    size_t processed = 0;
+    bool ok = false;
+
+    if ( NotOk ( fs.writeFile ( fh, data, 0, processed ) ) )
+    {
+        std::cerr << "Unable to write to the file" << std::endl;
+    }
+    else if ( NotOk ( fs.rename ( "/from", "/to" ) ) )
+    {
+        std::cerr << "Unable to rename the directory" << std::endl;
+    }
+    else if ( NotOk ( fs.readMetadata ( "/to/file", md ) ) || md.size() != data.size() )
+    {
+        std::cerr << "The file's size after the rename is " << md.size() << ", expected "
+            << data.size() << std::endl;
+    }
+    else
+    {
+        ok = true;
+    }
+
+    fs.closeFile ( fh );
+
+    return ok;
+}
+
+int main()
+{
+    char root[] = "/tmp/rfsPosixFileBufferTest.XXXXXX";
+
+    if ( mkdtemp ( root ) == nullptr )
+    {
+        std::cerr << "Unable to create a directory to test in" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const bool ok = testWriteThroughReadAhead ( root ) && testOutsideWrite ( root )
+                    && testRenameDirectory ( root );
+
+    PosixFileSystem fs;
+    fs.removeTree ( root );
+
+    if ( !ok )
+        return EXIT_FAILURE;
+
+    std::cout << "PosixFileBuffer tests passed" << std::endl;
+
+    return EXIT_SUCCESS;
+}
@@ -1,43 +1,203 @@
 #pragma once
 
+#include <map>
 #include <string>
+#include <vector>
 
 #include "Rfs.pb.h"
 
 #include "RetCode.hpp"
 
+struct iovec;
+
 namespace rfs
 {
 
+class RevocationPage;
+class ShmSession;
+
 class Client
 {
 public:
     Client();
-    ~Client();
 
-    RetCode open ( uint32_t& hd );
+    /// @brief Use a connection to a proxy which is open already, rather than the proxy
+    /// thread's, such as one end of a socket pair.
+    /// @param [in] fd The socket; taken over by this.
+    explicit Client ( int fd );
 
+    ~Client();
+
+    /// @brief How a file is opened; the flags may be combined.
+    enum OpenFlags
+    {
+        Write = 1, ///< The file will be written to.
+        Direct = 2 ///< Bypass the proxy for reads and writes, where possible.
+    };
+
+    /// @brief Open a file.
+    /// With Direct, the proxy checks this process may open the file and then hands it its
+    /// descriptor, if the file is local. read() and write() use the descriptor from then on,
+    /// without going through the proxy at all, until the file is renamed or removed, after
+    /// which they go through the proxy again. Otherwise they always go through the proxy.
+    /// @param [in] path The path of the file.
+    /// @param [out] hd The handle of the open file.
+    /// @param [in] flags A combination of OpenFlags.
+    /// @return Standard error code.
+    RetCode open ( const std::string& path, uint32_t& hd, int flags = 0 );
+
+    /// @brief Close an open file.
+    /// @param [in] hd The file to close.
+    /// @return Standard error code.
     RetCode close ( uint32_t hd );
 
+    /// @brief Whether reads and writes of an open file currently bypass the proxy.
+    bool isDirect ( uint32_t hd ) const;
+
+    /// @brief Read from an open file.
+    /// The data is read straight into the buffer, without being copied.
+    /// @param [in] hd The file to read from.
+    /// @param [in,out] data Sized to the number of bytes to read; resized to the number read.
+    /// @param [in] offset The offset to start reading at.
+    /// @return Standard error code.
     RetCode read ( uint32_t hd, std::vector<char>& data, off_t offset = 0 );
 
+    /// @brief Write to an open file.
+    /// The data is written straight from the buffer, without being copied. Through the
+    /// proxy, data which doesn't fit in a single frame is written in several requests;
+    /// if one of them fails, the data before it has been written.
+    /// @param [in] hd The file to write to.
+    /// @param [in] data The data to write.
+    /// @param [in] offset The offset to start writing at.
+    /// @return Standard error code.
     RetCode write ( uint32_t hd, const std::vector<char>& data, off_t offset = 0 );
 
     RetCode readdir ( const std::string& path, std::vector<Metadata>& entries );
 
     RetCode stat ( const std::string& path, Metadata& md );
 
+    RetCode copy ( const std::string& from, const std::string& to );
+
+    /// @brief Copy a range of one open file to another, without the data passing through
+    /// this process.
+    /// @param [in] from The file to copy from.
+    /// @param [in] fromOffset The offset to start copying from.
+    /// @param [in] to The file to copy to; must be open for Write.
+    /// @param [in] toOffset The offset to start copying to.
+    /// @param [in] size The number of bytes to copy.
+    /// @param [out] processed The number of bytes copied; short of size at the end of from.
+    /// @return Standard error code.
+    RetCode copyRange ( uint32_t from, off_t fromOffset, uint32_t to, off_t toOffset,
+                        size_t size, size_t& processed );
+
+    RetCode getXAttr ( const std::string& path, const std::string& key, std::string& value );
+
+    RetCode setXAttr ( const std::string& path, const std::string& key,
+                       const std::string& value );
+
+    RetCode removeXAttr ( const std::string& path, const std::string& key );
+
+    /// @brief Retrieve every extended attribute of an entry, along with its value.
+    RetCode listXAttr ( const std::string& path, std::vector<XAttr>& xattrs );
+
+    /// @brief Move the connection to memory shared with the proxy.
+    /// Requests and responses then go through a pair of rings instead of the socket,
+    /// which saves the system calls and copies of every request.
+    /// @param [in] ringSize The size of each ring to ask for (bytes); the proxy may pick another.
+    /// @return Standard error code; if it fails, the connection carries on over the socket.
+    RetCode useSharedMemory ( size_t ringSize = 0 );
+
 private:
+    /// @brief A file whose descriptor the proxy has handed over.
+    struct DirectFile
+    {
+        int fd; ///< The descriptor of the file.
+        uint32_t slot; ///< Its slot in the revocation page.
+    };
+
+    /// @brief Find the descriptor to use for an open file.
+    /// Forgets about it if it has been revoked.
+    /// @return nullptr if the file should be accessed through the proxy.
+    DirectFile* getDirect ( uint32_t hd );
+
     RetCode connect();
     void disconnect();
     RetCode execCmd ( const proto::RfsMsg& cmd, proto::RfsMsg& resp );
 
+    /// @brief Send a command along with bulk data, and wait for the response.
+    /// @param [in] cmd The command.
+    /// @param [in] data The data to send after it; may be nullptr if dataSize is 0.
+    /// @param [in] dataSize The size of the data.
+    /// @param [out] resp The response.
+    /// @param [out] respData The data sent after the response, or streamed after it, is read
+    /// into this; may be nullptr if none is expected.
+    /// @param [out] respFds The descriptors passed along with the response are appended to
+    /// this; may be nullptr if none are expected, in which case any passed are closed.
+    /// @return Standard error code.
+    RetCode execCmd ( const proto::RfsMsg& cmd, const char* data, size_t dataSize,
+                      proto::RfsMsg& resp, std::vector<char>* respData,
+                      std::vector<int>* respFds );
+    RetCode execXAttr ( proto::RfsMsg& cmd, proto::RfsMsg& resp );
+
+    /// @brief Write out a frame: a message, and the data to send after it.
+    /// @return Standard error code; the connection is closed on failure.
+    RetCode writeFrame ( const proto::RfsMsg& msg, const char* data, size_t dataSize );
+
+    /// @brief Read in a frame.
+    /// @param [out] msg The message.
+    /// @param [out] data The data sent after the message is read into this.
+    /// @param [out] fds The descriptors passed along with the message are appended to this;
+    /// may be nullptr, in which case any passed are closed.
+    /// @return Standard error code; the connection is closed on failure.
+    RetCode readFrame ( proto::RfsMsg& msg, std::vector<char>* data, std::vector<int>* fds );
+
+    /// @brief Read in the payload of a stream following a response, granting the proxy
+    /// credit as it's consumed.
+    /// @param [in] stream The ID of the stream, from the response.
+    /// @param [out] data The payload is appended to this.
+    /// @return Standard error code; the error the stream ended with, if any.
+    RetCode readStream ( uint32_t stream, std::vector<char>* data );
+
+    /// @brief Write out a request in full, through the socket or shared memory.
+    /// @return false on error.
+    bool writeRequest ( struct iovec* iov, int count );
+
+    /// @brief Read in part of a response in full, through the socket or shared memory.
+    /// @return false on error, or if the connection was closed.
+    bool readResponse ( char* buf, size_t size );
+
+    /// @brief Wait to be woken up through shared memory.
+    /// Descriptors arriving on the socket meanwhile are received.
+    /// @return false if the connection was closed.
+    bool waitShm();
+
+    /// @brief Take descriptors passed along with a response.
+    /// @param [in] count The number the response carries.
+    /// @param [out] fds They are appended to this; may be nullptr to close them.
+    /// @return false if they didn't arrive.
+    bool takeDescriptors ( size_t count, std::vector<int>* fds );
+
     inline bool isConnected() const
     {
         return ( fd_ >= 0 );
     }
 
     int fd_;
+
+    /// @brief The memory shared with the proxy; nullptr if the socket is used.
+    ShmSession* shm_;
+
+    /// @brief Descriptors received which no response has claimed yet.
+    std::vector<int> recvFds_;
+
+    /// @brief Where the proxy revokes direct access; nullptr until it's first granted.
+    RevocationPage* revoked_;
+
+    /// @brief The files open for direct access, by handle.
+    std::map<uint32_t, DirectFile> direct_;
+
+    /// @brief The handle to give the next file opened.
+    uint32_t nextHd_;
 };
 
 }
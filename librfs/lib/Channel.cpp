@@ -1,5 +1,17 @@
+extern "C"
+{
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
+
 #include "Channel.hpp"
+#include "Compressor.hpp"
 
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <sstream>
 
 #include <boost/bind.hpp>
@@ -7,133 +19,938 @@
 using namespace rfs;
 
 uint32_t Channel::MaxMessageSize ( 1024 * 128 );
+size_t Channel::MaxPooledBuffers ( 64 );
+size_t Channel::MaxPooledBufferSize ( 1024 * 16 );
+uint32_t Channel::CompressMinSize ( 512 );
+uint32_t Channel::StreamChunkSize ( 1024 * 64 );
+uint32_t Channel::StreamWindow ( 1024 * 256 );
+size_t Channel::LowWatermark ( 1024 * 1024 );
+size_t Channel::HighWatermark ( 1024 * 1024 * 4 );
+size_t Channel::HardLimit ( 1024 * 1024 * 16 );
 
 Logger Channel::log_ ( "rfsChannel" );
 
 Channel::Channel ( boost::asio::io_service& svc, const boost::asio::generic::stream_protocol& proto )
-    : socket_ ( svc, proto )
+    : socket_ ( svc, proto ), family_ ( proto.family() ), nextStreamId_ ( 1 ),
+      sendingStreams_ ( false ),
+      compression_ ( proto::RfsMsg::Uncompressed ), helloSent_ ( false ),
+      readStart_ ( 0 ), readEnd_ ( 0 ),
+      lowWatermark_ ( LowWatermark ), highWatermark_ ( HighWatermark ),
+      hardLimit_ ( HardLimit ), policy_ ( Disconnect ), queuedSize_ ( 0 ),
+      congested_ ( false ), shedCount_ ( 0 ), closed_ ( false ), shm_ ( nullptr ),
+      shmEvent_ ( svc ), shmEventCount_ ( 0 )
+{
+    // Leave room for the rest of a chunk's message.
+    assert ( StreamChunkSize + 64 <= MaxMessageSize );
+
+    readBuf_.resize ( sizeof ( WireHeader ) + MaxMessageSize );
+}
+
+Channel::~Channel()
 {
-    readMsg_.resize ( MaxMessageSize );
+    for ( size_t i = 0; i < writeFds_.size(); ++i )
+        ::close ( writeFds_[i] );
+
+    for ( size_t i = 0; i < writingFds_.size(); ++i )
+        ::close ( writingFds_[i] );
+
+    delete shm_;
+    shm_ = nullptr;
+}
+
+void Channel::start()
+{
+    startRead();
 }
 
 void Channel::close()
 {
     socket_.close();
+    shmEvent_.close();
+}
+
+void Channel::reset()
+{
+    notifyClosed();
+    close();
+}
+
+void Channel::notifyClosed()
+{
+    if ( closed_ )
+        return;
+
+    closed_ = true;
+
+    if ( closeCb_ )
+        closeCb_();
+}
+
+void Channel::setLimits ( size_t low, size_t high, size_t hard, OverloadPolicy policy )
+{
+    assert ( low <= high );
+    assert ( high <= hard );
+
+    lowWatermark_ = low;
+    highWatermark_ = high;
+    hardLimit_ = hard;
+    policy_ = policy;
+}
+
+void Channel::negotiate()
+{
+    proto::RfsMsg msg;
+    msg.set_cmd ( proto::RfsMsg::Hello );
+    msg.set_tag ( 0 );
+
+    proto::RfsMsg::HelloMsg* hello = msg.mutable_hello();
+
+    if ( Compressor::isSupported ( proto::RfsMsg::LZ4 ) )
+        hello->add_compression ( proto::RfsMsg::LZ4 );
+
+    if ( hello->compression_size() == 0 )
+        return;
+
+    helloSent_ = true;
+    send ( msg );
+}
+
+bool Channel::send ( const proto::RfsMsg& msg )
+{
+    return sendFrame ( msg, nullptr, nullptr );
+}
+
+bool Channel::send ( const proto::RfsMsg& msg, std::vector<char>& data )
+{
+    return sendFrame ( msg, &data, nullptr );
+}
+
+bool Channel::send ( const proto::RfsMsg& msg, std::vector<int>& fds )
+{
+    assert ( msg.descriptors() == fds.size() );
+
+    if ( family_ != AF_LOCAL || fds.size() > MaxDescriptors || ! sendFrame ( msg, nullptr, &fds ) )
+    {
+        for ( size_t i = 0; i < fds.size(); ++i )
+            ::close ( fds[i] );
+
+        fds.clear();
+        return false;
+    }
+
+    return true;
 }
 
-void Channel::send ( const proto::RfsMsg& msg )
+bool Channel::sendFrame ( const proto::RfsMsg& msg, std::vector<char>* data, std::vector<int>* fds )
 {
-    bool writeInProgress = ( writeMsgs_.size() > 0 );
+    if ( closed_ )
+        return false;
 
     const size_t hdrSize = sizeof ( WireHeader );
     const size_t msgSize = msg.ByteSize();
-    std::vector<char> tmp ( hdrSize + msgSize );
+    const size_t dataSize = ( data != nullptr ) ? data->size() : 0;
+
+    if ( msgSize + dataSize > MaxMessageSize )
+    {
+        // The receiver would reset the channel on seeing it.
+        log_ << Log::Crit << "Unable to send RFS message of size " << msgSize
+            << " with " << dataSize << " bytes of data, the max allowed size is "
+            << MaxMessageSize << std::endl;
+        return false;
+    }
+
+    // Control frames go ahead of everything else queued. Other frames keep their order,
+    // as a request may depend on the ones before it (a Stat following a Write).
+    const bool priority = ( msg.cmd() == proto::RfsMsg::Hello
+                            || msg.cmd() == proto::RfsMsg::StreamCredit );
+
+    // The chunk ending a stream without data is just as small, and without it the other
+    // end would wait for the rest of the stream forever. It keeps its place in the queue,
+    // though, behind the stream's other chunks.
+    const bool endsStream = ( msg.cmd() == proto::RfsMsg::StreamData && dataSize == 0
+                              && msg.has_streamchunk() && msg.streamchunk().last() );
+
+    // Control frames are small, and holding them back would stall the other end too.
+    if ( ! priority && ! endsStream && queuedSize_ + hdrSize + msgSize + dataSize > hardLimit_ )
+    {
+        if ( policy_ == Disconnect )
+        {
+            log_ << Log::Warning << "Send queue of " << queuedSize_ << " bytes is over the limit of "
+                << hardLimit_ << " bytes; disconnecting the peer" << std::endl;
+
+            reset();
+            return false;
+        }
+
+        // Logged once per overload, rather than for every frame shed.
+        if ( shedCount_++ == 0 )
+        {
+            log_ << Log::Warning << "Send queue of " << queuedSize_ << " bytes is over the limit of "
+                << hardLimit_ << " bytes; dropping messages" << std::endl;
+        }
+
+        return false;
+    }
+
+    std::vector<char> frame;
+    takeBuffer ( frame );
 
     WireHeader hdr;
+    hdr.cmd = msg.cmd();
+    hdr.tag = msg.tag();
     hdr.size = msgSize;
+    hdr.dataSize = dataSize;
+
+    if ( msg.cmd() == proto::RfsMsg::StreamData )
+        hdr.flags |= WireHeader::Continuation;
+
+    if ( priority )
+        hdr.flags |= WireHeader::Priority;
+
+    bool ok = true;
+
+    // Copying through shared memory is cheaper than compressing.
+    if ( compression_ != proto::RfsMsg::Uncompressed && shm_ == nullptr
+          && msgSize >= CompressMinSize )
+    {
+        compressBuf_.resize ( msgSize );
+        ok = msg.SerializeToArray ( &compressBuf_[0], msgSize );
+
+        frame.resize ( hdrSize + Compressor::getMaxSize ( compression_, msgSize ) );
+        size_t size = frame.size() - hdrSize;
 
-    if ( ! hdr.serialize ( &tmp[0], hdrSize )
-          || ! msg.SerializeToArray ( &tmp[hdrSize], msgSize ) )
+        // Data which doesn't shrink goes out as it is.
+        if ( ok && Compressor::compress ( compression_, &compressBuf_[0], msgSize,
+                                          &frame[hdrSize], size )
+              && size < msgSize )
+        {
+            hdr.size = size;
+            hdr.flags |= WireHeader::Compressed;
+        }
+        else if ( ok )
+        {
+            memcpy ( &frame[hdrSize], &compressBuf_[0], msgSize );
+        }
+
+        frame.resize ( hdrSize + hdr.size );
+    }
+    else
+    {
+        frame.resize ( hdrSize + msgSize );
+        ok = msg.SerializeToArray ( &frame[hdrSize], msgSize );
+    }
+
+    if ( ! ok || ! hdr.serialize ( &frame[0], hdrSize ) )
     {
         log_ << Log::Crit << "Unable to serialize RFS message to array, size "
             << msgSize << std::endl;
+
+        recycleBuffer ( frame );
+        return false;
+    }
+
+    queuedSize_ += frame.size() + dataSize;
+
+    if ( queuedSize_ > highWatermark_ )
+        congested_ = true;
+
+    // Descriptors go out with the first bytes written after they are queued. Over shared
+    // memory they still go through the socket, with a byte of their own to carry them;
+    // the other end picks them up from there once it sees the frame needs them.
+    if ( fds != nullptr && ! fds->empty() )
+    {
+        writeFds_.insert ( writeFds_.end(), fds->begin(), fds->end() );
+        fds->clear();
+
+        if ( shm_ != nullptr )
+        {
+            writeMsgs_.push_back ( std::vector<char> ( 1, 0 ) );
+            queuedSize_ += 1;
+
+            if ( writingMsgs_.empty() )
+                startWrite();
+        }
+    }
+
+    // Frames take their turn for room in the ring, whatever their priority.
+    if ( shm_ != nullptr )
+    {
+        shmMsgs_.push_back ( std::vector<char>() );
+        shmMsgs_.back().swap ( frame );
+
+        if ( dataSize > 0 )
+        {
+            shmMsgs_.push_back ( std::vector<char>() );
+            shmMsgs_.back().swap ( *data );
+        }
+
+        flushShm();
+        return true;
+    }
+
+    // Frames queued while a write is in progress go out together once it completes.
+    std::vector< std::vector<char> >& queue = priority ? priorityMsgs_ : writeMsgs_;
+
+    queue.push_back ( std::vector<char>() );
+    queue.back().swap ( frame );
+
+    // The data is written straight from its own buffer, right after the message.
+    if ( dataSize > 0 )
+    {
+        queue.push_back ( std::vector<char>() );
+        queue.back().swap ( *data );
+    }
+
+    if ( writingMsgs_.empty() )
+        startWrite();
+
+    return true;
+}
+
+void Channel::onSharedMemory ( const proto::RfsMsg& msg )
+{
+    proto::RfsMsg resp;
+    resp.set_tag ( msg.tag() );
+
+    RetCode rc = Success;
+
+    if ( family_ != AF_LOCAL )
+    {
+        rc = NotSupported;
+    }
+    else if ( shm_ != nullptr )
+    {
+        rc = AlreadyStarted;
+    }
+    else
+    {
+        // The rings must hold the largest frame, or it could never be written.
+        const size_t minSize = sizeof ( WireHeader ) + MaxMessageSize;
+
+        shm_ = new ShmSession();
+        rc = shm_->create ( std::max<size_t> ( msg.sharedmemory().ringsize(), minSize ) );
+
+        if ( IsOk ( rc ) && shm_->getRingSize() < minSize )
+            rc = NotPossible;
+    }
+
+    std::vector<int> fds;
+
+    for ( size_t i = 0; IsOk ( rc ) && i < ShmSession::DescriptorCount; ++i )
+    {
+        const int fd = dup ( shm_->getDescriptor ( static_cast<ShmSession::Descriptor> ( i ) ) );
+
+        if ( fd < 0 )
+        {
+            rc = SocketError;
+            break;
+        }
+
+        fds.push_back ( fd );
+    }
+
+    const int event = IsOk ( rc ) ? dup ( shm_->getDescriptor ( ShmSession::ProxyEvent ) ) : -1;
+
+    if ( IsOk ( rc ) && event < 0 )
+        rc = SocketError;
+
+    if ( NotOk ( rc ) )
+    {
+        for ( size_t i = 0; i < fds.size(); ++i )
+            ::close ( fds[i] );
+
+        if ( rc != AlreadyStarted )
+        {
+            delete shm_;
+            shm_ = nullptr;
+        }
+
+        resp.set_cmd ( proto::RfsMsg::Response );
+        resp.mutable_response()->set_ret ( rc );
+
+        send ( resp );
+        return;
+    }
+
+    resp.set_cmd ( proto::RfsMsg::SharedMemory );
+    resp.set_descriptors ( fds.size() );
+    resp.mutable_sharedmemory()->set_ringsize ( shm_->getRingSize() );
+
+    // The answer itself still goes through the socket; everything after it through the
+    // rings. shm_ is only set once it has been queued, so it doesn't go to the rings too.
+    ShmSession* session = shm_;
+    shm_ = nullptr;
+
+    if ( ! send ( resp, fds ) )
+    {
+        ::close ( event );
+        delete session;
         return;
     }
 
-    writeMsgs_.push_back ( tmp );
+    shm_ = session;
+    shmReadBuf_.resize ( sizeof ( WireHeader ) + MaxMessageSize );
 
-    if ( ! writeInProgress )
+    boost::system::error_code err;
+    shmEvent_.assign ( event, err );
+
+    if ( err )
     {
-        const std::vector<char>& toSend = writeMsgs_.front();
+        ::close ( event );
+
+        log_ << Log::Crit << "Unable to wait on shared memory: " << err.message()
+            << "; resetting channel" << std::endl;
 
-        boost::asio::async_write ( socket_,
-                                   boost::asio::buffer ( toSend ),
-                                   boost::bind ( &Channel::doNextWrite,
-                                       shared_from_this(),
-                                       boost::asio::placeholders::error ) );
+        reset();
+        return;
     }
+
+    // The client may already have written to the rings.
+    if ( readShm() )
+        startShmWait();
+}
+
+void Channel::startShmWait()
+{
+    assert ( shm_ != nullptr );
+
+    shmEvent_.async_read_some ( boost::asio::buffer ( &shmEventCount_, sizeof ( shmEventCount_ ) ),
+                                makeMemoryHandler ( shmMem_,
+                                    boost::bind ( &Channel::doShmWait, shared_from_this(),
+                                        boost::asio::placeholders::error,
+                                        boost::asio::placeholders::bytes_transferred ) ) );
 }
 
-void Channel::doHeaderRead ( const boost::system::error_code& err, size_t readSize )
+void Channel::doShmWait ( const boost::system::error_code& err, size_t readSize )
 {
+    ( void ) readSize;
+
     if ( err )
     {
-        if ( err != boost::asio::error::eof
-              && err != boost::asio::error::connection_reset )
+        // Closing the channel cancels the wait; the socket reports anything else.
+        if ( err != boost::asio::error::operation_aborted )
         {
-            log_ << Log::Crit << "Error occurred when writing to socket: "
-                << err.message() << ", closing socket" << std::endl;
+            log_ << Log::Crit << "Error occurred when waiting on shared memory: "
+                << err.message() << std::endl;
         }
 
-        if ( closeCb_ )
-            closeCb_();
+        return;
+    }
+
+    // Woken up either for requests, or for room to write responses.
+    flushShm();
 
+    if ( closed_ || ! readShm() )
         return;
+
+    startShmWait();
+}
+
+bool Channel::readShm()
+{
+    assert ( shm_ != nullptr );
+
+    ShmRing& requests = shm_->getRequests();
+    const size_t hdrSize = sizeof ( WireHeader );
+
+    while ( ! closed_ )
+    {
+        if ( ! requests.isValid() )
+        {
+            log_ << Log::Crit << "Shared memory request ring is corrupt; resetting channel"
+                << std::endl;
+
+            reset();
+            return false;
+        }
+
+        WireHeader hdr;
+        size_t frameSize = hdrSize;
+
+        if ( requests.peek ( &shmReadBuf_[0], hdrSize ) )
+        {
+            if ( ! hdr.deserialize ( &shmReadBuf_[0], hdrSize )
+                  || static_cast<uint64_t> ( hdr.size ) + hdr.dataSize > MaxMessageSize )
+            {
+                log_ << Log::Crit << "Received a frame header through shared memory which is"
+                    << " corrupt or too large; resetting channel" << std::endl;
+
+                reset();
+                return false;
+            }
+
+            frameSize += hdr.size + hdr.dataSize;
+        }
+
+        // Once there's a whole frame, it's copied out, so the client can reuse the room
+        // while it's handled.
+        if ( ! requests.read ( &shmReadBuf_[0], frameSize ) )
+        {
+            // Still asleep, if the rest arrived meanwhile.
+            if ( ! requests.prepareReaderWait ( frameSize ) )
+                continue;
+
+            return true;
+        }
+
+        if ( requests.wakeWriter() )
+            ShmSession::signal ( shm_->getDescriptor ( ShmSession::ClientEvent ) );
+
+        if ( ! onFrame ( hdr, &shmReadBuf_[hdrSize] ) )
+            return false;
     }
 
-    assert ( readSize == sizeof ( WireHeader ) );
+    return false;
+}
+
+void Channel::flushShm()
+{
+    if ( shm_ == nullptr || closed_ )
+        return;
+
+    ShmRing& responses = shm_->getResponses();
 
-    if ( ! readHdr_.deserialize ( readMsg_ ) )
+    size_t written = 0;
+
+    while ( written < shmMsgs_.size() )
     {
-        log_ << Log::Crit << "Unable to parse header message of size "
-            << readSize << std::endl;
+        std::vector<char>& frame = shmMsgs_[written];
+
+        struct iovec iov;
+        iov.iov_base = &frame[0];
+        iov.iov_len = frame.size();
+
+        if ( ! responses.write ( &iov, 1 ) )
+        {
+            // Asleep until the client has made room, unless it already has.
+            if ( responses.prepareWriterWait ( frame.size() ) )
+                break;
+
+            continue;
+        }
+
+        assert ( queuedSize_ >= frame.size() );
 
-        assert ( false );
+        queuedSize_ -= frame.size();
+        recycleBuffer ( frame );
+        ++written;
+    }
+
+    if ( written == 0 )
         return;
+
+    // Keeps the list's capacity, and that of the buffers still waiting.
+    for ( size_t i = written; i < shmMsgs_.size(); ++i )
+        shmMsgs_[i - written].swap ( shmMsgs_[i] );
+
+    shmMsgs_.resize ( shmMsgs_.size() - written );
+
+    if ( responses.wakeReader() )
+        ShmSession::signal ( shm_->getDescriptor ( ShmSession::ClientEvent ) );
+
+    onWritten();
+}
+
+uint32_t Channel::sendStream ( proto::RfsMsg& head, StreamSource source )
+{
+    assert ( source );
+
+    const uint32_t id = nextStreamId_++;
+
+    OutStream& stream = outStreams_[id];
+    stream.source = source;
+    stream.offset = 0;
+    stream.credit = StreamWindow;
+
+    head.set_stream ( id );
+
+    // Shed, like any other message; the stream goes with it.
+    if ( ! send ( head ) )
+    {
+        outStreams_.erase ( id );
+        return 0;
     }
-    else if ( readHdr_.size > MaxMessageSize )
+
+    sendStreamData();
+
+    return id;
+}
+
+void Channel::cancelStream ( uint32_t stream )
+{
+    if ( inStreams_.erase ( stream ) == 0 )
+        return;
+
+    sendStreamCredit ( stream, 0, true );
+}
+
+void Channel::onReceived ( const proto::RfsMsg& msg, const char* data, size_t dataSize )
+{
+    switch ( msg.cmd() )
     {
-        log_ << Log::Crit << "Received a request for a message of size " << readHdr_.size
-            << " but the max allowed size is " << MaxMessageSize
-            << "; resetting channel" << std::endl;
+    case proto::RfsMsg::Hello:
+        if ( msg.has_hello() )
+            onHello ( msg.hello() );
+
+        return;
+
+    case proto::RfsMsg::SharedMemory:
+        onSharedMemory ( msg );
+        return;
+
+    case proto::RfsMsg::StreamData:
+        if ( msg.has_streamchunk() && msg.streamchunk().size() == dataSize )
+            onStreamData ( msg.streamchunk(), data );
 
-        if ( closeCb_ )
-            closeCb_();
+        return;
+
+    case proto::RfsMsg::StreamCredit:
+        if ( msg.has_streamcredit() )
+            onStreamCredit ( msg.streamcredit() );
+
+        return;
+
+    default:
+        break;
+    }
+
+    // Chunks may only follow a head which has been seen.
+    if ( msg.has_stream() )
+        inStreams_[msg.stream()] = 0;
+
+    if ( recvCb_ )
+        recvCb_ ( msg, data, dataSize );
+}
+
+void Channel::onHello ( const proto::RfsMsg::HelloMsg& hello )
+{
+    if ( helloSent_ )
+    {
+        // The answer to our offer; it can only pick one of the algorithms we offered.
+        helloSent_ = false;
+
+        if ( hello.compression_size() == 1
+              && Compressor::isSupported ( hello.compression ( 0 ) ) )
+        {
+            compression_ = hello.compression ( 0 );
+        }
+
+        return;
+    }
+
+    proto::RfsMsg msg;
+    msg.set_cmd ( proto::RfsMsg::Hello );
+    msg.set_tag ( 0 );
+
+    proto::RfsMsg::HelloMsg* answer = msg.mutable_hello();
+
+    for ( int i = 0; i < hello.compression_size(); ++i )
+    {
+        if ( hello.compression ( i ) != proto::RfsMsg::Uncompressed
+              && Compressor::isSupported ( hello.compression ( i ) ) )
+        {
+            answer->add_compression ( hello.compression ( i ) );
+            break;
+        }
+    }
+
+    // Sent uncompressed, as the other end only starts decompressing once it has it.
+    send ( msg );
+
+    if ( answer->compression_size() == 1 )
+        compression_ = answer->compression ( 0 );
+}
+
+void Channel::onStreamData ( const proto::RfsMsg::StreamChunk& chunk, const char* data )
+{
+    // Cancelled (or never announced), so whatever is left of it is discarded.
+    if ( inStreams_.find ( chunk.stream() ) == inStreams_.end() )
+        return;
+
+    if ( streamCb_ )
+        streamCb_ ( chunk, data );
+
+    // The handler may have cancelled the stream.
+    std::map<uint32_t, uint64_t>::iterator it = inStreams_.find ( chunk.stream() );
+
+    if ( it == inStreams_.end() )
+        return;
+
+    if ( chunk.last() )
+    {
+        inStreams_.erase ( it );
+        return;
+    }
+
+    it->second += chunk.size();
+
+    // Handing credit back in large amounts keeps the number of messages down, while
+    // the half window still in flight keeps the sender busy meanwhile.
+    if ( it->second < StreamWindow / 2 )
+        return;
+
+    sendStreamCredit ( chunk.stream(), it->second, false );
+    it->second = 0;
+}
+
+void Channel::sendStreamCredit ( uint32_t stream, uint32_t size, bool cancel )
+{
+    creditMsg_.Clear();
+    creditMsg_.set_cmd ( proto::RfsMsg::StreamCredit );
+    creditMsg_.set_tag ( 0 );
+
+    proto::RfsMsg::StreamCreditMsg* credit = creditMsg_.mutable_streamcredit();
+    credit->set_stream ( stream );
+
+    if ( cancel )
+    {
+        credit->set_cancel ( true );
+    }
+    else
+    {
+        credit->set_size ( size );
+    }
+
+    send ( creditMsg_ );
+}
+
+void Channel::onStreamCredit ( const proto::RfsMsg::StreamCreditMsg& credit )
+{
+    std::map<uint32_t, OutStream>::iterator it = outStreams_.find ( credit.stream() );
+
+    if ( it == outStreams_.end() )
+        return;
+
+    if ( credit.cancel() )
+    {
+        outStreams_.erase ( it );
+        return;
+    }
 
-        close();
+    it->second.credit += credit.size();
+
+    sendStreamData();
+}
+
+void Channel::sendStreamData()
+{
+    // A source may start another stream; the loop below picks it up.
+    if ( sendingStreams_ )
         return;
+
+    sendingStreams_ = true;
+
+    streamMsg_.set_cmd ( proto::RfsMsg::StreamData );
+
+    proto::RfsMsg::StreamChunk* chunk = streamMsg_.mutable_streamchunk();
+
+    // Sources fill in buffers from the pool, which are written out as they are.
+    std::vector<char> data;
+
+    bool sent = true;
+
+    // A chunk of each stream in turn, so one large stream doesn't hold up the others.
+    // Streams pause while the channel isn't writable, and carry on once it drains.
+    while ( sent && ! congested_ )
+    {
+        sent = false;
+
+        std::map<uint32_t, OutStream>::iterator it = outStreams_.begin();
+
+        while ( it != outStreams_.end() && ! congested_ )
+        {
+            OutStream& stream = it->second;
+
+            if ( stream.credit == 0 )
+            {
+                ++it;
+                continue;
+            }
+
+            // The stream's ID goes in the tag too, so the frame header carries it.
+            streamMsg_.set_tag ( it->first );
+            chunk->set_stream ( it->first );
+            chunk->set_offset ( stream.offset );
+            chunk->clear_last();
+            chunk->clear_ret();
+
+            takeBuffer ( data );
+            bool last = false;
+
+            const RetCode rc = stream.source (
+                std::min<uint64_t> ( StreamChunkSize, stream.credit ), data, last );
+
+            if ( NotOk ( rc ) )
+            {
+                data.clear();
+                chunk->set_ret ( rc );
+                last = true;
+            }
+
+            assert ( data.size() <= std::min<uint64_t> ( StreamChunkSize, stream.credit ) );
+            assert ( last || ! data.empty() );
+
+            chunk->set_size ( data.size() );
+            stream.offset += data.size();
+            stream.credit -= std::min<uint64_t> ( data.size(), stream.credit );
+
+            if ( last )
+                chunk->set_last ( true );
+
+            // Under the Shed policy a chunk may be dropped, the last one included; the
+            // stream can't carry on with a hole in it, so it ends with an error instead.
+            // That chunk has no data, so it isn't shed itself.
+            if ( ! send ( streamMsg_, data ) && ! closed_ )
+            {
+                data.clear();
+                chunk->set_size ( 0 );
+                chunk->set_last ( true );
+                chunk->set_ret ( MemoryError );
+                last = true;
+
+                sendFrame ( streamMsg_, nullptr, nullptr );
+            }
+
+            recycleBuffer ( data );
+            sent = true;
+
+            if ( last )
+            {
+                outStreams_.erase ( it++ );
+            }
+            else
+            {
+                ++it;
+            }
+        }
     }
 
-    boost::asio::async_read ( socket_,
-                              boost::asio::buffer ( &readMsg_[0], readHdr_.size ),
-                              boost::bind ( &Channel::doPayloadRead, shared_from_this(),
-                                  boost::asio::placeholders::error,
-                                  boost::asio::placeholders::bytes_transferred ) );
+    sendingStreams_ = false;
+}
+
+void Channel::startRead()
+{
+    assert ( readEnd_ < readBuf_.size() );
+
+    socket_.async_read_some ( boost::asio::buffer ( &readBuf_[readEnd_],
+                                                    readBuf_.size() - readEnd_ ),
+                              makeMemoryHandler ( readMem_,
+                                  boost::bind ( &Channel::doRead, shared_from_this(),
+                                      boost::asio::placeholders::error,
+                                      boost::asio::placeholders::bytes_transferred ) ) );
 }
 
-void Channel::doPayloadRead ( const boost::system::error_code& err, size_t readSize )
+void Channel::doRead ( const boost::system::error_code& err, size_t readSize )
 {
     if ( err )
     {
         if ( err != boost::asio::error::eof
               && err != boost::asio::error::connection_reset )
         {
-            log_ << Log::Crit << "Error occurred when writing to socket: "
+            log_ << Log::Crit << "Error occurred when reading from socket: "
                 << err.message() << ", closing socket" << std::endl;
         }
 
-        if ( closeCb_ )
-            closeCb_();
-
+        notifyClosed();
         return;
     }
 
-    assert ( readSize == readHdr_.size );
+    readEnd_ += readSize;
+    assert ( readEnd_ <= readBuf_.size() );
 
-    proto::RfsMsg msg;
-    if ( msg.ParseFromArray ( &readMsg_[0], readSize ) && recvCb_ )
+    const size_t hdrSize = sizeof ( WireHeader );
+
+    // A single read may have brought in any number of frames; handle all of them.
+    while ( readEnd_ - readStart_ >= hdrSize )
     {
-        recvCb_ ( msg );
+        WireHeader hdr;
+
+        if ( ! hdr.deserialize ( &readBuf_[readStart_], hdrSize ) )
+        {
+            log_ << Log::Crit << "Received a frame header which is corrupt or of an unknown"
+                << " version; resetting channel" << std::endl;
+
+            reset();
+            return;
+        }
+
+        if ( static_cast<uint64_t> ( hdr.size ) + hdr.dataSize > MaxMessageSize )
+        {
+            log_ << Log::Crit << "Received a request for a message of size " << hdr.size
+                << " with " << hdr.dataSize << " bytes of data"
+                << " but the max allowed size is " << MaxMessageSize
+                << "; resetting channel" << std::endl;
+
+            reset();
+            return;
+        }
+
+        if ( readEnd_ - readStart_ < hdrSize + hdr.size + hdr.dataSize )
+            break;
+
+        if ( ! onFrame ( hdr, &readBuf_[readStart_ + hdrSize] ) )
+            return;
+
+        readStart_ += hdrSize + hdr.size + hdr.dataSize;
     }
 
-    readHdr_.reset();
-    readMsg_.clear();
+    // Move what's left of a partial frame to the front, so the rest of it fits.
+    if ( readStart_ > 0 )
+    {
+        memmove ( &readBuf_[0], &readBuf_[readStart_], readEnd_ - readStart_ );
+        readEnd_ -= readStart_;
+        readStart_ = 0;
+    }
 
-    boost::asio::async_read ( socket_,
-                              boost::asio::buffer ( &readMsg_[0], sizeof ( WireHeader ) ),
-                              boost::bind ( &Channel::doHeaderRead, shared_from_this(),
-                                  boost::asio::placeholders::error,
-                                  boost::asio::placeholders::bytes_transferred ) );
+    startRead();
+}
+
+bool Channel::onFrame ( const WireHeader& hdr, const char* body )
+{
+    // What's left of a cancelled stream is dropped without being parsed.
+    if ( ( hdr.flags & WireHeader::Continuation )
+          && inStreams_.find ( static_cast<uint32_t> ( hdr.tag ) ) == inStreams_.end() )
+    {
+        return true;
+    }
+
+    const char* data = body;
+    size_t size = hdr.size;
+
+    if ( hdr.flags & WireHeader::Compressed )
+    {
+        decompressBuf_.resize ( MaxMessageSize );
+        size = decompressBuf_.size();
+
+        if ( compression_ == proto::RfsMsg::Uncompressed
+              || ! Compressor::decompress ( compression_, data, hdr.size,
+                                            &decompressBuf_[0], size ) )
+        {
+            log_ << Log::Crit << "Received a compressed message of size " << hdr.size
+                << " which couldn't be decompressed; resetting channel" << std::endl;
+
+            reset();
+            return false;
+        }
+
+        data = &decompressBuf_[0];
+    }
+
+    // Parsing into the same message every time reuses its submessages and strings,
+    // so once they have grown to fit, receiving doesn't allocate at all.
+    if ( ! readMsg_.ParseFromArray ( data, size ) || readMsg_.cmd() != hdr.cmd
+          || readMsg_.tag() != hdr.tag )
+    {
+        log_ << Log::Crit << "Received a message which doesn't match its frame header"
+            << " (command " << hdr.cmd << ", tag " << hdr.tag << "); dropping it"
+            << std::endl;
+
+        return true;
+    }
+
+    onReceived ( readMsg_, body + hdr.size, hdr.dataSize );
+
+    return ! closed_;
 }
 
 void Channel::doNextWrite ( const boost::system::error_code& err )
@@ -147,22 +964,226 @@ void Channel::doNextWrite ( const boost::system::error_code& err )
                 << err.message() << ", closing socket" << std::endl;
         }
 
-        if ( closeCb_ )
-            closeCb_();
+        notifyClosed();
+        return;
+    }
+
+    for ( size_t i = 0; i < writingMsgs_.size(); ++i )
+    {
+        assert ( queuedSize_ >= writingMsgs_[i].size() );
+
+        queuedSize_ -= writingMsgs_[i].size();
+        recycleBuffer ( writingMsgs_[i] );
+    }
+
+    writingMsgs_.clear();
+
+    if ( ! priorityMsgs_.empty() || ! writeMsgs_.empty() )
+        startWrite();
 
+    onWritten();
+}
+
+void Channel::onWritten()
+{
+    if ( ! congested_ || queuedSize_ > lowWatermark_ )
         return;
+
+    congested_ = false;
+
+    if ( shedCount_ > 0 )
+    {
+        log_ << Log::Warning << "Send queue drained; dropped " << shedCount_
+            << " messages meanwhile" << std::endl;
+
+        shedCount_ = 0;
+    }
+
+    // Streams first, as their producers are already waiting.
+    sendStreamData();
+
+    if ( writableCb_ )
+        writableCb_();
+}
+
+void Channel::startWrite()
+{
+    assert ( writingMsgs_.empty() );
+    assert ( ! priorityMsgs_.empty() || ! writeMsgs_.empty() );
+
+    writeBufs_.clear();
+
+    // The lists keep their capacity, so queueing frames doesn't allocate either.
+    if ( priorityMsgs_.empty() )
+    {
+        writingMsgs_.swap ( writeMsgs_ );
+    }
+    else
+    {
+        writingMsgs_.swap ( priorityMsgs_ );
+
+        for ( size_t i = 0; i < writeMsgs_.size(); ++i )
+        {
+            writingMsgs_.push_back ( std::vector<char>() );
+            writingMsgs_.back().swap ( writeMsgs_[i] );
+        }
+
+        writeMsgs_.clear();
     }
 
-    writeMsgs_.pop_front();
+    for ( size_t i = 0; i < writingMsgs_.size(); ++i )
+        writeBufs_.push_back ( boost::asio::buffer ( writingMsgs_[i] ) );
 
-    if ( writeMsgs_.empty() )
+    // Every frame whose descriptors are still waiting is part of this write.
+    if ( ! writeFds_.empty() )
+    {
+        writingFds_.swap ( writeFds_ );
+        sendDescriptors();
         return;
+    }
 
-    const std::vector<char>& msg = writeMsgs_.front();
+    writeBuffers();
+}
+
+void Channel::writeBuffers()
+{
+    WriteBuffers bufs;
+    bufs.bufs = &writeBufs_;
 
     boost::asio::async_write ( socket_,
-                               boost::asio::buffer ( msg ),
-                               boost::bind ( &Channel::doNextWrite, shared_from_this(),
-                                   boost::asio::placeholders::error ) );
+                               bufs,
+                               makeMemoryHandler ( writeMem_,
+                                   boost::bind ( &Channel::doNextWrite, shared_from_this(),
+                                       boost::asio::placeholders::error ) ) );
+}
+
+void Channel::sendDescriptors()
+{
+    assert ( ! writingFds_.empty() );
+    assert ( ! writeBufs_.empty() );
+
+    // Not std::min, which would take MaxDescriptors by reference; it has no definition.
+    const size_t batch = ( writingFds_.size() < MaxDescriptors ) ? writingFds_.size()
+                                                                  : MaxDescriptors;
+
+    // While more batches are to follow, each only goes with the first buffer left, so
+    // the rest are left for them. There are enough: every frame carrying descriptors
+    // has a buffer of its own, and none carries more than MaxDescriptors.
+    const size_t maxCount = ( batch < writingFds_.size() ) ? 1 : 16;
+
+    // Asio has no way of passing descriptors, so the first part of the write goes out
+    // with sendmsg.
+    struct iovec iov[16];
+    size_t count = 0;
+
+    for ( ; count < writeBufs_.size() && count < maxCount; ++count )
+    {
+        iov[count].iov_base = const_cast<void*> ( boost::asio::buffer_cast<const void*> ( writeBufs_[count] ) );
+        iov[count].iov_len = boost::asio::buffer_size ( writeBufs_[count] );
+    }
+
+    union
+    {
+        char buf[CMSG_SPACE ( sizeof ( int ) * MaxDescriptors )];
+        struct cmsghdr align;
+    } control;
+
+    memset ( &control, 0, sizeof ( control ) );
+
+    struct msghdr mh;
+    memset ( &mh, 0, sizeof ( mh ) );
+    mh.msg_iov = iov;
+    mh.msg_iovlen = count;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = CMSG_SPACE ( sizeof ( int ) * batch );
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR ( &mh );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN ( sizeof ( int ) * batch );
+    memcpy ( CMSG_DATA ( cmsg ), &writingFds_[0], sizeof ( int ) * batch );
+
+    const ssize_t ret = ::sendmsg ( socket_.native_handle(), &mh, MSG_DONTWAIT | MSG_NOSIGNAL );
+
+    if ( ret < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+    {
+        socket_.async_wait ( boost::asio::socket_base::wait_write,
+                             makeMemoryHandler ( writeMem_,
+                                 boost::bind ( &Channel::doSendDescriptors, shared_from_this(),
+                                     boost::asio::placeholders::error ) ) );
+        return;
+    }
+
+    // Once sent, the other end has its own copies. If sending failed, the write of the
+    // rest fails the same way, and closes the channel.
+    const size_t closing = ( ret < 0 ) ? writingFds_.size() : batch;
+
+    for ( size_t i = 0; i < closing; ++i )
+        ::close ( writingFds_[i] );
+
+    writingFds_.erase ( writingFds_.begin(), writingFds_.begin() + closing );
+
+    // Skip over whatever has been written, which may end part way into a buffer.
+    size_t sent = ( ret > 0 ) ? ret : 0;
+    size_t done = 0;
+
+    while ( done < writeBufs_.size() && sent >= boost::asio::buffer_size ( writeBufs_[done] ) )
+    {
+        sent -= boost::asio::buffer_size ( writeBufs_[done] );
+        ++done;
+    }
+
+    writeBufs_.erase ( writeBufs_.begin(), writeBufs_.begin() + done );
+
+    if ( ! writeBufs_.empty() )
+        writeBufs_[0] = writeBufs_[0] + sent;
+
+    if ( ! writingFds_.empty() && ! writeBufs_.empty() )
+    {
+        sendDescriptors();
+        return;
+    }
+
+    // Can't happen, as long as no frame carries more than MaxDescriptors.
+    for ( size_t i = 0; i < writingFds_.size(); ++i )
+        ::close ( writingFds_[i] );
+
+    writingFds_.clear();
+
+    writeBuffers();
+}
+
+void Channel::doSendDescriptors ( const boost::system::error_code& err )
+{
+    if ( err )
+    {
+        doNextWrite ( err );
+        return;
+    }
+
+    sendDescriptors();
+}
+
+void Channel::takeBuffer ( std::vector<char>& buf )
+{
+    if ( bufPool_.empty() )
+        return;
+
+    buf.swap ( bufPool_.back() );
+    bufPool_.pop_back();
+}
+
+void Channel::recycleBuffer ( std::vector<char>& buf )
+{
+    if ( bufPool_.size() >= MaxPooledBuffers || buf.capacity() > MaxPooledBufferSize )
+    {
+        std::vector<char>().swap ( buf );
+        return;
+    }
+
+    buf.clear();
+
+    bufPool_.push_back ( std::vector<char>() );
+    bufPool_.back().swap ( buf );
 }
 
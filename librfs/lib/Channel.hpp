@@ -1,13 +1,17 @@
 #pragma once
 
-#include <deque>
+#include <map>
 #include <memory>
+#include <vector>
 
 #include <boost/asio.hpp>
 
 #include "Rfs.pb.h"
 
+#include "HandlerMemory.hpp"
 #include "Log.hpp"
+#include "RetCode.hpp"
+#include "ShmRing.hpp"
 #include "WireHeader.hpp"
 
 namespace rfs
@@ -15,14 +19,71 @@ namespace rfs
 
 typedef std::shared_ptr<class Channel> ChannelPtr;
 
+/// @brief Sends and receives framed RfsMsg messages over a stream socket.
+///
+/// No frame may be larger than MaxMessageSize. Larger payloads are sent as streams:
+/// a head message, carrying the stream's ID, followed by the payload in StreamData
+/// chunks. The payload is pulled from its source a chunk at a time, and only while
+/// the stream has credit: every stream starts with StreamWindow bytes of it, and the
+/// receiver hands out more as its handler consumes the chunks. Neither end ever holds
+/// more than a window of any stream in memory, however large its payload.
+///
+/// Frames of at least CompressMinSize bytes are compressed, if negotiate() has agreed
+/// on an algorithm with the other end. Only channels to other hosts negotiate, and
+/// nothing accepts those yet: the Proxy only listens locally, and Client (which is
+/// always local) rejects compressed frames.
+///
+/// The amount of data queued for sending is bounded. Once it passes the high watermark
+/// the channel stops being writable: producers should hold off until the writable
+/// handler is called, which happens once it has drained below the low watermark. Frames
+/// which would take it past the hard limit are handled according to the overload
+/// policy: dropped, or the peer is disconnected. Streams pause by themselves.
+///
+/// Over AF_LOCAL sockets, file descriptors can be passed along with messages, and a
+/// client may ask for the connection to move to rings in shared memory (see ShmSession).
+/// From then on frames go through the rings instead, and only descriptors still go
+/// through the socket.
 class Channel : public std::enable_shared_from_this<Channel>
 {
 public:
+    /// @brief Produces the payload of a stream.
+    /// Called whenever the stream has credit to send another chunk.
+    /// @param [in] maxSize The largest chunk which may be produced (bytes).
+    /// @param [out] data The chunk; empty on entry. Must not be left empty unless last is set.
+    /// @param [out] last Set once the payload is complete; false on entry.
+    /// @return Standard error code; anything but Success ends the stream with that error.
+    typedef std::function<RetCode ( size_t maxSize, std::vector<char>& data, bool& last )> StreamSource;
+
+    /// @brief What to do with frames which would take the send queue past the hard limit.
+    enum OverloadPolicy
+    {
+        /// @brief Drop the frame; the connection stays up.
+        /// For peers which can tolerate losing messages, such as subscribers to changes.
+        Shed,
+
+        /// @brief Drop the frame, and close the connection.
+        Disconnect
+    };
+
     Channel ( boost::asio::io_service& svc, const boost::asio::generic::stream_protocol& proto );
+    ~Channel();
+
+    /// @brief Start receiving messages.
+    /// Should be called once the handlers are set; until then nothing is read.
+    void start();
 
     void close();
 
-    inline void setOnReceiveHandler ( std::function<void( const proto::RfsMsg& msg )> cb )
+    /// @brief Offer the other end to compress frames, with any algorithm available.
+    /// Frames are sent uncompressed until it has agreed; if it doesn't support any of
+    /// them, they stay that way.
+    void negotiate();
+
+    /// @brief Set the handler for messages received.
+    /// The message and its bulk data are reused for the next one received, so the
+    /// handler must copy anything it needs to keep.
+    inline void setOnReceiveHandler (
+        std::function<void( const proto::RfsMsg& msg, const char* data, size_t dataSize )> cb )
     {
         recvCb_ = cb;
     }
@@ -32,7 +93,81 @@ public:
         closeCb_ = cb;
     }
 
-    void send ( const proto::RfsMsg& msg );
+    /// @brief Set the handler called when the channel becomes writable again.
+    /// It is called once the send queue has drained below the low watermark, after
+    /// having been past the high one.
+    inline void setOnWritableHandler ( std::function<void()> cb )
+    {
+        writableCb_ = cb;
+    }
+
+    /// @brief Set the limits of the send queue.
+    /// @param [in] low The size the queue must drain to for the channel to be writable again.
+    /// @param [in] high The size past which the channel stops being writable.
+    /// @param [in] hard The size past which frames are handled according to the policy.
+    /// @param [in] policy What to do with frames past the hard limit.
+    void setLimits ( size_t low, size_t high, size_t hard, OverloadPolicy policy );
+
+    /// @brief Whether the send queue is below the high watermark.
+    /// Sending when it isn't still works, up to the hard limit.
+    inline bool isWritable() const
+    {
+        return ! congested_;
+    }
+
+    /// @brief The amount of data queued for sending, including that being written (bytes).
+    inline size_t getQueuedSize() const
+    {
+        return queuedSize_;
+    }
+
+    /// @brief Set the handler for the chunks of streams received.
+    /// The head of each stream goes to the receive handler first. Chunks are passed on
+    /// in order, along with their data (chunk.size() bytes); the sender is given more
+    /// credit once the handler has returned.
+    inline void setOnStreamDataHandler (
+        std::function<void( const proto::RfsMsg::StreamChunk& chunk, const char* data )> cb )
+    {
+        streamCb_ = cb;
+    }
+
+    /// @brief The largest frame which may be sent or received: its message and its bulk
+    /// data together (bytes).
+    static inline uint32_t getMaxMessageSize()
+    {
+        return MaxMessageSize;
+    }
+
+    /// @brief Send a message.
+    /// Messages which don't fit in a frame are dropped; use sendStream() for those.
+    /// @return false if the message was dropped.
+    bool send ( const proto::RfsMsg& msg );
+
+    /// @brief Send a message followed by bulk data, such as the contents of a File.
+    /// The data goes out in the same frame, straight from its buffer.
+    /// @param [in] msg The message to send.
+    /// @param [in,out] data The data; taken over by this, and left empty, unless the message
+    /// is dropped.
+    /// @return false if the message was dropped.
+    bool send ( const proto::RfsMsg& msg, std::vector<char>& data );
+
+    /// @brief Send a message along with file descriptors; only possible over AF_LOCAL sockets.
+    /// @param [in] msg The message to send; its descriptors field must be the number passed.
+    /// @param [in,out] fds The descriptors; taken over by this, and closed once sent,
+    /// or if the message is dropped. Left empty.
+    /// @return false if the message was dropped.
+    bool send ( const proto::RfsMsg& msg, std::vector<int>& fds );
+
+    /// @brief Send a message followed by a payload of any size.
+    /// @param [in] head The message to send first; its stream field is set by this.
+    /// @param [in] source Produces the payload; dropped once it is complete.
+    /// @return The ID of the stream; 0 if the head was dropped, and the stream with it.
+    uint32_t sendStream ( proto::RfsMsg& head, StreamSource source );
+
+    /// @brief Stop receiving a stream.
+    /// The sender is asked to stop, and chunks still on their way are discarded.
+    /// @param [in] stream The ID of the stream, from its head.
+    void cancelStream ( uint32_t stream );
 
     inline boost::asio::generic::stream_protocol::socket& getSocket()
     {
@@ -41,23 +176,260 @@ public:
 
 private:
 
-    void doHeaderRead ( const boost::system::error_code& err, size_t readSize );
-    void doPayloadRead ( const boost::system::error_code& err, size_t readSize );
+    /// @brief Close the channel after receiving something it can't make sense of.
+    void reset();
+
+    /// @brief Let the close handler know the channel has closed, unless it already has.
+    void notifyClosed();
+
+    /// @brief Read as much as fits into the free end of the receive buffer.
+    void startRead();
+
+    /// @brief Handle every complete frame received, then read again.
+    void doRead ( const boost::system::error_code& err, size_t readSize );
+
+    /// @brief Handle a complete frame.
+    /// @param [in] hdr The header of the frame.
+    /// @param [in] body The message of the frame, followed by its data.
+    /// @return false if the channel has been reset.
+    bool onFrame ( const WireHeader& hdr, const char* body );
+
     void doNextWrite ( const boost::system::error_code& err );
 
+    /// @brief Write out every queued frame with a single gathered write.
+    void startWrite();
+
+    /// @brief Write out writeBufs_.
+    void writeBuffers();
+
+    /// @brief Write out as much of writeBufs_ as the socket takes along with the descriptors
+    /// being sent, then the rest of it.
+    /// No more than MaxDescriptors go with any one sendmsg; frames written together may
+    /// carry more than that between them, in which case they go out in several batches,
+    /// each with bytes of its own.
+    void sendDescriptors();
+
+    /// @brief Try sending the descriptors again, once the socket has room.
+    void doSendDescriptors ( const boost::system::error_code& err );
+
+    /// @brief Called once frames have been written; lets producers know if the queue
+    /// has drained.
+    void onWritten();
+
+    /// @brief Handle a request to move to shared memory.
+    void onSharedMemory ( const proto::RfsMsg& msg );
+
+    /// @brief Wait for the other end to wake us up through shared memory.
+    void startShmWait();
+
+    /// @brief Handle being woken up through shared memory.
+    void doShmWait ( const boost::system::error_code& err, size_t readSize );
+
+    /// @brief Handle every frame in the request ring.
+    /// @return false if the channel has been reset.
+    bool readShm();
+
+    /// @brief Write as many of the frames waiting for room as fit into the response ring.
+    void flushShm();
+
+    /// @brief Take a frame buffer from the pool, or allocate one if it's empty.
+    void takeBuffer ( std::vector<char>& buf );
+
+    /// @brief Return a frame buffer to the pool once it has been written.
+    void recycleBuffer ( std::vector<char>& buf );
+
+    /// @brief Serialize a message into a frame and queue it.
+    /// @param [in] msg The message to send.
+    /// @param [in,out] data Bulk data to send after it; may be nullptr.
+    /// @return false if the message was dropped.
+    /// @param [in,out] fds Descriptors to pass along with it; may be nullptr.
+    bool sendFrame ( const proto::RfsMsg& msg, std::vector<char>* data, std::vector<int>* fds );
+
+    /// @brief Handle a message received.
+    void onReceived ( const proto::RfsMsg& msg, const char* data, size_t dataSize );
+
+    /// @brief Handle an offer from the other end, or its answer to ours.
+    void onHello ( const proto::RfsMsg::HelloMsg& hello );
+
+    /// @brief Pass a chunk of a stream to the handler, and give the sender more credit.
+    void onStreamData ( const proto::RfsMsg::StreamChunk& chunk, const char* data );
+
+    /// @brief Handle credit given by the receiver of one of our streams.
+    void onStreamCredit ( const proto::RfsMsg::StreamCreditMsg& credit );
+
+    /// @brief Send chunks of every stream with credit left.
+    void sendStreamData();
+
+    /// @brief Give the sender of a stream more credit, or ask it to stop.
+    void sendStreamCredit ( uint32_t stream, uint32_t size, bool cancel );
+
+    /// @brief The buffers of the frames being written, as a buffer sequence.
+    /// Asio keeps a copy of the sequence for as long as the write takes; this saves it
+    /// copying the whole vector of buffers.
+    struct WriteBuffers
+    {
+        typedef boost::asio::const_buffer value_type;
+        typedef std::vector<boost::asio::const_buffer>::const_iterator const_iterator;
+
+        const std::vector<boost::asio::const_buffer>* bufs; ///< The buffers.
+
+        inline const_iterator begin() const
+        {
+            return bufs->begin();
+        }
+
+        inline const_iterator end() const
+        {
+            return bufs->end();
+        }
+    };
+
+    /// @brief A stream being sent.
+    struct OutStream
+    {
+        StreamSource source; ///< Produces the payload.
+        uint64_t offset; ///< The amount of the payload sent so far.
+        uint64_t credit; ///< The amount which may still be sent.
+    };
+
     static uint32_t MaxMessageSize;
 
+    /// @brief Configuration field, the largest chunk of a stream's payload sent in a frame (bytes).
+    static uint32_t StreamChunkSize;
+
+    /// @brief Configuration field, the smallest message compressed (bytes).
+    /// Smaller ones rarely shrink by enough to be worth the time.
+    static uint32_t CompressMinSize;
+
+    /// @brief Configuration field, the default low watermark of the send queue (bytes).
+    static size_t LowWatermark;
+
+    /// @brief Configuration field, the default high watermark of the send queue (bytes).
+    static size_t HighWatermark;
+
+    /// @brief Configuration field, the default hard limit of the send queue (bytes).
+    static size_t HardLimit;
+
+    /// @brief Configuration field, the credit each stream starts with (bytes).
+    /// The receiver gives more back once it has consumed half of it.
+    static uint32_t StreamWindow;
+
+    /// @brief Configuration field, the number of frame buffers each channel keeps for reuse.
+    static size_t MaxPooledBuffers;
+
+    /// @brief Configuration field, the largest frame buffer kept for reuse (bytes).
+    /// Larger ones are freed, so one large message doesn't pin its memory.
+    static size_t MaxPooledBufferSize;
+
+    /// @brief The most descriptors sent along with any one message, or sendmsg.
+    /// The kernel's own limit (SCM_MAX_FD), and what the other end makes room for.
+    static const size_t MaxDescriptors = 253;
+
     static Logger log_;
 
     boost::asio::generic::stream_protocol::socket socket_;
 
-    std::function<void( const proto::RfsMsg& msg )> recvCb_;
+    /// @brief The address family of the socket.
+    const int family_;
+
+    std::function<void( const proto::RfsMsg& msg, const char* data, size_t dataSize )> recvCb_;
     std::function<void()> closeCb_;
+    std::function<void()> writableCb_;
+    std::function<void( const proto::RfsMsg::StreamChunk& chunk, const char* data )> streamCb_;
+
+    /// @brief The streams being sent, by ID.
+    std::map<uint32_t, OutStream> outStreams_;
+
+    /// @brief The ID to give to the next stream sent.
+    uint32_t nextStreamId_;
+
+    /// @brief Whether sendStreamData() is running.
+    bool sendingStreams_;
+
+    /// @brief The streams being received, by ID, with the number of bytes consumed
+    /// since the sender was last given credit.
+    std::map<uint32_t, uint64_t> inStreams_;
+
+    /// @brief The algorithm frames are compressed with.
+    proto::RfsMsg::Compression compression_;
+
+    /// @brief Whether we have offered compression and are waiting for the answer.
+    bool helloSent_;
+
+    /// @brief Messages being compressed are serialized into this first.
+    std::vector<char> compressBuf_;
+
+    /// @brief Compressed messages received are decompressed into this.
+    std::vector<char> decompressBuf_;
+
+    /// @brief Received messages are parsed into this.
+    /// Handlers are passed a reference to it, which is only valid until they return.
+    proto::RfsMsg readMsg_;
+
+    /// @brief The chunks of streams sent are built in this.
+    proto::RfsMsg streamMsg_;
+
+    /// @brief Stream credit sent is built in this.
+    proto::RfsMsg creditMsg_;
+
+    /// @brief Received data; always large enough for the largest frame.
+    std::vector<char> readBuf_;
+    size_t readStart_; ///< The start of the first frame not yet handled.
+    size_t readEnd_; ///< The end of the data received.
+
+    size_t lowWatermark_; ///< The send queue size at which the channel is writable again.
+    size_t highWatermark_; ///< The send queue size past which it isn't writable.
+    size_t hardLimit_; ///< The send queue size past which the policy applies.
+    OverloadPolicy policy_; ///< What to do with frames past the hard limit.
+
+    size_t queuedSize_; ///< The size of the frames queued or being written.
+    bool congested_; ///< Whether the queue has passed the high watermark and not drained yet.
+    uint64_t shedCount_; ///< The number of frames dropped under the Shed policy.
+    bool closed_; ///< Whether the close handler has been called.
+
+    /// @brief Control frames waiting for the current write to complete.
+    /// They are written ahead of writeMsgs_, so credit and negotiation don't have to
+    /// wait for bulk data queued before them.
+    std::vector< std::vector<char> > priorityMsgs_;
+
+    /// @brief Frames waiting for the current write to complete.
+    std::vector< std::vector<char> > writeMsgs_;
+
+    /// @brief Frames being written; all of them go out in one gathered write.
+    std::vector< std::vector<char> > writingMsgs_;
+
+    /// @brief The buffers of the frames being written.
+    std::vector<boost::asio::const_buffer> writeBufs_;
+
+    /// @brief Descriptors to send along with the frames waiting to be written.
+    /// They go out with the first bytes of the write which includes their frames, so
+    /// they arrive ahead of, or together with, those frames.
+    std::vector<int> writeFds_;
+
+    /// @brief Descriptors to send along with the frames being written.
+    std::vector<int> writingFds_;
+
+    /// @brief The shared memory the connection has moved to; nullptr if it hasn't.
+    ShmSession* shm_;
+
+    /// @brief The eventfd which wakes us up, once the connection has moved to shared memory.
+    boost::asio::posix::stream_descriptor shmEvent_;
+
+    /// @brief The eventfd's counter is read into this.
+    uint64_t shmEventCount_;
+
+    /// @brief Frames waiting for room in the response ring, in order.
+    std::vector< std::vector<char> > shmMsgs_;
+
+    /// @brief Frames read from the request ring are copied into this.
+    std::vector<char> shmReadBuf_;
 
-    WireHeader readHdr_;
-    std::vector<char> readMsg_;
+    /// @brief Frame buffers which have been written, kept for reuse.
+    std::vector< std::vector<char> > bufPool_;
 
-    std::deque< std::vector<char> > writeMsgs_;
+    HandlerMemory readMem_; ///< The read in progress is allocated from this.
+    HandlerMemory writeMem_; ///< The write in progress is allocated from this.
+    HandlerMemory shmMem_; ///< The wait for shared memory is allocated from this.
 
 };
 
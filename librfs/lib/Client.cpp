@@ -1,17 +1,115 @@
 extern "C"
 {
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 }
 
+#include <algorithm>
+
+#include "Channel.hpp"
 #include "Client.hpp"
+#include "DirectAccess.hpp"
 #include "ProxyThread.hpp"
+#include "ShmRing.hpp"
 #include "WireHeader.hpp"
 
 using namespace rfs;
 
-Client::Client() : fd_ ( -1 )
+/// @brief Write out buffers in full.
+/// @return false on error.
+static bool writeFully ( int fd, struct iovec* iov, int count )
+{
+    while ( count > 0 )
+    {
+        ssize_t ret = ::writev ( fd, iov, count );
+
+        if ( ret < 0 )
+            return false;
+
+        // Skip over whatever has been written, which may end part way into a buffer.
+        while ( count > 0 && static_cast<size_t> ( ret ) >= iov->iov_len )
+        {
+            ret -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if ( count > 0 )
+        {
+            iov->iov_base = static_cast<char*> ( iov->iov_base ) + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    return true;
+}
+
+/// @brief Read in a given amount of data in full.
+/// @param [out] fds Descriptors passed along with the data are appended to this.
+/// @return false on error, or if the connection was closed.
+static bool readFully ( int fd, char* data, size_t size, std::vector<int>& fds )
+{
+    size_t read = 0;
+
+    while ( read < size )
+    {
+        struct iovec iov;
+        iov.iov_base = &data[read];
+        iov.iov_len = size - read;
+
+        union
+        {
+            char buf[CMSG_SPACE ( sizeof ( int ) * 253 )];
+            struct cmsghdr align;
+        } control;
+
+        struct msghdr mh;
+        memset ( &mh, 0, sizeof ( mh ) );
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof ( control.buf );
+
+        ssize_t ret = ::recvmsg ( fd, &mh, MSG_CMSG_CLOEXEC );
+
+        if ( ret <= 0 )
+            return false;
+
+        for ( struct cmsghdr* cmsg = CMSG_FIRSTHDR ( &mh ); cmsg != nullptr;
+              cmsg = CMSG_NXTHDR ( &mh, cmsg ) )
+        {
+            if ( cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS )
+                continue;
+
+            const size_t count = ( cmsg->cmsg_len - CMSG_LEN ( 0 ) ) / sizeof ( int );
+
+            for ( size_t i = 0; i < count; ++i )
+            {
+                int passed = -1;
+                memcpy ( &passed, CMSG_DATA ( cmsg ) + i * sizeof ( int ), sizeof ( int ) );
+                fds.push_back ( passed );
+            }
+        }
+
+        // Some of the descriptors were lost, so they can't be matched up with responses.
+        if ( mh.msg_flags & MSG_CTRUNC )
+            return false;
+
+        read += ret;
+    }
+
+    return true;
+}
+
+Client::Client() : fd_ ( -1 ), shm_ ( nullptr ), revoked_ ( nullptr ), nextHd_ ( 0 )
+{
+}
+
+Client::Client ( int fd ) : fd_ ( fd ), shm_ ( nullptr ), revoked_ ( nullptr ), nextHd_ ( 0 )
 {
 }
 
@@ -63,6 +161,23 @@ RetCode Client::connect()
 
 void Client::disconnect()
 {
+    delete shm_;
+    shm_ = nullptr;
+
+    for ( size_t i = 0; i < recvFds_.size(); ++i )
+        ::close ( recvFds_[i] );
+
+    recvFds_.clear();
+
+    // Without the connection, the proxy can't revoke them any more.
+    for ( std::map<uint32_t, DirectFile>::iterator it = direct_.begin(); it != direct_.end(); ++it )
+        ::close ( it->second.fd );
+
+    direct_.clear();
+
+    delete revoked_;
+    revoked_ = nullptr;
+
     if ( ! isConnected() )
         return;
 
@@ -70,6 +185,322 @@ void Client::disconnect()
     fd_ = -1;
 }
 
+RetCode Client::useSharedMemory ( size_t ringSize )
+{
+    if ( shm_ != nullptr )
+        return AlreadyStarted;
+
+    proto::RfsMsg cmd;
+    cmd.set_cmd ( proto::RfsMsg::SharedMemory );
+    cmd.set_tag ( 0 );
+    cmd.mutable_sharedmemory()->set_ringsize ( ringSize );
+
+    proto::RfsMsg resp;
+    std::vector<int> fds;
+
+    RetCode rc = execCmd ( cmd, nullptr, 0, resp, nullptr, &fds );
+
+    if ( IsOk ( rc ) && resp.has_response() )
+        rc = resp.response().ret();
+
+    if ( IsOk ( rc ) && ( resp.cmd() != proto::RfsMsg::SharedMemory || ! resp.has_sharedmemory() ) )
+        rc = MalformedMessage;
+
+    if ( NotOk ( rc ) )
+    {
+        for ( size_t i = 0; i < fds.size(); ++i )
+            ::close ( fds[i] );
+
+        return rc;
+    }
+
+    ShmSession* shm = new ShmSession();
+    rc = shm->attach ( fds, resp.sharedmemory().ringsize() );
+
+    if ( NotOk ( rc ) )
+    {
+        delete shm;
+        return rc;
+    }
+
+    shm_ = shm;
+    return Success;
+}
+
+RetCode Client::open ( const std::string& path, uint32_t& hd, int flags )
+{
+    const uint32_t fid = nextHd_;
+
+    proto::RfsMsg cmd;
+    cmd.set_cmd ( proto::RfsMsg::Open );
+    cmd.set_tag ( 0 );
+
+    proto::RfsMsg::OpenReq* req = cmd.mutable_openreq();
+    assert ( req != nullptr );
+    req->set_fid ( fid );
+    req->set_path ( path );
+    req->set_write ( ( flags & Write ) != 0 );
+    req->set_direct ( ( flags & Direct ) != 0 );
+
+    proto::RfsMsg resp;
+    std::vector<int> fds;
+
+    RetCode rc = execCmd ( cmd, nullptr, 0, resp, nullptr, &fds );
+
+    if ( IsOk ( rc ) )
+        rc = resp.has_response() ? resp.response().ret() : MalformedMessage;
+
+    // Either the file's descriptor, preceded by the page's the first time, or nothing.
+    const bool hasPage = ( resp.has_directaccess() && resp.directaccess().page() );
+    const size_t expected = resp.has_directaccess() ? ( hasPage ? 2 : 1 ) : 0;
+
+    if ( IsOk ( rc ) && ( fds.size() != expected
+                           || ( resp.has_directaccess() && hasPage != ( revoked_ == nullptr ) ) ) )
+        rc = MalformedMessage;
+
+    if ( IsOk ( rc ) && hasPage )
+    {
+        RevocationPage* page = new RevocationPage();
+        rc = page->attach ( fds[0] );
+        fds.erase ( fds.begin() );
+
+        if ( IsOk ( rc ) )
+        {
+            revoked_ = page;
+        }
+        else
+        {
+            delete page;
+        }
+    }
+
+    if ( NotOk ( rc ) )
+    {
+        for ( size_t i = 0; i < fds.size(); ++i )
+            ::close ( fds[i] );
+
+        return rc;
+    }
+
+    if ( ! fds.empty() )
+    {
+        DirectFile& df = direct_[fid];
+        df.fd = fds[0];
+        df.slot = resp.directaccess().slot();
+    }
+
+    ++nextHd_;
+    hd = fid;
+
+    return Success;
+}
+
+RetCode Client::close ( uint32_t hd )
+{
+    std::map<uint32_t, DirectFile>::iterator it = direct_.find ( hd );
+
+    // The slot must be free to be reused by the time the proxy hears about it.
+    if ( it != direct_.end() )
+    {
+        ::close ( it->second.fd );
+        direct_.erase ( it );
+    }
+
+    proto::RfsMsg cmd;
+    cmd.set_cmd ( proto::RfsMsg::Close );
+    cmd.set_tag ( 0 );
+    cmd.mutable_closereq()->set_fid ( hd );
+
+    proto::RfsMsg resp;
+
+    RetCode rc = execCmd ( cmd, resp );
+
+    if ( NotOk ( rc ) )
+    {
+        return rc;
+    }
+
+    if ( ! resp.has_response() )
+    {
+        return MalformedMessage;
+    }
+
+    return resp.response().ret();
+}
+
+bool Client::isDirect ( uint32_t hd ) const
+{
+    std::map<uint32_t, DirectFile>::const_iterator it = direct_.find ( hd );
+
+    return ( it != direct_.end() && revoked_ != nullptr
+             && ! revoked_->isRevoked ( it->second.slot ) );
+}
+
+Client::DirectFile* Client::getDirect ( uint32_t hd )
+{
+    std::map<uint32_t, DirectFile>::iterator it = direct_.find ( hd );
+
+    if ( it == direct_.end() )
+        return nullptr;
+
+    assert ( revoked_ != nullptr );
+
+    if ( ! revoked_->isRevoked ( it->second.slot ) )
+        return &it->second;
+
+    ::close ( it->second.fd );
+    direct_.erase ( it );
+
+    return nullptr;
+}
+
+RetCode Client::read ( uint32_t hd, std::vector<char>& data, off_t offset )
+{
+    DirectFile* df = getDirect ( hd );
+
+    if ( df != nullptr )
+    {
+        size_t done = 0;
+
+        while ( done < data.size() )
+        {
+            ssize_t ret = ::pread ( df->fd, &data[done], data.size() - done, offset + done );
+
+            if ( ret < 0 && errno == EINTR )
+                continue;
+
+            if ( ret < 0 )
+                return ReadError;
+
+            // The end of the file.
+            if ( ret == 0 )
+                break;
+
+            done += ret;
+        }
+
+        data.resize ( done );
+        return Success;
+    }
+
+    proto::RfsMsg cmd;
+    cmd.set_cmd ( proto::RfsMsg::Read );
+    cmd.set_tag ( 0 );
+
+    proto::RfsMsg::ReadReq* rr = cmd.mutable_readreq();
+    assert ( rr != nullptr );
+    rr->set_fid ( hd );
+    rr->set_size ( data.size() );
+    rr->set_offset ( offset );
+
+    const size_t size = data.size();
+
+    proto::RfsMsg resp;
+
+    RetCode rc = execCmd ( cmd, nullptr, 0, resp, &data, nullptr );
+
+    if ( NotOk ( rc ) )
+    {
+        return rc;
+    }
+
+    if ( resp.has_response() )
+    {
+        return resp.response().ret();
+    }
+
+    if ( ! resp.has_file() || resp.file().size() < 0 || data.size() > size )
+    {
+        return MalformedMessage;
+    }
+
+    // Large reads are streamed, and the file only tells the size of what came with it.
+    if ( ! resp.has_stream() && static_cast<size_t> ( resp.file().size() ) != data.size() )
+    {
+        return MalformedMessage;
+    }
+
+    return Success;
+}
+
+RetCode Client::write ( uint32_t hd, const std::vector<char>& data, off_t offset )
+{
+    DirectFile* df = getDirect ( hd );
+
+    if ( df != nullptr )
+    {
+        size_t done = 0;
+
+        while ( done < data.size() )
+        {
+            ssize_t ret = ::pwrite ( df->fd, &data[done], data.size() - done, offset + done );
+
+            if ( ret < 0 && errno == EINTR )
+                continue;
+
+            // Opened without Write.
+            if ( ret < 0 && errno == EBADF )
+                return InvalidPermissions;
+
+            if ( ret <= 0 )
+                return WriteError;
+
+            done += ret;
+        }
+
+        return Success;
+    }
+
+    proto::RfsMsg cmd;
+    cmd.set_cmd ( proto::RfsMsg::Write );
+    cmd.set_tag ( 0 );
+
+    proto::RfsMsg::File* file = cmd.mutable_file();
+    assert ( file != nullptr );
+    file->set_fid ( hd );
+
+    // Every request has to fit in a frame, along with its message; this is as large as
+    // the message gets.
+    file->set_size ( data.size() );
+    file->set_offset ( offset + data.size() );
+
+    const size_t maxSize = Channel::getMaxMessageSize() - cmd.ByteSize();
+
+    proto::RfsMsg resp;
+    size_t done = 0;
+
+    do
+    {
+        const size_t size = std::min ( data.size() - done, maxSize );
+
+        file->set_size ( size );
+        file->set_offset ( offset + done );
+
+        RetCode rc = execCmd ( cmd, ( size > 0 ) ? &data[done] : nullptr, size, resp, nullptr,
+                               nullptr );
+
+        if ( NotOk ( rc ) )
+        {
+            return rc;
+        }
+
+        if ( ! resp.has_response() )
+        {
+            return MalformedMessage;
+        }
+
+        if ( NotOk ( resp.response().ret() ) )
+        {
+            return resp.response().ret();
+        }
+
+        done += size;
+    }
+    while ( done < data.size() );
+
+    return Success;
+}
+
 RetCode Client::stat ( const std::string& path, Metadata& md )
 {
     proto::RfsMsg cmd;
@@ -97,7 +528,190 @@ RetCode Client::stat ( const std::string& path, Metadata& md )
     return Success;
 }
 
+RetCode Client::copy ( const std::string& from, const std::string& to )
+{
+    proto::RfsMsg cmd;
+    cmd.set_cmd ( proto::RfsMsg::Copy );
+    cmd.set_tag ( 0 );
+
+    proto::RfsMsg::CopyReq* cr = cmd.mutable_copyreq();
+    assert ( cr != nullptr );
+    cr->set_frompath ( from );
+    cr->set_topath ( to );
+
+    proto::RfsMsg resp;
+
+    RetCode rc = execCmd ( cmd, resp );
+
+    if ( NotOk ( rc ) )
+    {
+        return rc;
+    }
+
+    if ( ! resp.has_response() )
+    {
+        return MalformedMessage;
+    }
+
+    return resp.response().ret();
+}
+
+RetCode Client::copyRange ( uint32_t from, off_t fromOffset, uint32_t to, off_t toOffset,
+                            size_t size, size_t& processed )
+{
+    processed = 0;
+
+    proto::RfsMsg cmd;
+    cmd.set_cmd ( proto::RfsMsg::Copy );
+    cmd.set_tag ( 0 );
+
+    proto::RfsMsg::CopyReq* cr = cmd.mutable_copyreq();
+    assert ( cr != nullptr );
+    cr->set_fromfid ( from );
+    cr->set_fromoffset ( fromOffset );
+    cr->set_tofid ( to );
+    cr->set_tooffset ( toOffset );
+    cr->set_size ( size );
+
+    proto::RfsMsg resp;
+
+    RetCode rc = execCmd ( cmd, resp );
+
+    if ( NotOk ( rc ) )
+    {
+        return rc;
+    }
+
+    if ( ! resp.has_response() )
+    {
+        return MalformedMessage;
+    }
+
+    if ( IsOk ( resp.response().ret() ) )
+    {
+        processed = resp.response().size();
+    }
+
+    return resp.response().ret();
+}
+
+RetCode Client::getXAttr ( const std::string& path, const std::string& key,
+                           std::string& value )
+{
+    proto::RfsMsg cmd;
+
+    proto::RfsMsg::XAttrReq* xr = cmd.mutable_xattrreq();
+    assert ( xr != nullptr );
+    xr->set_op ( proto::RfsMsg::XAttrReq::Get );
+    xr->set_path ( path );
+    xr->set_key ( key );
+
+    proto::RfsMsg resp;
+
+    RetCode rc = execXAttr ( cmd, resp );
+
+    if ( NotOk ( rc ) )
+    {
+        return rc;
+    }
+
+    if ( ! resp.has_metadata() || resp.metadata().xattrs_size() != 1 )
+    {
+        return MalformedMessage;
+    }
+
+    value = resp.metadata().xattrs ( 0 ).value();
+    return Success;
+}
+
+RetCode Client::setXAttr ( const std::string& path, const std::string& key,
+                           const std::string& value )
+{
+    proto::RfsMsg cmd;
+
+    proto::RfsMsg::XAttrReq* xr = cmd.mutable_xattrreq();
+    assert ( xr != nullptr );
+    xr->set_op ( proto::RfsMsg::XAttrReq::Set );
+    xr->set_path ( path );
+    xr->set_key ( key );
+    xr->set_value ( value );
+
+    proto::RfsMsg resp;
+
+    return execXAttr ( cmd, resp );
+}
+
+RetCode Client::removeXAttr ( const std::string& path, const std::string& key )
+{
+    proto::RfsMsg cmd;
+
+    proto::RfsMsg::XAttrReq* xr = cmd.mutable_xattrreq();
+    assert ( xr != nullptr );
+    xr->set_op ( proto::RfsMsg::XAttrReq::Remove );
+    xr->set_path ( path );
+    xr->set_key ( key );
+
+    proto::RfsMsg resp;
+
+    return execXAttr ( cmd, resp );
+}
+
+RetCode Client::listXAttr ( const std::string& path, std::vector<XAttr>& xattrs )
+{
+    proto::RfsMsg cmd;
+
+    proto::RfsMsg::XAttrReq* xr = cmd.mutable_xattrreq();
+    assert ( xr != nullptr );
+    xr->set_op ( proto::RfsMsg::XAttrReq::List );
+    xr->set_path ( path );
+
+    proto::RfsMsg resp;
+
+    RetCode rc = execXAttr ( cmd, resp );
+
+    if ( NotOk ( rc ) )
+    {
+        return rc;
+    }
+
+    if ( ! resp.has_metadata() )
+    {
+        return MalformedMessage;
+    }
+
+    xattrs.assign ( resp.metadata().xattrs().begin(), resp.metadata().xattrs().end() );
+    return Success;
+}
+
+RetCode Client::execXAttr ( proto::RfsMsg& cmd, proto::RfsMsg& resp )
+{
+    cmd.set_cmd ( proto::RfsMsg::XAttr );
+    cmd.set_tag ( 0 );
+
+    RetCode rc = execCmd ( cmd, resp );
+
+    if ( NotOk ( rc ) )
+    {
+        return rc;
+    }
+
+    // Get and List reply with the attributes; anything else is a plain response.
+    if ( resp.has_response() )
+    {
+        return resp.response().ret();
+    }
+
+    return Success;
+}
+
 RetCode Client::execCmd ( const proto::RfsMsg& cmd, proto::RfsMsg& resp )
+{
+    return execCmd ( cmd, nullptr, 0, resp, nullptr, nullptr );
+}
+
+RetCode Client::execCmd ( const proto::RfsMsg& cmd, const char* data, size_t dataSize,
+                          proto::RfsMsg& resp, std::vector<char>* respData,
+                          std::vector<int>* respFds )
 {
     if ( ! isConnected() )
     {
@@ -109,59 +723,301 @@ RetCode Client::execCmd ( const proto::RfsMsg& cmd, proto::RfsMsg& resp )
 
     assert ( isConnected() );
 
+    RetCode rc = writeFrame ( cmd, data, dataSize );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    // Data nobody asked for still has to be read, to get to the next response.
+    std::vector<char> discard;
+
+    rc = readFrame ( resp, ( respData != nullptr ) ? respData : &discard, respFds );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    if ( resp.has_stream() )
+    {
+        rc = readStream ( resp.stream(), ( respData != nullptr ) ? respData : &discard );
+
+        if ( NotOk ( rc ) )
+            return rc;
+    }
+
+    return ( respData == nullptr && ! discard.empty() ) ? MalformedMessage : Success;
+}
+
+RetCode Client::writeFrame ( const proto::RfsMsg& msg, const char* data, size_t dataSize )
+{
     const size_t hdrSize = sizeof ( WireHeader );
-    const size_t cmdSize = cmd.ByteSize();
-    std::vector<char> tmp ( hdrSize + cmdSize );
+    const size_t msgSize = msg.ByteSize();
+    std::vector<char> tmp ( hdrSize + msgSize );
 
     WireHeader hdr;
-    hdr.size = cmdSize;
+    hdr.cmd = msg.cmd();
+    hdr.tag = msg.tag();
+    hdr.size = msgSize;
+    hdr.dataSize = dataSize;
 
     if ( ! hdr.serialize ( &tmp[0], hdrSize )
-          || ! cmd.SerializeToArray ( &tmp[hdrSize], cmdSize ) )
+          || ! msg.SerializeToArray ( &tmp[hdrSize], msgSize ) )
     {
         return MalformedMessage;
     }
 
-    ssize_t ret = ::write ( fd_, &tmp[0], tmp.size() );
-    if ( ret < 0 )
+    // The data is written straight from the caller's buffer, after the message.
+    struct iovec iov[2];
+    iov[0].iov_base = &tmp[0];
+    iov[0].iov_len = tmp.size();
+    iov[1].iov_base = const_cast<char*> ( data );
+    iov[1].iov_len = dataSize;
+
+    if ( ! writeRequest ( iov, ( dataSize > 0 ) ? 2 : 1 ) )
     {
         disconnect();
         return WriteError;
     }
 
-    hdr.reset();
-    ret = ::read ( fd_, &tmp[0], hdrSize );
+    return Success;
+}
+
+RetCode Client::readFrame ( proto::RfsMsg& msg, std::vector<char>* data, std::vector<int>* fds )
+{
+    const size_t hdrSize = sizeof ( WireHeader );
+    std::vector<char> tmp ( hdrSize );
 
-    if ( ret < 0 || ! hdr.deserialize ( tmp ) )
+    WireHeader hdr;
+
+    if ( ! readResponse ( &tmp[0], hdrSize ) || ! hdr.deserialize ( tmp ) )
     {
         disconnect();
         return ReadError;
     }
 
+    // Compression is only offered to peers on other hosts; this is always a local
+    // socket, so the response can't be compressed.
+    if ( hdr.flags & WireHeader::Compressed )
+    {
+        disconnect();
+        return MalformedMessage;
+    }
+
     tmp.resize ( hdr.size );
-    size_t read = 0;
 
-    while ( read < hdr.size )
+    if ( ! readResponse ( &tmp[0], hdr.size ) )
     {
-        ret = ::read ( fd_, &tmp[read], ( hdr.size - read ) );
+        disconnect();
+        return ReadError;
+    }
 
-        if ( ret < 0 )
+    msg.Clear();
+    if ( ! msg.ParseFromArray ( &tmp[0], hdr.size ) )
+    {
+        disconnect();
+        return MalformedMessage;
+    }
+
+    if ( msg.descriptors() > 0 && ! takeDescriptors ( msg.descriptors(), fds ) )
+    {
+        disconnect();
+        return ReadError;
+    }
+
+    assert ( data != nullptr );
+
+    // Read straight into the caller's buffer.
+    data->resize ( hdr.dataSize );
+
+    if ( hdr.dataSize > 0 && ! readResponse ( &data->at ( 0 ), hdr.dataSize ) )
+    {
+        disconnect();
+        return ReadError;
+    }
+
+    return Success;
+}
+
+RetCode Client::readStream ( uint32_t stream, std::vector<char>* data )
+{
+    proto::RfsMsg msg;
+    std::vector<char> chunk;
+
+    proto::RfsMsg credit;
+    credit.set_cmd ( proto::RfsMsg::StreamCredit );
+    credit.set_tag ( 0 );
+    credit.mutable_streamcredit()->set_stream ( stream );
+
+    uint64_t offset = 0;
+
+    while ( true )
+    {
+        RetCode rc = readFrame ( msg, &chunk, nullptr );
+
+        if ( NotOk ( rc ) )
+            return rc;
+
+        // Only one request is ever outstanding, so nothing else can arrive meanwhile.
+        if ( msg.cmd() != proto::RfsMsg::StreamData || ! msg.has_streamchunk()
+              || msg.streamchunk().stream() != stream
+              || msg.streamchunk().offset() != offset
+              || msg.streamchunk().size() != chunk.size() )
         {
             disconnect();
-            return ReadError;
+            return MalformedMessage;
         }
 
-        read += ret;
+        const proto::RfsMsg::StreamChunk& sc = msg.streamchunk();
+
+        offset += chunk.size();
+        data->insert ( data->end(), chunk.begin(), chunk.end() );
+
+        if ( sc.last() )
+            return sc.has_ret() ? sc.ret() : Success;
+
+        // Every chunk consumed lets the proxy send another one as large, which keeps
+        // as much on its way as it started out with, whatever that is.
+        credit.mutable_streamcredit()->set_size ( chunk.size() );
+
+        rc = writeFrame ( credit, nullptr, 0 );
+
+        if ( NotOk ( rc ) )
+            return rc;
     }
+}
 
-    assert ( read == hdr.size );
+bool Client::writeRequest ( struct iovec* iov, int count )
+{
+    if ( shm_ == nullptr )
+        return writeFully ( fd_, iov, count );
+
+    ShmRing& requests = shm_->getRequests();
+
+    size_t size = 0;
+
+    for ( int i = 0; i < count; ++i )
+        size += iov[i].iov_len;
 
-    resp.Clear();
-    if ( ! resp.ParseFromArray ( &tmp[0], hdr.size ) )
+    // It could never be written.
+    if ( size > requests.getSize() )
+        return false;
+
+    const uint32_t maxSpins = ShmSession::getSpinCount();
+    uint32_t spins = 0;
+
+    while ( ! requests.write ( iov, count ) )
     {
-        disconnect();
-        return MalformedMessage;
+        if ( spins++ < maxSpins || ! requests.prepareWriterWait ( size ) )
+            continue;
+
+        if ( ! waitShm() )
+            return false;
     }
 
-    return Success;
+    if ( requests.wakeReader() )
+        ShmSession::signal ( shm_->getDescriptor ( ShmSession::ProxyEvent ) );
+
+    return true;
+}
+
+bool Client::readResponse ( char* buf, size_t size )
+{
+    if ( shm_ == nullptr )
+        return readFully ( fd_, buf, size, recvFds_ );
+
+    ShmRing& responses = shm_->getResponses();
+
+    // It could never arrive.
+    if ( size > responses.getSize() )
+        return false;
+
+    const uint32_t maxSpins = ShmSession::getSpinCount();
+    uint32_t spins = 0;
+
+    while ( ! responses.read ( buf, size ) )
+    {
+        if ( ! responses.isValid() )
+            return false;
+
+        if ( spins++ < maxSpins || ! responses.prepareReaderWait ( size ) )
+            continue;
+
+        if ( ! waitShm() )
+            return false;
+    }
+
+    if ( responses.wakeWriter() )
+        ShmSession::signal ( shm_->getDescriptor ( ShmSession::ProxyEvent ) );
+
+    return true;
+}
+
+bool Client::waitShm()
+{
+    assert ( shm_ != nullptr );
+
+    const int event = shm_->getDescriptor ( ShmSession::ClientEvent );
+
+    struct pollfd fds[2];
+    fds[0].fd = event;
+    fds[0].events = POLLIN;
+    fds[1].fd = fd_;
+    fds[1].events = POLLIN;
+
+    int ret = 0;
+
+    do
+    {
+        ret = ::poll ( fds, 2, -1 );
+    }
+    while ( ret < 0 && errno == EINTR );
+
+    if ( ret < 0 )
+        return false;
+
+    if ( fds[0].revents & POLLIN )
+        ShmSession::clear ( event );
+
+    // The socket only carries descriptors now; anything else means the proxy has gone.
+    if ( fds[1].revents & ( POLLERR | POLLHUP | POLLNVAL ) )
+        return false;
+
+    if ( fds[1].revents & POLLIN )
+    {
+        char byte = 0;
+        return readFully ( fd_, &byte, 1, recvFds_ );
+    }
+
+    return true;
+}
+
+bool Client::takeDescriptors ( size_t count, std::vector<int>* fds )
+{
+    // Over shared memory, the descriptors come through the socket on their own, each
+    // frame's along with a byte of their own, which may not have arrived yet.
+    while ( shm_ != nullptr && recvFds_.size() < count )
+    {
+        char byte = 0;
+
+        if ( ! readFully ( fd_, &byte, 1, recvFds_ ) )
+            return false;
+    }
+
+    if ( recvFds_.size() < count )
+        return false;
+
+    for ( size_t i = 0; i < count; ++i )
+    {
+        if ( fds != nullptr )
+        {
+            fds->push_back ( recvFds_[i] );
+        }
+        else
+        {
+            ::close ( recvFds_[i] );
+        }
+    }
+
+    recvFds_.erase ( recvFds_.begin(), recvFds_.begin() + count );
+
+    return true;
 }
@@ -0,0 +1,106 @@
+#ifdef RFS_HAVE_LZ4
+extern "C"
+{
+#include <lz4.h>
+}
+#endif
+
+#include "Compressor.hpp"
+
+#include <cassert>
+#include <cstring>
+
+using namespace rfs;
+
+bool Compressor::isSupported ( proto::RfsMsg::Compression algo )
+{
+    switch ( algo )
+    {
+    case proto::RfsMsg::Uncompressed:
+        return true;
+
+#ifdef RFS_HAVE_LZ4
+    case proto::RfsMsg::LZ4:
+        return true;
+#endif
+
+    default:
+        return false;
+    }
+}
+
+size_t Compressor::getMaxSize ( proto::RfsMsg::Compression algo, size_t size )
+{
+    assert ( isSupported ( algo ) );
+
+    switch ( algo )
+    {
+#ifdef RFS_HAVE_LZ4
+    case proto::RfsMsg::LZ4:
+        return LZ4_compressBound ( size );
+#endif
+
+    default:
+        return size;
+    }
+}
+
+bool Compressor::compress ( proto::RfsMsg::Compression algo, const char* src, size_t srcSize,
+                            char* dst, size_t& dstSize )
+{
+    assert ( isSupported ( algo ) );
+
+    switch ( algo )
+    {
+#ifdef RFS_HAVE_LZ4
+    case proto::RfsMsg::LZ4:
+        {
+        const int ret = LZ4_compress_default ( src, dst, srcSize, dstSize );
+
+        if ( ret <= 0 )
+            return false;
+
+        dstSize = ret;
+        return true;
+        }
+#endif
+
+    default:
+        if ( srcSize > dstSize )
+            return false;
+
+        memcpy ( dst, src, srcSize );
+        dstSize = srcSize;
+        return true;
+    }
+}
+
+bool Compressor::decompress ( proto::RfsMsg::Compression algo, const char* src, size_t srcSize,
+                              char* dst, size_t& dstSize )
+{
+    assert ( isSupported ( algo ) );
+
+    switch ( algo )
+    {
+#ifdef RFS_HAVE_LZ4
+    case proto::RfsMsg::LZ4:
+        {
+        const int ret = LZ4_decompress_safe ( src, dst, srcSize, dstSize );
+
+        if ( ret < 0 )
+            return false;
+
+        dstSize = ret;
+        return true;
+        }
+#endif
+
+    default:
+        if ( srcSize > dstSize )
+            return false;
+
+        memcpy ( dst, src, srcSize );
+        dstSize = srcSize;
+        return true;
+    }
+}
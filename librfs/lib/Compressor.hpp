@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+
+#include "Rfs.pb.h"
+
+namespace rfs
+{
+
+/// @brief The compression algorithms frames may be compressed with.
+/// Which of them are available depends on the libraries found at build time; with
+/// none of them, frames are always sent uncompressed.
+class Compressor
+{
+public:
+    /// @brief Whether an algorithm is available.
+    /// @param [in] algo The algorithm.
+    /// @return true if data can be compressed and decompressed with it.
+    static bool isSupported ( proto::RfsMsg::Compression algo );
+
+    /// @brief The largest size data may take once compressed.
+    /// @param [in] algo The algorithm; must be supported.
+    /// @param [in] size The size of the data.
+    /// @return The size of the buffer to compress into.
+    static size_t getMaxSize ( proto::RfsMsg::Compression algo, size_t size );
+
+    /// @brief Compress data.
+    /// @param [in] algo The algorithm; must be supported.
+    /// @param [in] src The data to compress.
+    /// @param [in] srcSize The size of the data.
+    /// @param [out] dst Where to compress it to.
+    /// @param [in,out] dstSize The size of dst; set to the size of the compressed data.
+    /// @return false if it didn't fit.
+    static bool compress ( proto::RfsMsg::Compression algo, const char* src, size_t srcSize,
+                           char* dst, size_t& dstSize );
+
+    /// @brief Decompress data.
+    /// @param [in] algo The algorithm; must be supported.
+    /// @param [in] src The compressed data.
+    /// @param [in] srcSize The size of the compressed data.
+    /// @param [out] dst Where to decompress it to.
+    /// @param [in,out] dstSize The size of dst; set to the size of the decompressed data.
+    /// @return false if the data is corrupt or didn't fit.
+    static bool decompress ( proto::RfsMsg::Compression algo, const char* src, size_t srcSize,
+                             char* dst, size_t& dstSize );
+};
+
+}
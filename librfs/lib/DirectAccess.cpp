@@ -0,0 +1,505 @@
+extern "C"
+{
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/fsuid.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cassert>
+
+#include "DirectAccess.hpp"
+
+using namespace rfs;
+
+// The flags are read by the client while the proxy sets them.
+static_assert ( ATOMIC_INT_LOCK_FREE == 2, "revocation pages need lock free atomics" );
+
+/// @brief Translate the errno of a failed open.
+static RetCode openErrorToRetCode ( int err )
+{
+    switch ( err )
+    {
+    case EACCES:
+    case EPERM:
+    case EROFS:
+        return InvalidPermissions;
+
+    case ENOENT:
+    case ENOTDIR:
+        return NoSuchPath;
+
+    case ENAMETOOLONG:
+    case ELOOP:
+        return InvalidPath;
+
+    case EISDIR:
+        return InvalidFileType;
+
+    case ENOMEM:
+    case EMFILE:
+    case ENFILE:
+        return MemoryError;
+
+    default:
+        return NotPossible;
+    }
+}
+
+RevocationPage::RevocationPage() : fd_ ( -1 ), flags_ ( nullptr )
+{
+}
+
+RevocationPage::~RevocationPage()
+{
+    if ( flags_ != nullptr )
+    {
+        munmap ( flags_, getSize() );
+        flags_ = nullptr;
+    }
+
+    if ( fd_ >= 0 )
+    {
+        ::close ( fd_ );
+        fd_ = -1;
+    }
+}
+
+size_t RevocationPage::getSize()
+{
+    return SlotCount * sizeof ( std::atomic<uint32_t> );
+}
+
+RetCode RevocationPage::create()
+{
+    assert ( flags_ == nullptr );
+
+    fd_ = memfd_create ( "rfs-revoked", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+
+    if ( fd_ < 0 )
+        return MemoryError;
+
+    // A fresh memfd reads as zeroes, so every slot starts out cleared.
+    if ( ftruncate ( fd_, getSize() ) != 0 )
+        return MemoryError;
+
+    // The client can't shrink it from under the proxy, or write to it at all.
+    if ( fcntl ( fd_, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL ) != 0 )
+        return MemoryError;
+
+    void* mem = mmap ( nullptr, getSize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0 );
+
+    if ( mem == MAP_FAILED )
+        return MemoryError;
+
+    flags_ = static_cast<std::atomic<uint32_t>*> ( mem );
+
+    return Success;
+}
+
+RetCode RevocationPage::attach ( int fd )
+{
+    assert ( flags_ == nullptr );
+
+    struct stat st;
+
+    if ( fstat ( fd, &st ) != 0 || static_cast<size_t> ( st.st_size ) < getSize() )
+    {
+        ::close ( fd );
+        return InvalidData;
+    }
+
+    void* mem = mmap ( nullptr, getSize(), PROT_READ, MAP_SHARED, fd, 0 );
+
+    // The mapping stays valid without the descriptor.
+    ::close ( fd );
+
+    if ( mem == MAP_FAILED )
+        return MemoryError;
+
+    flags_ = static_cast<std::atomic<uint32_t>*> ( mem );
+
+    return Success;
+}
+
+void RevocationPage::setRevoked ( uint32_t slot, bool revoked )
+{
+    assert ( flags_ != nullptr );
+    assert ( fd_ >= 0 );
+    assert ( slot < SlotCount );
+
+    flags_[slot].store ( revoked ? 1 : 0, std::memory_order_release );
+}
+
+DirectGrants::DirectGrants() : nextSlot_ ( 0 )
+{
+}
+
+DirectGrants::~DirectGrants()
+{
+    for ( std::unordered_map<uint32_t, Grant>::iterator it = grants_.begin();
+          it != grants_.end(); ++it )
+    {
+        ::close ( it->second.fd );
+    }
+}
+
+std::string DirectGrants::normalizePath ( const std::string& path )
+{
+    std::string normalized;
+    size_t pos = 0;
+
+    while ( pos < path.size() )
+    {
+        while ( pos < path.size() && path[pos] == '/' )
+            ++pos;
+
+        size_t next = path.find ( '/', pos );
+
+        if ( next == std::string::npos )
+            next = path.size();
+
+        const std::string name ( path, pos, next - pos );
+
+        if ( ! name.empty() && name != "." )
+            normalized.append ( "/" ).append ( name );
+
+        pos = next;
+    }
+
+    return normalized.empty() ? std::string ( "/" ) : normalized;
+}
+
+RetCode DirectGrants::openPosix ( const std::string& rootPath, const std::string& path,
+                                  OpenMode mode, const struct ucred& cred, int& fd )
+{
+    fd = -1;
+
+    if ( path.empty() || path[0] != '/' || path.find ( '\0' ) != std::string::npos )
+        return InvalidPath;
+
+    // Only the file system IDs are switched, which only affect this thread and only
+    // permission checks.
+    const uid_t uid = geteuid();
+    const gid_t gid = getegid();
+    const bool switchIds = ( cred.uid != uid || cred.gid != gid );
+
+    if ( switchIds )
+    {
+        setfsgid ( cred.gid );
+        setfsuid ( cred.uid );
+
+        // Each call returns the previous ID, which is the only way to tell it worked.
+        if ( static_cast<uid_t> ( setfsuid ( cred.uid ) ) != cred.uid
+              || static_cast<gid_t> ( setfsgid ( cred.gid ) ) != cred.gid )
+        {
+            setfsuid ( uid );
+            setfsgid ( gid );
+            return InvalidPermissions;
+        }
+    }
+
+    std::vector<gid_t> savedGroups;
+    RetCode rc = InvalidPermissions;
+
+    if ( switchGroups ( cred, savedGroups ) )
+    {
+        rc = openBeneath ( rootPath, path, mode, fd );
+
+        if ( ! savedGroups.empty() )
+            syscall ( SYS_setgroups, savedGroups.size(), &savedGroups[0] );
+    }
+
+    if ( switchIds )
+    {
+        setfsuid ( uid );
+        setfsgid ( gid );
+    }
+
+    return rc;
+}
+
+bool DirectGrants::switchGroups ( const struct ucred& cred, std::vector<gid_t>& saved )
+{
+    saved.clear();
+
+    std::vector<gid_t> groups ( 1, cred.gid );
+
+    long bufSize = sysconf ( _SC_GETPW_R_SIZE_MAX );
+    std::vector<char> buf ( ( bufSize > 0 ) ? bufSize : 16384 );
+
+    struct passwd pw;
+    struct passwd* result = nullptr;
+
+    // A user without an entry only has its own group.
+    if ( getpwuid_r ( cred.uid, &pw, &buf[0], buf.size(), &result ) == 0 && result != nullptr )
+    {
+        int count = 32;
+        groups.resize ( count );
+
+        // Fails if there are more groups than room for them, saying how many there are.
+        if ( getgrouplist ( pw.pw_name, cred.gid, &groups[0], &count ) < 0 )
+        {
+            groups.resize ( count );
+
+            if ( getgrouplist ( pw.pw_name, cred.gid, &groups[0], &count ) < 0 )
+                return false;
+        }
+
+        groups.resize ( count );
+    }
+
+    const int currentCount = getgroups ( 0, nullptr );
+
+    if ( currentCount < 0 )
+        return false;
+
+    std::vector<gid_t> current ( currentCount );
+
+    if ( currentCount > 0 && getgroups ( currentCount, &current[0] ) != currentCount )
+        return false;
+
+    std::sort ( groups.begin(), groups.end() );
+    std::sort ( current.begin(), current.end() );
+
+    // Nothing to switch, if this thread's groups don't give it anything the user's don't.
+    if ( std::includes ( groups.begin(), groups.end(), current.begin(), current.end() ) )
+        return true;
+
+    // The C library's setgroups() switches every thread of the process; the system call
+    // only switches this one, which is what the file system IDs do as well. It needs
+    // CAP_SETGID; without it, files can't be opened on behalf of the user.
+    if ( syscall ( SYS_setgroups, groups.size(), &groups[0] ) != 0 )
+        return false;
+
+    saved.swap ( current );
+
+    return true;
+}
+
+RetCode DirectGrants::openBeneath ( const std::string& rootPath, const std::string& path,
+                                    OpenMode mode, int& fd )
+{
+    fd = -1;
+
+    int dirFd = ::open ( rootPath.empty() ? "/" : rootPath.c_str(),
+                         O_PATH | O_DIRECTORY | O_CLOEXEC );
+
+    if ( dirFd < 0 )
+        return openErrorToRetCode ( errno );
+
+    // Each component is looked up in the directory opened before it, without following
+    // symbolic links, so none of them can lead outside the root.
+    size_t pos = 0;
+
+    while ( true )
+    {
+        while ( pos < path.size() && path[pos] == '/' )
+            ++pos;
+
+        const size_t next = path.find ( '/', pos );
+        const std::string name ( path, pos, ( next == std::string::npos ) ? std::string::npos
+                                                                           : next - pos );
+
+        size_t last = next;
+
+        while ( last < path.size() && path[last] == '/' )
+            ++last;
+
+        const bool isLast = ( last >= path.size() );
+
+        if ( name == ".." )
+        {
+            ::close ( dirFd );
+            return InvalidPath;
+        }
+
+        // The root itself, or a directory, can't be opened as a file.
+        if ( name.empty() || name == "." )
+        {
+            if ( isLast )
+            {
+                ::close ( dirFd );
+                return InvalidFileType;
+            }
+
+            pos = last;
+            continue;
+        }
+
+        if ( isLast )
+        {
+            // Not blocking on opening a FIFO, which is turned away below anyway.
+            fd = openat ( dirFd, name.c_str(),
+                          ( ( mode == ReadOnly ) ? O_RDONLY : O_RDWR )
+                          | ( ( mode == Create ) ? O_CREAT : 0 )
+                          | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | O_NOCTTY, 0666 );
+
+            const int err = errno;
+            ::close ( dirFd );
+
+            if ( fd < 0 )
+                return openErrorToRetCode ( err );
+
+            break;
+        }
+
+        const int childFd = openat ( dirFd, name.c_str(),
+                                     O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+
+        const int err = errno;
+        ::close ( dirFd );
+
+        if ( childFd < 0 )
+            return openErrorToRetCode ( err );
+
+        dirFd = childFd;
+        pos = last;
+    }
+
+    struct stat st;
+
+    if ( fstat ( fd, &st ) != 0 || ! S_ISREG ( st.st_mode )
+          || fcntl ( fd, F_SETFL, fcntl ( fd, F_GETFL ) & ~O_NONBLOCK ) != 0 )
+    {
+        ::close ( fd );
+        fd = -1;
+        return InvalidFileType;
+    }
+
+    return Success;
+}
+
+RetCode DirectGrants::grant ( uint32_t fid, const std::string& path, int fd,
+                              proto::RfsMsg& resp, std::vector<int>& fds )
+{
+    if ( grants_.find ( fid ) != grants_.end() )
+    {
+        ::close ( fd );
+        return DuplicateFileHandle;
+    }
+
+    // The channel closes the descriptor it passes on; this one is kept.
+    const int ownFd = fcntl ( fd, F_DUPFD_CLOEXEC, 0 );
+
+    if ( ownFd < 0 )
+    {
+        ::close ( fd );
+        return MemoryError;
+    }
+
+    const bool newPage = ! page_.isValid();
+
+    if ( newPage )
+    {
+        RetCode rc = page_.create();
+
+        if ( NotOk ( rc ) )
+        {
+            ::close ( ownFd );
+            ::close ( fd );
+            return rc;
+        }
+    }
+
+    uint32_t slot = 0;
+
+    if ( ! freeSlots_.empty() )
+    {
+        slot = freeSlots_.back();
+        freeSlots_.pop_back();
+    }
+    else if ( nextSlot_ < RevocationPage::SlotCount )
+    {
+        slot = nextSlot_++;
+    }
+    else
+    {
+        ::close ( ownFd );
+        ::close ( fd );
+        return MemoryError;
+    }
+
+    if ( newPage )
+    {
+        // The channel closes what it sends, and the page's own descriptor is kept for
+        // as long as there is a page.
+        const int pageFd = fcntl ( page_.getDescriptor(), F_DUPFD_CLOEXEC, 0 );
+
+        if ( pageFd < 0 )
+        {
+            freeSlots_.push_back ( slot );
+            ::close ( ownFd );
+            ::close ( fd );
+            return MemoryError;
+        }
+
+        fds.push_back ( pageFd );
+    }
+
+    fds.push_back ( fd );
+
+    // Revoked by the path it's actually at, however the client spelled it.
+    Grant& g = grants_[fid];
+    g.path = normalizePath ( path );
+    g.slot = slot;
+    g.fd = ownFd;
+
+    page_.setRevoked ( slot, false );
+
+    proto::RfsMsg::DirectAccessMsg* da = resp.mutable_directaccess();
+    da->set_slot ( slot );
+    da->set_page ( newPage );
+
+    resp.set_descriptors ( fds.size() );
+
+    return Success;
+}
+
+bool DirectGrants::release ( uint32_t fid )
+{
+    std::unordered_map<uint32_t, Grant>::iterator it = grants_.find ( fid );
+
+    if ( it == grants_.end() )
+        return false;
+
+    // The client has stopped using the slot by now, so it can go to another file.
+    page_.setRevoked ( it->second.slot, false );
+    freeSlots_.push_back ( it->second.slot );
+
+    ::close ( it->second.fd );
+    grants_.erase ( it );
+
+    return true;
+}
+
+int DirectGrants::getDescriptor ( uint32_t fid ) const
+{
+    std::unordered_map<uint32_t, Grant>::const_iterator it = grants_.find ( fid );
+
+    return ( it != grants_.end() ) ? it->second.fd : -1;
+}
+
+void DirectGrants::revoke ( const std::string& path )
+{
+    const std::string p ( normalizePath ( path ) );
+
+    for ( std::unordered_map<uint32_t, Grant>::iterator it = grants_.begin();
+          it != grants_.end(); ++it )
+    {
+        const std::string& g = it->second.path;
+
+        if ( g.compare ( 0, p.size(), p ) == 0
+              && ( g.size() == p.size() || g[p.size()] == '/' || p == "/" ) )
+        {
+            page_.setRevoked ( it->second.slot, true );
+        }
+    }
+}
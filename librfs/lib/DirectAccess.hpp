@@ -0,0 +1,186 @@
+#pragma once
+
+extern "C"
+{
+#include <sys/types.h>
+}
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Rfs.pb.h"
+
+#include "RetCode.hpp"
+
+struct ucred;
+
+namespace rfs
+{
+
+/// @brief The flags through which the proxy tells a client to stop using descriptors it
+/// was handed. The proxy creates it and passes its descriptor to the client the first time
+/// it grants direct access; every file granted gets a slot in it, whose flag the proxy sets
+/// once the file is renamed or removed. The client checks the flag before every use of the
+/// descriptor, which costs a load rather than a round trip through the proxy.
+///
+/// Revocation is advisory: the kernel has no way of taking a descriptor back. It only
+/// keeps well-behaved clients from carrying on with a file which is no longer where they
+/// opened it; it takes nothing away the client wasn't allowed to do when it was granted.
+class RevocationPage
+{
+public:
+    /// @brief The number of slots, which is the number of files a connection may have
+    /// open for direct access at the same time.
+    static const uint32_t SlotCount = 1024;
+
+    RevocationPage();
+    ~RevocationPage();
+
+    /// @brief Create a new page, all of its flags cleared (the proxy's end).
+    /// @return Standard error code.
+    RetCode create();
+
+    /// @brief Map a page created by the other end, read only (the client's end).
+    /// @param [in] fd The descriptor passed; taken over by this.
+    /// @return Standard error code.
+    RetCode attach ( int fd );
+
+    inline bool isValid() const
+    {
+        return ( flags_ != nullptr );
+    }
+
+    /// @brief The descriptor of the page; -1 once attached, as it's not needed after that.
+    inline int getDescriptor() const
+    {
+        return fd_;
+    }
+
+    /// @brief Whether the file in a slot has been revoked.
+    inline bool isRevoked ( uint32_t slot ) const
+    {
+        return ( slot >= SlotCount || flags_[slot].load ( std::memory_order_acquire ) != 0 );
+    }
+
+    /// @brief Set or clear the flag of a slot; only the proxy's end may.
+    void setRevoked ( uint32_t slot, bool revoked );
+
+private:
+    RevocationPage ( const RevocationPage& );
+    RevocationPage& operator= ( const RevocationPage& );
+
+    /// @brief The size of the page (bytes).
+    static size_t getSize();
+
+    int fd_; ///< The memfd of the page; -1 where not open.
+    std::atomic<uint32_t>* flags_; ///< The mapping of the page.
+};
+
+/// @brief The files of a single connection which the client has been handed descriptors
+/// of (the proxy's end). A descriptor of each is kept as well, so the client can carry on
+/// through the proxy once its access has been revoked.
+class DirectGrants
+{
+public:
+    /// @brief How a file is opened.
+    enum OpenMode
+    {
+        ReadOnly, ///< For reading.
+        ReadWrite, ///< For reading and writing.
+        Create ///< For reading and writing, creating it if it doesn't exist.
+    };
+
+    /// @brief Opens a file on behalf of a client.
+    /// @param [in] path The path of the file.
+    /// @param [in] mode How to open it.
+    /// @param [in] cred The credentials of the client's process, which must be allowed
+    /// to open the file.
+    /// @param [out] fd The descriptor of the file, which the caller takes over.
+    /// @return Standard error code.
+    typedef std::function<RetCode ( const std::string& path, OpenMode mode,
+                                    const struct ucred& cred, int& fd )> Opener;
+
+    DirectGrants();
+    ~DirectGrants();
+
+    /// @brief Open a file below a directory of the local file system, as the client.
+    /// This is what a PosixFileSystem rooted at the same directory would open; the
+    /// permissions of the file are checked against the client's user, group and
+    /// supplementary groups, rather than the proxy's. Symbolic links aren't followed, so
+    /// nothing outside the root can be reached. Files created belong to the client.
+    /// Intended to be bound to a root, and used as an Opener.
+    /// @param [in] rootPath The directory files are opened below.
+    /// @return Standard error code.
+    static RetCode openPosix ( const std::string& rootPath, const std::string& path,
+                               OpenMode mode, const struct ucred& cred, int& fd );
+
+    /// @brief Grant direct access to a file.
+    /// @param [in] fid The ID the client uses for the file.
+    /// @param [in] path The path of the file; it's revoked by its normalized form.
+    /// @param [in] fd The descriptor of the file; taken over by this, closed on failure.
+    /// @param [out] resp The response, which is told about the access granted.
+    /// @param [out] fds The descriptors to pass along with the response are appended to this.
+    /// @return Standard error code.
+    RetCode grant ( uint32_t fid, const std::string& path, int fd, proto::RfsMsg& resp,
+                    std::vector<int>& fds );
+
+    /// @brief Whether direct access has been granted to a file.
+    inline bool isGranted ( uint32_t fid ) const
+    {
+        return ( grants_.find ( fid ) != grants_.end() );
+    }
+
+    /// @brief The descriptor the proxy keeps of a file granted, for access through it.
+    /// @return -1 if the file wasn't granted.
+    int getDescriptor ( uint32_t fid ) const;
+
+    /// @brief Release the access granted to a file, once the client has closed it.
+    /// @return false if it wasn't granted any.
+    bool release ( uint32_t fid );
+
+    /// @brief Revoke the access granted to a path and everything below it.
+    /// Called once it has been renamed or removed.
+    void revoke ( const std::string& path );
+
+private:
+    DirectGrants ( const DirectGrants& );
+    DirectGrants& operator= ( const DirectGrants& );
+
+    /// @brief Normalize a path the way openBeneath() walks it: without empty or "."
+    /// components, or a trailing slash.
+    static std::string normalizePath ( const std::string& path );
+
+    /// @brief Give this thread the supplementary groups of a client's user, if its own
+    /// include any the user isn't in.
+    /// @param [in] cred The credentials of the client.
+    /// @param [out] saved The groups to restore afterwards; left empty if they weren't switched.
+    /// @return false if they had to be switched, but couldn't be.
+    static bool switchGroups ( const struct ucred& cred, std::vector<gid_t>& saved );
+
+    /// @brief Open a regular file below a directory, one component of its path at a time.
+    /// @param [out] fd The descriptor of the file.
+    /// @return Standard error code.
+    static RetCode openBeneath ( const std::string& rootPath, const std::string& path,
+                                 OpenMode mode, int& fd );
+
+    /// @brief A file granted.
+    struct Grant
+    {
+        std::string path; ///< The path it was opened at, normalized.
+        uint32_t slot; ///< Its slot in the revocation page.
+        int fd; ///< The proxy's own descriptor of it.
+    };
+
+    RevocationPage page_; ///< Created on the first grant.
+
+    std::unordered_map<uint32_t, Grant> grants_; ///< The files granted, by fid.
+
+    std::vector<uint32_t> freeSlots_; ///< Slots released, to be reused.
+    uint32_t nextSlot_; ///< The next slot never used.
+};
+
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+#include <boost/asio.hpp>
+
+namespace rfs
+{
+
+/// @brief Memory for the completion handler of a single outstanding asynchronous operation.
+/// Asio allocates every operation it starts, along with the handler bound to it. A
+/// channel only ever has one read and one write outstanding, so giving each of them
+/// its own block means these allocations are free, however many operations are started.
+/// Larger handlers than fit, or a second operation started while the block is in use,
+/// fall back to the heap.
+class HandlerMemory
+{
+public:
+    HandlerMemory() : inUse_ ( false )
+    {
+    }
+
+    void* allocate ( size_t size )
+    {
+        if ( ! inUse_ && size <= sizeof ( storage_ ) )
+        {
+            inUse_ = true;
+            return &storage_;
+        }
+
+        return ::operator new ( size );
+    }
+
+    void deallocate ( void* pointer )
+    {
+        if ( pointer == &storage_ )
+        {
+            inUse_ = false;
+            return;
+        }
+
+        ::operator delete ( pointer );
+    }
+
+private:
+    HandlerMemory ( const HandlerMemory& );
+    HandlerMemory& operator= ( const HandlerMemory& );
+
+    /// @brief Large enough for the operations Channel starts.
+    static const size_t Size = 512;
+
+    union
+    {
+        char bytes[Size];
+        long double alignDouble;
+        void* alignPointer;
+    } storage_;
+
+    bool inUse_; ///< Whether storage_ is taken.
+};
+
+/// @brief Wraps a completion handler so Asio allocates its operation from a HandlerMemory.
+template<typename Handler>
+class MemoryHandler
+{
+public:
+    MemoryHandler ( HandlerMemory& memory, Handler handler )
+        : memory_ ( memory ), handler_ ( handler )
+    {
+    }
+
+    void operator() ( const boost::system::error_code& err )
+    {
+        handler_ ( err );
+    }
+
+    void operator() ( const boost::system::error_code& err, size_t size )
+    {
+        handler_ ( err, size );
+    }
+
+    friend void* asio_handler_allocate ( size_t size, MemoryHandler<Handler>* handler )
+    {
+        return handler->memory_.allocate ( size );
+    }
+
+    friend void asio_handler_deallocate ( void* pointer, size_t size,
+                                          MemoryHandler<Handler>* handler )
+    {
+        ( void ) size;
+        handler->memory_.deallocate ( pointer );
+    }
+
+private:
+    HandlerMemory& memory_; ///< Where the operation is allocated.
+    Handler handler_; ///< The wrapped handler.
+};
+
+/// @brief Wrap a completion handler so its operation is allocated from some memory.
+template<typename Handler>
+inline MemoryHandler<Handler> makeMemoryHandler ( HandlerMemory& memory, Handler handler )
+{
+    return MemoryHandler<Handler> ( memory, handler );
+}
+
+}
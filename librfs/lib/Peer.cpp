@@ -1,29 +1,215 @@
+extern "C"
+{
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+
 #include "Peer.hpp"
 
 using namespace rfs;
 
 Logger Peer::log_ ( "rfsPeer" );
 
+/// @brief Translate the errno of a failed extended attribute call.
+static RetCode xattrErrorToRetCode ( int err )
+{
+    switch ( err )
+    {
+    case ENODATA:
+        return NoSuchAttribute;
+
+    case EEXIST:
+        return AlreadyExists;
+
+    case EACCES:
+    case EPERM:
+        return InvalidPermissions;
+
+    case ENOTSUP:
+        return NotSupported;
+
+    case ERANGE:
+    case E2BIG:
+    case ENOSPC:
+    case EDQUOT:
+        return OutOfRange;
+
+    default:
+        return NotPossible;
+    }
+}
+
+/// @brief Read the value of an extended attribute of an open file.
+static RetCode getXAttr ( int fd, const std::string& key, std::string& value )
+{
+    // The value may change between asking for its size and reading it.
+    while ( true )
+    {
+        ssize_t size = fgetxattr ( fd, key.c_str(), nullptr, 0 );
+
+        if ( size < 0 )
+            return xattrErrorToRetCode ( errno );
+
+        value.resize ( size );
+
+        if ( size == 0 )
+            return Success;
+
+        size = fgetxattr ( fd, key.c_str(), &value[0], value.size() );
+
+        if ( size >= 0 )
+        {
+            value.resize ( size );
+            return Success;
+        }
+
+        if ( errno != ERANGE )
+            return xattrErrorToRetCode ( errno );
+    }
+}
+
+/// @brief Read the names of the extended attributes of an open file.
+/// @param [out] keys The names are appended to this.
+static RetCode listXAttr ( int fd, std::vector<std::string>& keys )
+{
+    std::vector<char> names;
+
+    while ( true )
+    {
+        ssize_t size = flistxattr ( fd, nullptr, 0 );
+
+        if ( size < 0 )
+            return xattrErrorToRetCode ( errno );
+
+        if ( size == 0 )
+            return Success;
+
+        names.resize ( size );
+
+        size = flistxattr ( fd, &names[0], names.size() );
+
+        if ( size >= 0 )
+        {
+            names.resize ( size );
+            break;
+        }
+
+        if ( errno != ERANGE )
+            return xattrErrorToRetCode ( errno );
+    }
+
+    // The names are each null terminated, one after another.
+    for ( size_t i = 0; i < names.size(); )
+    {
+        const size_t len = strnlen ( &names[i], names.size() - i );
+
+        if ( len > 0 )
+            keys.push_back ( std::string ( &names[i], len ) );
+
+        i += len + 1;
+    }
+
+    return Success;
+}
+
+Peer::ReadStream::ReadStream ( int f, uint64_t off, uint64_t size )
+    : fd ( f ), offset ( off ), remaining ( size )
+{
+}
+
+Peer::ReadStream::~ReadStream()
+{
+    ::close ( fd );
+}
+
+Peer::Peer()
+{
+    // Nobody, until the channel says otherwise.
+    cred_.pid = 0;
+    cred_.uid = static_cast<uid_t> ( -1 );
+    cred_.gid = static_cast<gid_t> ( -1 );
+}
+
+Peer::~Peer()
+{
+    for ( std::unordered_map<uint32_t, int>::iterator it = files_.begin(); it != files_.end(); ++it )
+        ::close ( it->second );
+
+    if ( ! channel_ )
+        return;
+
+    // The channel may outlive this, for as long as its handlers are pending.
+    channel_->setOnReceiveHandler (
+        std::function<void ( const proto::RfsMsg&, const char*, size_t )>() );
+    channel_->setOnCloseHandler ( std::function<void()>() );
+}
+
 void Peer::setChannel ( ChannelPtr channel )
 {
+    assert ( ! channel_ );
+
     channel_ = channel;
 
+    socklen_t credLen = sizeof ( cred_ );
+
+    if ( getsockopt ( channel_->getSocket().native_handle(), SOL_SOCKET, SO_PEERCRED,
+                      &cred_, &credLen ) != 0 )
+    {
+        // Not a local socket; files can't be handed over it anyway.
+        cred_.pid = 0;
+        cred_.uid = static_cast<uid_t> ( -1 );
+        cred_.gid = static_cast<gid_t> ( -1 );
+    }
+
     channel_->setOnReceiveHandler ( std::bind ( &Peer::onRfsMsgReceived,
                                                 this,
-                                                std::placeholders::_1 ) );
+                                                std::placeholders::_1,
+                                                std::placeholders::_2,
+                                                std::placeholders::_3 ) );
 
     channel_->setOnCloseHandler ( std::bind ( &Peer::onChannelClose,
                                   this ) );
+
+    channel_->start();
+
+    // Over local sockets, copying is cheaper than compressing. The proxy only listens
+    // on a local socket so far, so this is for the peers on other hosts to come; the
+    // client library doesn't take compressed frames at all.
+    if ( cred_.pid == 0 )
+        channel_->negotiate();
 }
 
-void Peer::onRfsMsgReceived ( const proto::RfsMsg& msg )
+void Peer::setOpener ( const DirectGrants::Opener& opener )
+{
+    opener_ = opener;
+}
+
+void Peer::revoke ( const std::string& path )
+{
+    grants_.revoke ( path );
+}
+
+void Peer::onRfsMsgReceived ( const proto::RfsMsg& msg, const char* data, size_t dataSize )
 {
     log_ << Log::Crit << "Channel received a command " << msg.cmd() << std::endl;
 
-    proto::RfsMsg resp;
+    proto::RfsMsg& resp = resp_;
+    resp.Clear();
     resp.set_cmd ( proto::RfsMsg::Response );
+    resp.set_tag ( msg.tag() );
 
     RetCode rc = Success;
+    std::vector<int> fds;
+    std::vector<char> respData;
+    bool sent = false;
 
     switch ( msg.cmd() )
     {
@@ -45,6 +231,30 @@ void Peer::onRfsMsgReceived ( const proto::RfsMsg& msg )
 
         break;
 
+    case proto::RfsMsg::Open:
+        rc = onOpen ( msg, resp, fds );
+        break;
+
+    case proto::RfsMsg::Read:
+        rc = onRead ( msg, resp, respData, sent );
+        break;
+
+    case proto::RfsMsg::Write:
+        rc = onWrite ( msg, data, dataSize, resp );
+        break;
+
+    case proto::RfsMsg::Copy:
+        rc = onCopy ( msg, resp );
+        break;
+
+    case proto::RfsMsg::XAttr:
+        rc = onXAttr ( msg, resp );
+        break;
+
+    case proto::RfsMsg::Close:
+        rc = onClose ( msg, resp );
+        break;
+
     default:
         rc = NotImplemented;
         break;
@@ -52,17 +262,531 @@ void Peer::onRfsMsgReceived ( const proto::RfsMsg& msg )
 
     if ( rc != Success )
     {
-        resp.Clear();
-        resp.set_cmd ( proto::RfsMsg::Response );
-        proto::RfsMsg::ResponseMsg* respMsg = resp.mutable_response();
-        respMsg->set_ret ( rc );
+        sendError ( msg, rc );
+        return;
     }
 
+    if ( sent )
+        return;
+
+    bool ok = true;
+
+    if ( ! respData.empty() )
+    {
+        ok = channel_->send ( resp, respData );
+    }
+    else if ( fds.empty() )
+    {
+        ok = channel_->send ( resp );
+    }
+    else if ( ! channel_->send ( resp, fds ) )
+    {
+        // The client never got the file, and won't close it.
+        grants_.release ( msg.openreq().fid() );
+        ok = false;
+    }
+
+    // The client is waiting for an answer; unless the channel has gone, it gets one.
+    if ( ! ok )
+        sendError ( msg, NotPossible );
+}
+
+void Peer::sendError ( const proto::RfsMsg& msg, RetCode rc )
+{
+    proto::RfsMsg& resp = resp_;
+    resp.Clear();
+    resp.set_cmd ( proto::RfsMsg::Response );
+    resp.set_tag ( msg.tag() );
+    proto::RfsMsg::ResponseMsg* respMsg = resp.mutable_response();
+    respMsg->set_ret ( rc );
+
     channel_->send ( resp );
 }
 
+RetCode Peer::onOpen ( const proto::RfsMsg& msg, proto::RfsMsg& resp, std::vector<int>& fds )
+{
+    if ( ! msg.has_openreq() )
+    {
+        log_ << Log::Crit << "Received open msg without openReq" << std::endl;
+        return MalformedMessage;
+    }
+
+    const proto::RfsMsg::OpenReq& req = msg.openreq();
+
+    if ( ! opener_ || cred_.pid == 0 )
+        return NotSupported;
+
+    if ( files_.find ( req.fid() ) != files_.end() || grants_.isGranted ( req.fid() ) )
+        return DuplicateFileHandle;
+
+    int fd = -1;
+    RetCode rc = opener_ ( req.path(), req.write() ? DirectGrants::ReadWrite
+                                                   : DirectGrants::ReadOnly, cred_, fd );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    if ( ! req.direct() )
+    {
+        files_[req.fid()] = fd;
+
+        resp.mutable_response()->set_ret ( Success );
+        return Success;
+    }
+
+    rc = grants_.grant ( req.fid(), req.path(), fd, resp, fds );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    resp.mutable_response()->set_ret ( Success );
+
+    return Success;
+}
+
+int Peer::getDescriptor ( uint32_t fid ) const
+{
+    std::unordered_map<uint32_t, int>::const_iterator it = files_.find ( fid );
+
+    if ( it != files_.end() )
+        return it->second;
+
+    return grants_.getDescriptor ( fid );
+}
+
+RetCode Peer::onRead ( const proto::RfsMsg& msg, proto::RfsMsg& resp, std::vector<char>& data,
+                       bool& sent )
+{
+    if ( ! msg.has_readreq() )
+        return MalformedMessage;
+
+    const proto::RfsMsg::ReadReq& req = msg.readreq();
+
+    const int fd = getDescriptor ( req.fid() );
+
+    if ( fd < 0 )
+        return InvalidFileHandle;
+
+    if ( req.size() < 0 || req.offset() < 0 )
+        return InvalidData;
+
+    if ( req.size() > std::numeric_limits<off_t>::max() - req.offset() )
+        return OutOfRange;
+
+    proto::RfsMsg::File* file = resp.mutable_file();
+    file->set_fid ( req.fid() );
+    file->set_offset ( req.offset() );
+
+    // The size the response has at most, once the size read is filled in.
+    file->set_size ( req.size() );
+
+    if ( static_cast<uint64_t> ( req.size() ) + resp.ByteSize() > Channel::getMaxMessageSize() )
+    {
+        file->set_size ( 0 );
+
+        // The file may be closed before the stream is done with it.
+        const int streamFd = fcntl ( fd, F_DUPFD_CLOEXEC, 0 );
+
+        if ( streamFd < 0 )
+            return MemoryError;
+
+        std::shared_ptr<ReadStream> rs ( new ReadStream ( streamFd, req.offset(), req.size() ) );
+
+        if ( channel_->sendStream ( resp, std::bind ( &Peer::readChunk, rs,
+                                                      std::placeholders::_1,
+                                                      std::placeholders::_2,
+                                                      std::placeholders::_3 ) ) == 0 )
+        {
+            return NotPossible;
+        }
+
+        sent = true;
+        return Success;
+    }
+
+    data.resize ( req.size() );
+
+    ssize_t ret = 0;
+
+    do
+    {
+        ret = ::pread ( fd, data.empty() ? nullptr : &data[0], data.size(), req.offset() );
+    }
+    while ( ret < 0 && errno == EINTR );
+
+    if ( ret < 0 )
+        return ReadError;
+
+    data.resize ( ret );
+    file->set_size ( ret );
+
+    return Success;
+}
+
+RetCode Peer::readChunk ( std::shared_ptr<ReadStream> rs, size_t maxSize,
+                          std::vector<char>& data, bool& last )
+{
+    data.resize ( std::min<uint64_t> ( maxSize, rs->remaining ) );
+
+    ssize_t ret = 0;
+
+    do
+    {
+        ret = ::pread ( rs->fd, &data[0], data.size(), rs->offset );
+    }
+    while ( ret < 0 && errno == EINTR );
+
+    if ( ret < 0 )
+    {
+        data.clear();
+        return ReadError;
+    }
+
+    data.resize ( ret );
+    rs->offset += ret;
+    rs->remaining -= ret;
+
+    // Short of what was asked for at the end of the file.
+    last = ( ret == 0 || rs->remaining == 0 );
+
+    return Success;
+}
+
+RetCode Peer::onWrite ( const proto::RfsMsg& msg, const char* data, size_t dataSize,
+                        proto::RfsMsg& resp )
+{
+    if ( ! msg.has_file() )
+        return MalformedMessage;
+
+    const proto::RfsMsg::File& file = msg.file();
+
+    const int fd = getDescriptor ( file.fid() );
+
+    if ( fd < 0 )
+        return InvalidFileHandle;
+
+    if ( file.size() < 0 || static_cast<size_t> ( file.size() ) != dataSize || file.offset() < 0 )
+        return MalformedMessage;
+
+    if ( file.size() > std::numeric_limits<off_t>::max() - file.offset() )
+        return OutOfRange;
+
+    size_t done = 0;
+
+    while ( done < dataSize )
+    {
+        ssize_t ret = ::pwrite ( fd, data + done, dataSize - done, file.offset() + done );
+
+        if ( ret < 0 && errno == EINTR )
+            continue;
+
+        // Opened without write.
+        if ( ret < 0 && errno == EBADF )
+            return InvalidPermissions;
+
+        if ( ret <= 0 )
+            return WriteError;
+
+        done += ret;
+    }
+
+    proto::RfsMsg::ResponseMsg* respMsg = resp.mutable_response();
+    respMsg->set_ret ( Success );
+    respMsg->set_size ( done );
+
+    return Success;
+}
+
+RetCode Peer::onCopy ( const proto::RfsMsg& msg, proto::RfsMsg& resp )
+{
+    if ( ! msg.has_copyreq() )
+        return MalformedMessage;
+
+    const proto::RfsMsg::CopyReq& req = msg.copyreq();
+
+    size_t processed = 0;
+    RetCode rc = Success;
+
+    if ( req.has_fromfid() || req.has_tofid() )
+    {
+        if ( ! req.has_fromfid() || ! req.has_tofid() || ! req.has_size() )
+            return MalformedMessage;
+
+        const int from = getDescriptor ( req.fromfid() );
+        const int to = getDescriptor ( req.tofid() );
+
+        if ( from < 0 || to < 0 )
+            return InvalidFileHandle;
+
+        if ( req.fromoffset() < 0 || req.tooffset() < 0 || req.size() < 0 )
+            return InvalidData;
+
+        if ( req.size() > std::numeric_limits<off_t>::max() - req.fromoffset()
+             || req.size() > std::numeric_limits<off_t>::max() - req.tooffset() )
+        {
+            return OutOfRange;
+        }
+
+        rc = copyData ( from, req.fromoffset(), to, req.tooffset(), req.size(), processed );
+    }
+    else
+    {
+        if ( ! req.has_frompath() || ! req.has_topath() )
+            return MalformedMessage;
+
+        if ( ! opener_ || cred_.pid == 0 )
+            return NotSupported;
+
+        int from = -1;
+        int to = -1;
+
+        rc = opener_ ( req.frompath(), DirectGrants::ReadOnly, cred_, from );
+
+        if ( NotOk ( rc ) )
+            return rc;
+
+        // Not truncated until it's known not to be the source.
+        rc = opener_ ( req.topath(), DirectGrants::Create, cred_, to );
+
+        if ( NotOk ( rc ) )
+        {
+            ::close ( from );
+            return rc;
+        }
+
+        struct stat fromSt;
+        struct stat toSt;
+
+        if ( fstat ( from, &fromSt ) != 0 || fstat ( to, &toSt ) != 0 )
+            rc = ReadError;
+        else if ( fromSt.st_dev == toSt.st_dev && fromSt.st_ino == toSt.st_ino )
+            rc = NotPossible;
+        else if ( ftruncate ( to, 0 ) != 0 )
+            rc = WriteError;
+        else
+            rc = copyData ( from, 0, to, 0, fromSt.st_size, processed );
+
+        ::close ( from );
+        ::close ( to );
+    }
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    proto::RfsMsg::ResponseMsg* respMsg = resp.mutable_response();
+    respMsg->set_ret ( Success );
+    respMsg->set_size ( processed );
+
+    return Success;
+}
+
+RetCode Peer::copyData ( int from, off_t fromOffset, int to, off_t toOffset, size_t size,
+                         size_t& processed )
+{
+    processed = 0;
+
+#ifdef __linux__
+    loff_t in = fromOffset;
+    loff_t out = toOffset;
+
+    while ( processed < size )
+    {
+        ssize_t ret = copy_file_range ( from, &in, to, &out, size - processed, 0 );
+
+        if ( ret == 0 )
+            return Success;
+
+        if ( ret > 0 )
+        {
+            processed += ret;
+            continue;
+        }
+
+        if ( errno == EINTR )
+            continue;
+
+        // Older kernels, or a pair of files which can't be copied between directly;
+        // carry on through a buffer from wherever it got to.
+        if ( errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP )
+            break;
+
+        // Either end opened the wrong way round.
+        if ( errno == EBADF )
+            return InvalidPermissions;
+
+        return WriteError;
+    }
+#endif
+
+    std::vector<char> buf ( 128 * 1024 );
+
+    while ( processed < size )
+    {
+        const size_t toRead = std::min ( buf.size(), size - processed );
+        ssize_t ret = ::pread ( from, &buf[0], toRead, fromOffset + processed );
+
+        if ( ret < 0 && errno == EINTR )
+            continue;
+
+        if ( ret < 0 && errno == EBADF )
+            return InvalidPermissions;
+
+        if ( ret < 0 )
+            return ReadError;
+
+        if ( ret == 0 )
+            break;
+
+        size_t written = 0;
+
+        while ( written < static_cast<size_t> ( ret ) )
+        {
+            ssize_t w = ::pwrite ( to, &buf[written], ret - written,
+                                   toOffset + processed + written );
+
+            if ( w < 0 && errno == EINTR )
+                continue;
+
+            if ( w < 0 && errno == EBADF )
+                return InvalidPermissions;
+
+            if ( w <= 0 )
+                return WriteError;
+
+            written += w;
+        }
+
+        processed += ret;
+    }
+
+    return Success;
+}
+
+RetCode Peer::onXAttr ( const proto::RfsMsg& msg, proto::RfsMsg& resp )
+{
+    if ( ! msg.has_xattrreq() )
+        return MalformedMessage;
+
+    const proto::RfsMsg::XAttrReq& req = msg.xattrreq();
+
+    if ( req.op() != proto::RfsMsg::XAttrReq::List && ! req.has_key() )
+        return MalformedMessage;
+
+    if ( ! opener_ || cred_.pid == 0 )
+        return NotSupported;
+
+    const bool change = ( req.op() == proto::RfsMsg::XAttrReq::Set
+                          || req.op() == proto::RfsMsg::XAttrReq::Remove );
+
+    int fd = -1;
+    RetCode rc = opener_ ( req.path(), change ? DirectGrants::ReadWrite
+                                              : DirectGrants::ReadOnly, cred_, fd );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    Metadata* md = nullptr;
+
+    if ( ! change )
+    {
+        md = resp.mutable_metadata();
+        md->set_path ( req.path() );
+        md->set_type ( Metadata::File );
+    }
+
+    switch ( req.op() )
+    {
+    case proto::RfsMsg::XAttrReq::Get:
+        {
+        XAttr* xattr = md->add_xattrs();
+        xattr->set_key ( req.key() );
+        rc = getXAttr ( fd, req.key(), *xattr->mutable_value() );
+        }
+
+        break;
+
+    case proto::RfsMsg::XAttrReq::List:
+        {
+        std::vector<std::string> keys;
+        rc = listXAttr ( fd, keys );
+
+        for ( size_t i = 0; i < keys.size() && IsOk ( rc ); ++i )
+        {
+            XAttr* xattr = md->add_xattrs();
+            xattr->set_key ( keys.at ( i ) );
+            rc = getXAttr ( fd, keys.at ( i ), *xattr->mutable_value() );
+
+            // Removed since it was listed.
+            if ( rc == NoSuchAttribute )
+            {
+                md->mutable_xattrs()->RemoveLast();
+                rc = Success;
+            }
+        }
+        }
+
+        break;
+
+    case proto::RfsMsg::XAttrReq::Set:
+        {
+        const int flags = req.create() ? XATTR_CREATE : ( req.replace() ? XATTR_REPLACE : 0 );
+
+        if ( fsetxattr ( fd, req.key().c_str(), req.value().data(), req.value().size(),
+                         flags ) != 0 )
+        {
+            rc = xattrErrorToRetCode ( errno );
+        }
+        }
+
+        break;
+
+    case proto::RfsMsg::XAttrReq::Remove:
+        if ( fremovexattr ( fd, req.key().c_str() ) != 0 )
+            rc = xattrErrorToRetCode ( errno );
+
+        break;
+    }
+
+    ::close ( fd );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    if ( change )
+        resp.mutable_response()->set_ret ( Success );
+
+    return Success;
+}
+
+RetCode Peer::onClose ( const proto::RfsMsg& msg, proto::RfsMsg& resp )
+{
+    if ( ! msg.has_closereq() )
+        return MalformedMessage;
+
+    const uint32_t fid = msg.closereq().fid();
+
+    std::unordered_map<uint32_t, int>::iterator it = files_.find ( fid );
+
+    if ( it != files_.end() )
+    {
+        ::close ( it->second );
+        files_.erase ( it );
+    }
+    else if ( ! grants_.release ( fid ) )
+    {
+        return InvalidFileHandle;
+    }
+
+    resp.mutable_response()->set_ret ( Success );
+
+    return Success;
+}
+
 void Peer::onChannelClose()
 {
     log_ << Log::Crit << "Channel for peer closed" << std::endl;
+
+    if ( closeCb_ )
+        closeCb_ ( this );
 }
 
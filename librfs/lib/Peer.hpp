@@ -1,24 +1,136 @@
 #pragma once
 
+extern "C"
+{
+#include <sys/socket.h>
+}
+
+#include <memory>
+#include <unordered_map>
+
 #include "Channel.hpp"
+#include "DirectAccess.hpp"
 #include "Log.hpp"
 
 namespace rfs
 {
 
+/// @brief Serves the requests of a single client, over its channel.
+/// Everything a client is given, such as the files it has open for direct access, is
+/// kept here, and goes away with its connection.
 class Peer
 {
 public:
+    Peer();
+    ~Peer();
+
+    /// @brief Start serving a connection; only called once.
     void setChannel ( ChannelPtr channel );
 
+    /// @brief Set the handler called once the connection has closed.
+    /// The peer has nothing left to do then, and may be deleted, though not from
+    /// within the handler.
+    inline void setOnCloseHandler ( std::function<void ( Peer* peer )> cb )
+    {
+        closeCb_ = cb;
+    }
+
+    /// @brief Allow the client to open files, through an opener.
+    /// Files are then read and written through the proxy, or handed to the client for
+    /// direct access if it asks for that. Without an opener, opening files fails with
+    /// NotSupported.
+    /// @param [in] opener Opens files as the client; DirectGrants::openPosix bound to the
+    /// root of a PosixFileSystem opens the same files that would.
+    void setOpener ( const DirectGrants::Opener& opener );
+
+    /// @brief Revoke direct access to a path and everything below it.
+    /// To be called when it's renamed or removed; a FileSystem's change handler is the
+    /// place to call it from.
+    void revoke ( const std::string& path );
+
 private:
-    void onRfsMsgReceived ( const proto::RfsMsg& msg );
+    void onRfsMsgReceived ( const proto::RfsMsg& msg, const char* data, size_t dataSize );
     void onChannelClose();
 
+    /// @brief A read being streamed.
+    struct ReadStream
+    {
+        ReadStream ( int f, uint64_t off, uint64_t size );
+        ~ReadStream();
+
+        int fd; ///< A descriptor of its own, as the file may be closed meanwhile.
+        uint64_t offset; ///< Where the next chunk is read from.
+        uint64_t remaining; ///< The number of bytes left to read.
+    };
+
+    /// @brief Open a file, for access through the proxy or direct access.
+    /// @param [out] fds The descriptors to pass along with the response.
+    RetCode onOpen ( const proto::RfsMsg& msg, proto::RfsMsg& resp, std::vector<int>& fds );
+
+    /// @brief The descriptor to read and write a file through the proxy with, whether it
+    /// was opened for that or for direct access (which the client falls back from once
+    /// revoked).
+    /// @return -1 if the client has no such file open.
+    int getDescriptor ( uint32_t fid ) const;
+
+    /// @brief Read from a file through the proxy.
+    /// Reads which fit in a frame along with their response are answered in it; larger
+    /// ones are streamed, so neither end holds more than a stream's window of them at a
+    /// time, however large they are.
+    /// @param [out] data The data read, to send along with the response.
+    /// @param [out] sent Set if the response has been sent already, as the head of a stream.
+    RetCode onRead ( const proto::RfsMsg& msg, proto::RfsMsg& resp, std::vector<char>& data,
+                     bool& sent );
+
+    /// @brief Write to a file through the proxy.
+    RetCode onWrite ( const proto::RfsMsg& msg, const char* data, size_t dataSize,
+                      proto::RfsMsg& resp );
+
+    /// @brief Copy data between files without it passing through the client: a whole
+    /// file by path, or a range between files it has open.
+    RetCode onCopy ( const proto::RfsMsg& msg, proto::RfsMsg& resp );
+
+    /// @brief Copy a range of one file to another, with copy_file_range() where possible.
+    /// @param [out] processed The number of bytes copied; short of size at the end of the
+    /// source.
+    /// @return Standard error code.
+    static RetCode copyData ( int from, off_t fromOffset, int to, off_t toOffset, size_t size,
+                              size_t& processed );
+
+    /// @brief Get, set, remove or list the extended attributes of a file.
+    /// The file is opened through the opener as the client, for writing if the request
+    /// changes anything, which is the access the kernel checks attributes against.
+    /// Only regular files can be opened that way, so only theirs can be reached.
+    RetCode onXAttr ( const proto::RfsMsg& msg, proto::RfsMsg& resp );
+
+    /// @brief Close a file, however it was opened.
+    RetCode onClose ( const proto::RfsMsg& msg, proto::RfsMsg& resp );
+
+    /// @brief Produce the next chunk of a streamed read.
+    static RetCode readChunk ( std::shared_ptr<ReadStream> rs, size_t maxSize,
+                               std::vector<char>& data, bool& last );
+
+    /// @brief Answer a request with an error.
+    void sendError ( const proto::RfsMsg& msg, RetCode rc );
+
     static Logger log_;
 
     ChannelPtr channel_;
 
+    std::function<void ( Peer* peer )> closeCb_;
+
+    /// @brief Responses are built in this, reusing its submessages from one to the next.
+    proto::RfsMsg resp_;
+
+    /// @brief The credentials of the client's process, checked when opening files for it.
+    struct ucred cred_;
+
+    DirectGrants::Opener opener_; ///< Opens files for the client.
+    DirectGrants grants_; ///< The files open for direct access.
+
+    /// @brief The files open through the proxy: their descriptors, by fid.
+    std::unordered_map<uint32_t, int> files_;
+
 };
 
 }
@@ -23,6 +23,14 @@ Proxy::Proxy ( boost::asio::io_service& svc )
 
 }
 
+Proxy::~Proxy()
+{
+    for ( std::set<Peer*>::iterator it = peers_.begin(); it != peers_.end(); ++it )
+        delete *it;
+
+    peers_.clear();
+}
+
 void Proxy::start()
 {
     log_ << Log::Crit << "Starting proxy on " << getPath() << std::endl;
@@ -35,6 +43,41 @@ void Proxy::onConnect ( Listener* listener, ChannelPtr channel )
     assert ( listener == &localListener_ );
     log_ << Log::Crit << "Channel received, passing to peer" << std::endl;
 
-    peer_.setChannel ( channel );
+    // Each client gets a peer of its own, checked with its own credentials.
+    Peer* peer = new Peer();
+    peers_.insert ( peer );
+
+    peer->setOpener ( opener_ );
+    peer->setOnCloseHandler ( std::bind ( &Proxy::onPeerClose, this,
+                                          std::placeholders::_1 ) );
+    peer->setChannel ( channel );
+}
+
+void Proxy::onPeerClose ( Peer* peer )
+{
+    if ( peers_.erase ( peer ) == 0 )
+        return;
+
+    // Called from within the peer's channel, so it can only go once that has returned.
+    svc_.post ( std::bind ( &Proxy::deletePeer, peer ) );
+}
+
+void Proxy::deletePeer ( Peer* peer )
+{
+    delete peer;
+}
+
+void Proxy::setOpener ( const DirectGrants::Opener& opener )
+{
+    opener_ = opener;
+
+    for ( std::set<Peer*>::iterator it = peers_.begin(); it != peers_.end(); ++it )
+        ( *it )->setOpener ( opener_ );
+}
+
+void Proxy::revoke ( const std::string& path )
+{
+    for ( std::set<Peer*>::iterator it = peers_.begin(); it != peers_.end(); ++it )
+        ( *it )->revoke ( path );
 }
 
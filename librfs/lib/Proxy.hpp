@@ -1,5 +1,6 @@
 #pragma once
 
+#include <set>
 #include <string>
 
 #include <boost/asio.hpp>
@@ -15,9 +16,19 @@ class Proxy
 {
 public:
     Proxy ( boost::asio::io_service& svc );
+    ~Proxy();
 
     void start();
 
+    /// @brief Allow clients to open files, through an opener.
+    /// Applies to clients connected already as well.
+    /// @param [in] opener Opens files as a client; see Peer::setOpener().
+    void setOpener ( const DirectGrants::Opener& opener );
+
+    /// @brief Revoke every client's direct access to a path and everything below it.
+    /// To be called when it's renamed or removed.
+    void revoke ( const std::string& path );
+
     inline const std::string& getPath() const
     {
         return path_;
@@ -25,6 +36,8 @@ public:
 
 private:
     void onConnect ( Listener* listener, ChannelPtr channel );
+    void onPeerClose ( Peer* peer );
+    static void deletePeer ( Peer* peer );
 
     static Logger log_;
 
@@ -34,7 +47,10 @@ private:
 
     LocalListener localListener_;
 
-    Peer peer_;
+    /// @brief A peer for each client connected.
+    std::set<Peer*> peers_;
+
+    DirectGrants::Opener opener_; ///< Given to every peer.
 
 };
 
@@ -0,0 +1,313 @@
+extern "C"
+{
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "ShmRing.hpp"
+
+using namespace rfs;
+
+// The positions are updated by two processes; that is only safe if no lock is involved.
+static_assert ( ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+                "shared memory rings need lock free atomics" );
+
+size_t ShmSession::MinRingSize ( 1024 * 256 );
+size_t ShmSession::MaxRingSize ( 1024 * 1024 * 16 );
+uint32_t ShmSession::SpinCount ( 2000 );
+
+ShmRing::ShmRing() : ctl_ ( nullptr ), data_ ( nullptr ), size_ ( 0 )
+{
+}
+
+void ShmRing::attach ( char* base, size_t size, bool init )
+{
+    assert ( base != nullptr );
+    assert ( size > 0 && ( size & ( size - 1 ) ) == 0 );
+
+    ctl_ = reinterpret_cast<Control*> ( base );
+    data_ = base + sizeof ( Control );
+    size_ = size;
+
+    if ( ! init )
+        return;
+
+    ctl_->head.store ( 0, std::memory_order_relaxed );
+    ctl_->tail.store ( 0, std::memory_order_relaxed );
+    ctl_->readerWaiting.store ( 0, std::memory_order_relaxed );
+    ctl_->writerWaiting.store ( 0, std::memory_order_relaxed );
+}
+
+size_t ShmRing::getReadable() const
+{
+    assert ( ctl_ != nullptr );
+
+    // Only the reader moves the tail, and it's the one calling this.
+    const uint64_t tail = ctl_->tail.load ( std::memory_order_relaxed );
+
+    return ctl_->head.load ( std::memory_order_acquire ) - tail;
+}
+
+size_t ShmRing::getWritable() const
+{
+    assert ( ctl_ != nullptr );
+
+    const uint64_t used = ctl_->head.load ( std::memory_order_relaxed )
+                          - ctl_->tail.load ( std::memory_order_acquire );
+
+    return ( used > size_ ) ? 0 : size_ - used;
+}
+
+bool ShmRing::isValid() const
+{
+    assert ( ctl_ != nullptr );
+
+    return ( ctl_->head.load ( std::memory_order_acquire )
+             - ctl_->tail.load ( std::memory_order_acquire ) <= size_ );
+}
+
+bool ShmRing::write ( const struct iovec* iov, int count )
+{
+    size_t total = 0;
+
+    for ( int i = 0; i < count; ++i )
+        total += iov[i].iov_len;
+
+    if ( total > getWritable() )
+        return false;
+
+    const uint64_t head = ctl_->head.load ( std::memory_order_relaxed );
+    uint64_t pos = head;
+
+    for ( int i = 0; i < count; ++i )
+    {
+        copyIn ( pos, static_cast<const char*> ( iov[i].iov_base ), iov[i].iov_len );
+        pos += iov[i].iov_len;
+    }
+
+    // Publishes the bytes, all at once.
+    ctl_->head.store ( pos, std::memory_order_release );
+
+    return true;
+}
+
+bool ShmRing::peek ( char* buf, size_t size ) const
+{
+    const size_t readable = getReadable();
+
+    if ( readable > size_ || readable < size )
+        return false;
+
+    copyOut ( ctl_->tail.load ( std::memory_order_relaxed ), buf, size );
+
+    return true;
+}
+
+bool ShmRing::read ( char* buf, size_t size )
+{
+    if ( ! peek ( buf, size ) )
+        return false;
+
+    // Hands the room back to the writer, once the bytes have been copied out.
+    ctl_->tail.fetch_add ( size, std::memory_order_release );
+
+    return true;
+}
+
+bool ShmRing::prepareReaderWait ( size_t size )
+{
+    ctl_->readerWaiting.store ( 1, std::memory_order_relaxed );
+
+    // The flag must be visible before the head is checked, or the writer could miss it
+    // right after the last check and never wake the reader up.
+    std::atomic_thread_fence ( std::memory_order_seq_cst );
+
+    if ( getReadable() < size )
+        return true;
+
+    ctl_->readerWaiting.store ( 0, std::memory_order_relaxed );
+    return false;
+}
+
+bool ShmRing::prepareWriterWait ( size_t size )
+{
+    ctl_->writerWaiting.store ( 1, std::memory_order_relaxed );
+    std::atomic_thread_fence ( std::memory_order_seq_cst );
+
+    if ( getWritable() < size )
+        return true;
+
+    ctl_->writerWaiting.store ( 0, std::memory_order_relaxed );
+    return false;
+}
+
+bool ShmRing::wakeReader()
+{
+    // The counterpart of the fence in prepareReaderWait().
+    std::atomic_thread_fence ( std::memory_order_seq_cst );
+
+    return ( ctl_->readerWaiting.load ( std::memory_order_relaxed ) != 0
+             && ctl_->readerWaiting.exchange ( 0, std::memory_order_relaxed ) != 0 );
+}
+
+bool ShmRing::wakeWriter()
+{
+    std::atomic_thread_fence ( std::memory_order_seq_cst );
+
+    return ( ctl_->writerWaiting.load ( std::memory_order_relaxed ) != 0
+             && ctl_->writerWaiting.exchange ( 0, std::memory_order_relaxed ) != 0 );
+}
+
+void ShmRing::copyIn ( uint64_t pos, const char* buf, size_t size )
+{
+    const size_t offset = pos & ( size_ - 1 );
+    const size_t first = std::min ( size, size_ - offset );
+
+    memcpy ( data_ + offset, buf, first );
+    memcpy ( data_, buf + first, size - first );
+}
+
+void ShmRing::copyOut ( uint64_t pos, char* buf, size_t size ) const
+{
+    const size_t offset = pos & ( size_ - 1 );
+    const size_t first = std::min ( size, size_ - offset );
+
+    memcpy ( buf, data_ + offset, first );
+    memcpy ( buf + first, data_, size - first );
+}
+
+ShmSession::ShmSession() : mem_ ( nullptr ), memSize_ ( 0 )
+{
+    for ( size_t i = 0; i < DescriptorCount; ++i )
+        fds_[i] = -1;
+}
+
+ShmSession::~ShmSession()
+{
+    if ( mem_ != nullptr )
+    {
+        munmap ( mem_, memSize_ );
+        mem_ = nullptr;
+    }
+
+    for ( size_t i = 0; i < DescriptorCount; ++i )
+    {
+        if ( fds_[i] >= 0 )
+        {
+            ::close ( fds_[i] );
+            fds_[i] = -1;
+        }
+    }
+}
+
+RetCode ShmSession::create ( size_t ringSize )
+{
+    assert ( mem_ == nullptr );
+
+    size_t size = MinRingSize;
+
+    while ( size < ringSize && size < MaxRingSize )
+        size <<= 1;
+
+    fds_[MemFd] = memfd_create ( "rfs-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+    fds_[ProxyEvent] = eventfd ( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+    fds_[ClientEvent] = eventfd ( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+
+    if ( fds_[MemFd] < 0 || fds_[ProxyEvent] < 0 || fds_[ClientEvent] < 0 )
+        return SocketError;
+
+    if ( ftruncate ( fds_[MemFd], 2 * ( sizeof ( ShmRing::Control ) + size ) ) != 0 )
+        return MemoryError;
+
+    // The client can't change the size from under the proxy then, which would make the
+    // proxy fault on touching memory which is no longer there.
+    if ( fcntl ( fds_[MemFd], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL ) != 0 )
+        return MemoryError;
+
+    return map ( size, true );
+}
+
+RetCode ShmSession::attach ( std::vector<int>& fds, size_t ringSize )
+{
+    assert ( mem_ == nullptr );
+
+    for ( size_t i = 0; i < fds.size(); ++i )
+    {
+        if ( i < DescriptorCount )
+        {
+            fds_[i] = fds[i];
+        }
+        else
+        {
+            ::close ( fds[i] );
+        }
+    }
+
+    const bool complete = ( fds.size() >= DescriptorCount );
+    fds.clear();
+
+    if ( ! complete || ringSize == 0 || ( ringSize & ( ringSize - 1 ) ) != 0
+          || ringSize > MaxRingSize )
+    {
+        return InvalidData;
+    }
+
+    struct stat st;
+
+    if ( fstat ( fds_[MemFd], &st ) != 0
+          || static_cast<size_t> ( st.st_size ) < 2 * ( sizeof ( ShmRing::Control ) + ringSize ) )
+    {
+        return InvalidData;
+    }
+
+    return map ( ringSize, false );
+}
+
+RetCode ShmSession::map ( size_t ringSize, bool init )
+{
+    memSize_ = 2 * ( sizeof ( ShmRing::Control ) + ringSize );
+
+    void* mem = mmap ( nullptr, memSize_, PROT_READ | PROT_WRITE, MAP_SHARED, fds_[MemFd], 0 );
+
+    if ( mem == MAP_FAILED )
+        return MemoryError;
+
+    mem_ = static_cast<char*> ( mem );
+
+    requests_.attach ( mem_, ringSize, init );
+    responses_.attach ( mem_ + sizeof ( ShmRing::Control ) + ringSize, ringSize, init );
+
+    return Success;
+}
+
+uint32_t ShmSession::getSpinCount()
+{
+    static const bool single = ( sysconf ( _SC_NPROCESSORS_ONLN ) <= 1 );
+
+    return single ? 0 : SpinCount;
+}
+
+void ShmSession::signal ( int eventFd )
+{
+    const uint64_t one = 1;
+
+    // Only fails if the counter is about to overflow, in which case it's set anyway.
+    ssize_t ret = ::write ( eventFd, &one, sizeof ( one ) );
+    ( void ) ret;
+}
+
+void ShmSession::clear ( int eventFd )
+{
+    uint64_t count = 0;
+
+    ssize_t ret = ::read ( eventFd, &count, sizeof ( count ) );
+    ( void ) ret;
+}
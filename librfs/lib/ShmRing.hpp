@@ -0,0 +1,193 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "RetCode.hpp"
+
+struct iovec;
+
+namespace rfs
+{
+
+/// @brief A single-producer, single-consumer ring of bytes in memory shared by two processes.
+/// The writer appends buffers and publishes each of them at once; the reader waits until
+/// a whole frame has arrived before taking it out. Positions only ever grow; they are
+/// masked down to the size of the ring (a power of two) to find where the bytes are.
+///
+/// Neither end trusts the other: a position which claims more data than the ring holds
+/// makes it invalid, and the end noticing it should give up on the connection.
+///
+/// Either end may sleep while it waits for the other: it says so in the ring before it
+/// does, and the other end wakes it up (through an eventfd) only when it sees that.
+/// While both ends are busy, no system calls are made at all.
+class ShmRing
+{
+public:
+    /// @brief The part of a ring which is shared, ahead of its bytes.
+    /// Each end's position has a cache line to itself, so updating it doesn't disturb
+    /// the other end reading its own.
+    struct Control
+    {
+        std::atomic<uint64_t> head; ///< The end of the data written.
+        char headPadding[64 - sizeof ( uint64_t )];
+        std::atomic<uint64_t> tail; ///< The end of the data read.
+        char tailPadding[64 - sizeof ( uint64_t )];
+        std::atomic<uint32_t> readerWaiting; ///< Set while the reader sleeps.
+        std::atomic<uint32_t> writerWaiting; ///< Set while the writer sleeps.
+        char waitingPadding[64 - 2 * sizeof ( uint32_t )];
+    };
+
+    ShmRing();
+
+    /// @brief Use a ring.
+    /// @param [in] base The start of the ring's Control, followed by its bytes.
+    /// @param [in] size The number of bytes in the ring; a power of two.
+    /// @param [in] init Whether to reset the positions; only the end creating the ring should.
+    void attach ( char* base, size_t size, bool init );
+
+    inline size_t getSize() const
+    {
+        return size_;
+    }
+
+    /// @brief The number of bytes which may be read.
+    /// Larger than getSize() if the writer has corrupted the ring.
+    size_t getReadable() const;
+
+    /// @brief The number of bytes which may be written.
+    /// 0 if the reader has corrupted the ring.
+    size_t getWritable() const;
+
+    /// @brief Whether the positions are consistent.
+    bool isValid() const;
+
+    /// @brief Append buffers, as a whole.
+    /// @return false if there isn't room for all of them; nothing is written then.
+    bool write ( const struct iovec* iov, int count );
+
+    /// @brief Copy bytes out without consuming them.
+    /// @return false if fewer than size bytes are available.
+    bool peek ( char* buf, size_t size ) const;
+
+    /// @brief Copy bytes out, and consume them.
+    /// @return false if fewer than size bytes are available; nothing is consumed then.
+    bool read ( char* buf, size_t size );
+
+    /// @brief Announce the reader is about to sleep until there is something to read.
+    /// @param [in] size The amount it needs to read.
+    /// @return false if it has arrived meanwhile, in which case it shouldn't sleep.
+    bool prepareReaderWait ( size_t size );
+
+    /// @brief Announce the writer is about to sleep until there is room to write.
+    /// @param [in] size The amount of room it needs.
+    /// @return false if there is room already, in which case it shouldn't sleep.
+    bool prepareWriterWait ( size_t size );
+
+    /// @brief Called by the writer once it has written.
+    /// @return true if the reader is asleep, and needs waking up.
+    bool wakeReader();
+
+    /// @brief Called by the reader once it has read.
+    /// @return true if the writer is asleep, and needs waking up.
+    bool wakeWriter();
+
+private:
+    void copyIn ( uint64_t pos, const char* buf, size_t size );
+    void copyOut ( uint64_t pos, char* buf, size_t size ) const;
+
+    Control* ctl_; ///< The shared positions.
+    char* data_; ///< The bytes of the ring.
+    size_t size_; ///< The number of bytes in the ring.
+};
+
+/// @brief The rings and wakeup descriptors a client and the proxy share.
+/// The proxy creates it, and passes the descriptors to the client over their socket,
+/// which attaches to it. Requests go through one ring and responses through the other;
+/// each end has an eventfd the other writes to when it has to wake it up.
+class ShmSession
+{
+public:
+    /// @brief The descriptors passed, in order.
+    enum Descriptor
+    {
+        MemFd = 0,
+        ProxyEvent = 1,
+        ClientEvent = 2,
+        DescriptorCount = 3
+    };
+
+    /// @brief Configuration field, the smallest size of each ring (bytes).
+    static size_t MinRingSize;
+
+    /// @brief Configuration field, the largest size of each ring (bytes).
+    static size_t MaxRingSize;
+
+    /// @brief Configuration field, the number of times an end checks a ring before it sleeps.
+    /// Spinning for a little while catches responses which arrive within microseconds,
+    /// without the cost of sleeping and being woken up.
+    static uint32_t SpinCount;
+
+    ShmSession();
+    ~ShmSession();
+
+    /// @brief Create a new session (the proxy's end).
+    /// @param [in] ringSize The size each ring should be; rounded to a power of two within the limits.
+    /// @return Standard error code.
+    RetCode create ( size_t ringSize );
+
+    /// @brief Attach to a session created by the other end (the client's end).
+    /// @param [in,out] fds The descriptors passed, in Descriptor order; taken over by this, and left empty.
+    /// @param [in] ringSize The size of each ring.
+    /// @return Standard error code.
+    RetCode attach ( std::vector<int>& fds, size_t ringSize );
+
+    inline ShmRing& getRequests()
+    {
+        return requests_;
+    }
+
+    inline ShmRing& getResponses()
+    {
+        return responses_;
+    }
+
+    inline int getDescriptor ( Descriptor d ) const
+    {
+        return fds_[d];
+    }
+
+    inline size_t getRingSize() const
+    {
+        return requests_.getSize();
+    }
+
+    /// @brief The number of times to check a ring before sleeping.
+    /// SpinCount, unless there's a single CPU, where spinning only keeps the other end
+    /// from running.
+    static uint32_t getSpinCount();
+
+    /// @brief Wake up the end waiting on an eventfd.
+    static void signal ( int eventFd );
+
+    /// @brief Clear an eventfd after being woken up by it.
+    static void clear ( int eventFd );
+
+private:
+    ShmSession ( const ShmSession& );
+    ShmSession& operator= ( const ShmSession& );
+
+    /// @brief Map the memfd and set up the rings.
+    RetCode map ( size_t ringSize, bool init );
+
+    int fds_[DescriptorCount]; ///< The descriptors; -1 where not open.
+
+    char* mem_; ///< The mapping of the memfd.
+    size_t memSize_; ///< The size of the mapping.
+
+    ShmRing requests_; ///< Client to proxy.
+    ShmRing responses_; ///< Proxy to client.
+};
+
+}
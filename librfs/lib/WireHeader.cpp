@@ -5,30 +5,78 @@ extern "C"
 
 #include "WireHeader.hpp"
 
+#include <cstddef>
+#include <cstring>
+
+#include <boost/crc.hpp>
+
 using namespace rfs;
 
+/// @brief The checksum of a header as it is sent, which covers everything before the
+/// checksum field itself.
+static uint32_t getChecksum ( const WireHeader& wire )
+{
+    boost::crc_32_type crc;
+    crc.process_bytes ( &wire, offsetof ( WireHeader, checksum ) );
+
+    return crc.checksum();
+}
+
 void WireHeader::reset()
 {
+    version = Version;
+    flags = 0;
+    cmd = 0;
+    tag = 0;
     size = 0;
+    dataSize = 0;
+    checksum = 0;
 }
 
-bool WireHeader::serialize ( char* data, size_t dataSize ) const
+bool WireHeader::serialize ( char* buf, size_t bufSize ) const
 {
-    if ( dataSize < sizeof ( WireHeader ) )
+    if ( bufSize < sizeof ( WireHeader ) )
         return false;
 
-    memcpy ( data, this, sizeof ( WireHeader ) );
+    WireHeader tmp;
+    tmp.version = Version;
+    tmp.flags = flags;
+    tmp.cmd = htons ( cmd );
+    tmp.tag = htonl ( tag );
+    tmp.size = htonl ( size );
+    tmp.dataSize = htonl ( dataSize );
+    tmp.checksum = htonl ( getChecksum ( tmp ) );
+
+    memcpy ( buf, &tmp, sizeof ( WireHeader ) );
     return true;
 }
 
-bool WireHeader::deserialize ( const std::vector<char>& data )
+bool WireHeader::deserialize ( const std::vector<char>& buf )
+{
+    if ( buf.empty() )
+        return false;
+
+    return deserialize ( &buf[0], buf.size() );
+}
+
+bool WireHeader::deserialize ( const char* buf, size_t bufSize )
 {
-    if ( data.size() < sizeof ( WireHeader ) )
+    if ( bufSize < sizeof ( WireHeader ) )
         return false;
 
-    const WireHeader* tmp = reinterpret_cast<const WireHeader*> ( &data[0] );
-    size = ntohl ( tmp->size );
+    WireHeader tmp;
+    memcpy ( &tmp, buf, sizeof ( WireHeader ) );
+
+    if ( tmp.version != Version || ntohl ( tmp.checksum ) != getChecksum ( tmp ) )
+        return false;
+
+    version = tmp.version;
+    flags = tmp.flags;
+    cmd = ntohs ( tmp.cmd );
+    tag = ntohl ( tmp.tag );
+    size = ntohl ( tmp.size );
+    dataSize = ntohl ( tmp.dataSize );
+    checksum = ntohl ( tmp.checksum );
 
     return true;
 }
-
@@ -1,23 +1,66 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 
 namespace rfs
 {
 
+/// @brief The header every frame starts with.
+/// It describes the message it precedes well enough for the frame to be routed,
+/// prioritised or rejected without parsing the message. All fields are sent in
+/// network byte order, and the header is protected by its own checksum, so a receiver
+/// which has lost its place in the stream finds out before trusting any of the sizes.
 #pragma pack(push,1)
 struct WireHeader
 {
-    uint32_t size;
+    /// @brief The version of the header format written.
+    static const uint8_t Version = 1;
 
-    WireHeader() : size ( 0 ) {}
+    /// @brief Bits of flags.
+    enum Flags
+    {
+        /// @brief The message is compressed with the algorithm negotiated for the connection;
+        /// size is its compressed size.
+        Compressed = 1,
+
+        /// @brief The frame carries part of a stream (a StreamData message); tag is the ID
+        /// of the stream.
+        Continuation = 2,
+
+        /// @brief The frame controls the connection itself, and was sent ahead of any
+        /// other frames queued at the time.
+        Priority = 4
+    };
+
+    uint8_t version; ///< The version of the header format.
+    uint8_t flags; ///< Bits of Flags.
+    uint16_t cmd; ///< The command of the message.
+    int32_t tag; ///< The tag of the message.
+    uint32_t size; ///< The size of the message.
+
+    /// @brief The size of the bulk data following the message, such as the contents of a file.
+    /// It is sent as it is, rather than in a bytes field of the message, so neither end has
+    /// to copy it into or out of the message.
+    uint32_t dataSize;
+
+    /// @brief The CRC-32 of the rest of the header.
+    /// Set by serialize(), and checked by deserialize().
+    uint32_t checksum;
+
+    WireHeader() : version ( Version ), flags ( 0 ), cmd ( 0 ), tag ( 0 ), size ( 0 ),
+        dataSize ( 0 ), checksum ( 0 ) {}
 
     void reset();
 
-    bool serialize ( char* data, size_t dataSize ) const;
-    bool deserialize ( const std::vector<char>& data );
+    bool serialize ( char* buf, size_t bufSize ) const;
+
+    /// @brief Read a header.
+    /// @return false if there isn't a whole header, it has a version other than Version,
+    /// or its checksum doesn't match.
+    bool deserialize ( const std::vector<char>& buf );
+    bool deserialize ( const char* buf, size_t bufSize );
 };
 #pragma pack(pop)
 
 }
-
@@ -0,0 +1,145 @@
+extern "C"
+{
+#include <sys/socket.h>
+}
+
+#include <iostream>
+
+#include "Channel.hpp"
+#include "Compressor.hpp"
+
+using namespace rfs;
+
+/// @brief Send a message from one end to the other, and wait for it to arrive.
+/// @param [out] queued The amount of data queued by sending it (bytes).
+/// @return false if it didn't arrive intact.
+static bool roundTrip ( boost::asio::io_service& svc, ChannelPtr from, const proto::RfsMsg& msg,
+                        proto::RfsMsg& received, size_t& queued )
+{
+    received.Clear();
+
+    if ( ! from->send ( msg ) )
+        return false;
+
+    queued = from->getQueuedSize();
+
+    while ( ! received.has_cmd() )
+    {
+        if ( svc.run_one() == 0 )
+            return false;
+    }
+
+    return ( received.SerializeAsString() == msg.SerializeAsString() );
+}
+
+int main()
+{
+    if ( ! Compressor::isSupported ( proto::RfsMsg::LZ4 ) )
+    {
+        std::cout << "No compression algorithm available; nothing to test" << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    int sv[2];
+
+    if ( socketpair ( AF_LOCAL, SOCK_STREAM, 0, sv ) != 0 )
+    {
+        std::cerr << "Unable to create a socket pair" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    boost::asio::io_service svc;
+    boost::asio::generic::stream_protocol proto ( AF_LOCAL, 0 );
+
+    ChannelPtr a ( new Channel ( svc, proto ) );
+    ChannelPtr b ( new Channel ( svc, proto ) );
+
+    // Each channel comes with a socket of its own, which is replaced by the pair's.
+    a->getSocket().close();
+    b->getSocket().close();
+    a->getSocket().assign ( proto, sv[0] );
+    b->getSocket().assign ( proto, sv[1] );
+
+    proto::RfsMsg received;
+
+    b->setOnReceiveHandler ( [&received] ( const proto::RfsMsg& msg, const char*, size_t )
+    {
+        received = msg;
+    } );
+
+    a->start();
+    b->start();
+
+    // Compresses well, and fits in a frame.
+    proto::RfsMsg msg;
+    msg.set_cmd ( proto::RfsMsg::Stat );
+    msg.set_tag ( 1 );
+
+    std::string path;
+
+    for ( int i = 0; i < 4096; ++i )
+        path += "/some/dir/";
+
+    msg.mutable_statreq()->set_path ( path );
+
+    const size_t rawSize = msg.ByteSize();
+    size_t queued = 0;
+
+    if ( ! roundTrip ( svc, a, msg, received, queued ) || queued < rawSize )
+    {
+        std::cerr << "Uncompressed message didn't arrive intact, or was compressed before "
+            << "negotiating (" << queued << " of " << rawSize << " bytes queued)" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    a->negotiate();
+
+    // The answer to the offer arrives before anything sent after it.
+    proto::RfsMsg ping;
+    ping.set_cmd ( proto::RfsMsg::Stat );
+    ping.set_tag ( 2 );
+    ping.mutable_statreq()->set_path ( "/" );
+
+    if ( ! roundTrip ( svc, a, ping, received, queued ) )
+    {
+        std::cerr << "Message sent after negotiating didn't arrive" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    a->setOnReceiveHandler ( [&received] ( const proto::RfsMsg& m, const char*, size_t )
+    {
+        received = m;
+    } );
+
+    // Ping back, so the answer has surely been handled by the end that offered.
+    ping.set_tag ( 3 );
+
+    if ( ! roundTrip ( svc, b, ping, received, queued ) )
+    {
+        std::cerr << "Message sent back after negotiating didn't arrive" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    msg.set_tag ( 4 );
+
+    if ( ! roundTrip ( svc, a, msg, received, queued ) || queued >= rawSize )
+    {
+        std::cerr << "Compressed message didn't arrive intact, or wasn't compressed ("
+            << queued << " of " << rawSize << " bytes queued)" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Message of " << rawSize << " bytes sent in " << queued << " bytes" << std::endl;
+
+    // Either end may compress, once negotiated.
+    msg.set_tag ( 5 );
+
+    if ( ! roundTrip ( svc, b, msg, received, queued ) || queued >= rawSize )
+    {
+        std::cerr << "Compressed answer didn't arrive intact, or wasn't compressed ("
+            << queued << " of " << rawSize << " bytes queued)" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
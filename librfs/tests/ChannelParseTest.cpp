@@ -0,0 +1,191 @@
+extern "C"
+{
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include <iostream>
+
+#include "Channel.hpp"
+#include "WireHeader.hpp"
+
+using namespace rfs;
+
+/// @brief A message received, along with its bulk data.
+struct Received
+{
+    int32_t tag;
+    std::string path;
+    std::string data;
+};
+
+static std::vector<Received> received;
+static bool closed = false;
+
+static void onReceived ( const proto::RfsMsg& msg, const char* data, size_t dataSize )
+{
+    Received r;
+    r.tag = msg.tag();
+    r.path = msg.statreq().path();
+    r.data.assign ( data, dataSize );
+
+    received.push_back ( r );
+}
+
+static void onClosed()
+{
+    closed = true;
+}
+
+/// @brief Append a frame to a buffer, as the other end would send it.
+static void appendFrame ( std::vector<char>& buf, int32_t tag, const std::string& path,
+                          const std::string& data )
+{
+    proto::RfsMsg msg;
+    msg.set_cmd ( proto::RfsMsg::Stat );
+    msg.set_tag ( tag );
+    msg.mutable_statreq()->set_path ( path );
+
+    WireHeader hdr;
+    hdr.cmd = msg.cmd();
+    hdr.tag = msg.tag();
+    hdr.size = msg.ByteSize();
+    hdr.dataSize = data.size();
+
+    const size_t start = buf.size();
+    buf.resize ( start + sizeof ( WireHeader ) + hdr.size );
+
+    hdr.serialize ( &buf[start], sizeof ( WireHeader ) );
+    msg.SerializeToArray ( &buf[start + sizeof ( WireHeader )], hdr.size );
+
+    buf.insert ( buf.end(), data.begin(), data.end() );
+}
+
+/// @brief Write bytes to the socket, and let the channel handle them.
+static bool feed ( boost::asio::io_service& svc, int fd, const char* buf, size_t size )
+{
+    if ( ::write ( fd, buf, size ) != static_cast<ssize_t> ( size ) )
+        return false;
+
+    // A few rounds are enough for a local socket.
+    for ( int i = 0; i < 10; ++i )
+    {
+        svc.poll();
+        svc.reset();
+        usleep ( 1000 );
+    }
+
+    return true;
+}
+
+static bool check ( size_t index, int32_t tag, const std::string& path, const std::string& data )
+{
+    if ( received.size() <= index )
+    {
+        std::cerr << "Message " << index << " (tag " << tag << ") not received" << std::endl;
+        return false;
+    }
+
+    const Received& r = received[index];
+
+    if ( r.tag != tag || r.path != path || r.data != data )
+    {
+        std::cerr << "Message " << index << " received as tag " << r.tag << ", path of "
+            << r.path.size() << " bytes, data of " << r.data.size() << " bytes" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main()
+{
+    int sv[2];
+
+    if ( socketpair ( AF_LOCAL, SOCK_STREAM, 0, sv ) != 0 )
+    {
+        std::cerr << "Unable to create a socket pair" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    boost::asio::io_service svc;
+    boost::asio::generic::stream_protocol proto ( AF_LOCAL, 0 );
+
+    ChannelPtr channel ( new Channel ( svc, proto ) );
+
+    // The channel comes with a socket of its own, which is replaced by the pair's.
+    channel->getSocket().close();
+    channel->getSocket().assign ( proto, sv[1] );
+
+    channel->setOnReceiveHandler ( &onReceived );
+    channel->setOnCloseHandler ( &onClosed );
+    channel->start();
+
+    // Several frames arriving in a single read, with and without bulk data.
+    std::vector<char> buf;
+    appendFrame ( buf, 1, "/a", "" );
+    appendFrame ( buf, 2, "/b", "some data" );
+    appendFrame ( buf, 3, std::string ( 1000, 'c' ), std::string ( 5000, 'd' ) );
+    appendFrame ( buf, 4, "/e", "" );
+
+    if ( ! feed ( svc, sv[0], &buf[0], buf.size() ) || received.size() != 4
+          || ! check ( 0, 1, "/a", "" ) || ! check ( 1, 2, "/b", "some data" )
+          || ! check ( 2, 3, std::string ( 1000, 'c' ), std::string ( 5000, 'd' ) )
+          || ! check ( 3, 4, "/e", "" ) )
+    {
+        std::cerr << "Frames read together not all received intact" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Frames trickling in, a few bytes at a time, split at every point: within the header,
+    // the message and the data, and across frames.
+    buf.clear();
+    appendFrame ( buf, 5, "/f", "more data" );
+
+    const size_t firstSize = buf.size();
+
+    appendFrame ( buf, 6, "/g", "" );
+
+    for ( size_t pos = 0; pos < buf.size(); pos += 3 )
+    {
+        const size_t size = std::min<size_t> ( 3, buf.size() - pos );
+
+        if ( ! feed ( svc, sv[0], &buf[pos], size ) )
+        {
+            std::cerr << "Unable to write to the socket" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // Nothing is handed on before the whole frame has arrived.
+        const size_t expected = 4 + ( ( pos + size >= firstSize ) ? 1 : 0 )
+                                + ( ( pos + size >= buf.size() ) ? 1 : 0 );
+
+        if ( received.size() != expected )
+        {
+            std::cerr << "Received " << received.size() << " messages with " << pos + size
+                << " bytes of the partial frames, rather than " << expected << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ( ! check ( 4, 5, "/f", "more data" ) || ! check ( 5, 6, "/g", "" ) )
+    {
+        std::cerr << "Partial frames not received intact" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // A frame whose header doesn't check out means the stream can't be trusted any more.
+    buf.clear();
+    appendFrame ( buf, 7, "/h", "" );
+    buf[4] ^= 1;
+
+    if ( ! feed ( svc, sv[0], &buf[0], buf.size() ) || received.size() != 6 || ! closed )
+    {
+        std::cerr << "Frame with a corrupt header not rejected" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    ::close ( sv[0] );
+
+    return EXIT_SUCCESS;
+}
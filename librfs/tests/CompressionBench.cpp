@@ -0,0 +1,229 @@
+extern "C"
+{
+#include <dirent.h>
+#include <sys/stat.h>
+}
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Compressor.hpp"
+
+using namespace rfs;
+
+/// @brief The size directory listings are split at; that of a chunk of a stream.
+static const size_t MaxListingSize = 1024 * 64;
+
+/// @brief Smaller listings are sent uncompressed.
+static const size_t MinCompressSize = 512;
+
+/// @brief Fill in the metadata of an entry the way a Directory listing carries it.
+static void statToMetadata ( const std::string& path, const struct stat& st, Metadata& md )
+{
+    md.set_path ( path );
+
+    if ( S_ISDIR ( st.st_mode ) )
+        md.set_type ( Metadata::Directory );
+    else if ( S_ISLNK ( st.st_mode ) )
+        md.set_type ( Metadata::Symlink );
+    else
+        md.set_type ( Metadata::File );
+
+    Metadata::Modes* modes = md.mutable_modes();
+    Metadata::Modes::Values* user = modes->mutable_user();
+    user->set_read ( st.st_mode & S_IRUSR );
+    user->set_write ( st.st_mode & S_IWUSR );
+    user->set_execute ( st.st_mode & S_IXUSR );
+    Metadata::Modes::Values* group = modes->mutable_group();
+    group->set_read ( st.st_mode & S_IRGRP );
+    group->set_write ( st.st_mode & S_IWGRP );
+    group->set_execute ( st.st_mode & S_IXGRP );
+    Metadata::Modes::Values* other = modes->mutable_other();
+    other->set_read ( st.st_mode & S_IROTH );
+    other->set_write ( st.st_mode & S_IWOTH );
+    other->set_execute ( st.st_mode & S_IXOTH );
+
+    md.set_size ( st.st_size );
+    md.set_atime ( st.st_atime );
+    md.set_mtime ( st.st_mtime );
+    md.set_ctime ( st.st_ctime );
+}
+
+/// @brief Serialize the listing of every directory below a path, as a peer would send them.
+static void listDirectory ( const std::string& path, std::vector<std::string>& listings )
+{
+    DIR* dir = opendir ( path.c_str() );
+
+    if ( dir == nullptr )
+        return;
+
+    proto::RfsMsg msg;
+    msg.set_cmd ( proto::RfsMsg::Response );
+    msg.set_tag ( listings.size() );
+
+    proto::RfsMsg::Directory* listing = msg.mutable_directory();
+    size_t size = 0;
+
+    std::vector<std::string> children;
+    struct dirent* entry = nullptr;
+
+    while ( ( entry = readdir ( dir ) ) != nullptr )
+    {
+        if ( strcmp ( entry->d_name, "." ) == 0 || strcmp ( entry->d_name, ".." ) == 0 )
+            continue;
+
+        const std::string child ( path + "/" + entry->d_name );
+        struct stat st;
+
+        if ( lstat ( child.c_str(), &st ) != 0 )
+            continue;
+
+        Metadata* md = listing->add_entries();
+        statToMetadata ( child, st, *md );
+        size += md->ByteSize();
+
+        if ( S_ISDIR ( st.st_mode ) )
+            children.push_back ( child );
+
+        if ( size >= MaxListingSize )
+        {
+            listings.push_back ( msg.SerializeAsString() );
+            listing->clear_entries();
+            size = 0;
+        }
+    }
+
+    closedir ( dir );
+
+    if ( listing->entries_size() > 0 )
+        listings.push_back ( msg.SerializeAsString() );
+
+    for ( size_t i = 0; i < children.size(); ++i )
+        listDirectory ( children.at ( i ), listings );
+}
+
+/// @brief Throughput in MiB/s.
+static double getRate ( size_t bytes, const std::chrono::steady_clock::duration& elapsed )
+{
+    const double secs = std::chrono::duration<double> ( elapsed ).count();
+    return ( secs > 0 ) ? bytes / secs / ( 1024 * 1024 ) : 0;
+}
+
+int main ( int argc, char* argv[] )
+{
+    if ( argc < 2 || argc > 3 )
+    {
+        std::cerr << "Usage: " << argv[0] << " <directory> [iterations]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const int iterations = ( argc == 3 ) ? atoi ( argv[2] ) : 10;
+
+    std::vector<std::string> listings;
+    listDirectory ( argv[1], listings );
+
+    size_t rawSize = 0;
+    size_t maxSize = 0;
+
+    for ( size_t i = 0; i < listings.size(); ++i )
+    {
+        rawSize += listings.at ( i ).size();
+        maxSize = std::max ( maxSize, listings.at ( i ).size() );
+    }
+
+    std::cout << "Listed " << argv[1] << ": " << listings.size() << " messages, "
+        << rawSize << " bytes" << std::endl;
+
+    if ( listings.empty() || iterations <= 0 )
+        return EXIT_FAILURE;
+
+    static const proto::RfsMsg::Compression Algos[] = { proto::RfsMsg::LZ4 };
+
+    for ( size_t a = 0; a < sizeof ( Algos ) / sizeof ( Algos[0] ); ++a )
+    {
+        const proto::RfsMsg::Compression algo = Algos[a];
+        const std::string& name = proto::RfsMsg::Compression_Name ( algo );
+
+        if ( ! Compressor::isSupported ( algo ) )
+        {
+            std::cout << name << ": not available in this build" << std::endl;
+            continue;
+        }
+
+        std::vector<std::string> compressed ( listings.size() );
+        std::vector<char> buf ( Compressor::getMaxSize ( algo, maxSize ) );
+        size_t sentSize = 0;
+
+        const std::chrono::steady_clock::time_point compressStart
+            = std::chrono::steady_clock::now();
+
+        for ( int it = 0; it < iterations; ++it )
+        {
+            sentSize = 0;
+
+            for ( size_t i = 0; i < listings.size(); ++i )
+            {
+                const std::string& raw = listings.at ( i );
+                size_t size = buf.size();
+
+                // As Channel does: small and incompressible messages go out as they are.
+                if ( raw.size() < MinCompressSize
+                      || ! Compressor::compress ( algo, raw.data(), raw.size(), &buf[0], size )
+                      || size >= raw.size() )
+                {
+                    compressed.at ( i ).clear();
+                    sentSize += raw.size();
+                    continue;
+                }
+
+                compressed.at ( i ).assign ( &buf[0], size );
+                sentSize += size;
+            }
+        }
+
+        const std::chrono::steady_clock::duration compressTime
+            = std::chrono::steady_clock::now() - compressStart;
+
+        const std::chrono::steady_clock::time_point decompressStart
+            = std::chrono::steady_clock::now();
+
+        buf.resize ( maxSize );
+
+        for ( int it = 0; it < iterations; ++it )
+        {
+            for ( size_t i = 0; i < listings.size(); ++i )
+            {
+                const std::string& data = compressed.at ( i );
+
+                if ( data.empty() )
+                    continue;
+
+                size_t size = buf.size();
+
+                if ( ! Compressor::decompress ( algo, data.data(), data.size(), &buf[0], size )
+                      || size != listings.at ( i ).size()
+                      || memcmp ( &buf[0], listings.at ( i ).data(), size ) != 0 )
+                {
+                    std::cerr << name << ": message " << i << " didn't survive a round trip"
+                        << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+
+        const std::chrono::steady_clock::duration decompressTime
+            = std::chrono::steady_clock::now() - decompressStart;
+
+        std::cout << name << ": " << sentSize << " bytes sent, ratio "
+            << static_cast<double> ( rawSize ) / sentSize
+            << ", compress " << getRate ( rawSize * iterations, compressTime ) << " MiB/s"
+            << ", decompress " << getRate ( rawSize * iterations, decompressTime ) << " MiB/s"
+            << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+extern "C"
+{
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <thread>
+
+#include "Client.hpp"
+#include "Peer.hpp"
+
+using namespace rfs;
+
+/// @brief Run a function on the proxy's thread, and wait for it to be done.
+static void runOnProxy ( boost::asio::io_service& svc, const std::function<void()>& func )
+{
+    std::promise<void> done;
+
+    svc.post ( [&func, &done]()
+    {
+        func();
+        done.set_value();
+    } );
+
+    done.get_future().wait();
+}
+
+int main()
+{
+    char root[] = "/tmp/rfsDirectAccessTest.XXXXXX";
+
+    if ( mkdtemp ( root ) == nullptr )
+    {
+        std::cerr << "Unable to create a directory to test in" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::string filePath = std::string ( root ) + "/file";
+    const std::string contents ( "the contents of the file" );
+
+    {
+        std::ofstream out ( filePath.c_str() );
+        out << contents;
+    }
+
+    int sv[2];
+
+    if ( socketpair ( AF_LOCAL, SOCK_STREAM, 0, sv ) != 0 )
+    {
+        std::cerr << "Unable to create a socket pair" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    boost::asio::io_service svc;
+    boost::asio::io_service::work work ( svc );
+    boost::asio::generic::stream_protocol proto ( AF_LOCAL, 0 );
+
+    ChannelPtr channel ( new Channel ( svc, proto ) );
+
+    // The channel comes with a socket of its own, which is replaced by the pair's.
+    channel->getSocket().close();
+    channel->getSocket().assign ( proto, sv[1] );
+
+    Peer* peer = new Peer();
+    peer->setOpener ( std::bind ( &DirectGrants::openPosix, std::string ( root ),
+                                  std::placeholders::_1, std::placeholders::_2,
+                                  std::placeholders::_3, std::placeholders::_4 ) );
+    peer->setChannel ( channel );
+
+    std::thread proxy ( [&svc]()
+    {
+        svc.run();
+    } );
+
+    int ret = EXIT_FAILURE;
+
+    {
+        Client client ( sv[0] );
+
+        uint32_t direct = 0;
+        uint32_t proxied = 0;
+        uint32_t unnormalized = 0;
+        std::vector<char> data ( contents.size() + 10 );
+        std::vector<char> proxiedData ( contents.size() + 10 );
+
+        if ( NotOk ( client.open ( "/file", direct, Client::Direct ) ) || ! client.isDirect ( direct ) )
+        {
+            std::cerr << "File not opened for direct access" << std::endl;
+        }
+        else if ( NotOk ( client.read ( direct, data ) )
+                  || std::string ( data.begin(), data.end() ) != contents )
+        {
+            std::cerr << "File read directly doesn't match" << std::endl;
+        }
+        else if ( NotOk ( client.open ( "/file", proxied ) ) || client.isDirect ( proxied ) )
+        {
+            std::cerr << "File not opened through the proxy" << std::endl;
+        }
+        else if ( NotOk ( client.read ( proxied, proxiedData ) )
+                  || std::string ( proxiedData.begin(), proxiedData.end() ) != contents )
+        {
+            std::cerr << "File read through the proxy doesn't match" << std::endl;
+        }
+        else if ( NotOk ( client.open ( "//./file", unnormalized, Client::Direct ) )
+                  || ! client.isDirect ( unnormalized ) )
+        {
+            std::cerr << "File not opened for direct access through an unnormalized path"
+                << std::endl;
+        }
+        else
+        {
+            runOnProxy ( svc, std::bind ( &Peer::revoke, peer, std::string ( "/file" ) ) );
+
+            uint32_t outside = 0;
+            std::vector<char> revokedData ( contents.size() + 10 );
+
+            if ( client.isDirect ( direct ) || client.isDirect ( unnormalized ) )
+            {
+                std::cerr << "File still accessed directly once revoked" << std::endl;
+            }
+            else if ( NotOk ( client.read ( direct, revokedData ) )
+                      || std::string ( revokedData.begin(), revokedData.end() ) != contents )
+            {
+                std::cerr << "File read through the proxy once revoked doesn't match" << std::endl;
+            }
+            else if ( IsOk ( client.open ( "/../file", outside, Client::Direct ) ) )
+            {
+                std::cerr << "File outside the root opened" << std::endl;
+            }
+            else if ( NotOk ( client.close ( direct ) ) || NotOk ( client.close ( proxied ) )
+                      || NotOk ( client.close ( unnormalized ) ) )
+            {
+                std::cerr << "Unable to close the files" << std::endl;
+            }
+            else
+            {
+                ret = EXIT_SUCCESS;
+            }
+        }
+    }
+
+    // The client has gone, which closes the channel.
+    runOnProxy ( svc, [peer]()
+    {
+        delete peer;
+    } );
+
+    svc.stop();
+    proxy.join();
+
+    unlink ( filePath.c_str() );
+    rmdir ( root );
+
+    return ret;
+}
@@ -0,0 +1,259 @@
+extern "C"
+{
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <thread>
+
+#include "Client.hpp"
+#include "Peer.hpp"
+
+using namespace rfs;
+
+/// @brief Run a function on the proxy's thread, and wait for it to be done.
+static void runOnProxy ( boost::asio::io_service& svc, const std::function<void()>& func )
+{
+    std::promise<void> done;
+
+    svc.post ( [&func, &done]()
+    {
+        func();
+        done.set_value();
+    } );
+
+    done.get_future().wait();
+}
+
+/// @brief Read part of a file through the proxy, and check it against what was written.
+static bool expectRead ( Client& client, uint32_t hd, const std::vector<char>& contents,
+                         size_t offset, size_t size )
+{
+    std::vector<char> data ( size );
+
+    RetCode rc = client.read ( hd, data, offset );
+
+    if ( NotOk ( rc ) )
+    {
+        std::cerr << "Reading " << size << " bytes at " << offset << " failed: " << rc
+            << std::endl;
+        return false;
+    }
+
+    const size_t expected = std::min ( size, contents.size() - offset );
+
+    if ( data.size() != expected
+         || ! std::equal ( data.begin(), data.end(), contents.begin() + offset ) )
+    {
+        std::cerr << "Reading " << size << " bytes at " << offset << " returned "
+            << data.size() << " bytes which don't match" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/// @brief Copy the file written, whole and in part, through the proxy.
+static bool testCopy ( Client& client, uint32_t hd, const std::vector<char>& contents )
+{
+    RetCode rc = client.copy ( "/file", "/file" );
+
+    if ( rc != NotPossible )
+    {
+        std::cerr << "Copying a file onto itself returned " << rc << std::endl;
+        return false;
+    }
+
+    if ( NotOk ( rc = client.copy ( "/file", "/copy" ) ) )
+    {
+        std::cerr << "Unable to copy the file: " << rc << std::endl;
+        return false;
+    }
+
+    uint32_t copy = 0;
+
+    if ( NotOk ( rc = client.open ( "/copy", copy, Client::Write ) ) )
+    {
+        std::cerr << "Unable to open the copy: " << rc << std::endl;
+        return false;
+    }
+
+    bool ok = expectRead ( client, copy, contents, 0, contents.size() );
+
+    // Shifts the start of the copy down by one byte.
+    const size_t size = 100000;
+    size_t processed = 0;
+
+    if ( ok && ( NotOk ( rc = client.copyRange ( hd, 1, copy, 0, size, processed ) )
+                 || processed != size ) )
+    {
+        std::cerr << "Copying a range returned " << rc << ", " << processed << " bytes copied"
+            << std::endl;
+        ok = false;
+    }
+
+    std::vector<char> data ( size );
+
+    if ( ok && ( NotOk ( client.read ( copy, data ) )
+                 || ! std::equal ( data.begin(), data.end(), contents.begin() + 1 ) ) )
+    {
+        std::cerr << "The range copied doesn't match" << std::endl;
+        ok = false;
+    }
+
+    client.close ( copy );
+
+    return ok;
+}
+
+/// @brief Set, read back, list and remove an extended attribute through the proxy.
+static bool testXAttr ( Client& client )
+{
+    const std::string key ( "user.rfs.test" );
+    const std::string value ( "a value\0with a null", 19 );
+
+    RetCode rc = client.setXAttr ( "/file", key, value );
+
+    // Not every file system /tmp may be on has them.
+    if ( rc == NotSupported )
+    {
+        std::cout << "Extended attributes not supported, not testing them" << std::endl;
+        return true;
+    }
+
+    std::string read;
+    std::vector<XAttr> xattrs;
+
+    if ( NotOk ( rc ) )
+    {
+        std::cerr << "Unable to set an extended attribute: " << rc << std::endl;
+    }
+    else if ( NotOk ( rc = client.getXAttr ( "/file", key, read ) ) || read != value )
+    {
+        std::cerr << "The extended attribute read back doesn't match: " << rc << std::endl;
+    }
+    else if ( NotOk ( rc = client.listXAttr ( "/file", xattrs ) ) || xattrs.size() != 1
+              || xattrs.at ( 0 ).key() != key || xattrs.at ( 0 ).value() != value )
+    {
+        std::cerr << "The extended attributes listed don't match: " << rc << std::endl;
+    }
+    else if ( NotOk ( rc = client.removeXAttr ( "/file", key ) ) )
+    {
+        std::cerr << "Unable to remove the extended attribute: " << rc << std::endl;
+    }
+    else if ( ( rc = client.getXAttr ( "/file", key, read ) ) != NoSuchAttribute )
+    {
+        std::cerr << "Reading a removed extended attribute returned " << rc << std::endl;
+    }
+    else
+    {
+        return true;
+    }
+
+    return false;
+}
+
+int main()
+{
+    char root[] = "/tmp/rfsPeerIoTest.XXXXXX";
+
+    if ( mkdtemp ( root ) == nullptr )
+    {
+        std::cerr << "Unable to create a directory to test in" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::string filePath = std::string ( root ) + "/file";
+
+    {
+        std::ofstream out ( filePath.c_str() );
+    }
+
+    int sv[2];
+
+    if ( socketpair ( AF_LOCAL, SOCK_STREAM, 0, sv ) != 0 )
+    {
+        std::cerr << "Unable to create a socket pair" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    boost::asio::io_service svc;
+    boost::asio::io_service::work work ( svc );
+    boost::asio::generic::stream_protocol proto ( AF_LOCAL, 0 );
+
+    ChannelPtr channel ( new Channel ( svc, proto ) );
+
+    // The channel comes with a socket of its own, which is replaced by the pair's.
+    channel->getSocket().close();
+    channel->getSocket().assign ( proto, sv[1] );
+
+    Peer* peer = new Peer();
+    peer->setOpener ( std::bind ( &DirectGrants::openPosix, std::string ( root ),
+                                  std::placeholders::_1, std::placeholders::_2,
+                                  std::placeholders::_3, std::placeholders::_4 ) );
+    peer->setChannel ( channel );
+
+    std::thread proxy ( [&svc]()
+    {
+        svc.run();
+    } );
+
+    int ret = EXIT_FAILURE;
+
+    {
+        Client client ( sv[0] );
+
+        // Several times the largest frame, so writes have to be split, and reads streamed.
+        const size_t maxFrame = Channel::getMaxMessageSize();
+        std::vector<char> contents ( maxFrame * 3 + 12345 );
+
+        for ( size_t i = 0; i < contents.size(); ++i )
+            contents[i] = static_cast<char> ( i * 7 + i / 251 );
+
+        uint32_t hd = 0;
+        RetCode rc = client.open ( "/file", hd, Client::Write );
+
+        if ( NotOk ( rc ) )
+        {
+            std::cerr << "Unable to open the file: " << rc << std::endl;
+        }
+        else if ( NotOk ( rc = client.write ( hd, contents ) ) )
+        {
+            std::cerr << "Unable to write " << contents.size() << " bytes: " << rc << std::endl;
+        }
+        else if ( expectRead ( client, hd, contents, 100, 4096 )
+                  // Just too large for a frame, along with its response.
+                  && expectRead ( client, hd, contents, 1, maxFrame - 16 )
+                  // Between one and two frames.
+                  && expectRead ( client, hd, contents, 0, maxFrame + maxFrame / 2 )
+                  // The whole file, and then some.
+                  && expectRead ( client, hd, contents, 0, contents.size() + 100 )
+                  && testCopy ( client, hd, contents ) && testXAttr ( client ) )
+        {
+            if ( NotOk ( client.close ( hd ) ) )
+                std::cerr << "Unable to close the file" << std::endl;
+            else
+                ret = EXIT_SUCCESS;
+        }
+    }
+
+    // The client has gone, which closes the channel.
+    runOnProxy ( svc, [peer]()
+    {
+        delete peer;
+    } );
+
+    svc.stop();
+    proxy.join();
+
+    unlink ( filePath.c_str() );
+    unlink ( ( std::string ( root ) + "/copy" ).c_str() );
+    rmdir ( root );
+
+    return ret;
+}
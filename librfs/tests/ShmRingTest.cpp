@@ -0,0 +1,140 @@
+extern "C"
+{
+#include <sys/uio.h>
+}
+
+#include <cstring>
+#include <iostream>
+
+#include "ShmRing.hpp"
+
+using namespace rfs;
+
+/// @brief Write a buffer to a ring.
+static bool writeBuf ( ShmRing& ring, const char* buf, size_t size )
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<char*> ( buf );
+    iov.iov_len = size;
+
+    return ring.write ( &iov, 1 );
+}
+
+int main()
+{
+    const size_t ringSize = 64;
+
+    // Plain memory does as well as shared memory, within a process.
+    std::vector<uint64_t> mem ( ( sizeof ( ShmRing::Control ) + ringSize ) / sizeof ( uint64_t ) + 1 );
+    char* base = reinterpret_cast<char*> ( &mem[0] );
+
+    ShmRing ring;
+    ring.attach ( base, ringSize, true );
+
+    if ( ! ring.isValid() || ring.getReadable() != 0 || ring.getWritable() != ringSize )
+    {
+        std::cerr << "New ring isn't empty" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    char in[ringSize + 1];
+    char out[ringSize + 1];
+
+    for ( size_t i = 0; i < sizeof ( in ); ++i )
+        in[i] = static_cast<char> ( i * 7 + 1 );
+
+    if ( writeBuf ( ring, in, ringSize + 1 ) || ring.getReadable() != 0 )
+    {
+        std::cerr << "Wrote more than the ring holds" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Every offset in the ring gets to be the start of a write, and most writes wrap.
+    for ( size_t round = 0; round < ringSize * 4; ++round )
+    {
+        const size_t size = 1 + ( round * 13 ) % ( ringSize - 1 );
+
+        // Written as two buffers, to cover gathering as well.
+        struct iovec iov[2];
+        iov[0].iov_base = in;
+        iov[0].iov_len = size / 2;
+        iov[1].iov_base = in + size / 2;
+        iov[1].iov_len = size - size / 2;
+
+        if ( ! ring.write ( iov, 2 ) || ring.getReadable() != size )
+        {
+            std::cerr << "Unable to write " << size << " bytes in round " << round << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        if ( ring.read ( out, size + 1 ) )
+        {
+            std::cerr << "Read more than was written in round " << round << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        memset ( out, 0, sizeof ( out ) );
+
+        if ( ! ring.peek ( out, size ) || memcmp ( in, out, size ) != 0
+              || ring.getReadable() != size )
+        {
+            std::cerr << "Peeked data doesn't match in round " << round << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        memset ( out, 0, sizeof ( out ) );
+
+        if ( ! ring.read ( out, size ) || memcmp ( in, out, size ) != 0
+              || ring.getReadable() != 0 || ! ring.isValid() )
+        {
+            std::cerr << "Read data doesn't match in round " << round << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Filling it up exactly leaves no room for anything else.
+    if ( ! writeBuf ( ring, in, ringSize ) || writeBuf ( ring, in, 1 )
+          || ring.getWritable() != 0 )
+    {
+        std::cerr << "Unable to fill the ring exactly" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if ( ! ring.read ( out, ringSize ) || memcmp ( in, out, ringSize ) != 0 )
+    {
+        std::cerr << "Full ring doesn't read back" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // The other end claiming more than the ring holds.
+    ShmRing::Control* ctl = reinterpret_cast<ShmRing::Control*> ( base );
+    const uint64_t tail = ctl->tail.load();
+
+    ctl->head.store ( tail + ringSize + 1 );
+
+    if ( ring.isValid() || ring.getReadable() <= ringSize )
+    {
+        std::cerr << "Head beyond the end of the ring not noticed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // The other end claiming to have read what was never written.
+    ctl->head.store ( tail );
+    ctl->tail.store ( tail + 1 );
+
+    if ( ring.isValid() || ring.getWritable() != 0 || writeBuf ( ring, in, 1 ) )
+    {
+        std::cerr << "Tail beyond the head not noticed" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    ctl->tail.store ( tail );
+
+    if ( ! ring.isValid() )
+    {
+        std::cerr << "Ring still invalid once put right" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,99 @@
+extern "C"
+{
+#include <arpa/inet.h>
+}
+
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+#include <boost/crc.hpp>
+
+#include "WireHeader.hpp"
+
+using namespace rfs;
+
+int main()
+{
+    WireHeader hdr;
+    hdr.flags = WireHeader::Compressed | WireHeader::Priority;
+    hdr.cmd = 0x1234;
+    hdr.tag = -42;
+    hdr.size = 0x01020304;
+    hdr.dataSize = 0xfffffff0;
+
+    std::vector<char> buf ( sizeof ( WireHeader ) );
+
+    if ( hdr.serialize ( &buf[0], buf.size() - 1 ) )
+    {
+        std::cerr << "Header serialized into a buffer too small for it" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if ( ! hdr.serialize ( &buf[0], buf.size() ) )
+    {
+        std::cerr << "Unable to serialize a header" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    WireHeader out;
+
+    if ( ! out.deserialize ( buf ) || out.version != WireHeader::Version
+          || out.flags != hdr.flags || out.cmd != hdr.cmd || out.tag != hdr.tag
+          || out.size != hdr.size || out.dataSize != hdr.dataSize )
+    {
+        std::cerr << "Header didn't survive a round trip" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if ( out.deserialize ( &buf[0], buf.size() - 1 ) )
+    {
+        std::cerr << "Partial header accepted" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Any bit flipped anywhere, checksum included, is caught.
+    for ( size_t i = 0; i < buf.size() * 8; ++i )
+    {
+        std::vector<char> bad ( buf );
+        bad[i / 8] ^= ( 1 << ( i % 8 ) );
+
+        if ( out.deserialize ( bad ) )
+        {
+            std::cerr << "Header with bit " << i << " flipped accepted" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // A header of another version is turned away, even with a valid checksum.
+    std::vector<char> other ( buf );
+    other[0] = static_cast<char> ( WireHeader::Version + 1 );
+
+    boost::crc_32_type crc;
+    crc.process_bytes ( &other[0], offsetof ( WireHeader, checksum ) );
+
+    const uint32_t checksum = htonl ( crc.checksum() );
+    memcpy ( &other[offsetof ( WireHeader, checksum )], &checksum, sizeof ( checksum ) );
+
+    if ( out.deserialize ( other ) )
+    {
+        std::cerr << "Header of version " << WireHeader::Version + 1 << " accepted" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Which it would have been, had its version been right.
+    other[0] = static_cast<char> ( WireHeader::Version );
+    crc.reset();
+    crc.process_bytes ( &other[0], offsetof ( WireHeader, checksum ) );
+
+    const uint32_t fixed = htonl ( crc.checksum() );
+    memcpy ( &other[offsetof ( WireHeader, checksum )], &fixed, sizeof ( fixed ) );
+
+    if ( ! out.deserialize ( other ) )
+    {
+        std::cerr << "Header with its checksum recomputed rejected" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -2,25 +2,48 @@
 
 extern "C"
 {
-#include <unistd.h>
-
-#include <sys/types.h>
-#include <grp.h>
-#include <pwd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/xattr.h>
 }
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
 #include <ctime>
+#include <iostream>
+#include <memory>
 
 #include <sstream>
 
 #include "fs/FileSystem.hpp"
+#include "fs/LatencyStats.hpp"
+#include "fs/NameCache.hpp"
 #include "fs/PosixUtils.hpp"
 
 using namespace rfs;
 
 FileSystem* FuseBridge::fs_ ( 0 );
 
+double FuseBridge::EntryTimeout ( 1.0 );
+double FuseBridge::AttrTimeout ( 1.0 );
+double FuseBridge::NegativeTimeout ( 1.0 );
+bool FuseBridge::KernelCache ( true );
+size_t FuseBridge::StatfsBlockSize ( 4096 );
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+bool FuseBridge::WritebackCache ( false );
+size_t FuseBridge::WritebackBufferSize ( 1024 * 1024 );
+#endif
+bool FuseBridge::BlockingRead ( false );
+
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+bool FuseBridge::writeback_ ( false );
+std::mutex FuseBridge::pendingMtx_;
+std::unordered_map<uint64_t, FuseBridge::PendingWrite*> FuseBridge::pending_;
+#endif
+std::mutex FuseBridge::watchMtx_;
+std::unordered_map<uint64_t, FuseBridge::Watch> FuseBridge::watches_;
+
 const std::string FuseBridge::RfsXAttrHid ( "user.rfs_hostid" );
 const std::string FuseBridge::RfsXAttrFid ( "user.rfs_fileid" );
 
@@ -60,11 +83,8 @@ RetCode FuseBridge::run ( int argc, char* argv[] )
     // .fgetattr is not implemented because getattr() will be used instead
     // .ftruncate is not implemented because truncate() will be used instead
     // .access is not implemented because 
-    // .flush is not implemented because this doesn't cache data
-    // .fsync is not implemented because this doesn't cache data
     // .link is not implemented because hard links are not supported
-    // .fsyncdir is not implemented because this doesn't cache data
-    // .opendir and .releasedir are not implemented because directory reads are single-shot
+    // .fsyncdir is not implemented because directory changes aren't buffered
 
     // The following operations deal with all files; regardless of type.
     // That is; any of the following functions can be invoked on
@@ -98,8 +118,13 @@ RetCode FuseBridge::run ( int argc, char* argv[] )
     rfsOper.open = FuseBridge::openFile; // open file; truncate() may be called first
     rfsOper.read = FuseBridge::readFile; // read data from file
     rfsOper.write = FuseBridge::writeFile; // write data to file
+    rfsOper.read_buf = FuseBridge::readFileBuf; // read data; used instead of read
+    rfsOper.write_buf = FuseBridge::writeFileBuf; // write data; used instead of write
     rfsOper.truncate = FuseBridge::resizeFile; // change file size
+    rfsOper.flush = FuseBridge::flushFile; // pass buffered data on (every close())
+    rfsOper.fsync = FuseBridge::syncFile; // write buffered data to stable storage
     rfsOper.release = FuseBridge::closeFile; // release an open file (1:1 mapping to open())
+    rfsOper.poll = FuseBridge::poll; // wait for a file to become readable
 
     // The following operations deal with symlinks
 
@@ -109,15 +134,42 @@ RetCode FuseBridge::run ( int argc, char* argv[] )
     // The following operations deal exclusively with directories
 
     rfsOper.mkdir = FuseBridge::createDirectory; // create a directory
+    rfsOper.opendir = FuseBridge::openDirectory; // snapshot the entries of a directory
     rfsOper.readdir = FuseBridge::readDirectory; // read directory entries from directory
+    rfsOper.releasedir = FuseBridge::closeDirectory; // release an open directory
 
     // The following operations operate on the global fs
     // Instead of using init and destroy we pass in the global context to fuse_main
     // this is done because the base path is only known at start time (not in init).
+    // init is only used to negotiate connection capabilities.
 
+    rfsOper.init = FuseBridge::init; // negotiate capabilities with the kernel
     rfsOper.statfs = FuseBridge::statfs; // get data for struct statvfs (file system stats)
 
-    int ret = fuse_main ( argc, argv, &rfsOper, 0 );
+    // The kernel caching options go ahead of the caller's, so that they can be
+    // overridden from the command line. The high-level API has no way to invalidate
+    // specific entries, so cached file contents are only reused while the file's
+    // size and mtime are unchanged (auto_cache), rather than indefinitely.
+    std::ostringstream opts;
+    opts << "-oentry_timeout=" << EntryTimeout << ",attr_timeout=" << AttrTimeout
+         << ",negative_timeout=" << NegativeTimeout;
+
+    if ( KernelCache )
+        opts << ",auto_cache";
+
+    struct fuse_args args = FUSE_ARGS_INIT ( 0, nullptr );
+
+    if ( argc > 0 )
+        fuse_opt_add_arg ( &args, argv[0] );
+
+    fuse_opt_add_arg ( &args, opts.str().c_str() );
+
+    for ( int i = 1; i < argc; ++i )
+        fuse_opt_add_arg ( &args, argv[i] );
+
+    int ret = fuse_main ( args.argc, args.argv, &rfsOper, 0 );
+
+    fuse_opt_free_args ( &args );
 
     if ( ret == 0 )
         return Success;
@@ -130,39 +182,21 @@ void FuseBridge::genUserInfo ( uid_t uid, gid_t gid, std::string& username, std:
     username.clear();
     groupname.clear();
 
-    std::string hostname;
-
-    hostname.reserve ( _POSIX_HOST_NAME_MAX + 1 );
-
-    struct passwd* user = getpwuid ( uid );
-    struct group* group = getgrgid ( gid );
+    NameCache& names = NameCache::get();
 
-    int ret = gethostname ( &hostname[0], hostname.size() );
+    // If we don't have a hostname, it'll just be empty for now.
+    const std::string hostname ( names.getHostname() );
 
-    if ( ret < 0 )
+    if ( ! names.getUserName ( uid, username ) )
     {
-        // If we don't have a hostname, it'll just be empty for now.
-        hostname.clear();
-    }
-
-    if ( user != nullptr )
-    {
-        username.append ( user->pw_name );
-    }
-    else
-    {
-        username.append ( std::to_string ( uid ) );
+        username = std::to_string ( uid );
     }
 
     username.append ( "@" ).append ( hostname );
 
-    if ( group != nullptr )
+    if ( ! names.getGroupName ( gid, groupname ) )
     {
-        groupname.append ( group->gr_name );
-    }
-    else
-    {
-        groupname.append ( std::to_string ( gid ) );
+        groupname = std::to_string ( gid );
     }
 
     groupname.append ( "@" ).append ( hostname );
@@ -174,6 +208,8 @@ int FuseBridge::getAttr ( const char* path, struct stat* stat )
     assert ( stat != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "getattr", path );
+
     Metadata md;
     RetCode rc = fs_->readMetadata ( path, md );
 
@@ -187,68 +223,83 @@ int FuseBridge::getAttr ( const char* path, struct stat* stat )
 int FuseBridge::listXAttr ( const char* path, char* mem, size_t memSize )
 {
     assert ( path != nullptr );
-    assert ( mem != nullptr );
+    assert ( fs_ != nullptr );
 
-    if ( memSize < ( RfsXAttrHid.length() + RfsXAttrFid.length() + 2 ) )
-        return -ERANGE;
+    LatencyTimer timer ( "fuse", "listxattr", path );
+
+    std::vector<std::string> keys;
+    keys.push_back ( RfsXAttrHid );
+    keys.push_back ( RfsXAttrFid );
+
+    RetCode rc = fs_->listXAttr ( path, keys );
+
+    if ( NotOk ( rc ) && rc != NotSupported )
+        return -PosixUtils::retCodeToErrno ( rc );
 
     size_t size = 0;
 
-    strncpy ( mem + size, RfsXAttrHid.c_str(), RfsXAttrHid.length() );
-    size += RfsXAttrHid.length();
-    mem[size] = '\0';
-    ++size;
+    for ( size_t i = 0; i < keys.size(); ++i )
+        size += keys.at ( i ).length() + 1;
+
+    if ( memSize == 0 )
+        return size;
+    else if ( memSize < size )
+        return -ERANGE;
+
+    assert ( mem != nullptr );
 
-    strncpy ( mem + size, RfsXAttrFid.c_str(), RfsXAttrFid.length() );
-    size += RfsXAttrHid.length();
-    mem[size] = '\0';
-    ++size;
+    char* pos = mem;
+
+    for ( size_t i = 0; i < keys.size(); ++i )
+    {
+        memcpy ( pos, keys.at ( i ).c_str(), keys.at ( i ).length() + 1 );
+        pos += keys.at ( i ).length() + 1;
+    }
 
     return size;
-    
 }
 
 int FuseBridge::getXAttr ( const char* path, const char* key, char* value, size_t valueSize )
 {
     assert ( path != nullptr );
     assert ( key != nullptr );
-    assert ( value != nullptr );
     assert ( fs_ != nullptr );
 
-    Metadata md;
-    RetCode rc = fs_->readMetadata ( path, md );
-
-    if ( NotOk ( rc ) )
-        return -PosixUtils::retCodeToErrno ( rc );
+    LatencyTimer timer ( "fuse", "getxattr", path );
 
     const std::string keyS ( key );
 
-    if ( keyS == RfsXAttrHid )
+    std::string data;
+
+    if ( keyS == RfsXAttrHid || keyS == RfsXAttrFid )
     {
-        const size_t size = md.hid().length();
+        Metadata md;
+        RetCode rc = fs_->readMetadata ( path, md );
 
-        if ( valueSize == 0 )
-            return size;
-        else if ( valueSize < size )
-            return -ERANGE;
+        if ( NotOk ( rc ) )
+            return -PosixUtils::retCodeToErrno ( rc );
 
-        strncpy ( value, md.hid().c_str(), size );
-        return size;
+        data = ( keyS == RfsXAttrHid ? md.hid() : md.fid() );
     }
-    else if ( keyS == RfsXAttrFid )
+    else
     {
-        const size_t size = md.fid().length();
+        RetCode rc = fs_->getXAttr ( path, keyS, data );
 
-        if ( valueSize == 0 )
-            return size;
-        else if ( valueSize < size )
-            return -ERANGE;
-
-        strncpy ( value, md.fid().c_str(), size );
-        return size;
+        if ( rc == NotSupported )
+            return -ENOATTR;
+        else if ( NotOk ( rc ) )
+            return -PosixUtils::retCodeToErrno ( rc );
     }
 
-    return -ENOATTR;
+    if ( valueSize == 0 )
+        return data.length();
+    else if ( valueSize < data.length() )
+        return -ERANGE;
+
+    assert ( value != nullptr );
+
+    memcpy ( value, data.data(), data.length() );
+    return data.length();
 }
 
 int FuseBridge::setXAttr ( const char* path, const char* key, const char* value,
@@ -256,10 +307,29 @@ int FuseBridge::setXAttr ( const char* path, const char* key, const char* value,
 {
     assert ( path != nullptr );
     assert ( key != nullptr );
-    assert ( value != nullptr );
     assert ( fs_ != nullptr );
 
-    return -ENOTSUP;
+    LatencyTimer timer ( "fuse", "setxattr", path );
+
+    const std::string keyS ( key );
+
+    // These describe the entry rather than being stored on it.
+    if ( keyS == RfsXAttrHid || keyS == RfsXAttrFid )
+        return -EPERM;
+
+    FileSystem::XAttrMode mode = FileSystem::XAttrSet;
+
+    if ( ( flags & XATTR_CREATE ) != 0 )
+        mode = FileSystem::XAttrCreate;
+    else if ( ( flags & XATTR_REPLACE ) != 0 )
+        mode = FileSystem::XAttrReplace;
+
+    RetCode rc = fs_->setXAttr ( path, keyS, std::string ( value, valueSize ), mode );
+
+    if ( NotOk ( rc ) )
+        return -PosixUtils::retCodeToErrno ( rc );
+
+    return 0;
 }
 
 int FuseBridge::removeXAttr ( const char* path, const char* key )
@@ -268,7 +338,19 @@ int FuseBridge::removeXAttr ( const char* path, const char* key )
     assert ( key != nullptr );
     assert ( fs_ != nullptr );
 
-    return -ENOTSUP;
+    LatencyTimer timer ( "fuse", "removexattr", path );
+
+    const std::string keyS ( key );
+
+    if ( keyS == RfsXAttrHid || keyS == RfsXAttrFid )
+        return -EPERM;
+
+    RetCode rc = fs_->removeXAttr ( path, keyS );
+
+    if ( NotOk ( rc ) )
+        return -PosixUtils::retCodeToErrno ( rc );
+
+    return 0;
 }
 
 int FuseBridge::setOwner ( const char* path, uid_t uid, gid_t gid )
@@ -276,6 +358,8 @@ int FuseBridge::setOwner ( const char* path, uid_t uid, gid_t gid )
     assert ( path != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "chown", path );
+
     std::string username;
     std::string groupname;
 
@@ -294,6 +378,8 @@ int FuseBridge::setMode ( const char* path, mode_t mode )
     assert ( path != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "chmod", path );
+
     Metadata tmp;
     PosixUtils::posixModeToMetadata ( mode, tmp );
 
@@ -310,6 +396,8 @@ int FuseBridge::setAccessTimes ( const char* path, const struct timespec tv[2] )
     assert ( path != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "utimens", path );
+
     // tv[0] is the atime, tv[1] is the mtime
 
     return -ENOTSUP;
@@ -321,6 +409,8 @@ int FuseBridge::rename ( const char* path, const char* newPath )
     assert ( newPath != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "rename", path );
+
     RetCode rc = fs_->rename ( path, newPath );
 
     if ( NotOk ( rc ) )
@@ -334,6 +424,8 @@ int FuseBridge::remove ( const char* path )
     assert ( path != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "unlink", path );
+
     RetCode rc = fs_->remove ( path );
 
     if ( NotOk ( rc ) )
@@ -348,6 +440,8 @@ int FuseBridge::createFile ( const char* path, mode_t mode, struct fuse_file_inf
     assert ( fi != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "create", path );
+
     Metadata md;
     md.set_path ( path );
     PosixUtils::posixModeToMetadata ( mode, md );
@@ -386,6 +480,8 @@ int FuseBridge::createFile ( const char* path, mode_t mode, struct fuse_file_inf
     }
 
     fi->fh = reinterpret_cast<uint64_t> ( fh );
+    setCacheFlags ( *fh, fi );
+    addPendingWrite ( *fh, fi );
     return 0;
 }
 
@@ -395,6 +491,8 @@ int FuseBridge::openFile ( const char* path, struct fuse_file_info* fi )
     assert ( fi != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "open", path );
+
     bool reqWrite = false;
 
     if ( ( ( fi->flags & O_WRONLY ) == O_WRONLY )
@@ -413,6 +511,8 @@ int FuseBridge::openFile ( const char* path, struct fuse_file_info* fi )
     }
 
     fi->fh = reinterpret_cast<uint64_t> ( fh );
+    setCacheFlags ( *fh, fi );
+    addPendingWrite ( *fh, fi );
     return 0;
 }
 
@@ -422,15 +522,27 @@ int FuseBridge::readFile ( const char*, char* mem, size_t memSize, off_t offset,
     assert ( mem != nullptr );
     assert ( fi != nullptr );
 
+    LatencyTimer timer ( "fuse", "read" );
+
     FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
     assert ( fh != nullptr );
 
-    std::vector<char> output;
-    output.reserve ( memSize );
+    // Reads have to see what was written through the handle before them.
+    RetCode rc = flushPendingWrite ( fi );
+
+    if ( NotOk ( rc ) )
+        return -PosixUtils::retCodeToErrno ( rc );
+
+    const int err = trackRead ( fi, offset );
+
+    if ( err != 0 )
+        return err;
+
+    std::vector<char> output ( memSize );
 
     size_t processed = 0;
 
-    RetCode rc = fs_->readFile ( *fh, output, offset, processed );
+    rc = fs_->readFile ( *fh, output, offset, processed );
 
     if ( NotOk ( rc ) )
         return -PosixUtils::retCodeToErrno ( rc );
@@ -459,20 +571,183 @@ int FuseBridge::writeFile ( const char*, const char* mem, size_t memSize, off_t
     assert ( fi != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "write" );
+
     FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
     assert ( fh != nullptr );
 
     const std::vector<char> data ( mem, mem + memSize );
     assert ( memSize == data.size() );
 
+    return writeData ( fi, data, offset );
+}
+
+int FuseBridge::readFileBuf ( const char*, struct fuse_bufvec** bufp, size_t size,
+                              off_t offset, struct fuse_file_info* fi )
+{
+    assert ( bufp != nullptr );
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "read_buf" );
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    // FUSE frees both the vector and any memory buffer in it with free().
+    struct fuse_bufvec* buf
+        = reinterpret_cast<struct fuse_bufvec*> ( malloc ( sizeof ( struct fuse_bufvec ) ) );
+
+    if ( buf == nullptr )
+        return -ENOMEM;
+
+    *buf = FUSE_BUFVEC_INIT ( size );
+
+    int fd = -1;
+
+    if ( IsOk ( fs_->getFileDescriptor ( *fh, fd ) ) )
+    {
+        buf->buf[0].flags = static_cast<enum fuse_buf_flags> ( FUSE_BUF_IS_FD
+                                                              | FUSE_BUF_FD_SEEK );
+        buf->buf[0].fd = fd;
+        buf->buf[0].pos = offset;
+
+        *bufp = buf;
+        return 0;
+    }
+
+    RetCode rc = flushPendingWrite ( fi );
+
+    if ( NotOk ( rc ) )
+    {
+        free ( buf );
+        return -PosixUtils::retCodeToErrno ( rc );
+    }
+
+    const int err = trackRead ( fi, offset );
+
+    if ( err != 0 )
+    {
+        free ( buf );
+        return err;
+    }
+
+    std::vector<char> output ( size );
     size_t processed = 0;
 
-    RetCode rc = fs_->writeFile ( *fh, data, offset, processed );
+    rc = fs_->readFile ( *fh, output, offset, processed );
 
     if ( NotOk ( rc ) )
+    {
+        free ( buf );
         return -PosixUtils::retCodeToErrno ( rc );
+    }
 
-    return processed;
+    processed = std::min ( processed, size );
+
+    buf->buf[0].size = processed;
+    buf->buf[0].mem = malloc ( processed > 0 ? processed : 1 );
+
+    if ( buf->buf[0].mem == nullptr )
+    {
+        free ( buf );
+        return -ENOMEM;
+    }
+
+    if ( processed > 0 )
+        memcpy ( buf->buf[0].mem, &output[0], processed );
+
+    *bufp = buf;
+    return 0;
+}
+
+int FuseBridge::writeFileBuf ( const char*, struct fuse_bufvec* buf, off_t offset,
+                               struct fuse_file_info* fi )
+{
+    assert ( buf != nullptr );
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "write_buf" );
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    const size_t size = fuse_buf_size ( buf );
+
+    int fd = -1;
+
+    if ( IsOk ( fs_->getFileDescriptor ( *fh, fd ) ) )
+    {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT ( size );
+        dst.buf[0].flags = static_cast<enum fuse_buf_flags> ( FUSE_BUF_IS_FD
+                                                             | FUSE_BUF_FD_SEEK );
+        dst.buf[0].fd = fd;
+        dst.buf[0].pos = offset;
+
+        return fuse_buf_copy ( &dst, buf, FUSE_BUF_SPLICE_NONBLOCK );
+    }
+
+    // Everything else takes the data as a vector, so it has to be gathered anyway.
+    std::vector<char> data ( size );
+
+    if ( size > 0 )
+    {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT ( size );
+        dst.buf[0].mem = &data[0];
+
+        const ssize_t copied = fuse_buf_copy ( &dst, buf, static_cast<enum fuse_buf_copy_flags> ( 0 ) );
+
+        if ( copied < 0 )
+            return copied;
+
+        data.resize ( copied );
+    }
+
+    return writeData ( fi, data, offset );
+}
+
+int FuseBridge::flushFile ( const char*, struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "flush" );
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    RetCode rc = flushPendingWrite ( fi );
+
+    if ( IsOk ( rc ) )
+        rc = fs_->flushFile ( *fh );
+
+    // File systems which don't buffer anything have nothing to do.
+    if ( NotOk ( rc ) && rc != NotImplemented && rc != NotSupported )
+        return -PosixUtils::retCodeToErrno ( rc );
+
+    return 0;
+}
+
+int FuseBridge::syncFile ( const char*, int dataOnly, struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "fsync" );
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    RetCode rc = flushPendingWrite ( fi );
+
+    if ( IsOk ( rc ) )
+        rc = fs_->syncFile ( *fh, dataOnly != 0 );
+
+    if ( NotOk ( rc ) && rc != NotImplemented && rc != NotSupported )
+        return -PosixUtils::retCodeToErrno ( rc );
+
+    return 0;
 }
 
 int FuseBridge::closeFile ( const char*, struct fuse_file_info* fi )
@@ -480,9 +755,30 @@ int FuseBridge::closeFile ( const char*, struct fuse_file_info* fi )
     assert ( fi != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "release" );
+
     FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
     assert ( fh != nullptr );
 
+    // Anything still pending was written after the last flush (through a descriptor
+    // duplicated across a fork, say); there is nobody left to report errors to.
+    flushPendingWrite ( fi );
+    removePendingWrite ( fi );
+
+    {
+        std::lock_guard<std::mutex> guard ( watchMtx_ );
+
+        std::unordered_map<uint64_t, Watch>::iterator it = watches_.find ( fi->fh );
+
+        if ( it != watches_.end() )
+        {
+            if ( it->second.ph != nullptr )
+                fuse_pollhandle_destroy ( it->second.ph );
+
+            watches_.erase ( it );
+        }
+    }
+
     RetCode rc = fs_->closeFile ( *fh );
 
     delete fh;
@@ -495,11 +791,84 @@ int FuseBridge::closeFile ( const char*, struct fuse_file_info* fi )
     return 0;
 }
 
+int FuseBridge::poll ( const char*, struct fuse_file_info* fi, struct fuse_pollhandle* ph,
+                       unsigned* reventsp )
+{
+    assert ( fi != nullptr );
+    assert ( reventsp != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "poll" );
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    *reventsp = POLLOUT | POLLWRNORM;
+
+    uint64_t version = 0;
+
+    if ( NotOk ( fs_->getVersion ( *fh, version ) ) )
+    {
+        if ( ph != nullptr )
+            fuse_pollhandle_destroy ( ph );
+
+        *reventsp |= POLLIN | POLLRDNORM;
+        return 0;
+    }
+
+    bool addWaiter = false;
+
+    {
+        std::lock_guard<std::mutex> guard ( watchMtx_ );
+
+        Watch& w = watches_[fi->fh];
+
+        if ( ! w.hasSeen || w.seen != version )
+        {
+            *reventsp |= POLLIN | POLLRDNORM;
+        }
+        else if ( ph != nullptr )
+        {
+            // Only the latest poll handle needs notifying, and only one waiter is
+            // needed however many times the kernel polls before the file changes.
+            if ( w.ph != nullptr )
+                fuse_pollhandle_destroy ( w.ph );
+
+            w.ph = ph;
+            ph = nullptr;
+
+            addWaiter = ! w.waiting;
+            w.waiting = true;
+        }
+    }
+
+    if ( ph != nullptr )
+        fuse_pollhandle_destroy ( ph );
+
+    if ( addWaiter )
+    {
+        const uint64_t key = fi->fh;
+
+        // The waiter may be called straight away, so watchMtx_ can't be held here.
+        RetCode rc = fs_->addWaiter ( *fh, version, [key]()
+        {
+            onWatchChanged ( key );
+        } );
+
+        if ( NotOk ( rc ) )
+            onWatchChanged ( key );
+    }
+
+    return 0;
+}
+
 int FuseBridge::resizeFile ( const char* path, off_t len )
 {
     assert ( path != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "truncate", path );
+
     RetCode rc = fs_->resizeFile ( path, len );
 
     if ( NotOk ( rc ) )
@@ -513,6 +882,8 @@ int FuseBridge::createDirectory ( const char* path, mode_t mode )
     assert ( path != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "mkdir", path );
+
     Metadata md;
     md.set_path ( path );
     PosixUtils::posixModeToMetadata ( mode, md );
@@ -541,58 +912,92 @@ int FuseBridge::createDirectory ( const char* path, mode_t mode )
     return 0;
 }
 
-int FuseBridge::readDirectory ( const char* path, void* mem, fuse_fill_dir_t filler,
-                                off_t, struct fuse_file_info* )
+int FuseBridge::openDirectory ( const char* path, struct fuse_file_info* fi )
 {
     assert ( path != nullptr );
-    assert ( mem != nullptr );
+    assert ( fi != nullptr );
     assert ( fs_ != nullptr );
 
-    std::vector<Metadata> children;
+    LatencyTimer timer ( "fuse", "opendir", path );
+
+    Directory* dir = new Directory();
 
-    RetCode rc = fs_->readDirectory ( path, children );
+    RetCode rc = fs_->readDirectory ( path, dir->children );
 
     if ( NotOk ( rc ) )
+    {
+        delete dir;
         return -PosixUtils::retCodeToErrno ( rc );
+    }
 
-    filler ( mem, ".", 0, 0 );
-    filler ( mem, "..", 0, 0 );
+    fi->fh = reinterpret_cast<uint64_t> ( dir );
 
-    for ( size_t i = 0; i < children.size(); ++i )
-    {
-        const Metadata& md = children.at ( i );
+    return 0;
+}
+
+int FuseBridge::readDirectory ( const char*, void* mem, fuse_fill_dir_t filler,
+                                off_t offset, struct fuse_file_info* fi )
+{
+    assert ( mem != nullptr );
+    assert ( fi != nullptr );
 
-        std::string name;
+    LatencyTimer timer ( "fuse", "readdir" );
 
-        std::string tmp ( md.path() );
+    const Directory* dir = reinterpret_cast<const Directory*> ( fi->fh );
+    assert ( dir != nullptr );
 
-        if ( tmp.length() > 0 )
-        {
-            // remove any possible trailing slashes
-            if ( tmp.at ( tmp.length() ) == '/' )
-                tmp = tmp.substr ( 0, tmp.length() - 1 );
+    // The offset of each entry is its index plus one: . and .. come first, then the
+    // children. The kernel hands back the offset of the last entry it received to
+    // continue from, and filler() reports when its buffer is full.
 
-            size_t lastSlash = tmp.find_last_of ( '/' );
+    if ( offset < 1 && filler ( mem, ".", 0, 1 ) != 0 )
+        return 0;
 
-            if ( lastSlash == std::string::npos )
-                name = tmp;
-            else
-                name = tmp.substr ( lastSlash + 1 );
-        }
+    if ( offset < 2 && filler ( mem, "..", 0, 2 ) != 0 )
+        return 0;
+
+    for ( size_t i = std::max<off_t> ( offset, 2 ) - 2; i < dir->children.size(); ++i )
+    {
+        const Metadata& md = dir->children.at ( i );
+        const std::string name ( baseName ( md.path() ) );
+
+        if ( name.empty() )
+            continue;
 
+        // Only the type bits are used; the kernel looks entries up before using them.
         struct stat s;
-        PosixUtils::metadataToStat ( md, &s );
-        filler ( mem, name.c_str(), &s, 0 );
+        memset ( &s, 0, sizeof ( s ) );
+        PosixUtils::metadataToPosixMode ( md, s.st_mode );
+
+        if ( filler ( mem, name.c_str(), &s, i + 3 ) != 0 )
+            break;
     }
 
     return 0;
 }
 
+int FuseBridge::closeDirectory ( const char*, struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+
+    LatencyTimer timer ( "fuse", "releasedir" );
+
+    Directory* dir = reinterpret_cast<Directory*> ( fi->fh );
+
+    delete dir;
+    dir = nullptr;
+    fi->fh = 0;
+
+    return 0;
+}
+
 int FuseBridge::createSymlink ( const char* from, const char* to )
 {
     assert ( from != nullptr );
     assert ( to != nullptr );
 
+    LatencyTimer timer ( "fuse", "symlink", to );
+
     RetCode rc = fs_->createLink ( from, to );
 
     if ( NotOk ( rc ) )
@@ -607,6 +1012,8 @@ int FuseBridge::readSymlink ( const char* path, char* mem, size_t memSize )
     assert ( mem != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "readlink", path );
+
     std::string name;
     name.reserve ( memSize );
 
@@ -620,11 +1027,366 @@ int FuseBridge::readSymlink ( const char* path, char* mem, size_t memSize )
     return 0;
 }
 
+void* FuseBridge::init ( struct fuse_conn_info* conn )
+{
+    assert ( conn != nullptr );
+
+    conn->want |= ( conn->capable & ( FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE
+                                      | FUSE_CAP_SPLICE_MOVE ) );
+
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+    if ( WritebackCache && ( conn->capable & FUSE_CAP_WRITEBACK_CACHE ) != 0 )
+    {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        writeback_ = true;
+    }
+
+    // Every write still works, just without the batching asked for.
+    if ( WritebackCache && ! writeback_ )
+    {
+        std::cerr << "Warning: the writeback cache is not supported by the kernel; "
+                  << "writes are passed on one at a time" << std::endl;
+    }
+#endif
+
+    return fuse_get_context()->private_data;
+}
+
 int FuseBridge::statfs ( const char*, struct statvfs* statvfs )
 {
     assert ( statvfs != nullptr );
     assert ( fs_ != nullptr );
 
+    LatencyTimer timer ( "fuse", "statfs" );
+
+    RetCode rc = genStatfs ( *fs_, *statvfs );
+
+    if ( NotOk ( rc ) )
+        return -PosixUtils::retCodeToErrno ( rc );
+
+    return 0;
+}
+
+RetCode FuseBridge::genStatfs ( const FileSystem& fs, struct statvfs& st )
+{
+    memset ( &st, 0, sizeof ( st ) );
+
+    st.f_bsize = StatfsBlockSize;
+    st.f_frsize = StatfsBlockSize;
+    st.f_namemax = 255;
+
+    FileSystem::Usage usage;
+
+    RetCode rc = fs.getUsage ( "/", usage );
+
+    // Not knowing the usage isn't an error; report an empty file system.
+    if ( rc == NotSupported )
+        return Success;
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    // Nothing can be created other than through the file system's owner, so there
+    // is never any space or inodes free.
+    st.f_blocks = ( usage.bytes + StatfsBlockSize - 1 ) / StatfsBlockSize;
+    st.f_files = usage.files + usage.directories;
+
+    return Success;
+}
+
+std::string FuseBridge::baseName ( const std::string& path )
+{
+    std::string tmp ( path );
+
+    // remove any possible trailing slashes
+    while ( tmp.length() > 0 && tmp.at ( tmp.length() - 1 ) == '/' )
+        tmp.erase ( tmp.length() - 1 );
+
+    const size_t lastSlash = tmp.find_last_of ( '/' );
+
+    if ( lastSlash == std::string::npos )
+        return tmp;
+
+    return tmp.substr ( lastSlash + 1 );
+}
+
+void FuseBridge::setCacheFlags ( const FileHandle& fh, struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    const FileSystem::CachePolicy policy = fs_->getCachePolicy ( fh );
+
+    // Contents which change by themselves must be read afresh every time.
+    fi->direct_io = ( policy == FileSystem::CacheNever );
+    fi->keep_cache = 0;
+
+    // So must those of handles which wait for changes, by blocking reads or by being
+    // opened non-blocking to be polled, as this API has no way to drop the kernel's
+    // copy of an open file when it changes. Other handles on files which track changes
+    // keep the page cache, and only see a change once the file is opened again; a
+    // handle polled without O_NONBLOCK may read what it had already seen.
+    uint64_t version = 0;
+
+    if ( ( BlockingRead || ( fi->flags & O_NONBLOCK ) != 0 )
+         && IsOk ( fs_->getVersion ( fh, version ) ) )
+    {
+        fi->direct_io = 1;
+    }
+}
+
+int FuseBridge::writeData ( struct fuse_file_info* fi, const std::vector<char>& data,
+                            off_t offset )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+    PendingWrite* pw = getPendingWrite ( fi );
+
+    if ( pw != nullptr )
+        return writePending ( *fh, *pw, data, offset );
+#endif
+
+    size_t processed = 0;
+
+    RetCode rc = fs_->writeFile ( *fh, data, offset, processed );
+
+    if ( NotOk ( rc ) )
+        return -PosixUtils::retCodeToErrno ( rc );
+
+    return processed;
+}
+
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+void FuseBridge::addPendingWrite ( const FileHandle& fh, struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    // Without the writeback cache every write is one made by the caller; files read
+    // and written directly aren't written a page at a time either.
+    if ( ! writeback_ || fi->direct_io )
+        return;
+
+    // Nor are files with a backing descriptor, which take the data as it comes.
+    int fd = -1;
+
+    if ( IsOk ( fs_->getFileDescriptor ( fh, fd ) ) )
+        return;
+
+    PendingWrite* pw = new PendingWrite();
+    pw->offset = 0;
+
+    std::lock_guard<std::mutex> guard ( pendingMtx_ );
+    pending_[fi->fh] = pw;
+}
+
+void FuseBridge::removePendingWrite ( struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+
+    std::lock_guard<std::mutex> guard ( pendingMtx_ );
+
+    std::unordered_map<uint64_t, PendingWrite*>::iterator it = pending_.find ( fi->fh );
+
+    if ( it != pending_.end() )
+    {
+        delete it->second;
+        pending_.erase ( it );
+    }
+}
+
+FuseBridge::PendingWrite* FuseBridge::getPendingWrite ( struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+
+    if ( ! writeback_ )
+        return nullptr;
+
+    std::lock_guard<std::mutex> guard ( pendingMtx_ );
+
+    std::unordered_map<uint64_t, PendingWrite*>::const_iterator it = pending_.find ( fi->fh );
+
+    if ( it == pending_.end() )
+        return nullptr;
+
+    return it->second;
+}
+
+int FuseBridge::writePending ( const FileHandle& fh, PendingWrite& pw,
+                               const std::vector<char>& data, off_t offset )
+{
+    std::lock_guard<std::mutex> guard ( pw.mtx );
+
+    // The kernel rewrites pages which are dirtied again before being written out, so
+    // data overlapping or directly following what is pending is merged into it.
+    // Anything else is written after what is pending, to keep the writes in order.
+    const off_t end = pw.offset + static_cast<off_t> ( pw.data.size() );
+
+    if ( ! pw.data.empty()
+         && ( offset < pw.offset || offset > end
+              || offset - pw.offset + data.size() > WritebackBufferSize ) )
+    {
+        RetCode rc = flushPendingWrite ( fh, pw );
+
+        if ( NotOk ( rc ) )
+            return -PosixUtils::retCodeToErrno ( rc );
+    }
+
+    if ( pw.data.empty() )
+        pw.offset = offset;
+
+    const size_t start = offset - pw.offset;
+
+    if ( pw.data.size() < start + data.size() )
+        pw.data.resize ( start + data.size() );
+
+    std::copy ( data.begin(), data.end(), pw.data.begin() + start );
+
+    return data.size();
+}
+
+RetCode FuseBridge::flushPendingWrite ( struct fuse_file_info* fi )
+{
+    PendingWrite* pw = getPendingWrite ( fi );
+
+    if ( pw == nullptr )
+        return Success;
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    std::lock_guard<std::mutex> guard ( pw->mtx );
+    return flushPendingWrite ( *fh, *pw );
+}
+
+RetCode FuseBridge::flushPendingWrite ( const FileHandle& fh, PendingWrite& pw )
+{
+    assert ( fs_ != nullptr );
+
+    if ( pw.data.empty() )
+        return Success;
+
+    std::vector<char> data;
+    data.swap ( pw.data );
+
+    size_t processed = 0;
+
+    RetCode rc = fs_->writeFile ( fh, data, pw.offset, processed );
+
+    // The file takes the data as a single update; it mustn't take only part of it.
+    if ( IsOk ( rc ) && processed < data.size() )
+        rc = WriteError;
+
+    return rc;
+}
+#endif
+
+int FuseBridge::trackRead ( struct fuse_file_info* fi, off_t offset )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    // Reads further into the file carry on reading the version already seen.
+    if ( offset != 0 )
+        return 0;
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    uint64_t version = 0;
+
+    if ( NotOk ( fs_->getVersion ( *fh, version ) ) )
+        return 0;
+
+    if ( BlockingRead )
+    {
+        bool seen = false;
+
+        {
+            std::lock_guard<std::mutex> guard ( watchMtx_ );
+
+            std::unordered_map<uint64_t, Watch>::const_iterator it = watches_.find ( fi->fh );
+
+            seen = ( it != watches_.end() && it->second.hasSeen
+                     && it->second.seen == version );
+        }
+
+        if ( seen )
+        {
+            // Shared with the waiter, which may be called after this read gives up.
+            std::shared_ptr<ChangeWait> wait ( new ChangeWait() );
+            wait->changed = false;
+
+            RetCode rc = fs_->addWaiter ( *fh, version, [wait]()
+            {
+                std::lock_guard<std::mutex> guard ( wait->mtx );
+                wait->changed = true;
+                wait->cond.notify_all();
+            } );
+
+            if ( NotOk ( rc ) )
+                return -PosixUtils::retCodeToErrno ( rc );
+
+            std::unique_lock<std::mutex> lock ( wait->mtx );
+
+            // FUSE can only be polled for interruptions, so wake up now and then.
+            while ( ! wait->changed )
+            {
+                if ( wait->cond.wait_for ( lock, std::chrono::seconds ( 1 ) )
+                     == std::cv_status::timeout && fuse_interrupted() )
+                {
+                    lock.unlock();
+
+                    // Don't leave the waiter behind. That drops the handle's poll waiter
+                    // too, if it has one, so wake the poller to poll (and wait) again.
+                    fs_->removeWaiter ( *fh );
+                    onWatchChanged ( fi->fh );
+
+                    return -EINTR;
+                }
+            }
+
+            lock.unlock();
+
+            if ( NotOk ( fs_->getVersion ( *fh, version ) ) )
+                return -EBADF;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard ( watchMtx_ );
+
+    Watch& w = watches_[fi->fh];
+    w.seen = version;
+    w.hasSeen = true;
+
     return 0;
 }
 
+void FuseBridge::onWatchChanged ( uint64_t key )
+{
+    struct fuse_pollhandle* ph = nullptr;
+
+    {
+        std::lock_guard<std::mutex> guard ( watchMtx_ );
+
+        std::unordered_map<uint64_t, Watch>::iterator it = watches_.find ( key );
+
+        if ( it == watches_.end() )
+            return;
+
+        it->second.waiting = false;
+        ph = it->second.ph;
+        it->second.ph = nullptr;
+    }
+
+    if ( ph != nullptr )
+    {
+        fuse_notify_poll ( ph );
+        fuse_pollhandle_destroy ( ph );
+    }
+}
@@ -8,7 +8,18 @@ extern "C"
 #include <fuse.h>
 }
 
+// libfuse 2.9 can't ask the kernel for the writeback cache, so the support for it is
+// only built against a libfuse which can (3.0 and later).
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+#define RFS_HAVE_WRITEBACK_CACHE
+#endif
+
+#include <condition_variable>
 #include <cstdlib>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "Common.pb.h"
 #include "RetCode.hpp"
@@ -25,6 +36,34 @@ public:
 
     RetCode run ( int argc, char* argv[] );
 
+    /// @brief Configuration field, how long the kernel may cache name lookups (seconds).
+    static double EntryTimeout;
+    /// @brief Configuration field, how long the kernel may cache attributes (seconds).
+    static double AttrTimeout;
+    /// @brief Configuration field, how long the kernel may cache failed lookups (seconds).
+    static double NegativeTimeout;
+    /// @brief Configuration field, whether the kernel may cache file contents across opens.
+    static bool KernelCache;
+    /// @brief Configuration field, the block size statfs reports usage in (bytes).
+    static size_t StatfsBlockSize;
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+    /// @brief Configuration field, whether the kernel may buffer writes and pass them
+    /// on in larger batches (writeback cache), where it supports this.
+    /// Written data is then only guaranteed to reach the file system by flush (every
+    /// close), fsync or release, and errors writing it are reported there. A kernel
+    /// without it is warned about.
+    static bool WritebackCache;
+    /// @brief Configuration field, how much data written to a file without a backing
+    /// descriptor is coalesced before being passed on, in writeback mode (bytes).
+    static size_t WritebackBufferSize;
+#endif
+    /// @brief Configuration field, whether reads of files which track changes wait for
+    /// the next change, when the reader has already seen the current contents.
+    /// Only reads from the start of the file wait, so a reader can read the whole file,
+    /// then read from the start again to wait for it to change. Each waiting read
+    /// occupies a FUSE thread; it is interrupted only if FUSE is mounted with -o intr.
+    static bool BlockingRead;
+
     /// @brief Implements the FUSE function getattr
     static int getAttr ( const char* path, struct stat* stat );
     /// @brief Implements the FUSE function listxattr
@@ -62,31 +101,189 @@ public:
     /// @brief Implements the FUSE function write
     static int writeFile ( const char* path, const char* mem, size_t memSize,
                            off_t offset, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function read_buf
+    /// Files with a backing descriptor are returned as a descriptor-backed buffer,
+    /// which FUSE can splice straight to the kernel.
+    static int readFileBuf ( const char* path, struct fuse_bufvec** bufp, size_t size,
+                             off_t offset, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function write_buf
+    /// Data is spliced straight into files with a backing descriptor.
+    static int writeFileBuf ( const char* path, struct fuse_bufvec* buf, off_t offset,
+                              struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function flush
+    /// Called on every close of a file descriptor; passes buffered data on.
+    static int flushFile ( const char* path, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function fsync
+    static int syncFile ( const char* path, int dataOnly, struct fuse_file_info* fi );
     /// @brief Implements the FUSE function release
     static int closeFile ( const char* path, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function poll
+    /// Files which track changes are readable once they have changed since they were
+    /// last read from the start through the handle (or if they haven't been read yet);
+    /// everything else is always readable.
+    static int poll ( const char* path, struct fuse_file_info* fi,
+                      struct fuse_pollhandle* ph, unsigned* reventsp );
     /// @brief Implements the FUSE function truncate
     static int resizeFile ( const char* path, off_t len );
 
     /// @brief Implements the FUSE function mkdir
     static int createDirectory ( const char* path, mode_t mode );
+    /// @brief Implements the FUSE function opendir
+    /// Takes a snapshot of the directory's entries, which readdir is served from.
+    static int openDirectory ( const char* path, struct fuse_file_info* fi );
     /// @brief Implements the FUSE function readdir
+    /// Resumes from the given offset, and stops as soon as the kernel's buffer is full.
     static int readDirectory ( const char* path, void* mem, fuse_fill_dir_t filler,
                          off_t offset, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function releasedir
+    static int closeDirectory ( const char* path, struct fuse_file_info* fi );
 
     /// @brief Implements the FUSE function symlink
     static int createSymlink ( const char* from, const char* to );
     /// @brief Implements the FUSE function readlink
     static int readSymlink ( const char* path, char* mem, size_t memSize );
 
+    /// @brief Implements the FUSE function init
+    /// Asks for splice to be used wherever the kernel supports it, and for the
+    /// writeback cache if WritebackCache is set (libfuse 3 builds only).
+    static void* init ( struct fuse_conn_info* conn );
+
     /// @brief Implements the FUSE function statfs
+    /// Reports the usage of the whole file system, where it tracks it.
     static int statfs ( const char* path, struct statvfs* statvfs );
 
-private:
+    /// @brief Generate the user@host and group@host names for a uid and gid.
     static void genUserInfo ( uid_t uid, gid_t gid,
                               std::string& username, std::string& groupname );
 
+    /// @brief Describe the usage of a file system for statfs.
+    /// @param [in] fs The file system.
+    /// @param [out] st The statistics to fill in.
+    /// @return Standard error code.
+    static RetCode genStatfs ( const FileSystem& fs, struct statvfs& st );
+
+    /// @brief The name of an entry, given the path the file system reports for it.
+    static std::string baseName ( const std::string& path );
+
+private:
+    /// @brief The entries of an open directory, as of when it was opened.
+    struct Directory
+    {
+        std::vector<Metadata> children; ///< The entries, in the order they're returned.
+    };
+
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+    /// @brief Writes to an open file which haven't been passed on yet.
+    /// In writeback mode the kernel writes a file out a page at a time. Files with a
+    /// backing descriptor don't mind, but to anything else (a ProcessFile driving a
+    /// controller, say) each of those would look like a separate update, so they're
+    /// gathered here and passed on as one write.
+    struct PendingWrite
+    {
+        std::mutex mtx; ///< Held while appending to or passing on the data.
+        off_t offset; ///< The offset of the first byte of data.
+        std::vector<char> data; ///< The data, contiguous from offset.
+    };
+#endif
+
+    /// @brief What a handle on a file which tracks changes has seen of it.
+    struct Watch
+    {
+        Watch() : seen ( 0 ), hasSeen ( false ), waiting ( false ), ph ( nullptr )
+        {
+        }
+
+        uint64_t seen; ///< The version last read from the start.
+        bool hasSeen; ///< Whether the file has been read from the start at all.
+        bool waiting; ///< Whether a waiter has been added for a change.
+        struct fuse_pollhandle* ph; ///< The poll handle to notify on a change.
+    };
+
+    /// @brief A read waiting for a file to change.
+    struct ChangeWait
+    {
+        std::mutex mtx; ///< Protects changed.
+        std::condition_variable cond; ///< Signalled when the file changes.
+        bool changed; ///< Whether the file has changed.
+    };
+
+    /// @brief Set the caching flags of a newly opened file.
+    static void setCacheFlags ( const FileHandle& fh, struct fuse_file_info* fi );
+
+    /// @brief Note a read of an open file, first waiting for it to change if the reader
+    /// has already seen it and BlockingRead is set.
+    /// @return 0, or a negative errno.
+    static int trackRead ( struct fuse_file_info* fi, off_t offset );
+
+    /// @brief Notify the poll handle of an open file of a change.
+    /// @param [in] key The fh of the file.
+    static void onWatchChanged ( uint64_t key );
+
+    /// @brief Write data to an open file, gathering it with earlier writes if needed.
+    /// @return The number of bytes written, or a negative errno.
+    static int writeData ( struct fuse_file_info* fi, const std::vector<char>& data,
+                           off_t offset );
+
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+    /// @brief Start gathering the writes to a newly opened file, if they need to be.
+    static void addPendingWrite ( const FileHandle& fh, struct fuse_file_info* fi );
+
+    /// @brief Stop gathering the writes to a file being closed, discarding any left.
+    static void removePendingWrite ( struct fuse_file_info* fi );
+
+    /// @brief Find the pending writes of an open file.
+    /// @return The pending writes, or nullptr if writes to the file aren't gathered.
+    static PendingWrite* getPendingWrite ( struct fuse_file_info* fi );
+
+    /// @brief Gather data written with what is pending, passing that on first if the
+    /// two can't be merged.
+    /// @return The number of bytes written, or a negative errno.
+    static int writePending ( const FileHandle& fh, PendingWrite& pw,
+                              const std::vector<char>& data, off_t offset );
+
+    /// @brief Pass the pending writes of an open file on to the file system.
+    /// @return Standard error code.
+    static RetCode flushPendingWrite ( struct fuse_file_info* fi );
+
+    /// @brief Pass gathered data on to the file system; must be called with pw.mtx held.
+    /// The data is discarded even if it can't be written.
+    /// @return Standard error code.
+    static RetCode flushPendingWrite ( const FileHandle& fh, PendingWrite& pw );
+#else
+    /// @brief Without the writeback cache, every write is passed on as it comes.
+    static inline void addPendingWrite ( const FileHandle&, struct fuse_file_info* )
+    {
+    }
+
+    static inline void removePendingWrite ( struct fuse_file_info* )
+    {
+    }
+
+    static inline RetCode flushPendingWrite ( struct fuse_file_info* )
+    {
+        return Success;
+    }
+#endif
+
     static FileSystem* fs_;
 
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+    /// @brief Whether the writeback cache was negotiated with the kernel.
+    static bool writeback_;
+
+    /// @brief Protects pending_; requests may be handled on several threads.
+    static std::mutex pendingMtx_;
+
+    /// @brief The pending writes of open files, keyed by their fh.
+    static std::unordered_map<uint64_t, PendingWrite*> pending_;
+#endif
+
+    /// @brief Protects watches_.
+    static std::mutex watchMtx_;
+
+    /// @brief What open files which track changes have seen, keyed by their fh.
+    static std::unordered_map<uint64_t, Watch> watches_;
+
     static const std::string RfsXAttrHid;
     static const std::string RfsXAttrFid;
 };
@@ -0,0 +1,1335 @@
+#include "FuseLowLevelBridge.hpp"
+
+extern "C"
+{
+#include <sys/xattr.h>
+}
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <ctime>
+#include <vector>
+
+#include "FuseBridge.hpp"
+
+#include "fs/FileSystem.hpp"
+#include "fs/LatencyStats.hpp"
+#include "fs/PosixUtils.hpp"
+
+using namespace rfs;
+
+FileSystem* FuseLowLevelBridge::fs_ ( 0 );
+
+std::mutex FuseLowLevelBridge::mtx_;
+std::unordered_map<fuse_ino_t, FuseLowLevelBridge::Node*> FuseLowLevelBridge::nodes_;
+std::unordered_map<std::string, FuseLowLevelBridge::Node*> FuseLowLevelBridge::paths_;
+fuse_ino_t FuseLowLevelBridge::nextIno_ ( FUSE_ROOT_ID + 1 );
+
+double FuseLowLevelBridge::entryTimeout_ ( 0 );
+double FuseLowLevelBridge::attrTimeout_ ( 0 );
+double FuseLowLevelBridge::negativeTimeout_ ( 0 );
+bool FuseLowLevelBridge::kernelCache_ ( false );
+
+struct fuse_chan* FuseLowLevelBridge::ch_ ( nullptr );
+
+std::thread FuseLowLevelBridge::invalidator_;
+std::deque<FuseLowLevelBridge::Invalidation> FuseLowLevelBridge::invalidations_;
+std::condition_variable FuseLowLevelBridge::invalidationsCond_;
+bool FuseLowLevelBridge::stopping_ ( false );
+
+FuseLowLevelBridge::FuseLowLevelBridge ( FileSystem& fs )
+{
+    if ( ! fs_ )
+    {
+        fs_ = &fs;
+    }
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    // The root is never looked up, and never forgotten.
+    Node* root = new Node();
+    root->ino = FUSE_ROOT_ID;
+    root->path = "/";
+    root->lookups = 1;
+    root->unlinked = false;
+
+    nodes_[root->ino] = root;
+    paths_[root->path] = root;
+}
+
+FuseLowLevelBridge::~FuseLowLevelBridge()
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    for ( std::unordered_map<fuse_ino_t, Node*>::iterator it = nodes_.begin();
+          it != nodes_.end(); ++it )
+    {
+        delete it->second;
+    }
+
+    nodes_.clear();
+    paths_.clear();
+
+    fs_ = nullptr;
+}
+
+RetCode FuseLowLevelBridge::run ( int argc, char* argv[] )
+{
+    struct fuse_lowlevel_ops rfsOper;
+    memset ( &rfsOper, 0, sizeof ( rfsOper ) );
+
+    // Operations are the same as the ones FuseBridge implements, except that entries
+    // are named by inode; see FuseBridge::run for the reasons others are left out.
+
+    rfsOper.init = FuseLowLevelBridge::init; // negotiate capabilities with the kernel
+
+    rfsOper.lookup = FuseLowLevelBridge::lookup; // resolve a name to an inode
+    rfsOper.forget = FuseLowLevelBridge::forget; // drop references taken by lookups
+    rfsOper.getattr = FuseLowLevelBridge::getAttr; // get data for struct stat
+    rfsOper.setattr = FuseLowLevelBridge::setAttr; // chmod, chown and truncate
+    rfsOper.listxattr = FuseLowLevelBridge::listXAttr; // get list of extended attributes
+    rfsOper.getxattr = FuseLowLevelBridge::getXAttr; // get specific extended attribute
+    rfsOper.setxattr = FuseLowLevelBridge::setXAttr; // set specific extended attribute
+    rfsOper.removexattr = FuseLowLevelBridge::removeXAttr; // remove extended attribute
+
+    rfsOper.unlink = FuseLowLevelBridge::remove; // remove a file
+    rfsOper.rmdir = FuseLowLevelBridge::remove; // remove a directory
+    rfsOper.rename = FuseLowLevelBridge::rename; // rename a file
+
+    rfsOper.create = FuseLowLevelBridge::createFile; // create & open file
+    rfsOper.open = FuseLowLevelBridge::openFile; // open file
+    rfsOper.read = FuseLowLevelBridge::readFile; // read data from file
+    rfsOper.write = FuseLowLevelBridge::writeFile; // write data to file
+    rfsOper.write_buf = FuseLowLevelBridge::writeFileBuf; // write data; used instead of write
+    rfsOper.release = FuseLowLevelBridge::closeFile; // release an open file
+
+    rfsOper.symlink = FuseLowLevelBridge::createSymlink; // create a symbolic link
+    rfsOper.readlink = FuseLowLevelBridge::readSymlink; // get the target of the symlink
+
+    rfsOper.mkdir = FuseLowLevelBridge::createDirectory; // create a directory
+    rfsOper.opendir = FuseLowLevelBridge::openDirectory; // snapshot the entries of a directory
+    rfsOper.readdir = FuseLowLevelBridge::readDirectory; // read directory entries
+    rfsOper.releasedir = FuseLowLevelBridge::closeDirectory; // release an open directory
+
+    rfsOper.statfs = FuseLowLevelBridge::statfs; // get data for struct statvfs
+
+    struct fuse_args args = FUSE_ARGS_INIT ( argc, argv );
+
+    // Only the high-level API understands the caching options; take them out here.
+    struct CacheOptions
+    {
+        double entryTimeout;
+        double attrTimeout;
+        double negativeTimeout;
+        int kernelCache;
+    };
+
+    CacheOptions cacheOpts = { FuseBridge::EntryTimeout, FuseBridge::AttrTimeout,
+                               FuseBridge::NegativeTimeout, FuseBridge::KernelCache };
+
+    const struct fuse_opt cacheOptsSpec[] =
+    {
+        { "entry_timeout=%lf", offsetof ( CacheOptions, entryTimeout ), 0 },
+        { "attr_timeout=%lf", offsetof ( CacheOptions, attrTimeout ), 0 },
+        { "negative_timeout=%lf", offsetof ( CacheOptions, negativeTimeout ), 0 },
+        { "kernel_cache", offsetof ( CacheOptions, kernelCache ), 1 },
+        { "no_kernel_cache", offsetof ( CacheOptions, kernelCache ), 0 },
+        FUSE_OPT_END
+    };
+
+    if ( fuse_opt_parse ( &args, &cacheOpts, cacheOptsSpec, nullptr ) < 0 )
+    {
+        fuse_opt_free_args ( &args );
+        return InvalidData;
+    }
+
+    entryTimeout_ = cacheOpts.entryTimeout;
+    attrTimeout_ = cacheOpts.attrTimeout;
+    negativeTimeout_ = cacheOpts.negativeTimeout;
+    kernelCache_ = ( cacheOpts.kernelCache != 0 );
+
+    char* mountpoint = nullptr;
+    int multithreaded = 0;
+    int foreground = 0;
+
+    if ( fuse_parse_cmdline ( &args, &mountpoint, &multithreaded, &foreground ) < 0
+         || mountpoint == nullptr )
+    {
+        fuse_opt_free_args ( &args );
+        return InvalidData;
+    }
+
+    RetCode rc = Unknown;
+
+    struct fuse_chan* ch = fuse_mount ( mountpoint, &args );
+
+    if ( ch != nullptr )
+    {
+        struct fuse_session* se = fuse_lowlevel_new ( &args, &rfsOper,
+                                                      sizeof ( rfsOper ), nullptr );
+
+        if ( se != nullptr )
+        {
+            if ( fuse_set_signal_handlers ( se ) == 0 )
+            {
+                fuse_session_add_chan ( se, ch );
+
+                fuse_daemonize ( foreground );
+
+                // Started after daemonizing, which forks.
+                ch_ = ch;
+                stopping_ = false;
+                invalidator_ = std::thread ( &FuseLowLevelBridge::runInvalidations );
+
+                fs_->setOnChangeHandler ( &FuseLowLevelBridge::onChange );
+
+                int ret = ( multithreaded ? fuse_session_loop_mt ( se )
+                            : fuse_session_loop ( se ) );
+
+                if ( ret == 0 )
+                    rc = Success;
+
+                fs_->setOnChangeHandler (
+                    std::function<void ( const std::string&, FileSystem::ChangeType )>() );
+
+                {
+                    std::lock_guard<std::mutex> guard ( mtx_ );
+                    stopping_ = true;
+                }
+
+                invalidationsCond_.notify_all();
+                invalidator_.join();
+
+                invalidations_.clear();
+                ch_ = nullptr;
+
+                fuse_remove_signal_handlers ( se );
+                fuse_session_remove_chan ( ch );
+            }
+
+            fuse_session_destroy ( se );
+        }
+
+        fuse_unmount ( mountpoint, ch );
+    }
+
+    free ( mountpoint );
+    fuse_opt_free_args ( &args );
+
+    return rc;
+}
+
+void FuseLowLevelBridge::init ( void*, struct fuse_conn_info* conn )
+{
+    assert ( conn != nullptr );
+
+    conn->want |= ( conn->capable & ( FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE
+                                      | FUSE_CAP_SPLICE_MOVE ) );
+}
+
+void FuseLowLevelBridge::lookup ( fuse_req_t req, fuse_ino_t parent, const char* name )
+{
+    assert ( name != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "lookup" );
+
+    std::string path;
+
+    if ( ! getPath ( parent, name, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    struct fuse_entry_param entry;
+    RetCode rc = makeEntry ( path, entry );
+
+    // An entry with no inode lets the kernel cache the fact the name doesn't exist.
+    if ( rc == NoSuchPath && negativeTimeout_ > 0 )
+    {
+        memset ( &entry, 0, sizeof ( entry ) );
+        entry.ino = 0;
+        entry.entry_timeout = negativeTimeout_;
+
+        fuse_reply_entry ( req, &entry );
+        return;
+    }
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    fuse_reply_entry ( req, &entry );
+}
+
+void FuseLowLevelBridge::forget ( fuse_req_t req, fuse_ino_t ino, unsigned long nlookup )
+{
+    LatencyTimer timer ( "fuse", "forget" );
+
+    forgetNode ( ino, nlookup );
+
+    fuse_reply_none ( req );
+}
+
+void FuseLowLevelBridge::forgetNode ( fuse_ino_t ino, uint64_t nlookup )
+{
+    if ( ino == FUSE_ROOT_ID )
+        return;
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    std::unordered_map<fuse_ino_t, Node*>::iterator it = nodes_.find ( ino );
+
+    if ( it == nodes_.end() )
+        return;
+
+    Node* node = it->second;
+
+    node->lookups -= std::min<uint64_t> ( nlookup, node->lookups );
+
+    if ( node->lookups > 0 )
+        return;
+
+    std::unordered_map<std::string, Node*>::iterator pIt = paths_.find ( node->path );
+
+    // The path may have been taken over by a newer entry.
+    if ( pIt != paths_.end() && pIt->second == node )
+        paths_.erase ( pIt );
+
+    nodes_.erase ( it );
+    delete node;
+}
+
+void FuseLowLevelBridge::getAttr ( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi )
+{
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "getattr" );
+
+    Metadata md;
+    RetCode rc = NotSupported;
+
+    // The kernel only passes the handle of a regular file (fstat), which may have been
+    // unlinked or replaced since it was opened; the handle still leads to it.
+    if ( fi != nullptr && fi->fh != 0 )
+        rc = fs_->readFileMetadata ( *reinterpret_cast<FileHandle*> ( fi->fh ), md );
+
+    if ( rc == NotSupported )
+    {
+        std::string path;
+
+        if ( ! getPath ( ino, path ) )
+        {
+            fuse_reply_err ( req, ENOENT );
+            return;
+        }
+
+        rc = fs_->readMetadata ( path, md );
+    }
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    struct stat st;
+    toStat ( ino, md, st );
+
+    fuse_reply_attr ( req, &st, attrTimeout_ );
+}
+
+void FuseLowLevelBridge::setAttr ( fuse_req_t req, fuse_ino_t ino, struct stat* attr,
+                                   int toSet, struct fuse_file_info* fi )
+{
+    assert ( attr != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "setattr" );
+
+    std::string path;
+
+    if ( ! getPath ( ino, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    RetCode rc = Success;
+
+    if ( toSet & FUSE_SET_ATTR_MODE )
+    {
+        Metadata tmp;
+        PosixUtils::posixModeToMetadata ( attr->st_mode, tmp );
+
+        rc = fs_->setMode ( path, tmp.modes() );
+    }
+
+    if ( IsOk ( rc ) && ( toSet & ( FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID ) ) )
+    {
+        // Only one of the two may be changing; keep the other as it is.
+        Metadata md;
+        rc = fs_->readMetadata ( path, md );
+
+        if ( IsOk ( rc ) )
+        {
+            std::string username;
+            std::string groupname;
+
+            FuseBridge::genUserInfo ( attr->st_uid, attr->st_gid, username, groupname );
+
+            rc = fs_->setOwner ( path, ( toSet & FUSE_SET_ATTR_UID ) ? username : md.uid(),
+                                 ( toSet & FUSE_SET_ATTR_GID ) ? groupname : md.gid() );
+        }
+    }
+
+    if ( IsOk ( rc ) && ( toSet & FUSE_SET_ATTR_SIZE ) )
+        rc = fs_->resizeFile ( path, attr->st_size );
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    getAttr ( req, ino, fi );
+}
+
+void FuseLowLevelBridge::listXAttr ( fuse_req_t req, fuse_ino_t ino, size_t size )
+{
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "listxattr" );
+
+    std::string path;
+
+    if ( ! getPath ( ino, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    std::vector<std::string> keys;
+
+    RetCode rc = fs_->listXAttr ( path, keys );
+
+    if ( NotOk ( rc ) && rc != NotSupported )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    // The names are each null terminated, one after another.
+    std::string names;
+
+    for ( size_t i = 0; i < keys.size(); ++i )
+        names.append ( keys.at ( i ) ).push_back ( '\0' );
+
+    if ( size == 0 )
+        fuse_reply_xattr ( req, names.length() );
+    else if ( size < names.length() )
+        fuse_reply_err ( req, ERANGE );
+    else
+        fuse_reply_buf ( req, names.data(), names.length() );
+}
+
+void FuseLowLevelBridge::getXAttr ( fuse_req_t req, fuse_ino_t ino, const char* key,
+                                    size_t size )
+{
+    assert ( key != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "getxattr" );
+
+    std::string path;
+
+    if ( ! getPath ( ino, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    std::string value;
+
+    RetCode rc = fs_->getXAttr ( path, key, value );
+
+    if ( rc == NotSupported )
+        rc = NoSuchAttribute;
+
+    if ( NotOk ( rc ) )
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+    else if ( size == 0 )
+        fuse_reply_xattr ( req, value.length() );
+    else if ( size < value.length() )
+        fuse_reply_err ( req, ERANGE );
+    else
+        fuse_reply_buf ( req, value.data(), value.length() );
+}
+
+void FuseLowLevelBridge::setXAttr ( fuse_req_t req, fuse_ino_t ino, const char* key,
+                                    const char* value, size_t size, int flags )
+{
+    assert ( key != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "setxattr" );
+
+    std::string path;
+
+    if ( ! getPath ( ino, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    FileSystem::XAttrMode mode = FileSystem::XAttrSet;
+
+    if ( ( flags & XATTR_CREATE ) != 0 )
+        mode = FileSystem::XAttrCreate;
+    else if ( ( flags & XATTR_REPLACE ) != 0 )
+        mode = FileSystem::XAttrReplace;
+
+    RetCode rc = fs_->setXAttr ( path, key, std::string ( value, size ), mode );
+
+    fuse_reply_err ( req, NotOk ( rc ) ? PosixUtils::retCodeToErrno ( rc ) : 0 );
+}
+
+void FuseLowLevelBridge::removeXAttr ( fuse_req_t req, fuse_ino_t ino, const char* key )
+{
+    assert ( key != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "removexattr" );
+
+    std::string path;
+
+    if ( ! getPath ( ino, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    RetCode rc = fs_->removeXAttr ( path, key );
+
+    fuse_reply_err ( req, NotOk ( rc ) ? PosixUtils::retCodeToErrno ( rc ) : 0 );
+}
+
+void FuseLowLevelBridge::rename ( fuse_req_t req, fuse_ino_t parent, const char* name,
+                                  fuse_ino_t newParent, const char* newName )
+{
+    assert ( name != nullptr );
+    assert ( newName != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "rename" );
+
+    std::string from;
+    std::string to;
+
+    if ( ! getPath ( parent, name, from ) || ! getPath ( newParent, newName, to ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    RetCode rc = fs_->rename ( from, to );
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard ( mtx_ );
+
+        // Whatever was at the destination has been replaced, and its node mustn't
+        // take over the path of the entry moved there.
+        unlinkPath ( to );
+
+        // Move the entry, and anything known below it, to its new path.
+        const std::string prefix ( from + "/" );
+        std::vector<Node*> moved;
+
+        for ( std::unordered_map<std::string, Node*>::iterator it = paths_.begin();
+              it != paths_.end(); )
+        {
+            if ( it->first == from || it->first.compare ( 0, prefix.length(), prefix ) == 0 )
+            {
+                moved.push_back ( it->second );
+                it = paths_.erase ( it );
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        for ( size_t i = 0; i < moved.size(); ++i )
+        {
+            Node* node = moved.at ( i );
+            node->path = to + node->path.substr ( from.length() );
+            paths_[node->path] = node;
+        }
+    }
+
+    fuse_reply_err ( req, 0 );
+}
+
+void FuseLowLevelBridge::remove ( fuse_req_t req, fuse_ino_t parent, const char* name )
+{
+    assert ( name != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "unlink" );
+
+    std::string path;
+
+    if ( ! getPath ( parent, name, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    RetCode rc = fs_->remove ( path );
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard ( mtx_ );
+        unlinkPath ( path );
+    }
+
+    fuse_reply_err ( req, 0 );
+}
+
+void FuseLowLevelBridge::createFile ( fuse_req_t req, fuse_ino_t parent, const char* name,
+                                      mode_t mode, struct fuse_file_info* fi )
+{
+    assert ( name != nullptr );
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "create" );
+
+    std::string path;
+
+    if ( ! getPath ( parent, name, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    const struct fuse_ctx* ctx = fuse_req_ctx ( req );
+
+    Metadata md;
+    md.set_path ( path );
+    PosixUtils::posixModeToMetadata ( mode, md );
+
+    std::string username;
+    std::string groupname;
+
+    FuseBridge::genUserInfo ( ctx->uid, ctx->gid, username, groupname );
+
+    md.set_uid ( username );
+    md.set_gid ( groupname );
+    md.set_size ( 0 );
+
+    const time_t now = time ( 0 );
+
+    md.set_atime ( now );
+    md.set_mtime ( now );
+    md.set_ctime ( now );
+
+    const bool reqWrite = ( ( fi->flags & O_ACCMODE ) != O_RDONLY );
+
+    FileHandle* fh = new FileHandle();
+
+    RetCode rc = fs_->createFile ( md, reqWrite, *fh );
+
+    struct fuse_entry_param entry;
+
+    if ( IsOk ( rc ) )
+    {
+        rc = makeEntry ( path, entry );
+
+        if ( NotOk ( rc ) )
+            fs_->closeFile ( *fh );
+    }
+
+    if ( NotOk ( rc ) )
+    {
+        delete fh;
+
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    fi->fh = reinterpret_cast<uint64_t> ( fh );
+    setCacheFlags ( *fh, fi );
+
+    if ( fuse_reply_create ( req, &entry, fi ) != 0 )
+    {
+        // The request was interrupted; the kernel has neither the entry nor the file.
+        fs_->closeFile ( *fh );
+        delete fh;
+        fi->fh = 0;
+
+        forgetNode ( entry.ino, 1 );
+    }
+}
+
+void FuseLowLevelBridge::openFile ( fuse_req_t req, fuse_ino_t ino,
+                                    struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "open" );
+
+    std::string path;
+
+    if ( ! getPath ( ino, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    const bool reqWrite = ( ( fi->flags & O_ACCMODE ) != O_RDONLY );
+
+    FileHandle* fh = new FileHandle();
+
+    RetCode rc = fs_->openFile ( path, reqWrite, *fh );
+
+    if ( NotOk ( rc ) )
+    {
+        delete fh;
+
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    fi->fh = reinterpret_cast<uint64_t> ( fh );
+    setCacheFlags ( *fh, fi );
+
+    if ( fuse_reply_open ( req, fi ) != 0 )
+    {
+        // The request was interrupted; release won't be called.
+        fs_->closeFile ( *fh );
+        delete fh;
+        fi->fh = 0;
+    }
+}
+
+void FuseLowLevelBridge::readFile ( fuse_req_t req, fuse_ino_t, size_t size, off_t offset,
+                                    struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "read" );
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    int fd = -1;
+
+    if ( IsOk ( fs_->getFileDescriptor ( *fh, fd ) ) )
+    {
+        // Let FUSE move the data from the backing file to the kernel, splicing
+        // it if the kernel allows; it also deals with reads past the end.
+        struct fuse_bufvec buf = FUSE_BUFVEC_INIT ( size );
+        buf.buf[0].flags = static_cast<enum fuse_buf_flags> ( FUSE_BUF_IS_FD
+                                                             | FUSE_BUF_FD_SEEK );
+        buf.buf[0].fd = fd;
+        buf.buf[0].pos = offset;
+
+        fuse_reply_data ( req, &buf, FUSE_BUF_SPLICE_MOVE );
+        return;
+    }
+
+    std::vector<char> output ( size );
+
+    size_t processed = 0;
+
+    RetCode rc = fs_->readFile ( *fh, output, offset, processed );
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    fuse_reply_buf ( req, ( processed > 0 ? &output[0] : nullptr ),
+                     std::min ( processed, size ) );
+}
+
+void FuseLowLevelBridge::writeFile ( fuse_req_t req, fuse_ino_t, const char* mem,
+                                     size_t memSize, off_t offset,
+                                     struct fuse_file_info* fi )
+{
+    assert ( mem != nullptr );
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "write" );
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    const std::vector<char> data ( mem, mem + memSize );
+
+    size_t processed = 0;
+
+    RetCode rc = fs_->writeFile ( *fh, data, offset, processed );
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    fuse_reply_write ( req, processed );
+}
+
+void FuseLowLevelBridge::writeFileBuf ( fuse_req_t req, fuse_ino_t, struct fuse_bufvec* buf,
+                                        off_t offset, struct fuse_file_info* fi )
+{
+    assert ( buf != nullptr );
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "write_buf" );
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    const size_t size = fuse_buf_size ( buf );
+
+    int fd = -1;
+
+    if ( IsOk ( fs_->getFileDescriptor ( *fh, fd ) ) )
+    {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT ( size );
+        dst.buf[0].flags = static_cast<enum fuse_buf_flags> ( FUSE_BUF_IS_FD
+                                                             | FUSE_BUF_FD_SEEK );
+        dst.buf[0].fd = fd;
+        dst.buf[0].pos = offset;
+
+        const ssize_t copied = fuse_buf_copy ( &dst, buf, FUSE_BUF_SPLICE_NONBLOCK );
+
+        if ( copied < 0 )
+            fuse_reply_err ( req, -copied );
+        else
+            fuse_reply_write ( req, copied );
+
+        return;
+    }
+
+    // Everything else takes the data as a vector, so it has to be gathered anyway.
+    std::vector<char> data ( size );
+
+    if ( size > 0 )
+    {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT ( size );
+        dst.buf[0].mem = &data[0];
+
+        const ssize_t copied = fuse_buf_copy ( &dst, buf, static_cast<enum fuse_buf_copy_flags> ( 0 ) );
+
+        if ( copied < 0 )
+        {
+            fuse_reply_err ( req, -copied );
+            return;
+        }
+
+        data.resize ( copied );
+    }
+
+    size_t processed = 0;
+
+    RetCode rc = fs_->writeFile ( *fh, data, offset, processed );
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    fuse_reply_write ( req, processed );
+}
+
+void FuseLowLevelBridge::closeFile ( fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "release" );
+
+    FileHandle* fh = reinterpret_cast<FileHandle*> ( fi->fh );
+    assert ( fh != nullptr );
+
+    RetCode rc = fs_->closeFile ( *fh );
+
+    delete fh;
+    fh = nullptr;
+    fi->fh = 0;
+
+    fuse_reply_err ( req, NotOk ( rc ) ? PosixUtils::retCodeToErrno ( rc ) : 0 );
+}
+
+void FuseLowLevelBridge::createDirectory ( fuse_req_t req, fuse_ino_t parent,
+                                           const char* name, mode_t mode )
+{
+    assert ( name != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "mkdir" );
+
+    std::string path;
+
+    if ( ! getPath ( parent, name, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    const struct fuse_ctx* ctx = fuse_req_ctx ( req );
+
+    Metadata md;
+    md.set_path ( path );
+    PosixUtils::posixModeToMetadata ( mode, md );
+
+    std::string username;
+    std::string groupname;
+
+    FuseBridge::genUserInfo ( ctx->uid, ctx->gid, username, groupname );
+
+    md.set_uid ( username );
+    md.set_gid ( groupname );
+    md.set_size ( 0 );
+
+    const time_t now = time ( 0 );
+
+    md.set_atime ( now );
+    md.set_mtime ( now );
+    md.set_ctime ( now );
+
+    RetCode rc = fs_->createDirectory ( path, md );
+
+    struct fuse_entry_param entry;
+
+    if ( IsOk ( rc ) )
+        rc = makeEntry ( path, entry );
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    fuse_reply_entry ( req, &entry );
+}
+
+void FuseLowLevelBridge::openDirectory ( fuse_req_t req, fuse_ino_t ino,
+                                         struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "opendir" );
+
+    Directory* dir = new Directory();
+
+    if ( ! getPath ( ino, dir->path ) )
+    {
+        delete dir;
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    dir->ino = ino;
+    dir->parentIno = FUSE_ROOT_ID;
+
+    const size_t lastSlash = dir->path.find_last_of ( '/' );
+
+    if ( ino != FUSE_ROOT_ID && lastSlash != std::string::npos )
+    {
+        const std::string parent ( lastSlash == 0 ? "/" : dir->path.substr ( 0, lastSlash ) );
+
+        std::lock_guard<std::mutex> guard ( mtx_ );
+
+        std::unordered_map<std::string, Node*>::const_iterator it = paths_.find ( parent );
+
+        if ( it != paths_.end() )
+            dir->parentIno = it->second->ino;
+    }
+
+    RetCode rc = fs_->readDirectory ( dir->path, dir->children );
+
+    if ( NotOk ( rc ) )
+    {
+        delete dir;
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    dir->names.reserve ( dir->children.size() );
+
+    for ( size_t i = 0; i < dir->children.size(); ++i )
+        dir->names.push_back ( FuseBridge::baseName ( dir->children.at ( i ).path() ) );
+
+    fi->fh = reinterpret_cast<uint64_t> ( dir );
+
+    if ( fuse_reply_open ( req, fi ) != 0 )
+    {
+        // The request was interrupted; releasedir won't be called.
+        delete dir;
+        fi->fh = 0;
+    }
+}
+
+void FuseLowLevelBridge::readDirectory ( fuse_req_t req, fuse_ino_t, size_t size,
+                                         off_t offset, struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+
+    LatencyTimer timer ( "fuse", "readdir" );
+
+    const Directory* dir = reinterpret_cast<const Directory*> ( fi->fh );
+    assert ( dir != nullptr );
+
+    std::vector<char> buf;
+    buf.reserve ( size );
+
+    // The offset of each entry is its index plus one: . and .. come first, then the
+    // children. The kernel hands back the offset of the last entry it received to
+    // continue from.
+    struct stat st;
+    memset ( &st, 0, sizeof ( st ) );
+    st.st_mode = S_IFDIR;
+
+    bool full = false;
+
+    if ( offset < 1 )
+    {
+        st.st_ino = dir->ino;
+        full = ! addDirEntry ( req, buf, size, ".", st, 1 );
+    }
+
+    if ( ! full && offset < 2 )
+    {
+        st.st_ino = dir->parentIno;
+        full = ! addDirEntry ( req, buf, size, "..", st, 2 );
+    }
+
+    for ( size_t i = std::max<off_t> ( offset, 2 ) - 2;
+          ! full && i < dir->children.size(); ++i )
+    {
+        const std::string& name = dir->names.at ( i );
+
+        if ( name.empty() )
+            continue;
+
+        // Only the type bits are used; the kernel looks entries up before using them.
+        memset ( &st, 0, sizeof ( st ) );
+        PosixUtils::metadataToPosixMode ( dir->children.at ( i ), st.st_mode );
+
+        full = ! addDirEntry ( req, buf, size, name.c_str(), st, i + 3 );
+    }
+
+    fuse_reply_buf ( req, ( buf.empty() ? nullptr : &buf[0] ), buf.size() );
+}
+
+void FuseLowLevelBridge::closeDirectory ( fuse_req_t req, fuse_ino_t,
+                                          struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+
+    LatencyTimer timer ( "fuse", "releasedir" );
+
+    Directory* dir = reinterpret_cast<Directory*> ( fi->fh );
+
+    delete dir;
+    dir = nullptr;
+    fi->fh = 0;
+
+    fuse_reply_err ( req, 0 );
+}
+
+void FuseLowLevelBridge::createSymlink ( fuse_req_t req, const char* link,
+                                         fuse_ino_t parent, const char* name )
+{
+    assert ( link != nullptr );
+    assert ( name != nullptr );
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "symlink" );
+
+    std::string path;
+
+    if ( ! getPath ( parent, name, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    RetCode rc = fs_->createLink ( link, path );
+
+    struct fuse_entry_param entry;
+
+    if ( IsOk ( rc ) )
+        rc = makeEntry ( path, entry );
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    fuse_reply_entry ( req, &entry );
+}
+
+void FuseLowLevelBridge::readSymlink ( fuse_req_t req, fuse_ino_t ino )
+{
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "readlink" );
+
+    std::string path;
+
+    if ( ! getPath ( ino, path ) )
+    {
+        fuse_reply_err ( req, ENOENT );
+        return;
+    }
+
+    std::string link;
+
+    RetCode rc = fs_->readLink ( path, link );
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    fuse_reply_readlink ( req, link.c_str() );
+}
+
+void FuseLowLevelBridge::statfs ( fuse_req_t req, fuse_ino_t )
+{
+    assert ( fs_ != nullptr );
+
+    LatencyTimer timer ( "fuse", "statfs" );
+
+    struct statvfs st;
+
+    RetCode rc = FuseBridge::genStatfs ( *fs_, st );
+
+    if ( NotOk ( rc ) )
+    {
+        fuse_reply_err ( req, PosixUtils::retCodeToErrno ( rc ) );
+        return;
+    }
+
+    fuse_reply_statfs ( req, &st );
+}
+
+void FuseLowLevelBridge::onChange ( const std::string& path, FileSystem::ChangeType type )
+{
+    std::string p ( path );
+
+    while ( p.length() > 1 && p.at ( p.length() - 1 ) == '/' )
+        p.erase ( p.length() - 1 );
+
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    if ( type == FileSystem::ContentChanged )
+    {
+        std::unordered_map<std::string, Node*>::const_iterator it = paths_.find ( p );
+
+        // The kernel can't have cached anything for entries it hasn't looked up.
+        if ( it != paths_.end() )
+            queueInvalidation ( it->second->ino, "" );
+
+        return;
+    }
+
+    const size_t lastSlash = p.find_last_of ( '/' );
+
+    if ( lastSlash == std::string::npos || lastSlash + 1 >= p.length() )
+        return;
+
+    const std::string parent ( lastSlash == 0 ? "/" : p.substr ( 0, lastSlash ) );
+
+    std::unordered_map<std::string, Node*>::const_iterator it = paths_.find ( parent );
+
+    if ( it == paths_.end() )
+        return;
+
+    // Drop the (possibly negative) entry, and the directory's listing and attributes.
+    queueInvalidation ( it->second->ino, p.substr ( lastSlash + 1 ) );
+    queueInvalidation ( it->second->ino, "" );
+}
+
+void FuseLowLevelBridge::queueInvalidation ( fuse_ino_t ino, const std::string& name )
+{
+    if ( ch_ == nullptr )
+        return;
+
+    Invalidation inv;
+    inv.ino = ino;
+    inv.name = name;
+
+    invalidations_.push_back ( inv );
+    invalidationsCond_.notify_one();
+}
+
+void FuseLowLevelBridge::runInvalidations()
+{
+    std::unique_lock<std::mutex> lock ( mtx_ );
+
+    while ( true )
+    {
+        invalidationsCond_.wait ( lock, [] { return stopping_ || ! invalidations_.empty(); } );
+
+        if ( stopping_ )
+            return;
+
+        const Invalidation inv ( invalidations_.front() );
+        invalidations_.pop_front();
+
+        lock.unlock();
+
+        // Failures just mean the kernel had nothing cached.
+        if ( inv.name.empty() )
+            fuse_lowlevel_notify_inval_inode ( ch_, inv.ino, 0, 0 );
+        else
+            fuse_lowlevel_notify_inval_entry ( ch_, inv.ino, inv.name.c_str(),
+                                               inv.name.length() );
+
+        lock.lock();
+    }
+}
+
+void FuseLowLevelBridge::setCacheFlags ( const FileHandle& fh, struct fuse_file_info* fi )
+{
+    assert ( fi != nullptr );
+    assert ( fs_ != nullptr );
+
+    const FileSystem::CachePolicy policy = fs_->getCachePolicy ( fh );
+
+    // Contents which change by themselves must be read afresh every time; contents
+    // whose changes are reported can be kept until we invalidate them.
+    fi->direct_io = ( policy == FileSystem::CacheNever );
+    fi->keep_cache = ( kernelCache_ && policy == FileSystem::CacheUntilChanged );
+}
+
+bool FuseLowLevelBridge::addDirEntry ( fuse_req_t req, std::vector<char>& buf, size_t size,
+                                       const char* name, const struct stat& st, off_t offset )
+{
+    // Asked for with no room, this only says how much room the entry needs.
+    const size_t len = fuse_add_direntry ( req, nullptr, 0, name, nullptr, 0 );
+
+    if ( len > size - buf.size() )
+        return false;
+
+    const size_t used = buf.size();
+    buf.resize ( used + len );
+
+    fuse_add_direntry ( req, &buf[used], len, name, &st, offset );
+
+    return true;
+}
+
+void FuseLowLevelBridge::unlinkPath ( const std::string& path )
+{
+    std::unordered_map<std::string, Node*>::iterator it = paths_.find ( path );
+
+    if ( it == paths_.end() )
+        return;
+
+    it->second->unlinked = true;
+    paths_.erase ( it );
+}
+
+bool FuseLowLevelBridge::getPath ( fuse_ino_t ino, std::string& path )
+{
+    std::lock_guard<std::mutex> guard ( mtx_ );
+
+    std::unordered_map<fuse_ino_t, Node*>::const_iterator it = nodes_.find ( ino );
+
+    if ( it == nodes_.end() || it->second->unlinked )
+        return false;
+
+    path = it->second->path;
+    return true;
+}
+
+bool FuseLowLevelBridge::getPath ( fuse_ino_t parent, const char* name, std::string& path )
+{
+    if ( ! getPath ( parent, path ) )
+        return false;
+
+    if ( path.empty() || path.at ( path.length() - 1 ) != '/' )
+        path.append ( "/" );
+
+    path.append ( name );
+    return true;
+}
+
+RetCode FuseLowLevelBridge::makeEntry ( const std::string& path,
+                                        struct fuse_entry_param& entry )
+{
+    Metadata md;
+    RetCode rc = fs_->readMetadata ( path, md );
+
+    if ( NotOk ( rc ) )
+        return rc;
+
+    memset ( &entry, 0, sizeof ( entry ) );
+
+    {
+        std::lock_guard<std::mutex> guard ( mtx_ );
+
+        Node*& node = paths_[path];
+
+        if ( node == nullptr )
+        {
+            node = new Node();
+            node->ino = nextIno_++;
+            node->path = path;
+            node->lookups = 0;
+            node->unlinked = false;
+
+            nodes_[node->ino] = node;
+        }
+
+        ++node->lookups;
+        entry.ino = node->ino;
+    }
+
+    entry.entry_timeout = entryTimeout_;
+    entry.attr_timeout = attrTimeout_;
+
+    toStat ( entry.ino, md, entry.attr );
+
+    return Success;
+}
+
+void FuseLowLevelBridge::toStat ( fuse_ino_t ino, const Metadata& md, struct stat& st )
+{
+    PosixUtils::metadataToStat ( md, &st );
+    st.st_ino = ino;
+
+    if ( md.type() == Metadata::Directory )
+        st.st_nlink = 2;
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+#undef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 30
+
+extern "C"
+{
+#include <fuse_lowlevel.h>
+}
+
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Common.pb.h"
+#include "RetCode.hpp"
+
+#include "fs/FileSystem.hpp"
+
+namespace rfs
+{
+
+/// @brief Exposes a FileSystem through the FUSE low-level (inode based) API.
+/// The high-level API hands every operation a full path, which the file system then
+/// has to resolve again. Here the kernel refers to entries by inode number instead:
+/// each path is resolved once, when the kernel looks it up, and is assigned an inode
+/// which stays valid until the kernel forgets it. Operations on open files use the
+/// FileHandle created when the file was opened and don't involve the path at all.
+///
+/// Entries, attributes and file contents are cached by the kernel according to the
+/// entry_timeout, attr_timeout, negative_timeout and (no_)kernel_cache options, which
+/// default to the FuseBridge configuration. Changes the file system reports by itself
+/// are pushed to the kernel as invalidations of the affected inodes and entries, so
+/// the timeouts only bound how stale changes it can't detect may get.
+class FuseLowLevelBridge
+{
+public:
+    FuseLowLevelBridge ( FileSystem& fs );
+    ~FuseLowLevelBridge();
+
+    RetCode run ( int argc, char* argv[] );
+
+    /// @brief Implements the FUSE function init
+    /// Asks for splice to be used wherever the kernel supports it.
+    static void init ( void* userdata, struct fuse_conn_info* conn );
+
+    /// @brief Implements the FUSE function lookup
+    static void lookup ( fuse_req_t req, fuse_ino_t parent, const char* name );
+    /// @brief Implements the FUSE function forget
+    static void forget ( fuse_req_t req, fuse_ino_t ino, unsigned long nlookup );
+    /// @brief Implements the FUSE function getattr
+    static void getAttr ( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function setattr
+    /// Covers chmod, chown and truncate.
+    static void setAttr ( fuse_req_t req, fuse_ino_t ino, struct stat* attr, int toSet,
+                          struct fuse_file_info* fi );
+
+    /// @brief Implements the FUSE function listxattr
+    static void listXAttr ( fuse_req_t req, fuse_ino_t ino, size_t size );
+    /// @brief Implements the FUSE function getxattr
+    static void getXAttr ( fuse_req_t req, fuse_ino_t ino, const char* key, size_t size );
+    /// @brief Implements the FUSE function setxattr
+    static void setXAttr ( fuse_req_t req, fuse_ino_t ino, const char* key,
+                           const char* value, size_t size, int flags );
+    /// @brief Implements the FUSE function removexattr
+    static void removeXAttr ( fuse_req_t req, fuse_ino_t ino, const char* key );
+
+    /// @brief Implements the FUSE function rename
+    static void rename ( fuse_req_t req, fuse_ino_t parent, const char* name,
+                         fuse_ino_t newParent, const char* newName );
+    /// @brief Implements the FUSE function unlink and rmdir
+    static void remove ( fuse_req_t req, fuse_ino_t parent, const char* name );
+
+    /// @brief Implements the FUSE function create
+    static void createFile ( fuse_req_t req, fuse_ino_t parent, const char* name,
+                             mode_t mode, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function open
+    static void openFile ( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function read
+    /// Files with a backing descriptor are replied to straight from the descriptor.
+    static void readFile ( fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                           struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function write
+    static void writeFile ( fuse_req_t req, fuse_ino_t ino, const char* mem,
+                            size_t memSize, off_t offset, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function write_buf
+    /// Data is spliced straight into files with a backing descriptor.
+    static void writeFileBuf ( fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* buf,
+                               off_t offset, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function release
+    static void closeFile ( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi );
+
+    /// @brief Implements the FUSE function mkdir
+    static void createDirectory ( fuse_req_t req, fuse_ino_t parent, const char* name,
+                                  mode_t mode );
+    /// @brief Implements the FUSE function opendir
+    /// Takes a snapshot of the directory's entries, which readdir is served from.
+    static void openDirectory ( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function readdir
+    static void readDirectory ( fuse_req_t req, fuse_ino_t ino, size_t size,
+                                off_t offset, struct fuse_file_info* fi );
+    /// @brief Implements the FUSE function releasedir
+    static void closeDirectory ( fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi );
+
+    /// @brief Implements the FUSE function symlink
+    static void createSymlink ( fuse_req_t req, const char* link, fuse_ino_t parent,
+                                const char* name );
+    /// @brief Implements the FUSE function readlink
+    static void readSymlink ( fuse_req_t req, fuse_ino_t ino );
+
+    /// @brief Implements the FUSE function statfs
+    static void statfs ( fuse_req_t req, fuse_ino_t ino );
+
+private:
+    /// @brief An entry the kernel holds a reference to.
+    struct Node
+    {
+        fuse_ino_t ino; ///< The inode number given to the kernel.
+        std::string path; ///< The path of the entry in the file system.
+        uint64_t lookups; ///< The number of lookups not yet forgotten.
+        bool unlinked; ///< Whether the entry was removed or replaced; path isn't its own.
+    };
+
+    /// @brief The entries of an open directory, as of when it was opened.
+    struct Directory
+    {
+        std::string path; ///< The path of the directory.
+        fuse_ino_t ino; ///< The inode of the directory, reported for "."
+        fuse_ino_t parentIno; ///< The inode of its parent, reported for ".."
+        std::vector<std::string> names; ///< The names of the entries.
+        std::vector<Metadata> children; ///< The entries, as readDirectory() returns them.
+    };
+
+    /// @brief A pending invalidation of kernel cache state.
+    struct Invalidation
+    {
+        fuse_ino_t ino; ///< The inode to invalidate, or the directory containing name.
+        std::string name; ///< The entry to invalidate; empty to invalidate ino itself.
+    };
+
+    /// @brief Handles changes reported by the file system.
+    static void onChange ( const std::string& path, FileSystem::ChangeType type );
+
+    /// @brief Queue an invalidation; must be called with mtx_ held.
+    static void queueInvalidation ( fuse_ino_t ino, const std::string& name );
+
+    /// @brief The body of the thread delivering invalidations to the kernel.
+    /// The kernel may be waiting on the request which caused a change (a write, say)
+    /// while holding locks the invalidation needs, so they can't be sent inline.
+    static void runInvalidations();
+
+    /// @brief Set the caching flags of a newly opened file.
+    static void setCacheFlags ( const FileHandle& fh, struct fuse_file_info* fi );
+
+    /// @brief Detach the node at a path, once its entry has been removed or replaced.
+    /// The node lives on until the kernel forgets it, but neither the path nor a new
+    /// entry created at it lead back to it; must be called with mtx_ held.
+    static void unlinkPath ( const std::string& path );
+
+    /// @brief Find the path of an inode.
+    /// @param [out] path The path of the inode.
+    /// @return false if the inode isn't known, or has been unlinked.
+    static bool getPath ( fuse_ino_t ino, std::string& path );
+
+    /// @brief Find the path of an entry within a directory inode.
+    /// @param [out] path The path of the entry.
+    /// @return false if the directory inode isn't known.
+    static bool getPath ( fuse_ino_t parent, const char* name, std::string& path );
+
+    /// @brief Read the attributes of a path and take a lookup reference to it.
+    /// This is what the kernel expects of every operation replying with an entry.
+    /// @param [in] path The path of the entry.
+    /// @param [out] entry The entry to reply with.
+    /// @return Standard error code.
+    static RetCode makeEntry ( const std::string& path, struct fuse_entry_param& entry );
+
+    /// @brief Drop lookup references to a node, and the node with the last of them.
+    static void forgetNode ( fuse_ino_t ino, uint64_t nlookup );
+
+    /// @brief Fill in a stat structure for an inode.
+    static void toStat ( fuse_ino_t ino, const Metadata& md, struct stat& st );
+
+    /// @brief Add an entry to a reply to readdir.
+    /// @param [in,out] buf The reply; the entry is appended if it fits.
+    /// @param [in] size The size of the reply the kernel asked for (bytes).
+    /// @param [in] offset The offset of the entry after this one.
+    /// @return false if the entry didn't fit.
+    static bool addDirEntry ( fuse_req_t req, std::vector<char>& buf, size_t size,
+                              const char* name, const struct stat& st, off_t offset );
+
+    static FileSystem* fs_;
+
+    /// @brief Protects the node maps and invalidation queue; requests may be handled
+    /// on several threads.
+    static std::mutex mtx_;
+
+    /// @brief Nodes the kernel holds references to, keyed by inode number.
+    static std::unordered_map<fuse_ino_t, Node*> nodes_;
+
+    /// @brief The same nodes, keyed by path.
+    static std::unordered_map<std::string, Node*> paths_;
+
+    /// @brief The inode number to give to the next new node.
+    static fuse_ino_t nextIno_;
+
+    static double entryTimeout_; ///< How long the kernel may cache lookups.
+    static double attrTimeout_; ///< How long the kernel may cache attributes.
+    static double negativeTimeout_; ///< How long the kernel may cache failed lookups.
+    static bool kernelCache_; ///< Whether the kernel may keep contents across opens.
+
+    static struct fuse_chan* ch_; ///< The channel invalidations are sent on.
+
+    static std::thread invalidator_; ///< The thread delivering invalidations.
+    static std::deque<Invalidation> invalidations_; ///< Invalidations to deliver.
+    static std::condition_variable invalidationsCond_; ///< Signalled when one is queued.
+    static bool stopping_; ///< Set to stop the invalidation thread.
+};
+
+}
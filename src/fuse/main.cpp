@@ -1,6 +1,14 @@
 #include "FuseBridge.hpp"
+#include "FuseLowLevelBridge.hpp"
 
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "fs/InstrumentedFileSystem.hpp"
 #include "fs/ProcessFileSystem.hpp"
+#include "modules/StatsProcessFile.hpp"
 #include "modules/TimeProcessFile.hpp"
 
 using namespace rfs;
@@ -11,8 +19,57 @@ int main ( int argc, char* argv[] )
 
     TimeProcessFile tm ( fs );
 
-    FuseBridge fb ( fs );
-    fb.run ( argc, argv );
+    // Latency of the FUSE callbacks, and of the file system calls they make.
+    StatsProcessFile fuseStats ( fs, "fuse" );
+    StatsProcessFile fsStats ( fs, "fs" );
+
+    InstrumentedFileSystem ifs ( fs );
+
+    // --lowlevel selects the inode based bridge. --writeback lets the kernel buffer
+    // writes (libfuse 3 builds only), and --blockingread makes reads of files which have already been read
+    // wait for them to change (both high-level bridge only). Everything else is
+    // passed to FUSE.
+    bool lowLevel = false;
+    std::vector<char*> args;
+
+    for ( int i = 0; i < argc; ++i )
+    {
+        if ( strcmp ( argv[i], "--lowlevel" ) == 0 )
+            lowLevel = true;
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+        else if ( strcmp ( argv[i], "--writeback" ) == 0 )
+            FuseBridge::WritebackCache = true;
+#else
+        else if ( strcmp ( argv[i], "--writeback" ) == 0 )
+        {
+            std::cerr << "--writeback needs rfs to be built against libfuse 3" << std::endl;
+            return EXIT_FAILURE;
+        }
+#endif
+        else if ( strcmp ( argv[i], "--blockingread" ) == 0 )
+            FuseBridge::BlockingRead = true;
+        else
+            args.push_back ( argv[i] );
+    }
+
+#ifdef RFS_HAVE_WRITEBACK_CACHE
+    // Rather than mount without what was asked for.
+    if ( FuseBridge::WritebackCache && lowLevel )
+    {
+        std::cerr << "--writeback is not supported by the low-level bridge" << std::endl;
+        return EXIT_FAILURE;
+    }
+#endif
+
+    if ( lowLevel )
+    {
+        FuseLowLevelBridge fb ( ifs );
+        fb.run ( args.size(), &args[0] );
+        return 0;
+    }
+
+    FuseBridge fb ( ifs );
+    fb.run ( args.size(), &args[0] );
     return 0;
 
 }